@@ -49,6 +49,32 @@ void show_frames_list(frame_data **frames, int list_sz, int delim_id)
 	}
 }
 
+/*
+ * References that are missing after a seek or skipped pictures of trick play
+ * are stood in for by the last one of the list.
+ */
+static void complete_ref_list(decoder_context *decoder, frames_list *list,
+			      int size, int needed, const char *name)
+{
+	int i;
+
+	if (size >= needed) {
+		return;
+	}
+
+	if (!decoder->DPB_incomplete || size == 0 ||
+			needed > (int) ARRAY_SIZE(list->frames)) {
+		DECODER_ERR("Shouldn't happen: %s.size=%d "
+			    "num_ref_idx_active=%d\n", name, size, needed);
+	}
+
+	DECODER_DPRINT("%s misses %d references\n", name, needed - size);
+
+	for (i = size; i < needed; i++) {
+		list->frames[i] = list->frames[size - 1];
+	}
+}
+
 static void clear_frame(frame_data *frame)
 {
 	assert(!frame->empty);
@@ -282,12 +308,9 @@ end:
 	show_frames_list(REF_frames, decoder->ref_frames_P_list0.size,
 			 decoder->sh.num_ref_idx_l0_active_minus1 + 1);
 
-	if (i < decoder->sh.num_ref_idx_l0_active_minus1 + 1) {
-		DECODER_ERR("Shouldn't happen: ref_frames_P_list0.size=%d "
-						"num_ref_idx_l0_active=%d\n",
-			    decoder->ref_frames_P_list0.size,
-			    decoder->sh.num_ref_idx_l0_active_minus1 + 1);
-	}
+	complete_ref_list(decoder, &decoder->ref_frames_P_list0, i,
+			  decoder->sh.num_ref_idx_l0_active_minus1 + 1,
+			  "ref_frames_P_list0");
 
 	decoder->ref_frames_P_list0.size =
 				decoder->sh.num_ref_idx_l0_active_minus1 + 1;
@@ -305,10 +328,6 @@ void form_B_frame_ref_list_l0(decoder_context *decoder)
 	DECODER_DPRINT("B L0 REF_list_size %d\n", REF_list_size);
 
 	for (;; i++) {
-		if (i == REF_list_size) {
-			DECODER_ERR("Shouldn't happen\n");
-		}
-
 		frame_id = get_frame_id_with_most_pic_order_cnt(
 				DPB_frames + 1, REF_list_size,
 				-1, start_stop_pic_order_cnt, 0);
@@ -318,6 +337,10 @@ void form_B_frame_ref_list_l0(decoder_context *decoder)
 
 		DECODER_DPRINT("B L0 before %d\n", frame_id);
 
+		if (i == REF_list_size) {
+			DECODER_ERR("Shouldn't happen\n");
+		}
+
 		REF_frames[i] = DPB_frames[frame_id + 1];
 		start_stop_pic_order_cnt = REF_frames[i]->pic_order_cnt;
 	}
@@ -348,12 +371,9 @@ void form_B_frame_ref_list_l0(decoder_context *decoder)
 	show_frames_list(REF_frames, decoder->ref_frames_B_list0.size,
 			 decoder->sh.num_ref_idx_l0_active_minus1 + 1);
 
-	if (i < decoder->sh.num_ref_idx_l0_active_minus1 + 1) {
-		DECODER_ERR("Shouldn't happen: ref_frames_B_list0.size=%d "
-						"num_ref_idx_l0_active=%d\n",
-			    decoder->ref_frames_B_list0.size,
-			    decoder->sh.num_ref_idx_l0_active_minus1 + 1);
-	}
+	complete_ref_list(decoder, &decoder->ref_frames_B_list0, i,
+			  decoder->sh.num_ref_idx_l0_active_minus1 + 1,
+			  "ref_frames_B_list0");
 
 	decoder->ref_frames_B_list0.size =
 				decoder->sh.num_ref_idx_l0_active_minus1 + 1;
@@ -369,10 +389,6 @@ void form_B_frame_ref_list_l1(decoder_context *decoder)
 	int i = 0;
 
 	for (;; i++) {
-		if (i == REF_list_size) {
-			DECODER_ERR("Shouldn't happen\n");
-		}
-
 		frame_id = get_frame_id_with_least_pic_order_cnt(
 				DPB_frames + 1, REF_list_size, INT_MAX,
 				start_stop_pic_order_cnt, 1);
@@ -382,6 +398,10 @@ void form_B_frame_ref_list_l1(decoder_context *decoder)
 
 		DECODER_DPRINT("B L1 after %d\n", frame_id);
 
+		if (i == REF_list_size) {
+			DECODER_ERR("Shouldn't happen\n");
+		}
+
 		REF_frames[i] = DPB_frames[frame_id + 1];
 		start_stop_pic_order_cnt = REF_frames[i]->pic_order_cnt;
 	}
@@ -412,12 +432,9 @@ void form_B_frame_ref_list_l1(decoder_context *decoder)
 	show_frames_list(REF_frames, decoder->ref_frames_B_list1.size,
 			 decoder->sh.num_ref_idx_l1_active_minus1 + 1);
 
-	if (i < decoder->sh.num_ref_idx_l1_active_minus1 + 1) {
-		DECODER_ERR("Shouldn't happen: ref_frames_B_list1.size %d "
-						"num_ref_idx_l1_active %d\n",
-			    decoder->ref_frames_B_list1.size,
-			    decoder->sh.num_ref_idx_l1_active_minus1 + 1);
-	}
+	complete_ref_list(decoder, &decoder->ref_frames_B_list1, i,
+			  decoder->sh.num_ref_idx_l1_active_minus1 + 1,
+			  "ref_frames_B_list1");
 
 	decoder->ref_frames_B_list1.size =
 				decoder->sh.num_ref_idx_l1_active_minus1 + 1;
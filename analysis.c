@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "analysis.h"
+#include "decoder.h"
+
+static const char gop_type[] = { 'P', 'B', 'I', 'S', 'S' };
+
+static const char * const type_name[] = { "P", "B", "I", "SP", "SI" };
+
+void analysis_start(decoder_context *decoder, stream_analysis *an, FILE *fp,
+		    int format, double fps)
+{
+	frame_data **DPB_frames = decoder->DPB_frames_array.frames;
+	analysis_header header;
+	int i;
+
+	bzero(an, sizeof(*an));
+
+	an->fp = fp;
+	an->format = format;
+	an->fps = fps;
+
+	/* DPB is set up as by tegra_VDE_decoder_init_mem(), minus memory.  */
+	for (i = 0; i < ARRAY_SIZE(decoder->DPB_frames_array.frames); i++) {
+		bzero(DPB_frames[i], sizeof(frame_data));
+		DPB_frames[i]->empty = (i > 0);
+	}
+
+	decoder->analysis = an;
+
+	if (format == ANALYSIS_BINARY) {
+		bzero(&header, sizeof(header));
+		memcpy(header.magic, ANALYSIS_MAGIC, sizeof(header.magic));
+		header.version = ANALYSIS_VERSION;
+		header.record_size = sizeof(analysis_record);
+
+		fwrite(&header, sizeof(header), 1, fp);
+		return;
+	}
+
+	fprintf(fp, "picture,offset,type,idr,ref_idc,size,frame_num,"
+		    "pic_order_cnt,slices,ref_list0,ref_list1,pts,dts\n");
+}
+
+/* Unknown timestamp is an empty CSV field.  */
+static void print_timestamp(FILE *fp, int64_t timestamp)
+{
+	if (timestamp != TIMESTAMP_NONE) {
+		fprintf(fp, "%" PRId64, timestamp);
+	}
+}
+
+/* Slice is accounted as tegra_VDE_queue_slice() would place it.  */
+void analysis_queue_slice(decoder_context *decoder)
+{
+	bitstream_reader *reader = &decoder->reader;
+	stream_analysis *an = decoder->analysis;
+
+	if (decoder->au.slices_nb == 0) {
+		decoder->au.nal = decoder->nal;
+		an->offset = reader->NAL_offset;
+	}
+
+	decoder->au.size += 3 + reader->NAL_end - reader->NAL_offset;
+	decoder->au.slices_nb++;
+}
+
+static void analysis_gop_end(stream_analysis *an)
+{
+	uint64_t length = an->pictures_nb - an->gop_start;
+
+	if (an->idr_nb == 0) {
+		return;
+	}
+
+	if (an->gop_min == 0 || length < an->gop_min) {
+		an->gop_min = length;
+	}
+
+	if (length > an->gop_max) {
+		an->gop_max = length;
+	}
+}
+
+/*
+ * Record the picture that apply_slice_header() prepared and do the DPB
+ * steps of tegra_VDE_decode_frame().
+ */
+void analysis_picture(decoder_context *decoder)
+{
+	stream_analysis *an = decoder->analysis;
+	decoder_context_sps *sps = decoder->active_sps;
+	unsigned type = decoder->sh.slice_type;
+	analysis_record rec;
+
+	bzero(&rec, sizeof(rec));
+
+	rec.offset = an->offset;
+	rec.size = decoder->au.size;
+	rec.frame_num = decoder->sh.frame_num;
+	rec.pic_order_cnt = decoder->DPB_frames_array.frames[0]->pic_order_cnt;
+	rec.pts = decoder->DPB_frames_array.frames[0]->pts;
+	rec.dts = decoder->DPB_frames_array.frames[0]->dts;
+	rec.slices_nb = decoder->au.slices_nb;
+	rec.slice_type = type;
+	rec.ref_idc = decoder->nal.ref_idc;
+
+	switch (type) {
+	case P:
+		rec.ref_list0_size = decoder->ref_frames_P_list0.size;
+		break;
+	case B:
+		rec.ref_list0_size = decoder->ref_frames_B_list0.size;
+		rec.ref_list1_size = decoder->ref_frames_B_list1.size;
+		break;
+	default:
+		break;
+	}
+
+	if (IdrPicFlag) {
+		rec.flags |= ANALYSIS_IDR;
+
+		analysis_gop_end(an);
+		an->gop_start = an->pictures_nb;
+		an->idr_nb++;
+	}
+
+	if (rec.size > DATA_BUF_SIZE) {
+		rec.flags |= ANALYSIS_OVERSIZED;
+		an->oversized_nb++;
+	}
+
+	if (an->idr_nb == 1 &&
+			an->pictures_nb - an->gop_start < ANALYSIS_GOP_PATTERN) {
+		an->gop_pattern[an->pictures_nb - an->gop_start] = gop_type[type];
+	}
+
+	if (rec.size > an->peak_size) {
+		an->peak_size = rec.size;
+		an->peak_picture = an->pictures_nb;
+	}
+
+	if (sps->time_scale != 0 && sps->num_units_in_tick != 0) {
+		an->time_scale = sps->time_scale;
+		an->num_units_in_tick = sps->num_units_in_tick;
+	}
+
+	an->types_nb[type]++;
+	an->bytes += rec.size;
+
+	if (an->format == ANALYSIS_BINARY) {
+		fwrite(&rec, sizeof(rec), 1, an->fp);
+	} else {
+		fprintf(an->fp, "%" PRIu64 ",%" PRIu64 ",%s,%u,%u,%u,%u,%d,%u,"
+			"%u,%u,", an->pictures_nb, rec.offset, type_name[type],
+			!!(rec.flags & ANALYSIS_IDR), rec.ref_idc, rec.size,
+			rec.frame_num, rec.pic_order_cnt, rec.slices_nb,
+			rec.ref_list0_size, rec.ref_list1_size);
+		print_timestamp(an->fp, rec.pts);
+		fputc(',', an->fp);
+		print_timestamp(an->fp, rec.dts);
+		fputc('\n', an->fp);
+	}
+
+	an->pictures_nb++;
+
+	decoder->frames_decoded++;
+
+	purge_unused_ref_frames(decoder);
+
+	if (decoder->nal.ref_idc) {
+		slide_frames(decoder);
+	}
+}
+
+/*
+ * Stream summary, appended to the CSV as comment lines or printed to stderr
+ * for the binary output. Frame rate comes from the VUI timing info if the
+ * stream has it.
+ */
+void analysis_summary(stream_analysis *an)
+{
+	FILE *fp = (an->format == ANALYSIS_CSV) ? an->fp : stderr;
+	const char *fps_src = "assumed";
+	double fps = an->fps;
+	double bitrate = 0;
+	int i;
+
+	analysis_gop_end(an);
+
+	if (an->time_scale != 0) {
+		fps = an->time_scale / (2.0 * an->num_units_in_tick);
+		fps_src = "VUI";
+	}
+
+	if (an->pictures_nb != 0) {
+		bitrate = an->bytes * 8.0 * fps / an->pictures_nb;
+	}
+
+	fprintf(fp, "# pictures %" PRIu64, an->pictures_nb);
+
+	for (i = 0; i < ARRAY_SIZE(an->types_nb); i++) {
+		fprintf(fp, " %s %" PRIu64, type_name[i], an->types_nb[i]);
+	}
+
+	fprintf(fp, "\n# IDR %" PRIu64 " GOP min %" PRIu64 " avg %.1f max %"
+		PRIu64 " first GOP %s\n", an->idr_nb, an->gop_min,
+		an->idr_nb ? (double) an->pictures_nb / an->idr_nb : 0,
+		an->gop_max, an->gop_pattern);
+
+	fprintf(fp, "# bytes %" PRIu64 " bitrate %.0f kbit/s at %.3f fps (%s)\n",
+		an->bytes, bitrate / 1000, fps, fps_src);
+
+	fprintf(fp, "# peak picture %" PRIu64 " size %u, %.1f%% of DATA_BUF_SIZE"
+		" %u, %" PRIu64 " pictures don't fit\n", an->peak_picture,
+		an->peak_size, an->peak_size * 100.0 / DATA_BUF_SIZE,
+		DATA_BUF_SIZE, an->oversized_nb);
+}
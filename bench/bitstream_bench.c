@@ -0,0 +1,413 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitstream.h"
+
+#define STREAM_PADDING	16
+
+enum field_type {
+	FIELD_U,
+	FIELD_U_NO_INC,
+	FIELD_UE,
+	FIELD_SE,
+	FIELD_LEADING_ZEROS,
+	FIELD_RBSP_ALIGN,
+	FIELD_MIXED,
+};
+
+static const char * FIELD_NAME[] = {
+	[FIELD_U]		= "read_u",
+	[FIELD_U_NO_INC]	= "read_u_no_inc",
+	[FIELD_UE]		= "read_ue",
+	[FIELD_SE]		= "read_se",
+	[FIELD_LEADING_ZEROS]	= "skip_leading_zeros",
+	[FIELD_RBSP_ALIGN]	= "read_rbsp_align",
+	[FIELD_MIXED]		= "mixed",
+};
+
+typedef struct field {
+	uint8_t type;
+	uint8_t bits_nb;
+	uint32_t value;
+} field;
+
+typedef struct stream {
+	field *fields;
+	uint32_t fields_nb;
+	uint8_t *rbsp;
+	uint32_t rbsp_size;
+	uint8_t *raw;
+	uint32_t raw_size;
+	uint32_t escapes_nb;
+} stream;
+
+typedef struct bit_writer {
+	uint8_t *data;
+	uint64_t bit_offset;
+} bit_writer;
+
+static void put_bits(bit_writer *writer, uint64_t value, unsigned bits_nb)
+{
+	while (bits_nb--) {
+		uint64_t offset = writer->bit_offset++;
+
+		if ((value >> bits_nb) & 1) {
+			writer->data[offset >> 3] |= 0x80 >> (offset & 7);
+		}
+	}
+}
+
+/* Bit at a time decoder of the RBSP, expected values come from it.  */
+typedef struct ref_reader {
+	const uint8_t *data;
+	uint64_t bit_offset;
+} ref_reader;
+
+static uint32_t ref_u(ref_reader *ref, unsigned bits_nb)
+{
+	uint32_t value = 0;
+
+	while (bits_nb--) {
+		uint64_t offset = ref->bit_offset++;
+
+		value <<= 1;
+		value |= (ref->data[offset >> 3] >> (7 - (offset & 7))) & 1;
+	}
+
+	return value;
+}
+
+static uint32_t ref_leading_zeros(ref_reader *ref)
+{
+	uint32_t leading_zeros = 0;
+
+	while (ref_u(ref, 1) == 0) {
+		leading_zeros++;
+	}
+
+	return leading_zeros;
+}
+
+static uint32_t ref_ue(ref_reader *ref)
+{
+	uint32_t leading_zeros = ref_leading_zeros(ref);
+
+	return (1ull << leading_zeros) - 1 + ref_u(ref, leading_zeros);
+}
+
+static uint32_t ref_se(ref_reader *ref)
+{
+	uint32_t ue = ref_ue(ref);
+
+	return (ue & 1) ? (ue + 1) / 2 : -(ue / 2);
+}
+
+static uint32_t ref_decode(ref_reader *ref, field *f)
+{
+	switch (f->type) {
+	case FIELD_U:
+	case FIELD_U_NO_INC:
+	case FIELD_RBSP_ALIGN:
+		return ref_u(ref, f->bits_nb);
+	case FIELD_UE:
+		return ref_ue(ref);
+	case FIELD_SE:
+		return ref_se(ref);
+	case FIELD_LEADING_ZEROS:
+		return ref_leading_zeros(ref);
+	}
+
+	abort();
+}
+
+static uint32_t random_bits(unsigned bits_nb, int zero_bias)
+{
+	uint32_t value = ((uint32_t) rand() << 16) ^ rand();
+
+	if (zero_bias && rand() % 4 == 0) {
+		return 0;
+	}
+
+	return (bits_nb < 32) ? value & ((1u << bits_nb) - 1) : value;
+}
+
+/* Mostly short codes like the real headers have, sometimes up to 31 bits.  */
+static void put_ue(bit_writer *writer, int zero_bias)
+{
+	unsigned bits_nb = (rand() % 8 == 0) ? rand() % 32 : rand() % 6;
+	uint64_t code = (uint64_t) random_bits(bits_nb, zero_bias) + 1;
+
+	bits_nb = 64 - __builtin_clzll(code);
+
+	put_bits(writer, 0, bits_nb - 1);
+	put_bits(writer, code, bits_nb);
+}
+
+static void generate_field(bit_writer *writer, field *f, int zero_bias)
+{
+	switch (f->type) {
+	case FIELD_U:
+	case FIELD_U_NO_INC:
+		f->bits_nb = 1 + rand() % 32;
+		put_bits(writer, random_bits(f->bits_nb, zero_bias),
+			 f->bits_nb);
+		break;
+	case FIELD_UE:
+	case FIELD_SE:
+		put_ue(writer, zero_bias);
+		break;
+	case FIELD_LEADING_ZEROS:
+		put_bits(writer, 0, rand() % (zero_bias ? 40 : 12));
+		put_bits(writer, 1, 1);
+		break;
+	case FIELD_RBSP_ALIGN:
+		f->bits_nb = (8 - (writer->bit_offset & 7)) & 7;
+		put_bits(writer, random_bits(f->bits_nb, zero_bias),
+			 f->bits_nb);
+		break;
+	}
+}
+
+/* Insert emulation prevention bytes the way an encoder does.  */
+static void escape_stream(stream *s)
+{
+	unsigned zeros = 0;
+	uint32_t i;
+
+	s->raw = malloc(s->rbsp_size * 3 / 2 + STREAM_PADDING);
+	if (s->raw == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		abort();
+	}
+
+	s->raw_size = 0;
+	s->escapes_nb = 0;
+
+	for (i = 0; i < s->rbsp_size; i++) {
+		if (zeros == 2 && s->rbsp[i] <= 0x03) {
+			s->raw[s->raw_size++] = 0x03;
+			s->escapes_nb++;
+			zeros = 0;
+		}
+
+		zeros = s->rbsp[i] ? 0 : zeros + 1;
+		s->raw[s->raw_size++] = s->rbsp[i];
+	}
+}
+
+static void generate_stream(stream *s, unsigned type, uint32_t fields_nb,
+			    int escaped)
+{
+	bit_writer writer;
+	ref_reader ref;
+	uint32_t i;
+
+	s->fields_nb = fields_nb;
+	s->fields = calloc(fields_nb, sizeof(field));
+	s->rbsp = calloc(fields_nb, 8);
+
+	if (s->fields == NULL || s->rbsp == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		abort();
+	}
+
+	writer.data = s->rbsp;
+	writer.bit_offset = 0;
+
+	for (i = 0; i < fields_nb - 1; i++) {
+		s->fields[i].type = (type == FIELD_MIXED) ? rand() % FIELD_MIXED
+							  : type;
+		generate_field(&writer, &s->fields[i], escaped);
+	}
+
+	/* Trailing ones keep the last reads away from the stream end.  */
+	put_bits(&writer, ~0ull, 64 - (writer.bit_offset & 7));
+	s->rbsp_size = writer.bit_offset / 8;
+	s->fields_nb = fields_nb - 1;
+
+	ref.data = s->rbsp;
+	ref.bit_offset = 0;
+
+	for (i = 0; i < s->fields_nb; i++) {
+		s->fields[i].value = ref_decode(&ref, &s->fields[i]);
+	}
+
+	if (escaped) {
+		escape_stream(s);
+	} else {
+		s->raw = s->rbsp;
+		s->raw_size = s->rbsp_size;
+		s->escapes_nb = 0;
+	}
+}
+
+static void free_stream(stream *s)
+{
+	if (s->raw != s->rbsp) {
+		free(s->raw);
+	}
+	free(s->rbsp);
+	free(s->fields);
+}
+
+static void mismatch(stream *s, uint32_t i, uint32_t value)
+{
+	fprintf(stderr, "Field %u %s(%u) mismatch: got 0x%X expected 0x%X\n",
+		i, FIELD_NAME[s->fields[i].type], s->fields[i].bits_nb,
+		value, s->fields[i].value);
+	exit(EXIT_FAILURE);
+}
+
+static uint32_t decode_stream(stream *s, int rbsp_mode, int check)
+{
+	bitstream_reader reader;
+	uint32_t value, sum = 0;
+	uint32_t i;
+
+	bitstream_init(&reader, s->raw, s->raw_size);
+	reader.rbsp_mode = rbsp_mode;
+
+	for (i = 0; i < s->fields_nb; i++) {
+		field *f = &s->fields[i];
+
+		switch (f->type) {
+		case FIELD_U:
+			value = bitstream_read_u(&reader, f->bits_nb);
+			break;
+		case FIELD_U_NO_INC:
+			value = bitstream_read_u_no_inc(&reader, f->bits_nb);
+			if (check && value != f->value) {
+				mismatch(s, i, value);
+			}
+			value = bitstream_read_u(&reader, f->bits_nb);
+			break;
+		case FIELD_UE:
+			value = bitstream_read_ue(&reader);
+			break;
+		case FIELD_SE:
+			value = bitstream_read_se(&reader);
+			break;
+		case FIELD_LEADING_ZEROS:
+			value = bitstream_skip_leading_zeros(&reader);
+			break;
+		case FIELD_RBSP_ALIGN:
+			value = bitstream_read_rbsp_align(&reader);
+			break;
+		default:
+			abort();
+		}
+
+		if (check && value != f->value) {
+			mismatch(s, i, value);
+		}
+
+		sum += value;
+	}
+
+	return sum;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(unsigned type, uint32_t fields_nb, unsigned loops,
+		int escaped)
+{
+	volatile uint32_t sum = 0;
+	double start, time;
+	stream s;
+	unsigned i;
+
+	generate_stream(&s, type, fields_nb, escaped);
+
+	decode_stream(&s, escaped, 1);
+
+	start = now();
+
+	for (i = 0; i < loops; i++) {
+		sum += decode_stream(&s, escaped, 0);
+	}
+
+	time = now() - start;
+
+	printf("%-20s %-8s %8.2f ns/field %9.1f MB/s %8u escapes\n",
+	       FIELD_NAME[type], escaped ? "escaped" : "plain",
+	       time * 1e9 / ((double) s.fields_nb * loops),
+	       (double) s.raw_size * loops / time / 1e6, s.escapes_nb);
+
+	free_stream(&s);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t fields_nb = 1000000;
+	unsigned loops = 8;
+	unsigned seed = 1;
+	unsigned type;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:l:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			fields_nb = atoi(optarg);
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "-n number of fields per stream\n");
+			fprintf(stderr, "-l number of passes\n");
+			fprintf(stderr, "-s random seed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (fields_nb < 2) {
+		fields_nb = 2;
+	}
+
+	bitstream_reader_selftest();
+
+	srand(seed);
+
+	for (type = 0; type <= FIELD_MIXED; type++) {
+		/* Alignment only makes sense in between the other fields.  */
+		if (type == FIELD_RBSP_ALIGN) {
+			continue;
+		}
+
+		run(type, fields_nb, loops, 0);
+		run(type, fields_nb, loops, 1);
+	}
+
+	return 0;
+}
@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Streams of h264_gen are analysed in Annex B and in the containers, every
+# container has to give the same pictures. Offsets, sizes and timestamps
+# are of the container and aren't compared, except between the MP4 movies
+# whose samples are the same. Run from the build directory.
+#
+
+BIN=${BIN:-.}
+TMP=$(mktemp -d) || exit 1
+FAILED=0
+
+trap 'rm -rf "$TMP"' EXIT
+
+# Picture number, type, idr, ref_idc, frame_num, POC, slices, list sizes.
+PICTURE=1,3-5,7-11
+# The above with the size and timestamps.
+SAMPLE=1,3-13
+
+# pictures file fields
+pictures() {
+	"$BIN/h264_tegra_decode" -A csv -i "$1" -o "$TMP/out.csv" \
+		>/dev/null 2>"$TMP/err" || return 1
+
+	grep '^[0-9]' "$TMP/out.csv" | cut -d, -f"$2"
+}
+
+# check name gen_args ref_container_args container_args [fields]
+check() {
+	"$BIN/h264_gen" $2 $3 -o "$TMP/ref" >/dev/null 2>&1 &&
+	"$BIN/h264_gen" $2 $4 -o "$TMP/cmp" >/dev/null 2>&1 || {
+		echo "$1: generation failed"
+		FAILED=1
+		return
+	}
+
+	pictures "$TMP/ref" "${5:-$PICTURE}" > "$TMP/ref.csv" &&
+	pictures "$TMP/cmp" "${5:-$PICTURE}" > "$TMP/cmp.csv" &&
+	test -s "$TMP/ref.csv" && cmp -s "$TMP/ref.csv" "$TMP/cmp.csv"
+
+	if [ $? -eq 0 ]; then
+		echo "$1: $(wc -l < "$TMP/ref.csv") pictures match"
+	else
+		echo "$1: MISMATCH"
+		FAILED=1
+	fi
+}
+
+SMALL="-f 60 -g 10 -w 8 -h 6"
+BFRAMES="-f 90 -g 30 -b 2 -i 2 -c 3 -w 20 -h 12"
+# PPS of the explicit slice groups map spans several TS packets.
+LARGE_PPS="-f 30 -G 6 -w 40 -h 30 -p 3 -q -v"
+
+for ARGS in "$SMALL" "$BFRAMES" "$LARGE_PPS"; do
+	check "TS 188 [$ARGS]" "$ARGS" "" "-t 188"
+	check "TS 192 [$ARGS]" "$ARGS" "" "-t 192"
+done
+
+# Parameter sets of IDRs go in STAP-A and the slices in single NAL packets,
+# small MTU aggregates slices of a picture, large PPS is sent in FU-A.
+check "RTP 1400 [$SMALL]" "$SMALL" "" "-u 1400"
+check "RTP 24 [$BFRAMES]" "$BFRAMES" "" "-u 24"
+check "RTP 200 [$LARGE_PPS]" "$LARGE_PPS" "" "-u 200"
+
+# Fragments are of the IDR periods, non-IDR I pictures are sync samples.
+for ARGS in "$SMALL" "$BFRAMES"; do
+	check "MP4 mdat [$ARGS]" "$ARGS" "" "-m"
+	check "MP4 moov [$ARGS]" "$ARGS" "" "-M"
+	check "MP4 fragments [$ARGS]" "$ARGS" "" "-F"
+	check "MP4 fragments to moov [$ARGS]" "$ARGS" "-M" "-F" "$SAMPLE"
+done
+
+exit $FAILED
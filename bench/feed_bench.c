@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Annex B file is analysed by parse_annex_b() from the mapped file and by
+ * decoder_feed() in chunks of the given sizes, the statistics of every chunk
+ * size have to match the file's. Parser traces go to stdout, results are
+ * printed to stderr.
+ */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "analysis.h"
+#include "decoder.h"
+#include "syntax_parse.h"
+
+static const uint32_t default_chunks[] = { 1, 7, 100, 65536 };
+
+typedef struct analysis_output {
+	char *data;
+	size_t size;
+	uint64_t pictures_nb;
+	double time;
+} analysis_output;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static decoder_context * analysis_begin(int fd, uint64_t size,
+					stream_analysis *an,
+					analysis_output *out)
+{
+	decoder_context *decoder;
+	FILE *fp;
+
+	decoder = malloc(sizeof(*decoder));
+	fp = open_memstream(&out->data, &out->size);
+
+	if (decoder == NULL || fp == NULL) {
+		perror("Failed to allocate decoder");
+		abort();
+	}
+
+	decoder_init_parser(decoder, fd, size);
+	analysis_start(decoder, an, fp, ANALYSIS_CSV, 25);
+
+	out->time = now();
+
+	return decoder;
+}
+
+static void analysis_end(decoder_context *decoder, stream_analysis *an,
+			 analysis_output *out)
+{
+	out->time = now() - out->time;
+	out->pictures_nb = an->pictures_nb;
+
+	analysis_summary(an);
+	fclose(an->fp);
+
+	decoder_close_parser(decoder);
+	free(decoder);
+}
+
+static void analyse_file(int fd, uint64_t size, analysis_output *out)
+{
+	decoder_context *decoder;
+	stream_analysis an;
+
+	decoder = analysis_begin(fd, size, &an, out);
+	parse_annex_b(decoder);
+	analysis_end(decoder, &an, out);
+}
+
+static void analyse_chunks(const uint8_t *data, uint64_t size, uint32_t chunk,
+			   analysis_output *out)
+{
+	decoder_context *decoder;
+	stream_analysis an;
+	uint64_t offset;
+
+	decoder = analysis_begin(-1, BITSTREAM_SIZE_UNKNOWN, &an, out);
+
+	for (offset = 0; offset < size; offset += chunk) {
+		decoder_feed(decoder, data + offset,
+			     size - offset < chunk ? size - offset : chunk);
+	}
+
+	decoder_feed_end(decoder);
+	analysis_end(decoder, &an, out);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t chunks[ARRAY_SIZE(default_chunks) * 4];
+	unsigned chunks_nb = 0, i;
+	analysis_output ref, out;
+	const char *path = NULL;
+	struct stat sb;
+	uint8_t *data;
+	int mismatch = 0;
+	int same;
+	int fd, c;
+
+	while ((c = getopt(argc, argv, "i:c:")) != -1) {
+		switch (c) {
+		case 'i':
+			path = optarg;
+			break;
+		case 'c':
+			if (chunks_nb < ARRAY_SIZE(chunks) && atoi(optarg) > 0) {
+				chunks[chunks_nb++] = atoi(optarg);
+			}
+			break;
+		default:
+			path = NULL;
+			optind = argc;
+			break;
+		}
+	}
+
+	if (path == NULL) {
+		fprintf(stderr, "-i Annex B input file path\n");
+		fprintf(stderr, "-c size of the fed chunks, can be repeated "
+				"(1, 7, 100, 65536)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (chunks_nb == 0) {
+		memcpy(chunks, default_chunks, sizeof(default_chunks));
+		chunks_nb = ARRAY_SIZE(default_chunks);
+	}
+
+	fd = open(path, O_RDONLY);
+
+	if (fd == -1 || fstat(fd, &sb) == -1 || sb.st_size == 0) {
+		perror("Failed to open input");
+		exit(EXIT_FAILURE);
+	}
+
+	data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (data == MAP_FAILED) {
+		perror("Failed to map input");
+		exit(EXIT_FAILURE);
+	}
+
+	analyse_file(fd, sb.st_size, &ref);
+
+	fprintf(stderr, "file          %8.3f s, %" PRIu64 " pictures\n",
+		ref.time, ref.pictures_nb);
+
+	for (i = 0; i < chunks_nb; i++) {
+		analyse_chunks(data, sb.st_size, chunks[i], &out);
+
+		same = (out.size == ref.size &&
+			memcmp(out.data, ref.data, ref.size) == 0);
+		mismatch |= !same;
+
+		fprintf(stderr, "chunk %7u %8.3f s, %s\n", chunks[i], out.time,
+			same ? "matches" : "MISMATCH");
+
+		free(out.data);
+	}
+
+	free(ref.data);
+	munmap(data, sb.st_size);
+	close(fd);
+
+	return mismatch ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bitstream.h"
+
+#define MB	(1024 * 1024)
+
+/* Byte at a time scanner, matches the original seek_to_NAL_start().  */
+static int find_start_code_ref(const uint8_t *data, uint32_t offset,
+			       uint32_t end, uint32_t *code_offset)
+{
+	for (; offset + 3 < end; offset++) {
+		if (data[offset] != 0x00 || data[offset + 1] != 0x00) {
+			continue;
+		}
+
+		if (data[offset + 2] == 0x01) {
+			*code_offset = offset;
+			return 3;
+		}
+
+		if (data[offset + 2] == 0x00 && data[offset + 3] == 0x01) {
+			*code_offset = offset;
+			return 4;
+		}
+	}
+
+	return 0;
+}
+
+typedef int (*scanner)(const uint8_t *, uint32_t, uint32_t, uint32_t *);
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Slice-like payload: random bytes with emulation prevention applied, short
+ * zero runs as produced by CABAC/CAVLC, start codes every nal_size bytes.
+ */
+static void fill_buffer(uint8_t *data, uint32_t size, uint32_t nal_size,
+			unsigned zero_rate)
+{
+	uint32_t offset = 0, next_nal = 0;
+	unsigned zeros = 0;
+	uint8_t byte;
+
+	srand(size ^ nal_size ^ zero_rate);
+
+	while (offset < size) {
+		if (offset == next_nal && offset + 4 < size) {
+			memcpy(data + offset, "\x00\x00\x00\x01", 4);
+			offset += 4;
+			next_nal += nal_size;
+			zeros = 0;
+			continue;
+		}
+
+		byte = (rand() % zero_rate == 0) ? 0x00 : rand();
+
+		if (zeros >= 2 && byte <= 0x03) {
+			data[offset++] = 0x03;
+			zeros = 0;
+			continue;
+		}
+
+		zeros = byte ? 0 : zeros + 1;
+		data[offset++] = byte;
+	}
+}
+
+static unsigned scan(scanner fn, const uint8_t *data, uint32_t size,
+		     uint32_t *codes)
+{
+	uint32_t offset = 0, code_offset;
+	unsigned codes_nb = 0;
+	int ret;
+
+	while ((ret = fn(data, offset, size, &code_offset)) != 0) {
+		if (codes) {
+			codes[codes_nb] = code_offset | (ret == 4 ? 1u << 31 : 0);
+		}
+		offset = code_offset + ret;
+		codes_nb++;
+	}
+
+	return codes_nb;
+}
+
+static double measure(scanner fn, const uint8_t *data, uint32_t size,
+		      unsigned loops)
+{
+	double start = now();
+	unsigned i;
+
+	for (i = 0; i < loops; i++) {
+		scan(fn, data, size, NULL);
+	}
+
+	return (double) size * loops / (now() - start) / 1e9;
+}
+
+static void run(uint8_t *data, uint32_t size, uint32_t nal_size,
+		unsigned zero_rate, unsigned loops)
+{
+	uint32_t *codes_ref, *codes;
+	unsigned ref_nb, nb;
+	double ref_gbs, gbs;
+
+	fill_buffer(data, size, nal_size, zero_rate);
+
+	codes_ref = malloc(sizeof(uint32_t) * (size / 3 + 1));
+	codes     = malloc(sizeof(uint32_t) * (size / 3 + 1));
+
+	if (!codes_ref || !codes) {
+		fprintf(stderr, "Out of memory\n");
+		abort();
+	}
+
+	ref_nb = scan(find_start_code_ref, data, size, codes_ref);
+	nb     = scan(find_start_code, data, size, codes);
+
+	if (ref_nb != nb || memcmp(codes_ref, codes, nb * sizeof(*codes))) {
+		fprintf(stderr, "Start codes mismatch: %u vs %u\n", ref_nb, nb);
+		exit(EXIT_FAILURE);
+	}
+
+	ref_gbs = measure(find_start_code_ref, data, size, loops);
+	gbs     = measure(find_start_code, data, size, loops);
+
+	printf("NAL %8u zero 1/%-3u codes %6u: byte %6.2f GB/s, "
+	       "%s %6.2f GB/s, x%.1f\n",
+	       nal_size, zero_rate, nb, ref_gbs, find_start_code_impl(),
+	       gbs, gbs / ref_gbs);
+
+	free(codes_ref);
+	free(codes);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t size = 256 * MB;
+	unsigned loops = 4;
+	uint8_t *data;
+	int c;
+
+	while ((c = getopt(argc, argv, "s:l:")) != -1) {
+		switch (c) {
+		case 's':
+			size = atoi(optarg) * MB;
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "-s buffer size in MB\n");
+			fprintf(stderr, "-l number of passes\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (data == MAP_FAILED) {
+		perror("Failed to allocate buffer");
+		exit(EXIT_FAILURE);
+	}
+
+	run(data, size, 2 * MB, 256, loops);
+	run(data, size, 64 * 1024, 256, loops);
+	run(data, size, 2 * MB, 16, loops);
+	run(data, size, 1024, 4, loops);
+
+	munmap(data, size);
+
+	return 0;
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bitstream.h"
+
+#define MB	(1024 * 1024)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Slice-like payload with emulation prevention applied and a 3 or 4 bytes
+ * start code every few KB. Another start code is put a few bytes around every
+ * MB boundary, so that scan jobs of any MB multiple size have start codes
+ * straddling their boundaries.
+ */
+static void fill_file(FILE *fp, uint64_t size)
+{
+	uint8_t *buf = malloc(MB + 8);
+	uint64_t offset, next_nal = 0;
+	uint32_t i, chunk;
+	unsigned zeros = 0;
+	int shift;
+	uint8_t byte;
+
+	if (buf == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		abort();
+	}
+
+	srand(size / MB);
+
+	for (offset = 0; offset < size; offset += chunk) {
+		chunk = (size - offset < MB) ? size - offset : MB;
+
+		for (i = 0; i < chunk; i++) {
+			if (offset + i == next_nal && i + 4 < chunk) {
+				memcpy(buf + i, rand() % 2 ? "\x00\x00\x00\x01" :
+							    "\xFF\x00\x00\x01", 4);
+				next_nal += 5 + rand() % 8192;
+				zeros = 0;
+				i += 3;
+				continue;
+			}
+
+			byte = (rand() % 64 == 0) ? 0x00 : rand();
+
+			if (zeros >= 2 && byte <= 0x03) {
+				byte = 0x03;
+			}
+
+			zeros = byte ? 0 : zeros + 1;
+			buf[i] = byte;
+		}
+
+		shift = (offset / MB) % 7;
+
+		if (offset + MB + 4 < size) {
+			memcpy(buf + MB - shift - 1, "\x00\x00\x00\x01", 4);
+		}
+
+		if (fwrite(buf, 1, chunk, fp) != chunk) {
+			perror("Failed to write test file");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	free(buf);
+	fflush(fp);
+}
+
+/* Table of the sequential bitstream_find_start_code() scan.  */
+static uint64_t scan_sequential(int fd, uint64_t size,
+				bitstream_start_code **codes)
+{
+	bitstream_reader reader;
+	uint64_t codes_nb = 0, codes_max = 1024;
+	uint64_t offset = 0, code_offset;
+	int ret;
+
+	bitstream_init_file(&reader, fd, size);
+
+	*codes = malloc(codes_max * sizeof(**codes));
+
+	while ((ret = bitstream_find_start_code(&reader, offset,
+						&code_offset)) != 0) {
+		if (codes_nb == codes_max) {
+			codes_max *= 2;
+			*codes = realloc(*codes, codes_max * sizeof(**codes));
+		}
+
+		if (*codes == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			abort();
+		}
+
+		(*codes)[codes_nb].offset = code_offset;
+		(*codes)[codes_nb].size = ret;
+		codes_nb++;
+
+		offset = code_offset + ret;
+	}
+
+	bitstream_close(&reader);
+
+	return codes_nb;
+}
+
+int main(int argc, char **argv)
+{
+	bitstream_start_code *codes_ref, *codes;
+	uint64_t ref_nb, nb, i, size = 512 * (uint64_t) MB;
+	unsigned threads_max = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *path = NULL;
+	double start, ref_time, time;
+	struct stat sb;
+	unsigned threads;
+	FILE *fp;
+	int fd;
+	int c;
+
+	while ((c = getopt(argc, argv, "i:s:t:")) != -1) {
+		switch (c) {
+		case 'i':
+			path = optarg;
+			break;
+		case 's':
+			size = atoi(optarg) * (uint64_t) MB;
+			break;
+		case 't':
+			threads_max = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "-i Annex B file to scan instead of "
+					"a generated one\n");
+			fprintf(stderr, "-s generated file size in MB\n");
+			fprintf(stderr, "-t max number of threads\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (path != NULL) {
+		fd = open(path, O_RDONLY);
+	} else {
+		fp = tmpfile();
+		if (fp == NULL) {
+			perror("Failed to create test file");
+			exit(EXIT_FAILURE);
+		}
+
+		fill_file(fp, size);
+		fd = fileno(fp);
+	}
+
+	if (fd == -1 || fstat(fd, &sb) == -1) {
+		perror("Failed to open input");
+		exit(EXIT_FAILURE);
+	}
+
+	size = sb.st_size;
+
+	start = now();
+	ref_nb = scan_sequential(fd, size, &codes_ref);
+	ref_time = now() - start;
+
+	printf("%" PRIu64 " MB, %" PRIu64 " start codes, sequential "
+	       "%.2f GB/s\n", size / MB, ref_nb, size / ref_time / 1e9);
+
+	for (threads = 1; threads <= threads_max; threads *= 2) {
+		start = now();
+		nb = bitstream_scan_start_codes(fd, size, threads, &codes);
+		time = now() - start;
+
+		for (i = 0; i < nb && i < ref_nb; i++) {
+			if (codes[i].offset != codes_ref[i].offset ||
+			    codes[i].size != codes_ref[i].size) {
+				break;
+			}
+		}
+
+		if (nb != ref_nb || i != nb) {
+			fprintf(stderr, "Start codes mismatch with %u threads: "
+				"%" PRIu64 " vs %" PRIu64 "\n",
+				threads, nb, ref_nb);
+			exit(EXIT_FAILURE);
+		}
+
+		printf("%2u threads: %6.2f GB/s, x%.2f\n",
+		       threads, size / time / 1e9, ref_time / time);
+
+		free(codes);
+	}
+
+	free(codes_ref);
+
+	return 0;
+}
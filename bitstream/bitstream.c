@@ -16,9 +16,11 @@
  */
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 
 #include "bitstream.h"
@@ -38,7 +40,7 @@
 	fprintf(stderr, "%s:%d:\n", __FILE__, __LINE__);		\
 	fprintf(stderr, "bitstream_reader: " f, ## __VA_ARGS__);	\
 	reader->error = 1;						\
-	exit(EXIT_FAILURE);						\
+	bitstream_bail(reader, BITSTREAM_MALFORMED);			\
 }
 
 #if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
@@ -49,6 +51,11 @@
 #define clz	__builtin_clz
 #endif
 
+#ifndef clzll
+#define clzll	__builtin_clzll
+#endif
+
+/* Checks of the reader, an assert fails if it is broken.  */
 void bitstream_reader_selftest(void)
 {
 	uint8_t test_data[] = { 0x0F, 0xFF, 0x03, 0x10, 0x90, 0x7F };
@@ -61,13 +68,13 @@ void bitstream_reader_selftest(void)
 
 	val = bitstream_read_ue(&reader);
 
-	printf("codenum = %u\n", val);
+	BITSTREAM_DPRINT("codenum = %u\n", val);
 
 	assert(val == 30);
 
 	val = bitstream_read_ue(&reader);
 
-	printf("codenum = %u\n", val);
+	BITSTREAM_DPRINT("codenum = %u\n", val);
 
 	assert(val == 0);
 
@@ -75,7 +82,7 @@ void bitstream_reader_selftest(void)
 
 	val = bitstream_read_ue(&reader);
 
-	printf("codenum = %u\n", val);
+	BITSTREAM_DPRINT("codenum = %u\n", val);
 
 	assert(val == 97);
 
@@ -84,13 +91,13 @@ void bitstream_reader_selftest(void)
 
 	val = bitstream_read_ue(&reader);
 
-	printf("codenum = %u\n", val);
+	BITSTREAM_DPRINT("codenum = %u\n", val);
 
 	assert(val == 17);
 
 	val = bitstream_read_ue(&reader);
 
-	printf("codenum = %u\n", val);
+	BITSTREAM_DPRINT("codenum = %u\n", val);
 
 	assert(val == 30);
 
@@ -100,7 +107,7 @@ void bitstream_reader_selftest(void)
 
 	for (i = 0; i < 64; i++) {
 		unsigned cmp = ((be64toh(test) >> (63 - i))) & 1;
-		printf("i = %d cmp 0x%X\n", i, cmp);
+		BITSTREAM_DPRINT("i = %d cmp 0x%X\n", i, cmp);
 		assert(bitstream_read_u(&reader, 1) == cmp);
 	}
 
@@ -110,7 +117,7 @@ void bitstream_reader_selftest(void)
 
 	for (i = 0; i < 12; i++) {
 		unsigned cmp = ((be64toh(test) >> (64 - 5 * (i + 1)))) & 31;
-		printf("i = %d cmp 0x%X\n", i, cmp);
+		BITSTREAM_DPRINT("i = %d cmp 0x%X\n", i, cmp);
 		assert(bitstream_read_u(&reader, 5) == cmp);
 	}
 
@@ -118,7 +125,7 @@ void bitstream_reader_selftest(void)
 
 	for (i = 0; i < 16; i++) {
 		unsigned cmp = ((be64toh(test) >> (64 - 4 * (i + 1)))) & 15;
-		printf("i = %d cmp 0x%X\n", i, cmp);
+		BITSTREAM_DPRINT("i = %d cmp 0x%X\n", i, cmp);
 		assert(bitstream_read_u(&reader, 4) == cmp);
 	}
 
@@ -127,34 +134,75 @@ void bitstream_reader_selftest(void)
 
 	for (i = 0; i < 15; i++) {
 		unsigned cmp = (((be64toh(test) << 1) >> (64 - 4 * (i + 1)))) & 15;
-		printf("i = %d cmp 0x%X\n", i, cmp);
+		BITSTREAM_DPRINT("i = %d cmp 0x%X\n", i, cmp);
 		assert(bitstream_read_u(&reader, 4) == cmp);
 	}
 
-	printf("%s passed\n", __func__);
+	for (i = 0; i < 100000; i += (i < 600) ? 1 : 997) {
+		unsigned bits_nb = 32 - clz(i + 1);
+		unsigned shift = i & 7;
+
+		test = htobe64((uint64_t) (i + 1) << (64 - shift - bits_nb * 2 + 1));
+
+		bitstream_init(&reader, &test, sizeof(test));
+		reader.bit_shift = shift;
+
+		val = bitstream_read_ue(&reader);
+		assert(val == i);
+		assert(reader.data_offset * 8 + reader.bit_shift ==
+		       shift + bits_nb * 2 - 1);
+	}
+
+	BITSTREAM_DPRINT("%s passed\n", __func__);
 }
 
-void bitstream_init(bitstream_reader *reader, void *data, uint32_t size)
+void bitstream_init(bitstream_reader *reader, void *data, uint64_t size)
 {
 	reader->data_ptr = data;
+	reader->data_start = 0;
+	reader->data_size = size;
+	reader->file_size = size;
+	reader->fd = -1;
+	reader->ring = NULL;
+	reader->rbsp = NULL;
 	reader->bitstream_end = size;
 	reader->data_offset = 0;
+	reader->NAL_offset = 0;
+	reader->NAL_end = size;
+	reader->stop_bit_offset = 0;
+	reader->stop_bit_shift = 0;
 	reader->bit_shift = 0;
 	reader->rbsp_mode = 0;
 	reader->error = 0;
+	reader->bail = NULL;
+	reader->cache = 0;
+	reader->cache_size = 0;
+	reader->cache_escapes = 0;
+	reader->cache_offset = 0;
+	reader->cache_end = size;
+	reader->cache_rbsp_mode = 0;
+}
+
+void bitstream_bail(bitstream_reader *reader, int reason)
+{
+	if (reader->bail != NULL) {
+		longjmp(*reader->bail, reason);
+	}
+
+	exit(reason == BITSTREAM_END_REACHED ? 0 : EXIT_FAILURE);
 }
 
 static int check_range(bitstream_reader *reader, uint32_t offset)
 {
 	if (reader->data_offset + offset >= reader->bitstream_end) {
 		BITSTREAM_IPRINT("Reached data stream end\n");
-		exit(0);
+		bitstream_bail(reader, BITSTREAM_END_REACHED);
 	}
 
 	return 0;
 }
 
-inline void bitstream_reader_inc_offset(bitstream_reader *reader, uint32_t delta)
+inline void bitstream_reader_inc_offset(bitstream_reader *reader, uint64_t delta)
 {
 	reader->data_offset += delta;
 }
@@ -170,227 +218,336 @@ uint8_t bitstream_read_rbsp_align(bitstream_reader *reader)
 
 uint32_t bitstream_read_next_word(bitstream_reader *reader)
 {
-	uint32_t offset = reader->data_offset;
+	uint64_t offset = reader->data_offset;
 	int align = (reader->bit_shift == 0) ? 0 : 1;
+	uint32_t word;
 
 	if (check_range(reader, align + 3) != 0) {
 		return 0;
 	}
 
-	return *((uint32_t *)(reader->data_ptr + offset + align));
-}
+	memcpy(&word, bitstream_data(reader, offset + align, 4), sizeof(word));
 
-static uint8_t bitstream_read_u8_no_inc(bitstream_reader *reader);
+	return word;
+}
 
-static uint8_t emulation_escape(bitstream_reader *reader, uint32_t offset,
-				uint8_t data, int inc_offset, int *escaped)
+/*
+ * 0x03 that follows two zero bytes and precedes a byte in range 0x00-0x03
+ * is an emulation prevention byte and isn't part of the RBSP.
+ */
+static int is_emulation_prevention_byte(bitstream_reader *reader,
+					uint64_t offset)
 {
-	uint32_t seq;
+	const uint8_t *data;
 
-	if (data != 0x03 || !reader->rbsp_mode) {
-		return data;
+	if (offset < 2) {
+		return 0;
 	}
 
-	if (offset < 2 || offset == reader->bitstream_end) {
-		return data;
+	data = bitstream_data(reader, offset - 2, 3);
+
+	if (data[2] != 0x03 || data[1] != 0x00 || data[0] != 0x00) {
+		return 0;
 	}
 
-	seq = *((uint32_t *)(reader->data_ptr + offset - 2));
-	seq = be32toh(seq);
-
-	switch (seq) {
-	case 0x00000300:
-	case 0x00000301:
-	case 0x00000302:
-	case 0x00000303:
-		BITSTREAM_DPRINT("0x%08X escaped!\n", seq);
-		if (inc_offset) {
-			reader->data_offset++;
-		}
-		if (escaped != NULL) {
-			*escaped = 1;
-		}
-		return seq & 0xFF;
-	default:
-		break;
+	if (offset + 1 < reader->bitstream_end &&
+			*bitstream_data(reader, offset + 1, 1) > 0x03) {
+		return 0;
 	}
 
-	return data;
+	return 1;
 }
 
-static uint8_t bitstream_read_u8_no_inc(bitstream_reader *reader)
+/* Non-zero if any byte of the word equals 0x03.  */
+static int has_byte_0x03(uint64_t word)
 {
-	uint8_t ret;
+	word ^= 0x0303030303030303ull;
 
-	if (reader->error) {
-		return 0;
+	return !!((word - 0x0101010101010101ull) & ~word & 0x8080808080808080ull);
+}
+
+/*
+ * Load the bit window with up to 8 bytes starting at data_offset. In RBSP
+ * mode emulation prevention bytes are dropped from the window and recorded in
+ * cache_escapes: bit N set means that an escape byte precedes window byte N.
+ * The de-escaped NAL buffer is used when available, raw data otherwise.
+ */
+static void bitstream_refill(bitstream_reader *reader)
+{
+	uint64_t offset = reader->data_offset;
+	uint64_t end = reader->bitstream_end;
+	uint64_t cache = 0;
+	uint8_t escapes = 0;
+	unsigned i = 0;
+
+	/* Streamed input learns its size only once the end is reached.  */
+	if (reader->ring != NULL) {
+		bitstream_wait(reader, (offset + 8 < end) ? offset + 8 : end);
+		end = reader->bitstream_end;
 	}
 
-	if (check_range(reader, 0) != 0) {
-		return 0;
+	reader->cache_offset = offset;
+	reader->cache_end = end;
+	reader->cache_rbsp_mode = reader->rbsp_mode;
+
+	if (reader->rbsp_mode && reader->rbsp != NULL &&
+			bitstream_rbsp_load(reader)) {
+		return;
 	}
 
-	ret = *(reader->data_ptr + reader->data_offset);
+	if (offset < end && end - offset >= 8) {
+		memcpy(&cache, bitstream_data(reader, offset, 8), sizeof(cache));
+		cache = be64toh(cache);
 
-	return emulation_escape(reader, reader->data_offset, ret, 1, NULL);
-}
+		if (!reader->rbsp_mode || !has_byte_0x03(cache)) {
+			reader->cache = cache;
+			reader->cache_size = 8;
+			reader->cache_escapes = 0;
+			return;
+		}
 
-static uint32_t bitstream_read_bits(bitstream_reader *reader, uint8_t bits_nb,
-				    int inc_offset)
-{
-	const uint8_t bit_shift = reader->bit_shift;
-	const uint8_t *data_ptr = reader->data_ptr;
-	uint32_t data_offset = reader->data_offset;
-	const uint64_t mask = (1ll << bits_nb) - 1;
-	uint8_t bytes_to_read = (bits_nb + bit_shift - 1) >> 3;
-	const uint8_t rshift = 8 * (bytes_to_read + 1) - (bit_shift + bits_nb);
-	int escape_inc_offset = 0;
-	uint64_t ret = 0;
+		cache = 0;
+	}
 
-	assert(bits_nb != 0);
-	assert(bits_nb <= 32);
+	for (; i < 8 && offset < end; offset++) {
+		if (reader->rbsp_mode &&
+				is_emulation_prevention_byte(reader, offset)) {
+			BITSTREAM_DPRINT("0x%" PRIX64 " escaped!\n", offset);
+			escapes |= 1 << i;
+			continue;
+		}
 
-	if (inc_offset && check_range(reader, bytes_to_read) != 0) {
-		return 0;
+		cache |= (uint64_t) *bitstream_data(reader, offset, 1) <<
+							(56 - 8 * i++);
 	}
 
-	BITSTREAM_DPRINT("===\n");
-	BITSTREAM_DPRINT("bit_shift %u bits_nb %u bytes_to_read %u\n",
-			 bit_shift, bits_nb, bytes_to_read);
+	reader->cache = cache;
+	reader->cache_size = i;
+	reader->cache_escapes = escapes;
+}
 
-	do {
-		uint8_t byte = *(data_ptr + data_offset);
-		uint8_t lshift = bytes_to_read << 3;
-		int escaped = 0;
+/*
+ * Locate the current position within the bit window, reloading the window if
+ * it doesn't hold bits_nb bits past the position. Window is re-used only if
+ * it has no escapes, otherwise the position mapping isn't linear.
+ */
+static inline int bitstream_fill(bitstream_reader *reader, unsigned bits_nb,
+				 unsigned *pos)
+{
+	uint64_t delta = reader->data_offset - reader->cache_offset;
 
-		byte = emulation_escape(reader, data_offset++, byte,
-					!escape_inc_offset || inc_offset,
-					&escaped);
+	if (reader->cache_escapes == 0 && delta < 8 &&
+			reader->cache_end == reader->bitstream_end &&
+			reader->cache_rbsp_mode == reader->rbsp_mode) {
+		*pos = delta * 8 + reader->bit_shift;
 
-		if (escaped) {
-			data_offset++;
+		if (*pos + bits_nb <= reader->cache_size * 8) {
+			return 1;
 		}
+	}
 
-		escape_inc_offset = 1;
+	bitstream_refill(reader);
 
-		ret |= (uint64_t) byte << lshift;
+	*pos = reader->bit_shift;
 
-		BITSTREAM_DPRINT("0x%02X lshift %u 0x%lX\n",
-				 byte, lshift, ret);
-	} while (bytes_to_read--);
+	return *pos + bits_nb <= reader->cache_size * 8;
+}
 
-	BITSTREAM_DPRINT("ret 0x%lX\n", ret);
-	BITSTREAM_DPRINT("rshift %u\n", rshift);
-	BITSTREAM_DPRINT("mask 0x%lX\n", mask);
+static inline unsigned check_bits_range(bitstream_reader *reader,
+					unsigned bits_nb)
+{
+	unsigned pos;
 
-	ret >>= rshift;
-	ret &= mask;
+	if (!bitstream_fill(reader, bits_nb, &pos)) {
+		BITSTREAM_IPRINT("Reached data stream end\n");
+		bitstream_bail(reader, BITSTREAM_END_REACHED);
+	}
 
-	BITSTREAM_DPRINT("ret 0x%lX\n", ret);
-	BITSTREAM_DPRINT("===\n\n");
+	return pos;
+}
 
-	return ret;
+static uint32_t bitstream_peek_bits(bitstream_reader *reader, unsigned pos,
+				    uint8_t bits_nb)
+{
+	return (reader->cache << pos) >> (64 - bits_nb);
 }
 
-static void bitstream_reader_inc_offset_b(bitstream_reader *reader,
-					  uint8_t bits_nb)
+/* Move position to the window bit pos + bits_nb.  */
+static void bitstream_skip_bits(bitstream_reader *reader, unsigned pos,
+				unsigned bits_nb)
 {
-	uint8_t bit_shift = reader->bit_shift;
+	unsigned bits = pos + bits_nb;
+	unsigned bytes = bits >> 3;
+	unsigned escapes_mask;
+
+	reader->bit_shift = bits & 7;
+	reader->data_offset = reader->cache_offset + bytes;
+
+	if (reader->cache_escapes == 0) {
+		return;
+	}
+
+	/*
+	 * Byte aligned position may point to the escape byte, like the
+	 * byte-wise reader did. Otherwise it is within the data byte that
+	 * follows the escape.
+	 */
+	if (reader->bit_shift == 0) {
+		escapes_mask = (1u << bytes) - 1;
+	} else {
+		escapes_mask = (2u << bytes) - 1;
+	}
 
-	reader->data_offset += (bit_shift + bits_nb) >> 3;
-	reader->bit_shift = (bit_shift + bits_nb) % 8;
+	reader->data_offset += __builtin_popcount(reader->cache_escapes &
+						  escapes_mask);
 }
 
 uint32_t bitstream_read_u_no_inc(bitstream_reader *reader, uint8_t bits_nb)
 {
-	uint32_t ret;
+	unsigned pos;
 
-	if (reader->bit_shift == 0 && bits_nb == 8) {
-		ret = bitstream_read_u8_no_inc(reader);
-	} else {
-		ret = bitstream_read_bits(reader, bits_nb, 0);
+	assert(bits_nb != 0);
+	assert(bits_nb <= 32);
+
+	if (reader->error) {
+		return 0;
 	}
 
-	return ret;
+	/* Bits past the stream end read as zeros.  */
+	bitstream_fill(reader, bits_nb, &pos);
+
+	return bitstream_peek_bits(reader, pos, bits_nb);
 }
 
 uint32_t bitstream_read_u(bitstream_reader *reader, uint8_t bits_nb)
 {
 	uint32_t ret;
+	unsigned pos;
 
-	if (reader->bit_shift == 0 && bits_nb == 8) {
-		ret = bitstream_read_u8_no_inc(reader);
-		bitstream_reader_inc_offset(reader, 1);
-	} else {
-		ret = bitstream_read_bits(reader, bits_nb, 1);
-		bitstream_reader_inc_offset_b(reader, bits_nb);
+	assert(bits_nb != 0);
+	assert(bits_nb <= 32);
+
+	if (reader->error) {
+		return 0;
 	}
 
+	pos = check_bits_range(reader, bits_nb);
+
+	ret = bitstream_peek_bits(reader, pos, bits_nb);
+	bitstream_skip_bits(reader, pos, bits_nb);
+
+	BITSTREAM_DPRINT("read %u bits 0x%X\n", bits_nb, ret);
+
 	return ret;
 }
 
 unsigned bitstream_skip_leading_zeros(bitstream_reader *reader)
 {
-	const uint8_t bit_shift = reader->bit_shift;
-	uint8_t leading_zeros_align = 0;
-	uint8_t leading_zeros = 0;
+	unsigned leading_zeros = 0;
 
-	if (bit_shift != 0 && !reader->error) {
-		uint8_t byte = bitstream_read_bits(reader, 8 - bit_shift, 0);
+	while (!reader->error) {
+		unsigned pos = check_bits_range(reader, 1);
+		unsigned avail = reader->cache_size * 8 - pos;
+		uint64_t window = reader->cache << pos;
 
-		if (byte != 0) {
-			leading_zeros_align = clz(byte) - 24 - bit_shift;
-		} else {
-			leading_zeros_align = 8 - bit_shift;
-		}
-
-		BITSTREAM_DPRINT("byte 0x%X leading_zeros_align %u\n",
-				 byte, leading_zeros_align);
+		/* The window is zero-padded, so any set bit is a valid one.  */
+		if (window != 0) {
+			unsigned zeros = clzll(window);
 
-		if (byte != 0) {
-			reader->bit_shift += leading_zeros_align;
+			bitstream_skip_bits(reader, pos, zeros + 1);
 
-			bitstream_reader_inc_offset_b(reader, 1);
+			BITSTREAM_DPRINT("leading_zeros %u\n",
+					 leading_zeros + zeros);
 
-			return leading_zeros_align;
+			return leading_zeros + zeros;
 		}
 
-		bitstream_reader_inc_offset_b(reader, leading_zeros_align);
+		leading_zeros += avail;
+		bitstream_skip_bits(reader, pos, avail);
 	}
 
-	for (;;) {
-		uint8_t byte = bitstream_read_u8_no_inc(reader);
+	return 0;
+}
 
-		leading_zeros += byte ? clz(byte) - 24 : 8;
+static uint32_t exp_golomb_codenum(unsigned exp, uint32_t val)
+{
+	uint32_t ret = (1l << exp) - 1 + val;
 
-		BITSTREAM_DPRINT("byte 0x%X leading_zeros %u\n",
-				 byte, leading_zeros);
+	BITSTREAM_DPRINT("exp %u val %u ret %u\n", exp, val, ret);
 
-		if (byte != 0) {
-			reader->bit_shift += leading_zeros % 8;
+	return ret;
+}
 
-			bitstream_reader_inc_offset_b(reader, 1);
+#define UE(val, len)	(((val) << 8) | (len))
+#define X2(...)		__VA_ARGS__, __VA_ARGS__
+#define X4(...)		X2(X2(__VA_ARGS__))
+#define X16(...)	X4(X4(__VA_ARGS__))
+#define X64(...)	X4(X16(__VA_ARGS__))
+#define X256(...)	X4(X64(__VA_ARGS__))
 
-			leading_zeros += leading_zeros_align;
+/*
+ * Exp-Golomb codes up to UE_LUT_BITS long (codenum 0..30) indexed by the next
+ * UE_LUT_BITS of the stream, entry is codenum << 8 | code length. Zero entry
+ * means the code is longer.
+ */
+#define UE_LUT_BITS	9
+
+static const uint16_t ue_lut[1 << UE_LUT_BITS] = {
+	X16(0),
+	UE(15, 9), UE(16, 9), UE(17, 9), UE(18, 9),
+	UE(19, 9), UE(20, 9), UE(21, 9), UE(22, 9),
+	UE(23, 9), UE(24, 9), UE(25, 9), UE(26, 9),
+	UE(27, 9), UE(28, 9), UE(29, 9), UE(30, 9),
+	X4(UE(7, 7)), X4(UE(8, 7)), X4(UE(9, 7)), X4(UE(10, 7)),
+	X4(UE(11, 7)), X4(UE(12, 7)), X4(UE(13, 7)), X4(UE(14, 7)),
+	X16(UE(3, 5)), X16(UE(4, 5)), X16(UE(5, 5)), X16(UE(6, 5)),
+	X64(UE(1, 3)), X64(UE(2, 3)),
+	X256(UE(0, 1)),
+};
+
+/*
+ * Resolve the code within the bit window: short codes with a single table
+ * lookup, longer ones with CLZ. Returns 0 if the code doesn't fit the window
+ * or is malformed, the caller takes the byte-wise path then.
+ */
+static inline int bitstream_read_ue_fast(bitstream_reader *reader,
+					 uint32_t *codenum)
+{
+	unsigned leading_zeros, code_len, pos;
+	uint64_t window;
+	uint16_t code;
 
-			BITSTREAM_DPRINT("leading_zeros %u\n", leading_zeros);
+	if (!bitstream_fill(reader, UE_LUT_BITS, &pos)) {
+		return 0;
+	}
 
-			return leading_zeros;
-		}
+	code = ue_lut[bitstream_peek_bits(reader, pos, UE_LUT_BITS)];
 
-		bitstream_reader_inc_offset(reader, 1);
+	if (code) {
+		bitstream_skip_bits(reader, pos, code & 0xFF);
+		*codenum = code >> 8;
+		return 1;
 	}
 
-	return 0;
-}
+	window = reader->cache << pos;
 
-static uint32_t exp_golomb_codenum(unsigned exp, uint32_t val)
-{
-	uint32_t ret = (1l << exp) - 1 + val;
+	if (window == 0) {
+		return 0;
+	}
 
-	BITSTREAM_DPRINT("exp %u val %u ret %u\n", exp, val, ret);
+	leading_zeros = clzll(window);
+	code_len = leading_zeros * 2 + 1;
 
-	return ret;
+	if (leading_zeros > 31 || pos + code_len > reader->cache_size * 8) {
+		return 0;
+	}
+
+	window <<= leading_zeros + 1;
+	*codenum = exp_golomb_codenum(leading_zeros,
+				      window >> (64 - leading_zeros));
+	bitstream_skip_bits(reader, pos, code_len);
+
+	return 1;
 }
 
 uint32_t bitstream_read_ue(bitstream_reader *reader)
@@ -398,6 +555,11 @@ uint32_t bitstream_read_ue(bitstream_reader *reader)
 	unsigned leading_zeros;
 	uint32_t val = 0;
 
+	if (!reader->error && bitstream_read_ue_fast(reader, &val)) {
+		BITSTREAM_DPRINT("ue %u\n", val);
+		return val;
+	}
+
 	leading_zeros = bitstream_skip_leading_zeros(reader);
 
 	if (leading_zeros > 31) {
@@ -415,7 +577,7 @@ uint32_t bitstream_read_ue(bitstream_reader *reader)
 int32_t bitstream_read_se(bitstream_reader *reader)
 {
 	uint32_t ue = bitstream_read_ue(reader);
-	uint32_t val = (ue > 1) ? (ue >> 1) + (ue & 1) : ue;
+	uint32_t val = (ue >> 1) + (ue & 1);
 	int positive = ue & 1;
 
 	return positive ? val : -val;
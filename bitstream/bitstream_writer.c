@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitstream_writer.h"
+
+#define WRITER_CHUNK_SIZE	65536
+
+void bitstream_writer_init(bitstream_writer *writer)
+{
+	memset(writer, 0, sizeof(*writer));
+}
+
+void bitstream_writer_free(bitstream_writer *writer)
+{
+	free(writer->data_ptr);
+	bitstream_writer_init(writer);
+}
+
+/* Drop the written data, the buffer is kept for re-use.  */
+void bitstream_writer_reset(bitstream_writer *writer)
+{
+	writer->data_offset = 0;
+	writer->cache = 0;
+	writer->cache_bits = 0;
+	writer->rbsp_mode = 0;
+	writer->zeros = 0;
+}
+
+static void bitstream_writer_reserve(bitstream_writer *writer, uint32_t size)
+{
+	if (writer->data_offset + size <= writer->data_size) {
+		return;
+	}
+
+	writer->data_size += size + WRITER_CHUNK_SIZE;
+	writer->data_ptr = realloc(writer->data_ptr, writer->data_size);
+	assert(writer->data_ptr != NULL);
+}
+
+/*
+ * In RBSP mode a byte in range 0x00-0x03 that follows two zero bytes is
+ * preceded with the emulation prevention byte 0x03, mirroring the reader.
+ */
+static void bitstream_put_byte(bitstream_writer *writer, uint8_t byte)
+{
+	bitstream_writer_reserve(writer, 2);
+
+	if (writer->rbsp_mode && writer->zeros == 2 && byte <= 0x03) {
+		writer->data_ptr[writer->data_offset++] = 0x03;
+		writer->zeros = 0;
+	}
+
+	writer->data_ptr[writer->data_offset++] = byte;
+	writer->zeros = byte ? 0 : writer->zeros + 1;
+}
+
+void bitstream_write_u(bitstream_writer *writer, uint32_t value,
+		       uint8_t bits_nb)
+{
+	assert(bits_nb <= 32);
+
+	if (bits_nb == 0) {
+		return;
+	}
+
+	if (bits_nb < 32) {
+		value &= (1u << bits_nb) - 1;
+	}
+
+	writer->cache = (writer->cache << bits_nb) | value;
+	writer->cache_bits += bits_nb;
+
+	while (writer->cache_bits >= 8) {
+		writer->cache_bits -= 8;
+		bitstream_put_byte(writer, writer->cache >> writer->cache_bits);
+	}
+}
+
+void bitstream_write_ue(bitstream_writer *writer, uint32_t value)
+{
+	uint64_t code = (uint64_t) value + 1;
+	unsigned bits_nb = 64 - __builtin_clzll(code);
+
+	bitstream_write_u(writer, 0, bits_nb - 1);
+
+	if (bits_nb > 32) {
+		bitstream_write_u(writer, code >> 32, bits_nb - 32);
+		bits_nb = 32;
+	}
+
+	bitstream_write_u(writer, code, bits_nb);
+}
+
+void bitstream_write_se(bitstream_writer *writer, int32_t value)
+{
+	if (value > 0) {
+		bitstream_write_ue(writer, (uint32_t) value * 2 - 1);
+	} else {
+		bitstream_write_ue(writer, -(int64_t) value * 2);
+	}
+}
+
+/* rbsp_stop_one_bit followed by zero bits up to the byte boundary.  */
+void bitstream_write_rbsp_trailing_bits(bitstream_writer *writer)
+{
+	bitstream_write_u(writer, 1, 1);
+	bitstream_write_u(writer, 0, bitstream_writer_bit_shift(writer) ?
+				8 - bitstream_writer_bit_shift(writer) : 0);
+}
+
+/* Byte aligned raw data, like start code or length prefix, never escaped.  */
+void bitstream_write_bytes(bitstream_writer *writer, const void *data,
+			   uint32_t size)
+{
+	assert(writer->cache_bits == 0);
+
+	bitstream_writer_reserve(writer, size);
+	memcpy(writer->data_ptr + writer->data_offset, data, size);
+	writer->data_offset += size;
+	writer->zeros = 0;
+}
+
+uint8_t bitstream_writer_bit_shift(bitstream_writer *writer)
+{
+	return writer->cache_bits;
+}
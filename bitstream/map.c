@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bitstream.h"
+
+/*
+ * Only a window of the input file is mapped at a time, so that address space
+ * and RSS don't depend on the file size. The window is re-mapped to follow
+ * the reader, keeping a bit of the data behind the position for the look
+ * backs done by parser.
+ */
+#define MAP_WINDOW_SIZE		(16 * 1024 * 1024)
+#define MAP_LOOKBEHIND		(64 * 1024)
+
+static void bitstream_unmap(bitstream_reader *reader)
+{
+	if (reader->data_ptr != NULL) {
+		munmap((void *) reader->data_ptr, reader->data_size);
+	}
+
+	reader->data_ptr = NULL;
+	reader->data_start = 0;
+	reader->data_size = 0;
+}
+
+void bitstream_init_file(bitstream_reader *reader, int fd, uint64_t size)
+{
+	bitstream_init(reader, NULL, size);
+
+	reader->fd = fd;
+	reader->data_size = 0;
+}
+
+void bitstream_close(bitstream_reader *reader)
+{
+	if (reader->ring != NULL) {
+		bitstream_ring_close(reader);
+	}
+
+	if (reader->fd >= 0) {
+		bitstream_unmap(reader);
+	}
+}
+
+void bitstream_remap(bitstream_reader *reader, uint64_t offset, uint32_t size)
+{
+	uint64_t page_mask = ~((uint64_t) sysconf(_SC_PAGESIZE) - 1);
+	uint64_t start, end;
+	void *data;
+
+	if (reader->ring != NULL) {
+		bitstream_ring_remap(reader, offset, size);
+		return;
+	}
+
+	if (reader->fd < 0 || offset + size > reader->file_size) {
+		fprintf(stderr, "bitstream_reader: access to 0x%" PRIX64 "+%u "
+			"is out of data range 0x%" PRIX64 "\n",
+			offset, size, reader->file_size);
+		abort();
+	}
+
+	start = (offset > MAP_LOOKBEHIND) ? offset - MAP_LOOKBEHIND : 0;
+	start &= page_mask;
+	end = offset + size;
+
+	if (end - start < MAP_WINDOW_SIZE) {
+		end = start + MAP_WINDOW_SIZE;
+	}
+
+	if (end > reader->file_size) {
+		end = reader->file_size;
+	}
+
+	bitstream_unmap(reader);
+
+	data = mmap(NULL, end - start, PROT_READ, MAP_PRIVATE, reader->fd,
+		    start);
+	if (data == MAP_FAILED) {
+		perror("Failed to map input file");
+		abort();
+	}
+
+	madvise(data, end - start, MADV_SEQUENTIAL);
+
+	reader->data_ptr = data;
+	reader->data_start = start;
+	reader->data_size = end - start;
+}
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitstream.h"
+#include "simd.h"
+
+// #define RBSP_DEBUG
+
+#ifdef RBSP_DEBUG
+#define RBSP_DPRINT(f, ...)	printf(f, ## __VA_ARGS__)
+#else
+#define RBSP_DPRINT(...)	{}
+#endif
+
+#define RBSP_CHUNK_SIZE		256
+
+/*
+ * Raw bytes mapped per de-escape call. It always fits a full RBSP buffer,
+ * emulation prevention takes at most one byte per three.
+ */
+#define RBSP_RAW_SPAN		(RBSP_BUF_SIZE * 2)
+
+/* Raw stream offset of the escape byte number idx.  */
+#define ESCAPE_RAW_OFFSET(rbsp, idx)	\
+	((rbsp)->raw_start + (rbsp)->escapes[idx] + (idx))
+
+/*
+ * De-escape raw NAL bytes into the RBSP buffer until it holds "target" bytes
+ * or the NAL ends. A NAL ends at 0x000000, 0x000001 or 0x000002 (which can't
+ * occur within the NAL) or at the bitstream end. Blocks without a pair of
+ * zero bytes are copied as is, the rest goes through the byte-wise check.
+ */
+static void rbsp_unescape(bitstream_reader *reader, bitstream_rbsp *rbsp,
+			  uint32_t target)
+{
+	uint64_t raw_offset = rbsp->raw_offset;
+	uint32_t end = rbsp->raw_end - raw_offset;
+	uint32_t offset = 0;
+	uint32_t size = rbsp->size;
+	uint32_t zeros = rbsp->zeros;
+	uint32_t mask, pairs;
+	unsigned bytes_nb;
+
+	const uint8_t *raw;
+
+	if (target > RBSP_BUF_SIZE) {
+		target = RBSP_BUF_SIZE;
+	}
+
+	if (rbsp->raw_end - raw_offset > RBSP_RAW_SPAN) {
+		end = RBSP_RAW_SPAN;
+	}
+
+	raw = bitstream_data(reader, raw_offset, end);
+
+	while (!rbsp->complete && size < target) {
+		bytes_nb = 1;
+
+		if (end - offset >= SIMD_BLOCK &&
+				size + SIMD_BLOCK <= RBSP_BUF_SIZE) {
+			mask = zero_mask(raw + offset);
+			pairs = mask & (mask << 1);
+
+			if (!pairs && zeros < 2 && !(zeros && (mask & 1))) {
+				memcpy(rbsp->data + size, raw + offset,
+				       SIMD_BLOCK);
+				size += SIMD_BLOCK;
+				offset += SIMD_BLOCK;
+				zeros = (mask >> (SIMD_BLOCK - 1)) & 1;
+				continue;
+			}
+
+			bytes_nb = SIMD_BLOCK;
+		}
+
+		for (; bytes_nb && size < RBSP_BUF_SIZE; bytes_nb--, offset++) {
+			uint8_t byte = raw[offset];
+
+			if (zeros >= 2 && byte <= 0x03) {
+				if (byte != 0x03) {
+					/*
+					 * Trailing zeros aren't part of NAL,
+					 * some may be of the previous call.
+					 */
+					size -= zeros;
+					raw_offset -= zeros;
+					rbsp->complete = 1;
+					break;
+				}
+
+				/* Byte past the span is checked by next call.  */
+				if (offset + 1 >= end &&
+				    raw_offset + end < rbsp->raw_end) {
+					goto out;
+				}
+
+				if (offset + 1 >= end || raw[offset + 1] <= 0x03) {
+					RBSP_DPRINT("0x%" PRIX64 " escaped!\n",
+						    raw_offset + offset);
+					rbsp->escapes[rbsp->escapes_nb++] = size;
+					zeros = 0;
+					continue;
+				}
+			}
+
+			zeros = byte ? 0 : zeros + 1;
+			rbsp->data[size++] = byte;
+		}
+
+		if (raw_offset + offset >= rbsp->raw_end) {
+			rbsp->complete = 1;
+		}
+
+		if (size == RBSP_BUF_SIZE) {
+			break;
+		}
+	}
+out:
+	rbsp->raw_offset = raw_offset + offset;
+	rbsp->size = size;
+	rbsp->zeros = zeros;
+
+	RBSP_DPRINT("RBSP: %u bytes, %u escapes, raw 0x%" PRIX64 "..0x%" PRIX64
+		    "%s\n", size, rbsp->escapes_nb, rbsp->raw_start,
+		    rbsp->raw_offset, rbsp->complete ? " (NAL end)" : "");
+}
+
+void bitstream_rbsp_start(bitstream_reader *reader, bitstream_rbsp *rbsp)
+{
+	rbsp->raw_start = reader->data_offset;
+	rbsp->raw_offset = reader->data_offset;
+	rbsp->raw_end = reader->bitstream_end;
+	rbsp->size = 0;
+	rbsp->zeros = 0;
+	rbsp->escapes_nb = 0;
+	rbsp->escapes_cursor = 0;
+	rbsp->complete = (rbsp->raw_start >= rbsp->raw_end);
+
+	rbsp_unescape(reader, rbsp, RBSP_CHUNK_SIZE);
+
+	reader->rbsp = rbsp;
+	reader->cache_size = 0;
+}
+
+void bitstream_rbsp_stop(bitstream_reader *reader)
+{
+	reader->rbsp = NULL;
+	reader->cache_size = 0;
+}
+
+/*
+ * Load the reader's bit window from the de-escaped buffer. Escapes that were
+ * dropped are reported through cache_escapes, so that the reader keeps
+ * data_offset in raw stream coordinates. Returns 0 if position isn't covered
+ * by the buffer and the window should be loaded from the raw data.
+ */
+int bitstream_rbsp_load(bitstream_reader *reader)
+{
+	bitstream_rbsp *rbsp = reader->rbsp;
+	uint64_t offset = reader->data_offset;
+	uint32_t idx = rbsp->escapes_cursor;
+	uint8_t escapes = 0;
+	uint64_t cache;
+	uint64_t pos;
+
+	if (offset < rbsp->raw_start || rbsp->raw_end != reader->bitstream_end) {
+		return 0;
+	}
+
+	for (;;) {
+		while (idx < rbsp->escapes_nb &&
+				ESCAPE_RAW_OFFSET(rbsp, idx) < offset) {
+			idx++;
+		}
+
+		while (idx > 0 && ESCAPE_RAW_OFFSET(rbsp, idx - 1) >= offset) {
+			idx--;
+		}
+
+		pos = offset - rbsp->raw_start - idx;
+
+		if (pos + 8 <= rbsp->size) {
+			break;
+		}
+
+		if (rbsp->complete || rbsp->size == RBSP_BUF_SIZE) {
+			return 0;
+		}
+
+		rbsp_unescape(reader, rbsp, pos + 8 + RBSP_CHUNK_SIZE);
+	}
+
+	rbsp->escapes_cursor = idx;
+
+	for (; idx < rbsp->escapes_nb && rbsp->escapes[idx] < pos + 8; idx++) {
+		escapes |= 1 << (rbsp->escapes[idx] - pos);
+	}
+
+	memcpy(&cache, rbsp->data + pos, sizeof(cache));
+
+	reader->cache = be64toh(cache);
+	reader->cache_size = 8;
+	reader->cache_escapes = escapes;
+
+	return 1;
+}
+
+/*
+ * Locate the rbsp_stop_one_bit of the current NAL, it is the last set bit
+ * besides trailing zeros. Escaped cabac_zero_words end
+ * with 0x03, which is skipped as well. Stop bit position is set to the NAL
+ * start if there is none.
+ */
+void bitstream_find_stop_bit(bitstream_reader *reader)
+{
+	uint64_t offset = reader->NAL_end;
+	const uint8_t *data;
+	uint8_t byte = 0;
+
+	while (offset > reader->NAL_offset) {
+		byte = *bitstream_data(reader, --offset, 1);
+
+		if (byte == 0x00) {
+			continue;
+		}
+
+		if (byte == 0x03 && offset >= reader->NAL_offset + 2) {
+			data = bitstream_data(reader, offset - 2, 2);
+
+			if (data[0] == 0x00 && data[1] == 0x00) {
+				byte = 0x00;
+				continue;
+			}
+		}
+
+		break;
+	}
+
+	if (byte == 0x00) {
+		reader->stop_bit_offset = reader->NAL_offset;
+		reader->stop_bit_shift = 0;
+		return;
+	}
+
+	reader->stop_bit_offset = offset;
+	reader->stop_bit_shift = 7 - __builtin_ctz(byte);
+
+	RBSP_DPRINT("NAL 0x%" PRIX64 "..0x%" PRIX64 " stop bit @0x%" PRIX64
+		    ":%u\n", reader->NAL_offset, reader->NAL_end, offset,
+		    reader->stop_bit_shift);
+}
@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bitstream.h"
+
+/*
+ * Pipes and sockets can't be mapped, their data is received by a thread into
+ * a ring buffer of a fixed size. The buffer is mapped twice back to back, so
+ * any range of it is contiguous in memory and a NAL never needs to be
+ * linearised. Receiving stalls while the buffer is full, until the reader
+ * releases data that it is done with.
+ *
+ * Without input fd the data is pushed to the ring by bitstream_push() and
+ * reader doesn't wait for the data, it gets what was pushed so far.
+ */
+#define RING_SIZE		(16 * 1024 * 1024)
+#define RING_LOOKBEHIND		(64 * 1024)
+#define RING_READ_SIZE		(256 * 1024)
+
+typedef struct bitstream_ring {
+	uint8_t *data;
+	uint64_t head;
+	uint64_t tail;
+	unsigned eof:1;
+	unsigned stop:1;
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} bitstream_ring;
+
+static void * ring_receive(void *arg)
+{
+	bitstream_ring *ring = arg;
+	uint64_t head, size;
+	ssize_t ret;
+	int stop;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	for (;;) {
+		pthread_mutex_lock(&ring->lock);
+
+		while (ring->head == ring->tail + RING_SIZE && !ring->stop) {
+			pthread_cond_wait(&ring->cond, &ring->lock);
+		}
+
+		head = ring->head;
+		size = ring->tail + RING_SIZE - head;
+		stop = ring->stop;
+
+		pthread_mutex_unlock(&ring->lock);
+
+		if (stop) {
+			break;
+		}
+
+		if (size > RING_READ_SIZE) {
+			size = RING_READ_SIZE;
+		}
+
+		/* Only a blocked read() is cancelled by bitstream_close().  */
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		ret = read(ring->fd, ring->data + head % RING_SIZE, size);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (ret < 0) {
+			perror("Failed to read input stream");
+		}
+
+		pthread_mutex_lock(&ring->lock);
+
+		if (ret > 0) {
+			ring->head += ret;
+		} else {
+			ring->eof = 1;
+		}
+
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+
+		if (ret <= 0) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int ring_memfd(void)
+{
+#ifdef HAVE_MEMFD_CREATE
+	return memfd_create("bitstream_ring", 0);
+#else
+	char path[] = "/dev/shm/bitstream_ring_XXXXXX";
+	int fd = mkstemp(path);
+
+	if (fd != -1) {
+		unlink(path);
+	}
+
+	return fd;
+#endif
+}
+
+static uint8_t * ring_map(void)
+{
+	uint8_t *data;
+	int fd;
+
+	fd = ring_memfd();
+	if (fd == -1) {
+		perror("Failed to create ring buffer");
+		abort();
+	}
+
+	if (ftruncate(fd, RING_SIZE) != 0) {
+		perror("Failed to size ring buffer");
+		abort();
+	}
+
+	data = mmap(NULL, RING_SIZE * 2, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED) {
+		perror("Failed to reserve ring buffer");
+		abort();
+	}
+
+	if (mmap(data, RING_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	    mmap(data + RING_SIZE, RING_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		perror("Failed to map ring buffer");
+		abort();
+	}
+
+	close(fd);
+
+	return data;
+}
+
+/*
+ * Window covers all received data that isn't released, lock is held. Data
+ * can be released ahead of the received, it is dropped when received.
+ */
+static void ring_update_window(bitstream_reader *reader)
+{
+	bitstream_ring *ring = reader->ring;
+
+	reader->data_ptr = ring->data + ring->tail % RING_SIZE;
+	reader->data_start = ring->tail;
+	reader->data_size = 0;
+
+	if (ring->head > ring->tail) {
+		reader->data_size = ring->head - ring->tail;
+	}
+
+	if (ring->eof) {
+		reader->file_size = ring->head;
+
+		if (reader->bitstream_end > ring->head) {
+			reader->bitstream_end = ring->head;
+		}
+	}
+}
+
+void bitstream_init_stream(bitstream_reader *reader, int fd)
+{
+	bitstream_ring *ring;
+
+	bitstream_init(reader, NULL, BITSTREAM_SIZE_UNKNOWN);
+
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL) {
+		perror("Failed to allocate ring buffer");
+		abort();
+	}
+
+	ring->data = ring_map();
+	ring->fd = fd;
+
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+
+	reader->ring = ring;
+	ring_update_window(reader);
+
+	if (fd < 0) {
+		return;
+	}
+
+	if (pthread_create(&ring->thread, NULL, ring_receive, ring) != 0) {
+		perror("Failed to create input thread");
+		abort();
+	}
+}
+
+/*
+ * Append data to the stream of reader that has no input fd. Returns number
+ * of bytes taken, it is less than size if the ring buffer is full.
+ */
+uint32_t bitstream_push(bitstream_reader *reader, const void *data,
+			uint32_t size)
+{
+	bitstream_ring *ring = reader->ring;
+	uint64_t space;
+
+	pthread_mutex_lock(&ring->lock);
+
+	space = ring->tail + RING_SIZE - ring->head;
+
+	if (size > space) {
+		size = space;
+	}
+
+	/* Mirror takes care of the wrap around.  */
+	memcpy(ring->data + ring->head % RING_SIZE, data, size);
+	ring->head += size;
+
+	ring_update_window(reader);
+
+	pthread_mutex_unlock(&ring->lock);
+
+	return size;
+}
+
+void bitstream_push_end(bitstream_reader *reader)
+{
+	bitstream_ring *ring = reader->ring;
+
+	pthread_mutex_lock(&ring->lock);
+	ring->eof = 1;
+	ring_update_window(reader);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+void bitstream_ring_close(bitstream_reader *reader)
+{
+	bitstream_ring *ring = reader->ring;
+
+	pthread_mutex_lock(&ring->lock);
+	ring->stop = 1;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+
+	if (ring->fd >= 0) {
+		pthread_cancel(ring->thread);
+		pthread_join(ring->thread, NULL);
+	}
+
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->lock);
+
+	munmap(ring->data, RING_SIZE * 2);
+	free(ring);
+
+	reader->ring = NULL;
+	reader->data_ptr = NULL;
+	reader->data_size = 0;
+}
+
+uint64_t bitstream_ring_wait(bitstream_reader *reader, uint64_t end)
+{
+	bitstream_ring *ring = reader->ring;
+	uint64_t head;
+
+	pthread_mutex_lock(&ring->lock);
+
+	if (end > ring->tail + RING_SIZE) {
+		fprintf(stderr, "bitstream_reader: 0x%" PRIX64 " doesn't fit "
+			"the ring buffer, data from 0x%" PRIX64 " is in use\n",
+			end, ring->tail);
+		abort();
+	}
+
+	while (ring->head < end && !ring->eof && ring->fd >= 0) {
+		pthread_cond_wait(&ring->cond, &ring->lock);
+	}
+
+	head = ring->head;
+
+	ring_update_window(reader);
+
+	pthread_mutex_unlock(&ring->lock);
+
+	return head;
+}
+
+void bitstream_ring_remap(bitstream_reader *reader, uint64_t offset,
+			  uint32_t size)
+{
+	if (offset < reader->ring->tail ||
+			bitstream_ring_wait(reader, offset + size) < offset + size) {
+		fprintf(stderr, "bitstream_reader: access to 0x%" PRIX64 "+%u "
+			"is out of data range 0x%" PRIX64 "..0x%" PRIX64 "\n",
+			offset, size, reader->data_start,
+			reader->data_start + reader->data_size);
+		abort();
+	}
+}
+
+/*
+ * Reader won't access data before offset, except for a bit of look back.
+ * No-op for files, they are mapped.
+ */
+void bitstream_release(bitstream_reader *reader, uint64_t offset)
+{
+	bitstream_ring *ring = reader->ring;
+
+	if (ring == NULL) {
+		return;
+	}
+
+	offset = (offset > RING_LOOKBEHIND) ? offset - RING_LOOKBEHIND : 0;
+
+	pthread_mutex_lock(&ring->lock);
+
+	if (offset > ring->tail) {
+		ring->tail = offset;
+		ring_update_window(reader);
+		pthread_cond_broadcast(&ring->cond);
+	}
+
+	pthread_mutex_unlock(&ring->lock);
+}
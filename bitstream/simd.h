@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITSTREAM_SIMD_H
+#define BITSTREAM_SIMD_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * eq_mask() returns a mask of the bytes equal to value within SIMD_BLOCK
+ * bytes at data, bit N is set if data[N] == value. Data doesn't need to be
+ * aligned.
+ */
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+#define SIMD_BLOCK	32
+#define SIMD_NAME	"AVX2"
+
+static inline uint32_t eq_mask(const uint8_t *data, uint8_t value)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *) data);
+
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v,
+						_mm256_set1_epi8(value)));
+}
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+#define SIMD_BLOCK	16
+#define SIMD_NAME	"SSE2"
+
+static inline uint32_t eq_mask(const uint8_t *data, uint8_t value)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *) data);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(value)));
+}
+
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+
+#define SIMD_BLOCK	16
+#define SIMD_NAME	"NEON"
+
+static inline uint32_t eq_mask(const uint8_t *data, uint8_t value)
+{
+	static const uint8_t weights[16] = {
+		0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+		0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+	};
+	uint8x16_t eq = vceqq_u8(vld1q_u8(data), vdupq_n_u8(value));
+	uint8x16_t bits = vandq_u8(eq, vld1q_u8(weights));
+	uint8x8_t sum = vpadd_u8(vget_low_u8(bits), vget_high_u8(bits));
+
+	sum = vpadd_u8(sum, sum);
+	sum = vpadd_u8(sum, sum);
+
+	return vget_lane_u16(vreinterpret_u16_u8(sum), 0);
+}
+
+#else
+
+#define SIMD_BLOCK	8
+#define SIMD_NAME	"scalar"
+
+/* Word-at-a-time fallback, exact for every byte (no carry false-positives).  */
+static inline uint32_t eq_mask(const uint8_t *data, uint8_t value)
+{
+	uint64_t word, nonzero;
+
+	memcpy(&word, data, sizeof(word));
+	word ^= value * 0x0101010101010101ull;
+
+	nonzero = ((word & 0x7F7F7F7F7F7F7F7Full) + 0x7F7F7F7F7F7F7F7Full) | word;
+	nonzero = ~nonzero & 0x8080808080808080ull;
+
+	return ((nonzero >> 7) * 0x0102040810204080ull) >> 56;
+}
+
+#endif
+
+static inline uint32_t zero_mask(const uint8_t *data)
+{
+	return eq_mask(data, 0x00);
+}
+
+#endif // BITSTREAM_SIMD_H
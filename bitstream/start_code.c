@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bitstream.h"
+#include "simd.h"
+
+#ifndef ctz
+#define ctz	__builtin_ctz
+#endif
+
+/* Bytes scanned per bitstream_data() request.  */
+#define SCAN_CHUNK_SIZE		(1 << 20)
+
+/* Bytes of a file scanned per bitstream_scan_start_codes() job.  */
+#define SCAN_JOB_SIZE		(64 << 20)
+
+/*
+ * Check the 0x000001 at offset, a zero byte in front of it makes it a 4 bytes
+ * start code. Start code has to be followed by at least one byte of data.
+ */
+static int start_code_size(const uint8_t *data, uint32_t offset,
+			   uint32_t start, uint32_t end, uint32_t *code_offset)
+{
+	if (offset > start && data[offset - 1] == 0x00) {
+		*code_offset = offset - 1;
+		return 4;
+	}
+
+	if (offset + 3 < end) {
+		*code_offset = offset;
+		return 3;
+	}
+
+	return 0;
+}
+
+/*
+ * Find the first 0x000001 at or after offset, returns its offset or end if
+ * there is none.
+ *
+ * SIMD_BLOCK positions are checked at once by AND'ing the "== 0x01" mask of
+ * the third byte with the "== 0x00" masks of the first two, most of the
+ * blocks are rejected by the first compare.
+ */
+static uint32_t scan(const uint8_t *data, uint32_t offset, uint32_t end)
+{
+	uint32_t mask;
+
+	while (offset + 2 + SIMD_BLOCK <= end) {
+		mask = eq_mask(data + offset + 2, 0x01);
+
+		if (mask) {
+			mask &= eq_mask(data + offset, 0x00);
+			mask &= eq_mask(data + offset + 1, 0x00);
+		}
+
+		if (mask) {
+			return offset + ctz(mask);
+		}
+
+		offset += SIMD_BLOCK;
+	}
+
+	for (; offset + 2 < end; offset++) {
+		if (data[offset + 2] != 0x01) {
+			continue;
+		}
+
+		if (data[offset] != 0x00 || data[offset + 1] != 0x00) {
+			continue;
+		}
+
+		return offset;
+	}
+
+	return end;
+}
+
+/*
+ * Find the first Annex B start code at or after offset. Returns the start
+ * code size (3 or 4) and stores its offset to code_offset, returns 0 if
+ * there is no start code before end.
+ */
+int find_start_code(const uint8_t *data, uint32_t offset, uint32_t end,
+		    uint32_t *code_offset)
+{
+	uint32_t start = offset;
+
+	offset = scan(data, offset, end);
+
+	if (offset + 2 >= end) {
+		return 0;
+	}
+
+	return start_code_size(data, offset, start, end, code_offset);
+}
+
+/*
+ * Same as find_start_code(), but for the reader's stream that may be larger
+ * than the mapped window. Stream is scanned in chunks, each chunk starts one
+ * byte early for the 4 bytes start code check and overlaps the previous one
+ * by the two bytes that a start code could straddle.
+ */
+int bitstream_find_start_code(bitstream_reader *reader, uint64_t offset,
+			      uint64_t *code_offset)
+{
+	uint64_t start = offset;
+	const uint8_t *data;
+	uint64_t base, end;
+	uint32_t size;
+	uint32_t pos;
+	int zero;
+
+	while (offset + 2 < reader->bitstream_end) {
+		base = (offset > start) ? offset - 1 : offset;
+
+		/* Streamed input is scanned as it arrives.  */
+		end = bitstream_wait(reader, offset + 3);
+
+		if (end > reader->bitstream_end) {
+			end = reader->bitstream_end;
+		}
+
+		if (offset + 2 >= end) {
+			break;
+		}
+
+		size = SCAN_CHUNK_SIZE;
+
+		if (end - base < size) {
+			size = end - base;
+		}
+
+		data = bitstream_data(reader, base, size);
+		pos = scan(data, offset - base, size);
+
+		if (pos + 2 < size) {
+			zero = (base + pos > start && data[pos - 1] == 0x00);
+
+			/* Byte past the start code may be yet to arrive.  */
+			end = bitstream_wait(reader, base + pos + 4);
+
+			if (base + pos + 3 >= end &&
+			    reader->bitstream_end == BITSTREAM_SIZE_UNKNOWN) {
+				return 0;
+			}
+
+			if (zero) {
+				*code_offset = base + pos - 1;
+				return 4;
+			}
+
+			if (base + pos + 3 < reader->bitstream_end) {
+				*code_offset = base + pos;
+				return 3;
+			}
+
+			return 0;
+		}
+
+		offset = base + size - 2;
+	}
+
+	return 0;
+}
+
+typedef struct scan_job {
+	bitstream_start_code *codes;
+	uint64_t codes_nb;
+	uint64_t codes_max;
+} scan_job;
+
+typedef struct scan_jobs {
+	int fd;
+	uint64_t size;
+	uint64_t next;
+	uint64_t jobs_nb;
+	scan_job *jobs;
+} scan_jobs;
+
+static void scan_job_add(scan_job *job, uint64_t offset, uint32_t size)
+{
+	if (job->codes_nb == job->codes_max) {
+		job->codes_max = job->codes_max ? job->codes_max * 2 : 1024;
+		job->codes = realloc(job->codes,
+				     job->codes_max * sizeof(*job->codes));
+		if (job->codes == NULL) {
+			perror("Failed to grow start codes table");
+			abort();
+		}
+	}
+
+	job->codes[job->codes_nb].offset = offset;
+	job->codes[job->codes_nb].size = size;
+	job->codes_nb++;
+}
+
+/*
+ * Collect start codes whose 0x000001 begins within the job's range. The range
+ * is mapped with one byte in front, for the 4 bytes start code check, and the
+ * two bytes that 0x000001 may straddle after it. Whether a code is 3 or 4
+ * bytes depends on that single byte in front only, so the result doesn't
+ * depend on the other jobs.
+ */
+static void scan_job_run(scan_jobs *jobs, uint64_t idx)
+{
+	uint64_t page_mask = ~((uint64_t) sysconf(_SC_PAGESIZE) - 1);
+	uint64_t start = idx * SCAN_JOB_SIZE;
+	uint64_t end = start + SCAN_JOB_SIZE;
+	uint64_t map_start, map_end, pos;
+	scan_job *job = &jobs->jobs[idx];
+	const uint8_t *data;
+	uint32_t size;
+
+	if (end > jobs->size) {
+		end = jobs->size;
+	}
+
+	map_start = (start ? start - 1 : 0) & page_mask;
+	map_end = (end + 2 < jobs->size) ? end + 2 : jobs->size;
+	size = map_end - map_start;
+
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, jobs->fd, map_start);
+	if (data == MAP_FAILED) {
+		perror("Failed to map start codes scan range");
+		abort();
+	}
+
+	madvise((void *) data, size, MADV_SEQUENTIAL);
+
+	for (pos = start; ; pos += 3) {
+		pos = map_start + scan(data, pos - map_start, size);
+
+		if (pos >= end) {
+			break;
+		}
+
+		if (pos > 0 && data[pos - 1 - map_start] == 0x00) {
+			scan_job_add(job, pos - 1, 4);
+		} else if (pos + 3 < jobs->size) {
+			scan_job_add(job, pos, 3);
+		}
+	}
+
+	munmap((void *) data, size);
+}
+
+static void * scan_worker(void *arg)
+{
+	scan_jobs *jobs = arg;
+	uint64_t idx;
+
+	for (;;) {
+		idx = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED);
+
+		if (idx >= jobs->jobs_nb) {
+			break;
+		}
+
+		scan_job_run(jobs, idx);
+	}
+
+	return NULL;
+}
+
+/*
+ * Find all start codes of a file of the given size using threads_nb threads,
+ * all online CPUs if 0. File is split into jobs that are scanned in parallel,
+ * the table is ordered by offset and is the same as the one made by calling
+ * bitstream_find_start_code() from the file start onwards. Returns number of
+ * the table entries, table has to be freed by caller. Table is NULL if there
+ * are no start codes.
+ */
+uint64_t bitstream_scan_start_codes(int fd, uint64_t size, unsigned threads_nb,
+				    bitstream_start_code **codes)
+{
+	pthread_t *threads;
+	scan_jobs jobs;
+	uint64_t codes_nb = 0;
+	uint64_t i;
+
+	if (threads_nb == 0) {
+		threads_nb = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	bzero(&jobs, sizeof(jobs));
+	jobs.fd = fd;
+	jobs.size = size;
+	jobs.jobs_nb = (size + SCAN_JOB_SIZE - 1) / SCAN_JOB_SIZE;
+
+	if (threads_nb > jobs.jobs_nb) {
+		threads_nb = jobs.jobs_nb ? jobs.jobs_nb : 1;
+	}
+
+	jobs.jobs = calloc(jobs.jobs_nb + 1, sizeof(*jobs.jobs));
+	threads = calloc(threads_nb, sizeof(*threads));
+
+	if (jobs.jobs == NULL || threads == NULL) {
+		perror("Failed to allocate start codes scan");
+		abort();
+	}
+
+	/* Calling thread is a worker too.  */
+	for (i = 1; i < threads_nb; i++) {
+		if (pthread_create(&threads[i], NULL, scan_worker, &jobs) != 0) {
+			perror("Failed to create start codes scan thread");
+			abort();
+		}
+	}
+
+	scan_worker(&jobs);
+
+	for (i = 1; i < threads_nb; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (i = 0; i < jobs.jobs_nb; i++) {
+		codes_nb += jobs.jobs[i].codes_nb;
+	}
+
+	if (codes_nb == 0) {
+		*codes = NULL;
+	} else {
+		*codes = malloc(codes_nb * sizeof(**codes));
+		if (*codes == NULL) {
+			perror("Failed to allocate start codes table");
+			abort();
+		}
+	}
+
+	for (codes_nb = 0, i = 0; i < jobs.jobs_nb; i++) {
+		if (jobs.jobs[i].codes_nb != 0) {
+			memcpy(*codes + codes_nb, jobs.jobs[i].codes,
+			       jobs.jobs[i].codes_nb * sizeof(**codes));
+			codes_nb += jobs.jobs[i].codes_nb;
+		}
+
+		free(jobs.jobs[i].codes);
+	}
+
+	free(jobs.jobs);
+	free(threads);
+
+	return codes_nb;
+}
+
+const char * find_start_code_impl(void)
+{
+	return SIMD_NAME;
+}
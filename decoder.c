@@ -16,6 +16,7 @@
  */
 
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <pthread.h>
 #include <stdint.h>
@@ -25,7 +26,9 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include "analysis.h"
 #include "decoder.h"
+#include "mp4.h"
 #include "syntax_parse.h"
 
 #define FOREACH_BIT_SET(val, itr, size)			\
@@ -40,8 +43,6 @@
 
 #define FPS()	(decoder->frames_decoded / max(decoder->dec_time_acc, 1))
 
-#define DATA_BUF_SIZE		0x00080000
-
 #define DRAM_PHYS_BASE		0x2F600000
 #define DRAM_PHYS_END		(DRAM_PHYS_BASE + MEM_SZ)
 #define MEM_SZ			0x08000000
@@ -624,10 +625,6 @@ static void tegra_VDE_decoder_init_mem(decoder_context *decoder,
 	decoder->parse_start_paddress = reserve_mem_phys(DATA_BUF_SIZE, 1);
 	decoder->parse_limit_paddress = reserve_mem_phys(0x0, 0x20);
 
-	// Prepend NAL_START_CODE to the syntax data
-	memcpy(p2v(decoder->parse_start_paddress),
-	       nal_start_code, NAL_START_CODE_SZ);
-
 	for (i = 0; i < ARRAY_SIZE(decoder->DPB_frames_array.frames); i++) {
 		DPB_frames[i]->Y_paddr = reserve_mem_phys(
 					frame_luma_size(decoder), 0x100);
@@ -678,9 +675,50 @@ static int tegra_VDE_decode_trigger(decoder_context *decoder,
 	return ret;
 }
 
-void tegra_VDE_decode_frame(decoder_context *decoder)
+/*
+ * Append data to the picture's bitstream buffer. All slices of the picture
+ * are parsed by SXE in one go. Picture that doesn't fit is only accounted,
+ * it is dropped by tegra_VDE_decode_frame().
+ */
+void tegra_VDE_queue_data(decoder_context *decoder, const void *data,
+			  uint32_t size)
+{
+	unsigned pic_width_in_mbs = decoder->active_sps->pic_width_in_mbs_minus1 + 1;
+	unsigned pic_height_in_mbs = decoder->active_sps->pic_height_in_map_units_minus1 + 1;
+
+	if (decoder->parse_start_paddress == 0) {
+		tegra_VDE_decoder_init_mem(decoder,
+					   pic_width_in_mbs * pic_height_in_mbs);
+	}
+
+	if (decoder->au.size + size <= DATA_BUF_SIZE) {
+		memcpy(p2v(decoder->parse_start_paddress) + decoder->au.size,
+		       data, size);
+	}
+
+	decoder->au.size += size;
+}
+
+/* Append the current slice NAL to the picture, start code prepended.  */
+void tegra_VDE_queue_slice(decoder_context *decoder)
 {
 	bitstream_reader *reader = &decoder->reader;
+	uint32_t size = reader->NAL_end - reader->NAL_offset;
+
+	if (decoder->au.slices_nb == 0) {
+		decoder->au.nal = decoder->nal;
+	}
+
+	tegra_VDE_queue_data(decoder, nal_start_code, NAL_START_CODE_SZ);
+	tegra_VDE_queue_data(decoder,
+			     bitstream_data(reader, reader->NAL_offset, size),
+			     size);
+
+	decoder->au.slices_nb++;
+}
+
+void tegra_VDE_decode_frame(decoder_context *decoder)
+{
 	frame_data **DPB_frames = decoder->DPB_frames_array.frames;
 	int DPB_frames_array_size = decoder->DPB_frames_array.size;
 	unsigned pic_width_in_mbs = decoder->active_sps->pic_width_in_mbs_minus1 + 1;
@@ -689,27 +727,31 @@ void tegra_VDE_decode_frame(decoder_context *decoder)
 	unsigned baseline_profile = (decoder->active_sps->profile_idc == 66);
 	unsigned is_B_frame = (decoder->sh.slice_type == B);
 	unsigned is_ref_frame = (decoder->nal.ref_idc != 0);
-	uint32_t data_start = reader->NAL_offset;
-	uint32_t data_end, data_size, SXE_parsed;
+	uint32_t data_size = decoder->au.size;
+	uint32_t SXE_parsed;
 	uint32_t macroblocks_parsed;
 	int i, ret;
 
-	if (decoder->frames_decoded == 0) {
-		tegra_VDE_decoder_init_mem(decoder, total_mbs_nb);
-	}
+	/* DPB is kept in step, pictures referencing it decode with errors.  */
+	if (data_size > DATA_BUF_SIZE) {
+		decoder->frames_dropped++;
 
-	data_end = min(data_start + DATA_BUF_SIZE,
-		       reader->bitstream_end + NAL_START_CODE_SZ);
-	data_size = data_end - data_start;
+		DECODER_WARN("Picture of 0x%X bytes doesn't fit the bitstream "
+			     "buffer, dropped! Total frames dropped %d\n",
+			     data_size, decoder->frames_dropped);
 
-	DECODER_DPRINT("++++++++++++++++\n" \
-		       "Decoding frame %d at 0x%X size 0x%X @0x%08X\n",
-		       decoder->frames_decoded, data_start, data_size,
-		       decoder->parse_start_paddress);
+		purge_unused_ref_frames(decoder);
 
-	memcpy(p2v(decoder->parse_start_paddress + NAL_START_CODE_SZ),
-	       reader->data_ptr + reader->NAL_offset,
-	       data_size - NAL_START_CODE_SZ);
+		if (is_ref_frame) {
+			slide_frames(decoder);
+		}
+		return;
+	}
+
+	DECODER_DPRINT("++++++++++++++++\n" \
+		       "Decoding frame %d of %u slices size 0x%X @0x%08X\n",
+		       decoder->frames_decoded, decoder->au.slices_nb,
+		       data_size, decoder->parse_start_paddress);
 
 	for (i = 0; i <= DPB_frames_array_size; i++) {
 		tegra_setup_FRAMEID(decoder, DPB_frames[i], i);
@@ -844,27 +886,248 @@ void tegra_VDE_decode_frame(decoder_context *decoder)
 	} else {
 		DECODER_DPRINT("DPB: NOT sliding frames\n");
 	}
-
-	reader->data_offset = data_start + SXE_parsed - NAL_START_CODE_SZ;
 }
 
-void decoder_init(decoder_context *decoder, void *data, uint32_t size)
+/* Parsing half of decoder_init(), hardware isn't touched.  */
+void decoder_init_parser(decoder_context *decoder, int fd, uint64_t size)
 {
 	int i;
 
 	bzero(decoder, sizeof(*decoder));
 
-	bitstream_reader_selftest();
-	bitstream_init(&decoder->reader, data, size);
+	decoder->pts = TIMESTAMP_NONE;
+	decoder->dts = TIMESTAMP_NONE;
+
+	if (size == BITSTREAM_SIZE_UNKNOWN) {
+		bitstream_init_stream(&decoder->reader, fd);
+	} else {
+		bitstream_init_file(&decoder->reader, fd, size);
+	}
 
 	for (i = 0; i < ARRAY_SIZE(decoder->DPB_frames_array.frames); i++) {
 		decoder->DPB_frames_array.frames[i] = malloc(sizeof(frame_data));
 		assert(decoder->DPB_frames_array.frames[i] != NULL);
 	}
+}
+
+void decoder_init(decoder_context *decoder, int fd, uint64_t size)
+{
+	decoder_init_parser(decoder, fd, size);
 
 	tegra_VDE_init(decoder);
 }
 
+static void decoder_parse_pushed(decoder_context *decoder)
+{
+	int ret;
+
+	do {
+		ret = parse_annex_b_NAL(decoder);
+	} while (ret < PARSE_NEED_DATA);
+}
+
+/*
+ * Decode Annex B data as it arrives, decoder has to be initialized with
+ * fd = -1 and unknown size. Every NAL is decoded as soon as it is complete,
+ * malformed NALs are skipped.
+ */
+void decoder_feed(decoder_context *decoder, const void *data, uint32_t size)
+{
+	uint32_t pushed;
+
+	while (size) {
+		pushed = bitstream_push(&decoder->reader, data, size);
+
+		decoder_parse_pushed(decoder);
+
+		if (pushed == 0) {
+			DECODER_ERR("NAL doesn't fit the input buffer\n");
+		}
+
+		data += pushed;
+		size -= pushed;
+	}
+}
+
+void decoder_feed_end(decoder_context *decoder)
+{
+	bitstream_push_end(&decoder->reader);
+
+	decoder_parse_pushed(decoder);
+	decoder_flush(decoder);
+}
+
+/*
+ * Decode the picture whose slices were queued so far. Picture ends when a
+ * slice of another picture or a NAL preceding one arrives, or at the stream
+ * end. Decoder state is of the picture, except for the NAL header that
+ * could be of the NAL that ended it.
+ */
+void decoder_flush(decoder_context *decoder)
+{
+	nal_header nal = decoder->nal;
+
+	if (decoder->au.slices_nb == 0) {
+		return;
+	}
+
+	/* Picture is decoded by decoder_run_lookahead().  */
+	if (decoder->lookahead != NULL) {
+		lookahead_queue_picture(decoder);
+		return;
+	}
+
+	decoder->nal = decoder->au.nal;
+
+	apply_slice_header(decoder);
+
+	if (decoder->analysis != NULL) {
+		analysis_picture(decoder);
+	} else {
+		tegra_VDE_decode_frame(decoder);
+	}
+
+	decoder->nal = nal;
+	decoder->au.size = 0;
+	decoder->au.slices_nb = 0;
+}
+
+void decoder_queue_slice(decoder_context *decoder)
+{
+	/* Timestamps of the NAL that starts the picture are of the picture.  */
+	if (decoder->au.slices_nb == 0) {
+		decoder->au.pts = decoder->pts;
+		decoder->au.dts = decoder->dts;
+	}
+
+	if (decoder->lookahead != NULL) {
+		lookahead_queue_slice(decoder);
+	} else if (decoder->analysis != NULL) {
+		analysis_queue_slice(decoder);
+	} else {
+		tegra_VDE_queue_slice(decoder);
+	}
+}
+
+/*
+ * Decode only IDR pictures, intra pictures or spaced reference pictures:
+ * all of them for interval 1, otherwise the first intra picture after at
+ * least interval reference pictures since the last decoded one. Skipped
+ * pictures are dropped after parsing the NAL header or the first slice
+ * header fields, they don't get to the DPB and hardware.
+ */
+void decoder_set_trick_mode(decoder_context *decoder, int mode,
+			    unsigned interval)
+{
+	bzero(&decoder->trick, sizeof(decoder->trick));
+
+	decoder->trick.mode = mode;
+	decoder->trick.interval = interval ? interval : 1;
+	decoder->trick.refs_nb = decoder->trick.interval - 1;
+	decoder->trick.skip = 1;
+}
+
+/*
+ * Real-time decoding: picture N is due latency_ns + N * period_ns after the
+ * first one. Non-reference pictures that are late are dropped.
+ */
+void decoder_set_deadline(decoder_context *decoder, uint64_t period_ns,
+			  uint64_t latency_ns)
+{
+	bzero(&decoder->deadline, sizeof(decoder->deadline));
+
+	decoder->deadline.period = period_ns;
+	decoder->deadline.latency = latency_ns;
+}
+
+/*
+ * Account the picture that is about to be decoded in the real-time schedule.
+ * Returns 1 if it is late and nothing references it, caller drops it then
+ * without touching the DPB.
+ */
+int decoder_drop_late(decoder_context *decoder, unsigned ref_idc)
+{
+	decode_deadline *dl = &decoder->deadline;
+	struct timespec time;
+	uint64_t now, due;
+
+	if (dl->period == 0) {
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	now = time.tv_sec * 1000000000ull + time.tv_nsec;
+
+	/* Parser of the lookahead goes by the clock of the decoding.  */
+	if (decoder->lookahead != NULL) {
+		return lookahead_drop_late(decoder, ref_idc, now);
+	}
+
+	if (dl->pictures_nb == 0) {
+		dl->start = now;
+	}
+
+	due = dl->start + dl->latency + dl->pictures_nb * dl->period;
+
+	if (ref_idc != 0 || now <= due) {
+		dl->pictures_nb++;
+		return 0;
+	}
+
+	decoder_dropped_late(decoder, now - due);
+
+	return 1;
+}
+
+/*
+ * Account the late picture that was dropped, lookahead parser hands its
+ * drops over to the decoding context.
+ */
+void decoder_dropped_late(decoder_context *decoder, uint64_t late_ns)
+{
+	decoder->deadline.pictures_nb++;
+	decoder->frames_dropped++;
+
+	DECODER_IPRINT("Picture is late by %" PRIu64 " us, dropped! " \
+		       "Total frames dropped %d\n",
+		       late_ns / 1000, decoder->frames_dropped);
+}
+
+/*
+ * Start decoding from the sync picture at or before the target, that is a
+ * picture number in decoding order or a time in ns. Target is looked up by
+ * the parser once it knows the stream layout: MP4 sample tables, Matroska
+ * cues, the NAL index of Annex B file if there is one. Annex B file without
+ * an index is seeked by its byte offsets, see annex_b_seek(), target past
+ * the head of the file is only estimated then.
+ */
+void decoder_seek(decoder_context *decoder, int unit, uint64_t target)
+{
+	decoder->seek.unit = unit;
+	decoder->seek.target = target;
+}
+
+/*
+ * Target is found, nothing that was decoded before it is referenced by the
+ * pictures that follow. Sync picture of MP4 and Matroska may be a non-IDR
+ * I picture, it is taken like the first picture after skipped references
+ * of trick play, see apply_slice_header().
+ */
+void decoder_seek_done(decoder_context *decoder)
+{
+	decoder->seek.unit = SEEK_NONE;
+
+	clear_DPB(decoder);
+
+	decoder->prevPicOrderCntMsb = 0;
+	decoder->prevPicOrderCntLsb = 0;
+	decoder->prev_frame_num = 0;
+	decoder->DPB_incomplete = 1;
+	decoder->trick.refs_missing = 1;
+	decoder->au.slices_nb = 0;
+	decoder->au.size = 0;
+}
+
 void decoder_set_notify(decoder_context *decoder,
 			void (*frame_decoded_notify)(decoder_context*, frame_data*),
 			void *opaque)
@@ -894,3 +1157,62 @@ void decoder_reset_SH(decoder_context *decoder)
 	free(decoder->sh.pred_weight_l1);
 	bzero(&decoder->sh, sizeof(decoder->sh));
 }
+
+static void * memdup(const void *src, size_t size)
+{
+	void *dst;
+
+	if (src == NULL) {
+		return NULL;
+	}
+
+	dst = malloc(size);
+	assert(dst != NULL);
+
+	return memcpy(dst, src, size);
+}
+
+void decoder_copy_SPS(decoder_context_sps *dst, const decoder_context_sps *src)
+{
+	*dst = *src;
+
+	dst->offset_for_ref_frame = memdup(src->offset_for_ref_frame,
+			sizeof(int32_t) * src->num_ref_frames_in_pic_order_cnt_cycle);
+}
+
+void decoder_copy_PPS(decoder_context_pps *dst, const decoder_context_pps *src)
+{
+	size_t groups_size = sizeof(uint32_t) * (src->num_slice_groups_minus1 + 1);
+	size_t units_size = sizeof(uint32_t) * (src->pic_size_in_map_units_minus1 + 1);
+
+	*dst = *src;
+
+	dst->run_length_minus1 = memdup(src->run_length_minus1, groups_size);
+	dst->top_left = memdup(src->top_left, groups_size);
+	dst->bottom_right = memdup(src->bottom_right, groups_size);
+	dst->slice_group_id = memdup(src->slice_group_id, units_size);
+}
+
+void decoder_close_parser(decoder_context *decoder)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(decoder->sps); i++) {
+		decoder_reset_SPS(&decoder->sps[i]);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(decoder->pps); i++) {
+		decoder_reset_PPS(&decoder->pps[i]);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(decoder->DPB_frames_array.frames); i++) {
+		free(decoder->DPB_frames_array.frames[i]);
+	}
+
+	decoder_reset_SH(decoder);
+
+	mp4_free(decoder->mp4);
+	decoder->mp4 = NULL;
+
+	bitstream_close(&decoder->reader);
+}
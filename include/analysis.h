@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "decoder.h"
+
+/*
+ * Header-only stream analysis: pictures go through the parsing and the DPB
+ * bookkeeping, but not to the hardware. A record per picture is written as
+ * CSV or binary, fields of the binary output are in host byte order.
+ */
+#define ANALYSIS_CSV		0
+#define ANALYSIS_BINARY		1
+
+#define ANALYSIS_MAGIC		"H264STAT"
+#define ANALYSIS_VERSION	2
+
+#define ANALYSIS_IDR		(1 << 0)
+#define ANALYSIS_OVERSIZED	(1 << 1)
+
+#define ANALYSIS_GOP_PATTERN	64
+
+typedef struct analysis_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+} analysis_header;
+
+/* Timestamps are in 90 kHz units, TIMESTAMP_NONE if unknown.  */
+typedef struct analysis_record {
+	uint64_t offset;
+	int64_t  pts;
+	int64_t  dts;
+	uint32_t size;
+	uint32_t frame_num;
+	int32_t  pic_order_cnt;
+	uint16_t slices_nb;
+	uint8_t  slice_type;
+	uint8_t  ref_idc;
+	uint8_t  flags;
+	uint8_t  ref_list0_size;
+	uint8_t  ref_list1_size;
+	uint8_t  reserved[5];
+} analysis_record;
+
+typedef struct stream_analysis {
+	FILE *fp;
+	int format;
+	double fps;
+	uint64_t offset;
+	uint64_t pictures_nb;
+	uint64_t bytes;
+	uint64_t types_nb[5];
+	uint64_t oversized_nb;
+	uint32_t peak_size;
+	uint64_t peak_picture;
+	uint64_t idr_nb;
+	uint64_t gop_start;
+	uint64_t gop_min;
+	uint64_t gop_max;
+	char gop_pattern[ANALYSIS_GOP_PATTERN + 1];
+	uint32_t num_units_in_tick;
+	uint32_t time_scale;
+} stream_analysis;
+
+void analysis_start(decoder_context *decoder, stream_analysis *an, FILE *fp,
+		    int format, double fps);
+
+void analysis_queue_slice(decoder_context *decoder);
+
+void analysis_picture(decoder_context *decoder);
+
+void analysis_summary(stream_analysis *an);
+
+#endif // ANALYSIS_H
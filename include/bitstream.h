@@ -18,21 +18,94 @@
 #ifndef BITSTREAM_H
 #define BITSTREAM_H
 
+#include <setjmp.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#define RBSP_BUF_SIZE	8192
+
+/* Size of a streamed input isn't known until its end is reached.  */
+#define BITSTREAM_SIZE_UNKNOWN	((uint64_t) INT64_MAX)
+
+/* Reasons of the jump to bitstream_reader.bail.  */
+#define BITSTREAM_END_REACHED	1
+#define BITSTREAM_MALFORMED	2
+
+struct bitstream_ring;
+
+/* De-escaped head of the current NAL, see bitstream/rbsp.c.  */
+typedef struct bitstream_rbsp {
+	uint8_t data[RBSP_BUF_SIZE + 8];
+	uint16_t escapes[RBSP_BUF_SIZE / 2 + 1];
+	uint32_t escapes_nb;
+	uint32_t escapes_cursor;
+	uint64_t raw_start;
+	uint64_t raw_offset;
+	uint64_t raw_end;
+	uint32_t size;
+	uint32_t zeros;
+	uint8_t complete;
+} bitstream_rbsp;
+
+/* Annex B start code of a file, see bitstream_scan_start_codes().  */
+typedef struct bitstream_start_code {
+	uint64_t offset;
+	uint32_t size;
+} bitstream_start_code;
+
 typedef struct bitstream_reader {
+	/* Mapped stream data, covers data_size bytes at data_start.  */
 	const uint8_t *data_ptr;
-	uint32_t bitstream_end;
-	uint32_t data_offset;
-	uint32_t NAL_offset;
+	uint64_t data_start;
+	uint64_t data_size;
+	uint64_t file_size;
+	int fd;
+
+	/* Pipe or socket input, see bitstream/ring.c.  */
+	struct bitstream_ring *ring;
+
+	bitstream_rbsp *rbsp;
+	uint64_t bitstream_end;
+	uint64_t data_offset;
+	uint64_t NAL_offset;
+
+	/* Current NAL end and its rbsp_stop_one_bit position.  */
+	uint64_t NAL_end;
+	uint64_t stop_bit_offset;
+	uint8_t stop_bit_shift;
+
 	uint8_t bit_shift;
 	uint8_t rbsp_mode;
 	uint8_t error;
+
+	/* If set, reaching the end or an error jumps there instead of exit.  */
+	jmp_buf *bail;
+
+	/* Big-endian bit window, valid while data_offset == cache_offset.  */
+	uint64_t cache;
+	uint64_t cache_offset;
+	uint64_t cache_end;
+	uint8_t cache_size;
+	uint8_t cache_escapes;
+	uint8_t cache_rbsp_mode;
 } bitstream_reader;
 
 void bitstream_reader_selftest(void);
-void bitstream_init(bitstream_reader *reader, void *data, uint32_t size);
-void bitstream_reader_inc_offset(bitstream_reader *reader, uint32_t delta);
+void bitstream_init(bitstream_reader *reader, void *data, uint64_t size);
+void bitstream_init_file(bitstream_reader *reader, int fd, uint64_t size);
+void bitstream_close(bitstream_reader *reader);
+void bitstream_remap(bitstream_reader *reader, uint64_t offset, uint32_t size);
+void bitstream_init_stream(bitstream_reader *reader, int fd);
+uint64_t bitstream_ring_wait(bitstream_reader *reader, uint64_t end);
+void bitstream_ring_remap(bitstream_reader *reader, uint64_t offset,
+			  uint32_t size);
+void bitstream_ring_close(bitstream_reader *reader);
+void bitstream_release(bitstream_reader *reader, uint64_t offset);
+uint32_t bitstream_push(bitstream_reader *reader, const void *data,
+			uint32_t size);
+void bitstream_push_end(bitstream_reader *reader);
+void bitstream_bail(bitstream_reader *reader, int reason);
+void bitstream_reader_inc_offset(bitstream_reader *reader, uint64_t delta);
 uint32_t bitstream_read_u(bitstream_reader *reader, uint8_t bits_nb);
 uint32_t bitstream_read_ue(bitstream_reader *reader);
 int32_t bitstream_read_se(bitstream_reader *reader);
@@ -42,4 +115,50 @@ unsigned bitstream_skip_leading_zeros(bitstream_reader *reader);
 uint32_t bitstream_read_u_no_inc(bitstream_reader *reader, uint8_t bits_nb);
 #define bitstream_read_ae(reader)	0
 
+void bitstream_rbsp_start(bitstream_reader *reader, bitstream_rbsp *rbsp);
+void bitstream_rbsp_stop(bitstream_reader *reader);
+int bitstream_rbsp_load(bitstream_reader *reader);
+void bitstream_find_stop_bit(bitstream_reader *reader);
+
+int find_start_code(const uint8_t *data, uint32_t offset, uint32_t end,
+		    uint32_t *code_offset);
+int bitstream_find_start_code(bitstream_reader *reader, uint64_t offset,
+			      uint64_t *code_offset);
+const char * find_start_code_impl(void);
+uint64_t bitstream_scan_start_codes(int fd, uint64_t size, unsigned threads_nb,
+				    bitstream_start_code **codes);
+
+/*
+ * Pointer to size bytes of the stream at offset, the window is moved if it
+ * doesn't cover them. Pointer is valid until the next call.
+ */
+static inline const uint8_t * bitstream_data(bitstream_reader *reader,
+					     uint64_t offset, uint32_t size)
+{
+	if (offset < reader->data_start ||
+			offset + size > reader->data_start + reader->data_size) {
+		bitstream_remap(reader, offset, size);
+	}
+
+	return reader->data_ptr + (offset - reader->data_start);
+}
+
+/*
+ * Block until the stream data up to end is received, returns the offset up to
+ * which data is available. It is less than end only if the stream ended, the
+ * stream size is known then. Doesn't block for files.
+ */
+static inline uint64_t bitstream_wait(bitstream_reader *reader, uint64_t end)
+{
+	if (reader->ring == NULL) {
+		return reader->file_size;
+	}
+
+	if (end <= reader->data_start + reader->data_size) {
+		return reader->data_start + reader->data_size;
+	}
+
+	return bitstream_ring_wait(reader, end);
+}
+
 #endif // BITSTREAM_H
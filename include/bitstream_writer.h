@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BITSTREAM_WRITER_H
+#define BITSTREAM_WRITER_H
+
+#include <stdint.h>
+
+typedef struct bitstream_writer {
+	uint8_t *data_ptr;
+	uint32_t data_size;
+	uint32_t data_offset;
+	uint64_t cache;
+	uint8_t cache_bits;
+	uint8_t rbsp_mode;
+	uint8_t zeros;
+} bitstream_writer;
+
+void bitstream_writer_init(bitstream_writer *writer);
+void bitstream_writer_free(bitstream_writer *writer);
+void bitstream_writer_reset(bitstream_writer *writer);
+void bitstream_write_u(bitstream_writer *writer, uint32_t value,
+		       uint8_t bits_nb);
+void bitstream_write_ue(bitstream_writer *writer, uint32_t value);
+void bitstream_write_se(bitstream_writer *writer, int32_t value);
+void bitstream_write_rbsp_trailing_bits(bitstream_writer *writer);
+void bitstream_write_bytes(bitstream_writer *writer, const void *data,
+			   uint32_t size);
+uint8_t bitstream_writer_bit_shift(bitstream_writer *writer);
+
+#endif // BITSTREAM_WRITER_H
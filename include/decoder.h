@@ -38,21 +38,41 @@
 #define SP_ONLY	8
 #define SI_ONLY	9
 
+#define DECODE_ALL		0
+#define DECODE_IDR		1
+#define DECODE_INTRA		2
+#define DECODE_REF_SPACED	3
+
+#define SEEK_NONE	0
+#define SEEK_PICTURE	1
+#define SEEK_TIME	2
+
+/* PTS / DTS of the NAL isn't known.  */
+#define TIMESTAMP_NONE	INT64_MIN
+
 #define IdrPicFlag	(decoder->nal.unit_type == 5)
 
 #define ARRAY_SIZE(x)	(sizeof(x) / sizeof(*(x)))
 
+/* Size of the bitstream buffer that holds the picture for VDE.  */
+#define DATA_BUF_SIZE		0x00080000
+
 #define DECODER_IPRINT(f, ...)	printf(f, ## __VA_ARGS__)
 #define DECODER_DPRINT(f, ...)	printf(f, ## __VA_ARGS__)
 
 // #define DECODER_IPRINT(f, ...) {}
 // #define DECODER_DPRINT(f, ...) {}
 
-#define DECODER_ERR(f, ...)				\
+#define DECODER_WARN(f, ...)				\
 {							\
 	fprintf(stderr, "%s:%d:\n", __FILE__, __LINE__);\
 	fprintf(stderr, "error! decode: %s: "		\
 		f, __func__, ## __VA_ARGS__);		\
+}
+
+#define DECODER_ERR(f, ...)				\
+{							\
+	DECODER_WARN(f, ## __VA_ARGS__)			\
 	abort();					\
 }
 
@@ -96,6 +116,10 @@ typedef struct decoder_context_sps {
 	uint32_t frame_crop_top_offset;
 	uint32_t frame_crop_bottom_offset;
 	unsigned vui_parameters_present_flag:1;
+	uint32_t num_units_in_tick;
+	uint32_t time_scale;
+	unsigned bitstream_restriction_flag:1;
+	uint32_t max_num_reorder_frames;
 	unsigned UseDefaultScalingMatrix4x4Flag[6];
 	unsigned UseDefaultScalingMatrix8x8Flag[6];
 	int8_t scalingList_4x4[6][16];
@@ -176,6 +200,15 @@ typedef struct slice_header {
 	pred_weight *pred_weight_l1;
 	unsigned no_output_of_prior_pics_flag:1;
 	unsigned long_term_reference_flag:1;
+
+	/* Parsed ahead, applied to the DPB by apply_slice_header().  */
+	uint32_t pic_parameter_set_id;
+	unsigned is_B_frame:1;
+	int32_t  abs_diff_pic_num[2][33];
+	uint8_t  modifications_nb[2];
+	uint32_t difference_of_pic_nums_minus1[32];
+	uint8_t  mmco_nb;
+	unsigned refs_missing:1;
 } slice_header;
 
 typedef struct nal_header {
@@ -183,6 +216,66 @@ typedef struct nal_header {
 	unsigned unit_type:5;
 } nal_header;
 
+/* Slice header fields that tell pictures apart, see 7.4.1.2.4.  */
+typedef struct picture_id {
+	uint32_t first_mb_in_slice;
+	uint32_t slice_type;
+	uint32_t pps_id;
+	uint32_t frame_num;
+	uint32_t idr_pic_id;
+	uint32_t pic_order_cnt_lsb;
+	int32_t  delta_pic_order_cnt_bottom;
+	int32_t  delta_pic_order_cnt[2];
+	unsigned field_pic_flag:1;
+	unsigned bottom_field_flag:1;
+	unsigned ref_idc:2;
+	unsigned idr:1;
+	unsigned intra:1;
+} picture_id;
+
+/* Slices of the picture that is gathered for decoding.  */
+typedef struct access_unit {
+	picture_id id;
+	nal_header nal;
+	uint32_t size;
+	unsigned slices_nb;
+	int64_t pts;
+	int64_t dts;
+} access_unit;
+
+/* Pictures selection of the trick play modes, see AU_skip_slice().  */
+typedef struct trick_mode {
+	int mode;
+	unsigned interval;
+	unsigned refs_nb;
+	picture_id id;
+	unsigned skip:1;
+	unsigned refs_missing:1;
+} trick_mode;
+
+/* Timestamps made up for raw streams, see picture_timestamps().  */
+typedef struct timestamp_clock {
+	int64_t base;
+	int64_t last_pts;
+	int64_t next_dts;
+	int64_t delay;
+	unsigned started:1;
+} timestamp_clock;
+
+/* Real-time schedule of the decoding, see decoder_set_deadline().  */
+typedef struct decode_deadline {
+	uint64_t period;
+	uint64_t latency;
+	uint64_t start;
+	uint64_t pictures_nb;
+} decode_deadline;
+
+/* Start of the decoding, see decoder_seek().  */
+typedef struct seek_target {
+	int unit;
+	uint64_t target;
+} seek_target;
+
 typedef struct frame_data {
 	int frame_dec_num;
 	int frame_num;
@@ -197,6 +290,8 @@ typedef struct frame_data {
 	unsigned is_B_frame:1;
 	unsigned frame_num_wrap:1;
 	decoder_context_sps *sps;
+	int64_t pts;
+	int64_t dts;
 } frame_data;
 
 typedef struct frames_list {
@@ -206,6 +301,7 @@ typedef struct frames_list {
 
 typedef struct decoder_context {
 	bitstream_reader reader;
+	bitstream_rbsp rbsp;
 
 	void (*frame_decoded_notify)(struct decoder_context *decoder,
 				     frame_data *frame);
@@ -219,17 +315,33 @@ typedef struct decoder_context {
 
 	nal_header   nal;
 	slice_header sh;
+	access_unit  au;
+	trick_mode   trick;
+	decode_deadline deadline;
+	seek_target  seek;
+	timestamp_clock clock;
 
 	frames_list DPB_frames_array;
 	frames_list ref_frames_P_list0;
 	frames_list ref_frames_B_list0;
 	frames_list ref_frames_B_list1;
 
-	int NAL_start_delim;
+	struct nal_index *indexing;
+	struct decoder_lookahead *lookahead;
+	struct stream_analysis *analysis;
+	struct mp4_movie *mp4;
+
+	/* Timestamps of the parsed NAL in 90 kHz units, given by container.  */
+	int64_t pts;
+	int64_t dts;
+
+	int NAL_pending;
 	int frames_decoded;
+	int frames_dropped;
 	int prev_frame_num;
 	int prevPicOrderCntMsb;
 	int prevPicOrderCntLsb;
+	int DPB_incomplete;
 	int running;
 
 	uint32_t parse_limit_paddress;
@@ -241,7 +353,35 @@ typedef struct decoder_context {
 	time_t dec_time_acc;
 } decoder_context;
 
-void decoder_init(decoder_context *decoder, void *data, uint32_t size);
+void decoder_init(decoder_context *decoder, int fd, uint64_t size);
+
+void decoder_init_parser(decoder_context *decoder, int fd, uint64_t size);
+
+void decoder_close_parser(decoder_context *decoder);
+
+void decoder_feed(decoder_context *decoder, const void *data, uint32_t size);
+
+void decoder_feed_end(decoder_context *decoder);
+
+void decoder_flush(decoder_context *decoder);
+
+void decoder_queue_slice(decoder_context *decoder);
+
+void decoder_run_lookahead(decoder_context *decoder, unsigned depth);
+
+void decoder_set_trick_mode(decoder_context *decoder, int mode,
+			    unsigned interval);
+
+void decoder_set_deadline(decoder_context *decoder, uint64_t period_ns,
+			  uint64_t latency_ns);
+
+int decoder_drop_late(decoder_context *decoder, unsigned ref_idc);
+
+void decoder_dropped_late(decoder_context *decoder, uint64_t late_ns);
+
+void decoder_seek(decoder_context *decoder, int unit, uint64_t target);
+
+void decoder_seek_done(decoder_context *decoder);
 
 void decoder_set_notify(decoder_context *decoder,
 			void (*frame_decoded_notify)(decoder_context*,
@@ -254,8 +394,34 @@ unsigned frame_luma_size(decoder_context *decoder);
 
 unsigned frame_chroma_size(decoder_context *decoder);
 
+void tegra_VDE_queue_data(decoder_context *decoder, const void *data,
+			  uint32_t size);
+
+void tegra_VDE_queue_slice(decoder_context *decoder);
+
 void tegra_VDE_decode_frame(decoder_context *decoder);
 
+void decoder_reset_SPS(decoder_context_sps *sps);
+
+void decoder_reset_PPS(decoder_context_pps *pps);
+
+void decoder_reset_SH(decoder_context *decoder);
+
+void decoder_copy_SPS(decoder_context_sps *dst, const decoder_context_sps *src);
+
+void decoder_copy_PPS(decoder_context_pps *dst, const decoder_context_pps *src);
+
+void lookahead_queue_slice(decoder_context *decoder);
+
+void lookahead_queue_picture(decoder_context *decoder);
+
+void lookahead_queue_SPS(decoder_context *decoder, decoder_context_sps *sps);
+
+void lookahead_queue_PPS(decoder_context *decoder, decoder_context_pps *pps);
+
+int lookahead_drop_late(decoder_context *decoder, unsigned ref_idc,
+			uint64_t now);
+
 void show_frames_list(frame_data **frames, int list_sz, int delim_id);
 
 void clear_DPB(decoder_context *decoder);
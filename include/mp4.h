@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MP4_H
+#define MP4_H
+
+#include <stdint.h>
+
+#include "decoder.h"
+
+/*
+ * Sample tables of the video track, built from the moov's stbl. Samples are
+ * in decoding order, times are in the track's timescale units. Sync samples
+ * are 0-based sample numbers in ascending order, all samples are sync ones
+ * if the track has no stss.
+ *
+ * Samples of a movie fragment are held in the same way, the tables are
+ * reused by the next fragment.
+ */
+typedef struct mp4_track {
+	uint32_t track_id;
+	uint32_t handler;
+	uint32_t timescale;
+	unsigned nal_length_size;
+	unsigned has_avcC:1;
+	unsigned has_stss:1;
+
+	uint32_t samples_nb;
+	uint32_t samples_max;
+	uint32_t next_sample;
+	uint64_t *sample_offset;
+	uint32_t *sample_size;
+	uint64_t *sample_dts;
+	int32_t *sample_cts;
+
+	uint32_t sync_nb;
+	uint32_t *sync_samples;
+
+	/* Raw tables, only until the sample arrays are built.  */
+	uint32_t stts_nb;
+	uint32_t *stts;
+	uint32_t ctts_nb;
+	uint32_t *ctts;
+	uint32_t chunks_nb;
+	uint64_t *chunk_offset;
+	uint32_t stsc_nb;
+	uint32_t *stsc;
+} mp4_track;
+
+/* Defaults of the fragments samples, given by mvex.  */
+typedef struct mp4_trex {
+	uint32_t track_id;
+	uint32_t default_duration;
+	uint32_t default_size;
+	uint32_t default_flags;
+} mp4_trex;
+
+typedef struct mp4_movie {
+	mp4_track video;
+	mp4_track fragment;
+	mp4_trex *trex;
+	uint32_t trex_nb;
+	uint64_t fragment_dts;
+	uint64_t fragment_picture;
+	uint32_t fragments_nb;
+	unsigned has_video:1;
+} mp4_movie;
+
+void mp4_free(mp4_movie *movie);
+
+#endif // MP4_H
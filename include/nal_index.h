@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NAL_INDEX_H
+#define NAL_INDEX_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "decoder.h"
+
+/*
+ * Index of the stream NALs, saved next to the stream as a sidecar file that
+ * is mapped as is. The sidecar is valid while size and mtime of the stream
+ * match the ones it was built for. Fields are in host byte order.
+ */
+#define NAL_INDEX_MAGIC		"H264NIDX"
+#define NAL_INDEX_VERSION	2
+#define NAL_INDEX_SUFFIX	".idx"
+
+#define NAL_INDEX_IDR		(1 << 0)
+
+typedef struct nal_index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint64_t file_size;
+	int64_t mtime_sec;
+	uint32_t mtime_nsec;
+	uint32_t reserved;
+	uint64_t entries_nb;
+} nal_index_header;
+
+typedef struct nal_index_entry {
+	uint64_t offset;
+	uint32_t size;
+	uint32_t first_mb_in_slice;
+	uint32_t frame_num;
+	uint8_t unit_type;
+	uint8_t ref_idc;
+	uint8_t slice_type;
+	uint8_t flags;
+	/* Container timestamps of the NAL, TIMESTAMP_NONE for Annex B.  */
+	int64_t pts;
+	int64_t dts;
+} nal_index_entry;
+
+typedef struct nal_sync_point {
+	uint64_t entry;
+	uint64_t picture;
+} nal_sync_point;
+
+typedef struct nal_index {
+	nal_index_entry *entries;
+	uint64_t entries_nb;
+	uint64_t entries_max;
+	void *map;
+	size_t map_size;
+	nal_sync_point *sync_points;
+	uint64_t sync_nb;
+} nal_index;
+
+nal_index * nal_index_build(int fd, uint64_t size);
+
+nal_index * nal_index_load(const char *path, const struct stat *sb);
+
+int nal_index_save(nal_index *index, const char *path, const struct stat *sb);
+
+nal_index * nal_index_open(const char *path, int fd, const struct stat *sb);
+
+void nal_index_free(nal_index *index);
+
+void nal_index_add(nal_index *index, decoder_context *decoder);
+
+void parse_indexed(decoder_context *decoder, nal_index *index,
+		   uint64_t first, uint64_t count);
+
+#endif // NAL_INDEX_H
@@ -28,8 +28,39 @@
 
 #define MB_UNAVAILABLE	-1
 
+/* parse_annex_b_NAL() status.  */
+#define PARSE_NAL_DONE		0
+#define PARSE_NAL_TRUNCATED	1
+#define PARSE_NAL_MALFORMED	2
+#define PARSE_NEED_DATA		3
+#define PARSE_STREAM_END	4
+
 void parse_annex_b(decoder_context *decoder);
 
+int parse_annex_b_NAL(decoder_context *decoder);
+
 int parse_mp4(decoder_context *decoder);
 
+unsigned parse_avc_config(decoder_context *decoder, uint64_t end,
+			  int parse_sets);
+
+void parse_avc_sample(decoder_context *decoder, uint64_t offset,
+		      uint32_t size, unsigned nal_length_size);
+
+int parse_mkv(decoder_context *decoder);
+
+int probe_mkv(bitstream_reader *reader);
+
+int parse_ts(decoder_context *decoder);
+
+int probe_ts(bitstream_reader *reader);
+
+int parse_rtp_pcap(decoder_context *decoder);
+
+int probe_rtp_pcap(bitstream_reader *reader);
+
+void parse_rtp_udp(decoder_context *decoder, int fd);
+
+void apply_slice_header(decoder_context *decoder);
+
 #endif // SYNTAX_PARSE_H
@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decoder.h"
+#include "syntax_parse.h"
+
+/*
+ * Parse-ahead: the input is parsed by a thread with a decoder context of its
+ * own, up to "depth" pictures ahead of the decoding. Parser hands parameter
+ * sets and gathered pictures over through a queue of jobs, the decoding
+ * context takes them in the stream order and does the DPB steps of every
+ * picture right before it is decoded, like decoder_flush() does.
+ */
+#define LOOKAHEAD_SPS		0
+#define LOOKAHEAD_PPS		1
+#define LOOKAHEAD_PICTURE	2
+#define LOOKAHEAD_END		3
+#define LOOKAHEAD_DROPPED	4
+
+typedef struct lookahead_job {
+	struct lookahead_job *next;
+	int type;
+	decoder_context_sps sps;
+	decoder_context_pps pps;
+	nal_header nal;
+	slice_header sh;
+	uint8_t *data;
+	uint32_t size;
+	uint32_t size_max;
+	unsigned slices_nb;
+	int64_t pts;
+	int64_t dts;
+	uint64_t late_ns;
+} lookahead_job;
+
+typedef struct decoder_lookahead {
+	decoder_context *parser;
+	lookahead_job *head;
+	lookahead_job *tail;
+	lookahead_job *picture;
+	unsigned pictures_nb;
+	unsigned depth;
+	uint64_t deadline_start;
+	unsigned deadline_started:1;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} decoder_lookahead;
+
+static const uint8_t nal_start_code[] = { 0x00, 0x00, 0x01 };
+
+static lookahead_job * job_alloc(int type)
+{
+	lookahead_job *job = calloc(1, sizeof(*job));
+
+	if (job == NULL) {
+		perror("Failed to allocate lookahead job");
+		abort();
+	}
+
+	job->type = type;
+
+	return job;
+}
+
+/* Parser blocks while "depth" pictures are waiting for decoding.  */
+static void job_push(decoder_lookahead *la, lookahead_job *job)
+{
+	pthread_mutex_lock(&la->lock);
+
+	if (job->type == LOOKAHEAD_PICTURE) {
+		while (la->pictures_nb >= la->depth) {
+			pthread_cond_wait(&la->cond, &la->lock);
+		}
+
+		la->pictures_nb++;
+	}
+
+	if (la->tail != NULL) {
+		la->tail->next = job;
+	} else {
+		la->head = job;
+	}
+
+	la->tail = job;
+
+	pthread_cond_broadcast(&la->cond);
+	pthread_mutex_unlock(&la->lock);
+}
+
+static lookahead_job * job_pop(decoder_lookahead *la)
+{
+	lookahead_job *job;
+
+	pthread_mutex_lock(&la->lock);
+
+	while (la->head == NULL) {
+		pthread_cond_wait(&la->cond, &la->lock);
+	}
+
+	job = la->head;
+	la->head = job->next;
+
+	if (la->head == NULL) {
+		la->tail = NULL;
+	}
+
+	if (job->type == LOOKAHEAD_PICTURE) {
+		la->pictures_nb--;
+		pthread_cond_broadcast(&la->cond);
+	}
+
+	pthread_mutex_unlock(&la->lock);
+
+	return job;
+}
+
+static void job_append(lookahead_job *job, const void *data, uint32_t size)
+{
+	if (job->size + size > job->size_max) {
+		job->size_max = max(job->size_max * 2, job->size + size);
+		job->data = realloc(job->data, job->size_max);
+		if (job->data == NULL) {
+			perror("Failed to grow lookahead picture");
+			abort();
+		}
+	}
+
+	memcpy(job->data + job->size, data, size);
+	job->size += size;
+}
+
+/* Parser side of tegra_VDE_queue_slice().  */
+void lookahead_queue_slice(decoder_context *decoder)
+{
+	decoder_lookahead *la = decoder->lookahead;
+	bitstream_reader *reader = &decoder->reader;
+	uint32_t size = reader->NAL_end - reader->NAL_offset;
+
+	if (la->picture == NULL) {
+		la->picture = job_alloc(LOOKAHEAD_PICTURE);
+	}
+
+	if (decoder->au.slices_nb == 0) {
+		decoder->au.nal = decoder->nal;
+	}
+
+	job_append(la->picture, nal_start_code, sizeof(nal_start_code));
+	job_append(la->picture,
+		   bitstream_data(reader, reader->NAL_offset, size), size);
+
+	decoder->au.size += sizeof(nal_start_code) + size;
+	decoder->au.slices_nb++;
+}
+
+/* Parser side of decoder_flush(), picture is handed over to the decoding.  */
+void lookahead_queue_picture(decoder_context *decoder)
+{
+	decoder_lookahead *la = decoder->lookahead;
+	lookahead_job *job = la->picture;
+
+	job->nal = decoder->au.nal;
+	job->sh = decoder->sh;
+	job->slices_nb = decoder->au.slices_nb;
+	job->pts = decoder->au.pts;
+	job->dts = decoder->au.dts;
+
+	/* Prediction weights are owned by the job now.  */
+	decoder->sh.pred_weight_l0 = NULL;
+	decoder->sh.pred_weight_l1 = NULL;
+
+	decoder->au.size = 0;
+	decoder->au.slices_nb = 0;
+
+	la->picture = NULL;
+
+	job_push(la, job);
+}
+
+void lookahead_queue_SPS(decoder_context *decoder, decoder_context_sps *sps)
+{
+	lookahead_job *job = job_alloc(LOOKAHEAD_SPS);
+
+	decoder_copy_SPS(&job->sps, sps);
+	job_push(decoder->lookahead, job);
+}
+
+void lookahead_queue_PPS(decoder_context *decoder, decoder_context_pps *pps)
+{
+	lookahead_job *job = job_alloc(LOOKAHEAD_PPS);
+
+	decoder_copy_PPS(&job->pps, pps);
+	job_push(decoder->lookahead, job);
+}
+
+/*
+ * Parser side of decoder_drop_late(). Schedule of the decoding starts with
+ * its first picture, picture that is late while parsed only gets later by
+ * the time it is decoded. It is dropped before its slices are parsed and
+ * copied, decoding context accounts the drop.
+ */
+int lookahead_drop_late(decoder_context *decoder, unsigned ref_idc,
+			uint64_t now)
+{
+	decoder_lookahead *la = decoder->lookahead;
+	decode_deadline *dl = &decoder->deadline;
+	lookahead_job *job;
+	uint64_t due;
+	int started;
+
+	pthread_mutex_lock(&la->lock);
+	started = la->deadline_started;
+	dl->start = la->deadline_start;
+	pthread_mutex_unlock(&la->lock);
+
+	due = dl->start + dl->latency + dl->pictures_nb++ * dl->period;
+
+	if (!started || ref_idc != 0 || now <= due) {
+		return 0;
+	}
+
+	job = job_alloc(LOOKAHEAD_DROPPED);
+	job->late_ns = now - due;
+	job_push(la, job);
+
+	return 1;
+}
+
+static void * lookahead_parse(void *arg)
+{
+	decoder_lookahead *la = arg;
+
+	if (!parse_mp4(la->parser) && !parse_mkv(la->parser) &&
+	    !parse_rtp_pcap(la->parser) && !parse_ts(la->parser)) {
+		parse_annex_b(la->parser);
+	}
+
+	job_push(la, job_alloc(LOOKAHEAD_END));
+
+	return NULL;
+}
+
+static void lookahead_decode(decoder_context *decoder,
+			     decoder_lookahead *la, lookahead_job *job)
+{
+	decoder_context_pps *pps;
+	uint32_t id;
+
+	switch (job->type) {
+	case LOOKAHEAD_SPS:
+		id = job->sps.seq_parameter_set_id;
+		decoder_reset_SPS(&decoder->sps[id]);
+		decoder->sps[id] = job->sps;
+		break;
+	case LOOKAHEAD_PPS:
+		id = job->pps.pic_parameter_set_id;
+		decoder_reset_PPS(&decoder->pps[id]);
+		decoder->pps[id] = job->pps;
+		break;
+	case LOOKAHEAD_PICTURE:
+		/*
+		 * Parser drops pictures that are late already, this one could
+		 * have got late while waiting in the queue.
+		 */
+		if (decoder_drop_late(decoder, job->nal.ref_idc)) {
+			free(job->sh.pred_weight_l0);
+			free(job->sh.pred_weight_l1);
+			free(job->data);
+			break;
+		}
+
+		if (!la->deadline_started && decoder->deadline.period != 0) {
+			pthread_mutex_lock(&la->lock);
+			la->deadline_start = decoder->deadline.start;
+			la->deadline_started = 1;
+			pthread_mutex_unlock(&la->lock);
+		}
+
+		pps = &decoder->pps[job->sh.pic_parameter_set_id];
+
+		decoder_reset_SH(decoder);
+		decoder->sh = job->sh;
+		decoder->active_pps = pps;
+		decoder->active_sps = &decoder->sps[pps->seq_parameter_set_id];
+
+		decoder->au.nal = job->nal;
+		tegra_VDE_queue_data(decoder, job->data, job->size);
+		decoder->au.slices_nb = job->slices_nb;
+		decoder->au.pts = job->pts;
+		decoder->au.dts = job->dts;
+
+		decoder_flush(decoder);
+		free(job->data);
+		break;
+	case LOOKAHEAD_DROPPED:
+		decoder_dropped_late(decoder, job->late_ns);
+		break;
+	default:
+		break;
+	}
+
+	free(job);
+}
+
+/*
+ * Decode the input of decoder with parsing done "depth" pictures ahead by a
+ * thread. Equivalent of parse_mp4() || parse_mkv() || parse_rtp_pcap() ||
+ * parse_ts() || parse_annex_b().
+ */
+void decoder_run_lookahead(decoder_context *decoder, unsigned depth)
+{
+	decoder_lookahead *la;
+	decoder_context *parser;
+	lookahead_job *job;
+	int type;
+	int i;
+
+	la = calloc(1, sizeof(*la));
+	parser = calloc(1, sizeof(*parser));
+
+	if (la == NULL || parser == NULL) {
+		perror("Failed to allocate lookahead");
+		abort();
+	}
+
+	pthread_mutex_init(&la->lock, NULL);
+	pthread_cond_init(&la->cond, NULL);
+
+	la->depth = depth ? depth : 1;
+	la->parser = parser;
+
+	/* Input is read by the parser only, until it is done.  */
+	parser->reader = decoder->reader;
+	parser->trick = decoder->trick;
+	parser->deadline = decoder->deadline;
+	parser->seek = decoder->seek;
+	parser->pts = decoder->pts;
+	parser->dts = decoder->dts;
+	parser->lookahead = la;
+
+	if (pthread_create(&la->thread, NULL, lookahead_parse, la) != 0) {
+		perror("Failed to create lookahead thread");
+		abort();
+	}
+
+	do {
+		job = job_pop(la);
+		type = job->type;
+
+		lookahead_decode(decoder, la, job);
+	} while (type != LOOKAHEAD_END);
+
+	pthread_join(la->thread, NULL);
+
+	decoder->reader = parser->reader;
+	decoder->mp4 = parser->mp4;
+
+	for (i = 0; i < ARRAY_SIZE(parser->sps); i++) {
+		decoder_reset_SPS(&parser->sps[i]);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(parser->pps); i++) {
+		decoder_reset_PPS(&parser->pps[i]);
+	}
+
+	decoder_reset_SH(parser);
+
+	pthread_cond_destroy(&la->cond);
+	pthread_mutex_destroy(&la->lock);
+
+	free(parser);
+	free(la);
+}
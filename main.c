@@ -17,13 +17,20 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
+#include <sys/un.h>
 
+#include "analysis.h"
 #include "decoder.h"
+#include "nal_index.h"
 #include "syntax_parse.h"
 
 static void save_decoded_frame(decoder_context *decoder, frame_data *frame)
@@ -40,8 +47,113 @@ static void save_decoded_frame(decoder_context *decoder, frame_data *frame)
 		abort();
 	}
 
-	printf("Saved frame %d file offset 0x%lX\n",
-	       decoder->frames_decoded - 1, foff);
+	printf("Saved frame %d file offset 0x%lX pts %" PRId64,
+	       decoder->frames_decoded - 1, foff, frame->pts);
+
+	if (frame->dts != TIMESTAMP_NONE) {
+		printf(" dts %" PRId64, frame->dts);
+	}
+
+	printf("\n");
+}
+
+#define UDP_RCVBUF_SIZE	(4 * 1024 * 1024)
+
+/*
+ * UDP socket bound to the "[host]:port" of the "udp://" input, host is a
+ * numeric IPv4 or [IPv6] address, any one if it is omitted.
+ */
+static int open_udp(const char *url)
+{
+	struct sockaddr_in6 addr6;
+	struct sockaddr_in addr;
+	struct sockaddr *sa = (struct sockaddr *) &addr;
+	socklen_t sa_len = sizeof(addr);
+	int size = UDP_RCVBUF_SIZE;
+	char host[INET6_ADDRSTRLEN] = "";
+	const char *port;
+	int fd;
+
+	port = strrchr(url, ':');
+	if (port == NULL || port - url >= (long) sizeof(host)) {
+		return -1;
+	}
+
+	if (url[0] == '[' && port[-1] == ']') {
+		memcpy(host, url + 1, port - url - 2);
+	} else {
+		memcpy(host, url, port - url);
+	}
+
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(port + 1));
+
+	if (strchr(host, ':') != NULL) {
+		bzero(&addr6, sizeof(addr6));
+		addr6.sin6_family = AF_INET6;
+		addr6.sin6_port = addr.sin_port;
+		sa = (struct sockaddr *) &addr6;
+		sa_len = sizeof(addr6);
+
+		if (inet_pton(AF_INET6, host, &addr6.sin6_addr) != 1) {
+			return -1;
+		}
+	} else if (host[0] != '\0' &&
+		   inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+		return -1;
+	}
+
+	fd = socket(sa->sa_family, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		return -1;
+	}
+
+	/* Bursts of a picture's packets shouldn't overflow the socket.  */
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	if (bind(fd, sa, sa_len) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Input is a file, FIFO, Unix socket or stdin if path is "-".  */
+static int open_input(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat sb;
+	int fd;
+
+	if (strcmp(path, "-") == 0) {
+		return STDIN_FILENO;
+	}
+
+	if (stat(path, &sb) == -1 || !S_ISSOCK(sb.st_mode)) {
+		return open(path, O_RDONLY);
+	}
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		return -1;
+	}
+
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
 }
 
 int main(int argc, char **argv)
@@ -50,12 +162,26 @@ int main(int argc, char **argv)
 	decoder_context decoder;
 	const char *in_file_path = NULL;
 	const char *out_file_path = NULL;
+	nal_index *index = NULL;
+	int use_index = 0;
+	int lookahead = 0;
+	int trick_mode = DECODE_ALL;
+	int trick_interval = 0;
+	double deadline_fps = 0;
+	double deadline_latency = 0;
+	stream_analysis analysis;
+	int analysis_format = -1;
+	double analysis_fps = 25;
+	int seek_unit = SEEK_NONE;
+	uint64_t seek_target = 0;
+	char *end;
 	FILE *fp_out;
-	void *data_ptr;
+	uint64_t size;
+	int udp_fd = -1;
 	int fd;
 	int c;
 
-	while ((c = getopt(argc, argv, "i:o:")) != -1) {
+	while ((c = getopt(argc, argv, "i:o:IL:T:D:A:s:")) != -1) {
 		switch (c) {
 		case 'i':
 			in_file_path = optarg;
@@ -63,40 +189,153 @@ int main(int argc, char **argv)
 		case 'o':
 			out_file_path = optarg;
 			break;
+		case 'I':
+			use_index = 1;
+			break;
+		case 'L':
+			lookahead = atoi(optarg);
+			break;
+		case 'T':
+			if (strcmp(optarg, "idr") == 0) {
+				trick_mode = DECODE_IDR;
+			} else if (strcmp(optarg, "intra") == 0) {
+				trick_mode = DECODE_INTRA;
+			} else {
+				trick_mode = DECODE_REF_SPACED;
+				trick_interval = atoi(optarg);
+			}
+			break;
+		case 'D':
+			sscanf(optarg, "%lf:%lf", &deadline_fps,
+			       &deadline_latency);
+			break;
+		case 'A':
+			if (strncmp(optarg, "bin", 3) == 0) {
+				analysis_format = ANALYSIS_BINARY;
+			} else {
+				analysis_format = ANALYSIS_CSV;
+			}
+
+			if (strchr(optarg, ':') != NULL) {
+				analysis_fps = atof(strchr(optarg, ':') + 1);
+			}
+			break;
+		case 's':
+			seek_target = strtoull(optarg, &end, 10);
+			seek_unit = SEEK_PICTURE;
+
+			if (*end == '.' || *end == 's') {
+				seek_target = strtod(optarg, NULL) * 1000000000;
+				seek_unit = SEEK_TIME;
+			}
+			break;
 		default:
 			break;
 		}
 	}
 
+	if (use_index && lookahead > 0) {
+		fprintf(stderr, "-I and -L can't be used together\n");
+		exit(EXIT_FAILURE);
+	}
+
 	if (in_file_path == NULL || out_file_path == NULL) {
-		fprintf(stderr, "-i h264 input file path\n");
+		fprintf(stderr, "-i h264 input file, FIFO or socket path, "
+				"\"-\" for stdin, or udp://[host]:port for "
+				"RTP\n");
 		fprintf(stderr, "-o decoded i420 frames output file path\n");
+		fprintf(stderr, "-I use NAL index sidecar of the input file, "
+				"build it if needed\n");
+		fprintf(stderr, "-L parse up to the given number of pictures "
+				"ahead of decoding on a thread\n");
+		fprintf(stderr, "-T decode \"idr\" or \"intra\" pictures only, "
+				"or N for reference pictures, spaced to intra "
+				"ones at least N references apart if N > 1\n");
+		fprintf(stderr, "-D fps[:latency_ms] real-time decoding, drop "
+				"late non-reference pictures\n");
+		fprintf(stderr, "-A csv|bin[:fps] write per-picture statistics "
+				"to the output instead of decoding, no hardware "
+				"needed\n");
+		fprintf(stderr, "-s start from the IDR picture at or before the "
+				"given picture number, or time with \"s\" "
+				"suffix; Annex B past its first 4 MiB without "
+				"-I starts near it, by the average picture "
+				"size\n");
 		exit(EXIT_FAILURE);
 	}
 
-	fd = open(in_file_path, O_RDONLY);
+	if (strncmp(in_file_path, "udp://", 6) == 0) {
+		udp_fd = open_udp(in_file_path + 6);
+
+		assert(udp_fd != -1);
 
-	assert(fd != -1);
-	assert(fstat(fd, &sb) != -1);
+		/* Packets are parsed as they are, reader only holds NALs.  */
+		fd = -1;
+		size = BITSTREAM_SIZE_UNKNOWN;
+		use_index = 0;
+		lookahead = 0;
+	} else {
+		fd = open_input(in_file_path);
+
+		assert(fd != -1);
+		assert(fstat(fd, &sb) != -1);
+
+		size = S_ISREG(sb.st_mode) ? sb.st_size :
+					     BITSTREAM_SIZE_UNKNOWN;
+	}
+
+	if (use_index && S_ISREG(sb.st_mode)) {
+		index = nal_index_open(in_file_path, fd, &sb);
+
+		if (index == NULL) {
+			fprintf(stderr, "-I is supported for well-formed MP4 "
+					"and Annex B files only\n");
+			exit(EXIT_FAILURE);
+		}
+	}
 
 	fp_out = fopen(out_file_path, "w+");
 
 	assert(fp_out != NULL);
 
-	data_ptr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	assert(data_ptr != MAP_FAILED);
+	if (analysis_format != -1) {
+		decoder_init_parser(&decoder, fd, size);
+		analysis_start(&decoder, &analysis, fp_out, analysis_format,
+			       analysis_fps);
+		lookahead = 0;
+	} else {
+		decoder_init(&decoder, fd, size);
+		decoder_set_notify(&decoder, save_decoded_frame, fp_out);
+	}
 
-	assert(madvise(data_ptr, sb.st_size, MADV_SEQUENTIAL) == 0);
+	if (trick_mode != DECODE_ALL) {
+		decoder_set_trick_mode(&decoder, trick_mode, trick_interval);
+	}
 
-	decoder_init(&decoder, data_ptr, sb.st_size);
+	if (deadline_fps > 0) {
+		decoder_set_deadline(&decoder, 1000000000 / deadline_fps,
+				     deadline_latency * 1000000);
+	}
 
-	if (out_file_path) {
-		decoder_set_notify(&decoder, save_decoded_frame, fp_out);
+	if (seek_unit != SEEK_NONE) {
+		decoder_seek(&decoder, seek_unit, seek_target);
 	}
 
-	if (!parse_mp4(&decoder)) {
+	if (udp_fd != -1) {
+		parse_rtp_udp(&decoder, udp_fd);
+	} else if (index != NULL) {
+		parse_indexed(&decoder, index, 0, index->entries_nb);
+	} else if (lookahead > 0) {
+		decoder_run_lookahead(&decoder, lookahead);
+	} else if (!parse_mp4(&decoder) && !parse_mkv(&decoder) &&
+		   !parse_rtp_pcap(&decoder) && !parse_ts(&decoder)) {
 		parse_annex_b(&decoder);
 	}
 
+	if (analysis_format != -1) {
+		analysis_summary(&analysis);
+		fclose(fp_out);
+	}
+
 	return 0;
 }
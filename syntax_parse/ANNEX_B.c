@@ -19,21 +19,312 @@
 
 #include "common.h"
 
-void parse_annex_b(decoder_context *decoder)
+/*
+ * Parse the next NAL of the stream. NAL extends to the next start code or
+ * the stream end, so streamed NAL is parsed once it is fully received.
+ * Streamed NAL's reader end is set past the start code, as if the stream
+ * continues. PARSE_NEED_DATA is returned if a pushed stream has no complete
+ * NAL yet, the next call resumes from the same NAL.
+ */
+int parse_annex_b_NAL(decoder_context *decoder)
 {
 	bitstream_reader *reader = &decoder->reader;
+	uint64_t orig_end = reader->bitstream_end;
+	uint64_t next_NAL;
+	int next_NAL_found;
+	int ret;
+
+	if (!decoder->NAL_pending) {
+		if (!seek_to_NAL_start(reader)) {
+			if (reader->bitstream_end == BITSTREAM_SIZE_UNKNOWN) {
+				return PARSE_NEED_DATA;
+			}
+
+			return PARSE_STREAM_END;
+		}
+
+		decoder->NAL_pending = 1;
+	}
+
+	next_NAL_found = bitstream_find_start_code(reader, reader->data_offset,
+						   &next_NAL);
+	if (next_NAL_found) {
+		reader->NAL_end = next_NAL;
+
+		if (reader->ring != NULL) {
+			reader->bitstream_end = next_NAL + next_NAL_found + 1;
+		}
+	} else if (reader->bitstream_end == BITSTREAM_SIZE_UNKNOWN) {
+		return PARSE_NEED_DATA;
+	} else {
+		reader->NAL_end = reader->bitstream_end;
+	}
+
+	decoder->NAL_pending = 0;
+
+	SYNTAX_IPRINT("+++++++++++++++\n");
+
+	ret = try_parse_NAL(decoder);
+
+	SYNTAX_IPRINT("---------------\n\n");
+
+	reader->bitstream_end = min(orig_end, reader->file_size);
+
+	/* Next NAL is found already.  */
+	if (next_NAL_found) {
+		reader->data_offset = next_NAL;
+		reader->bit_shift = 0;
+	}
+
+	switch (ret) {
+	case BITSTREAM_END_REACHED:
+		return PARSE_NAL_TRUNCATED;
+	case BITSTREAM_MALFORMED:
+		return PARSE_NAL_MALFORMED;
+	default:
+		return PARSE_NAL_DONE;
+	}
+}
+
+/* Head of the file that the average coded picture size is taken from.  */
+#define SEEK_PROBE_SIZE		(4 << 20)
+
+/* Data scanned back for an IDR or parameter sets, doubled till found.  */
+#define SEEK_BACK_STEP		(256 << 10)
+
+/*
+ * Start code at or after offset, the offset is moved to it and the first two
+ * bytes of the NAL are read to header. Returns the start code size, 0 if
+ * there is no NAL.
+ */
+static int seek_next_NAL(bitstream_reader *reader, uint64_t *offset,
+			 uint8_t *header)
+{
+	uint64_t code_offset;
+	const uint8_t *data;
+	int code_size;
+
+	code_size = bitstream_find_start_code(reader, *offset, &code_offset);
+	if (!code_size || code_offset + code_size + 2 > reader->file_size) {
+		return 0;
+	}
+
+	data = bitstream_data(reader, code_offset + code_size, 2);
+	header[0] = data[0];
+	header[1] = data[1];
+
+	*offset = code_offset;
+
+	return code_size;
+}
+
+/* Parse the NAL of the start code at offset.  */
+static void seek_parse_NAL(decoder_context *decoder, uint64_t offset)
+{
+	decoder->reader.data_offset = offset;
+	decoder->NAL_pending = 0;
+
+	if (parse_annex_b_NAL(decoder) == PARSE_NAL_MALFORMED) {
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Last IDR picture that starts in [from, end) and is at most max_picture
+ * pictures past from. Pictures that start in the range are counted to
+ * pictures_nb. Returns 0 if there is no such IDR.
+ */
+static int seek_last_IDR(bitstream_reader *reader, uint64_t from,
+			 uint64_t end, uint64_t max_picture,
+			 uint64_t *pictures_nb, uint64_t *IDR_offset)
+{
+	uint64_t offset = from;
+	uint64_t pictures = 0;
+	uint8_t header[2];
+	int found = 0;
+	int code_size;
+
+	while ((code_size = seek_next_NAL(reader, &offset, header)) &&
+			offset < end) {
+		if (IS_PICTURE_START(header)) {
+			if ((header[0] & 0x1F) == 5 && pictures <= max_picture) {
+				*IDR_offset = offset;
+				found = 1;
+			}
+
+			pictures++;
+		}
+
+		offset += code_size;
+	}
+
+	if (pictures_nb != NULL) {
+		*pictures_nb = pictures;
+	}
+
+	return found;
+}
 
-	decoder->NAL_start_delim = 1;
+/* First IDR picture that starts at or after offset.  */
+static int seek_next_IDR(bitstream_reader *reader, uint64_t offset,
+			 uint64_t *IDR_offset)
+{
+	uint8_t header[2];
+	int code_size;
+
+	while ((code_size = seek_next_NAL(reader, &offset, header))) {
+		if (IS_PICTURE_START(header) && (header[0] & 0x1F) == 5) {
+			*IDR_offset = offset;
+			return 1;
+		}
+
+		offset += code_size;
+	}
+
+	return 0;
+}
+
+/*
+ * Parameter sets ahead of the IDR are parsed, data before it is scanned back
+ * till both an SPS and a PPS are found or the file start is reached.
+ */
+static void seek_parameter_sets(decoder_context *decoder, uint64_t IDR_offset)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t step = SEEK_BACK_STEP;
+	uint64_t from, offset;
+	uint8_t header[2];
+	int sps_found, pps_found;
+	int code_size;
 
 	do {
-		if (!seek_to_NAL_start(reader)) {
-			break;
+		from = IDR_offset > step ? IDR_offset - step : 0;
+		offset = from;
+		sps_found = 0;
+		pps_found = 0;
+		step *= 2;
+
+		while ((code_size = seek_next_NAL(reader, &offset, header)) &&
+				offset < IDR_offset) {
+			sps_found |= ((header[0] & 0x1F) == 7);
+			pps_found |= ((header[0] & 0x1F) == 8);
+			offset += code_size;
+		}
+	} while (from > 0 && !(sps_found && pps_found));
+
+	offset = from;
+
+	while ((code_size = seek_next_NAL(reader, &offset, header)) &&
+			offset < IDR_offset) {
+		if ((header[0] & 0x1F) == 7 || (header[0] & 0x1F) == 8) {
+			seek_parse_NAL(decoder, offset);
 		}
 
-		SYNTAX_IPRINT("+++++++++++++++\n");
+		offset += code_size;
+	}
+}
 
-		parse_NAL(decoder);
+/*
+ * Resync on the IDR picture at or before the seek target without indexing
+ * the file. Pictures are counted over the head of the file, the target
+ * within it is found exactly. Target past it is mapped to a byte offset by
+ * the average coded picture size of the head, then the last IDR ahead of
+ * that offset is looked for in a window that grows back from it. Seek cost
+ * depends on the GOP size, not on the target position.
+ */
+static void annex_b_seek(decoder_context *decoder)
+{
+	bitstream_reader *reader = &decoder->reader;
+	seek_target *seek = &decoder->seek;
+	uint64_t probe_end = min(reader->file_size, SEEK_PROBE_SIZE);
+	uint64_t step = SEEK_BACK_STEP;
+	uint64_t picture = seek->target;
+	uint64_t pictures_nb, estimate, from, IDR_offset = 0;
+	uint64_t offset = 0;
+	uint8_t header[2];
+	int found = 0;
+	int code_size;
+
+	/* Parameter sets of the head give the frame rate.  */
+	while ((code_size = seek_next_NAL(reader, &offset, header)) &&
+			offset < probe_end) {
+		if ((header[0] & 0x1F) == 7 || (header[0] & 0x1F) == 8) {
+			seek_parse_NAL(decoder, offset);
+		}
+
+		offset += code_size;
+	}
+
+	if (seek->unit == SEEK_TIME) {
+		picture = seek->target * seek_fps(decoder) / 1000000000;
+	}
+
+	found = seek_last_IDR(reader, 0, probe_end, picture,
+			      &pictures_nb, &IDR_offset);
+
+	if (picture >= pictures_nb && probe_end < reader->file_size &&
+			pictures_nb > 0) {
+		estimate = picture * probe_end / pictures_nb;
+		estimate = min(estimate, reader->file_size);
+
+		/* Last IDR of the head is taken if there is none past it.  */
+		do {
+			from = estimate > step ? estimate - step : 0;
+			from = max(from, probe_end);
+			step *= 2;
+
+			if (seek_last_IDR(reader, from, estimate, UINT64_MAX,
+					  NULL, &IDR_offset)) {
+				found = 1;
+				break;
+			}
+		} while (from > probe_end);
+	}
+
+	if (!found) {
+		found = seek_next_IDR(reader, 0, &IDR_offset);
+	}
+
+	decoder_seek_done(decoder);
+
+	if (!found) {
+		SYNTAX_WARN("Stream has no IDR pictures to seek to\n");
+		reader->data_offset = 0;
+		return;
+	}
+
+	SYNTAX_IPRINT("Seek for picture %" PRIu64 ", IDR @0x%" PRIX64 "\n",
+		      picture, IDR_offset);
+
+	seek_parameter_sets(decoder, IDR_offset);
+
+	reader->data_offset = IDR_offset;
+	reader->bit_shift = 0;
+	decoder->NAL_pending = 0;
+}
+
+void parse_annex_b(decoder_context *decoder)
+{
+	int ret;
+
+	if (decoder->seek.unit != SEEK_NONE &&
+			decoder->reader.ring == NULL) {
+		annex_b_seek(decoder);
+	}
+
+	if (decoder->seek.unit != SEEK_NONE) {
+		SYNTAX_WARN("Streamed Annex B can't be seeked, "
+			    "decoding from the start\n");
+		decoder_seek_done(decoder);
+	}
+
+	do {
+		ret = parse_annex_b_NAL(decoder);
+
+		if (ret == PARSE_NAL_MALFORMED) {
+			exit(EXIT_FAILURE);
+		}
+	} while (ret < PARSE_NEED_DATA);
 
-		SYNTAX_IPRINT("---------------\n\n");
-	} while (!reader->error);
+	decoder_flush(decoder);
 }
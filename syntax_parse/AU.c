@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+/*
+ * Slice header up to the last field that 7.4.1.2.4 compares, parsed without
+ * touching the decoder state.
+ */
+static void parse_picture_id(decoder_context *decoder, picture_id *id)
+{
+	bitstream_reader *reader = &decoder->reader;
+	decoder_context_sps *sps;
+	decoder_context_pps *pps;
+	uint32_t slice_type;
+
+	bzero(id, sizeof(*id));
+
+	id->ref_idc = decoder->nal.ref_idc;
+	id->idr = IdrPicFlag;
+
+	id->first_mb_in_slice = bitstream_read_ue(reader);
+	slice_type = bitstream_read_ue(reader) % 5;
+	id->slice_type = slice_type;
+	id->intra = (slice_type == I || slice_type == SI);
+	id->pps_id = bitstream_read_ue(reader);
+
+	/* Left for parse_slice_header() to report.  */
+	if (id->pps_id > 255 || !decoder->pps[id->pps_id].valid) {
+		return;
+	}
+
+	pps = &decoder->pps[id->pps_id];
+	sps = &decoder->sps[pps->seq_parameter_set_id];
+
+	if (sps->separate_colour_plane_flag) {
+		bitstream_read_u(reader, 2);
+	}
+
+	id->frame_num = bitstream_read_u(reader,
+					 sps->log2_max_frame_num_minus4 + 4);
+
+	if (!sps->frame_mbs_only_flag) {
+		id->field_pic_flag = bitstream_read_u(reader, 1);
+
+		if (id->field_pic_flag) {
+			id->bottom_field_flag = bitstream_read_u(reader, 1);
+		}
+	}
+
+	if (id->idr) {
+		id->idr_pic_id = bitstream_read_ue(reader);
+	}
+
+	if (sps->pic_order_cnt_type == 0) {
+		id->pic_order_cnt_lsb = bitstream_read_u(reader,
+				sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
+
+		if (pps->bottom_field_pic_order_in_frame_present_flag &&
+			!id->field_pic_flag)
+		{
+			id->delta_pic_order_cnt_bottom = bitstream_read_se(reader);
+		}
+	}
+
+	if (sps->pic_order_cnt_type == 1 &&
+		!sps->delta_pic_order_always_zero_flag)
+	{
+		id->delta_pic_order_cnt[0] = bitstream_read_se(reader);
+
+		if (pps->bottom_field_pic_order_in_frame_present_flag &&
+			!id->field_pic_flag)
+		{
+			id->delta_pic_order_cnt[1] = bitstream_read_se(reader);
+		}
+	}
+}
+
+/* Slice of id doesn't belong to the picture of prev.  */
+static int new_picture(const picture_id *id, const picture_id *prev)
+{
+	return id->first_mb_in_slice == 0 ||
+		id->pps_id != prev->pps_id ||
+		id->frame_num != prev->frame_num ||
+		id->field_pic_flag != prev->field_pic_flag ||
+		id->bottom_field_flag != prev->bottom_field_flag ||
+		(id->ref_idc != prev->ref_idc &&
+			(id->ref_idc == 0 || prev->ref_idc == 0)) ||
+		id->idr != prev->idr ||
+		(id->idr && id->idr_pic_id != prev->idr_pic_id) ||
+		id->pic_order_cnt_lsb != prev->pic_order_cnt_lsb ||
+		id->delta_pic_order_cnt_bottom != prev->delta_pic_order_cnt_bottom ||
+		id->delta_pic_order_cnt[0] != prev->delta_pic_order_cnt[0] ||
+		id->delta_pic_order_cnt[1] != prev->delta_pic_order_cnt[1];
+}
+
+/*
+ * Whether the current slice NAL is the first slice of a picture, checked
+ * against the previous slice by the rules of 7.4.1.2.4. Slice starting at
+ * the first macroblock begins a picture as well. Reader is returned to the
+ * slice header start.
+ */
+int AU_first_slice(decoder_context *decoder)
+{
+	bitstream_reader *reader = &decoder->reader;
+	picture_id *prev = &decoder->au.id;
+	uint64_t offset = reader->data_offset;
+	uint8_t bit_shift = reader->bit_shift;
+	picture_id id;
+	int first;
+
+	parse_picture_id(decoder, &id);
+
+	reader->data_offset = offset;
+	reader->bit_shift = bit_shift;
+
+	first = decoder->au.slices_nb == 0 || new_picture(&id, prev);
+
+	*prev = id;
+
+	return first;
+}
+
+static int slice_type_rank(uint32_t slice_type)
+{
+	switch (slice_type) {
+	case B:
+		return 2;
+	case P:
+	case SP:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Whether the current slice, that isn't the first one of the picture, is of
+ * a more general type than the slices before it: B > P > I. Slice types may
+ * be mixed within a picture, its reference lists and the hardware are set up
+ * by the most general one. Checked after AU_first_slice().
+ */
+int AU_general_slice(decoder_context *decoder)
+{
+	return slice_type_rank(decoder->au.id.slice_type) >
+		slice_type_rank(decoder->sh.slice_type);
+}
+
+static int trick_skip_picture(decoder_context *decoder, picture_id *id)
+{
+	trick_mode *trick = &decoder->trick;
+
+	switch (trick->mode) {
+	case DECODE_INTRA:
+		return !id->intra;
+	case DECODE_REF_SPACED:
+		if (++trick->refs_nb < trick->interval) {
+			return 1;
+		}
+
+		/*
+		 * A P/B picture may refer to any of the skipped reference
+		 * pictures, only an intra one can be decoded without them.
+		 */
+		if (trick->interval > 1 && !id->intra) {
+			return 1;
+		}
+
+		trick->refs_nb = 0;
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Whether the current slice NAL belongs to a picture that the trick play
+ * mode skips or that is dropped for being late. IDR-only mode and
+ * non-reference pictures in the spaced reference mode are rejected by the
+ * NAL header alone, otherwise decision is made on the first slice of a
+ * picture from the first slice header fields. Reader is returned to the
+ * slice header start.
+ */
+int AU_skip_slice(decoder_context *decoder)
+{
+	bitstream_reader *reader = &decoder->reader;
+	trick_mode *trick = &decoder->trick;
+	uint64_t offset = reader->data_offset;
+	uint8_t bit_shift = reader->bit_shift;
+	picture_id id;
+
+	switch (trick->mode) {
+	case DECODE_ALL:
+		if (decoder->deadline.period == 0) {
+			return 0;
+		}
+		break;
+	case DECODE_IDR:
+		if (!IdrPicFlag) {
+			return 1;
+		}
+		break;
+	case DECODE_REF_SPACED:
+		if (decoder->nal.ref_idc == 0) {
+			return 1;
+		}
+		break;
+	default:
+		break;
+	}
+
+	parse_picture_id(decoder, &id);
+
+	reader->data_offset = offset;
+	reader->bit_shift = bit_shift;
+
+	if (new_picture(&id, &trick->id)) {
+		trick->skip = trick_skip_picture(decoder, &id) ||
+			      decoder_drop_late(decoder, id.ref_idc);
+
+		if (trick->skip && id.ref_idc != 0) {
+			trick->refs_missing = 1;
+		}
+	}
+
+	trick->id = id;
+
+	return trick->skip;
+}
@@ -0,0 +1,915 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "syntax_parse.h"
+
+#include "common.h"
+
+#define EBML_ID_HEADER			0x1A45DFA3
+#define EBML_ID_DOC_TYPE		0x4282
+
+#define MKV_ID_SEGMENT			0x18538067
+#define MKV_ID_SEEK_HEAD		0x114D9B74
+#define MKV_ID_SEEK			0x4DBB
+#define MKV_ID_SEEK_ID			0x53AB
+#define MKV_ID_SEEK_POSITION		0x53AC
+#define MKV_ID_INFO			0x1549A966
+#define MKV_ID_TIMECODE_SCALE		0x2AD7B1
+#define MKV_ID_TRACKS			0x1654AE6B
+#define MKV_ID_TRACK_ENTRY		0xAE
+#define MKV_ID_TRACK_NUMBER		0xD7
+#define MKV_ID_TRACK_TYPE		0x83
+#define MKV_ID_CODEC_ID			0x86
+#define MKV_ID_CODEC_PRIVATE		0x63A2
+#define MKV_ID_DEFAULT_DURATION		0x23E383
+#define MKV_ID_CLUSTER			0x1F43B675
+#define MKV_ID_TIMECODE			0xE7
+#define MKV_ID_SIMPLE_BLOCK		0xA3
+#define MKV_ID_BLOCK_GROUP		0xA0
+#define MKV_ID_BLOCK			0xA1
+#define MKV_ID_REFERENCE_BLOCK		0xFB
+#define MKV_ID_CUES			0x1C53BB6B
+#define MKV_ID_CUE_POINT		0xBB
+#define MKV_ID_CUE_TIME			0xB3
+#define MKV_ID_CUE_TRACK_POSITIONS	0xB7
+#define MKV_ID_CUE_TRACK		0xF7
+#define MKV_ID_CUE_CLUSTER_POSITION	0xF1
+
+#define MKV_TRACK_TYPE_VIDEO		1
+#define MKV_CODEC_AVC			"V_MPEG4/ISO/AVC"
+
+/* Block flags.  */
+#define MKV_BLOCK_KEYFRAME		0x80
+#define MKV_BLOCK_LACING		0x06
+
+/* Size of a live stream's Segment or Cluster, it ends with the next one.  */
+#define EBML_SIZE_UNKNOWN		UINT64_MAX
+
+typedef struct mkv_cue {
+	uint64_t time;
+	uint64_t track;
+	uint64_t cluster;
+} mkv_cue;
+
+/*
+ * Segment state, positions within a segment are relative to its data. Times
+ * are in TimecodeScale units. Cues are of the video track keyframes, made
+ * from the file's Cues or from its clusters if it has none.
+ */
+typedef struct mkv_segment {
+	uint64_t data_start;
+	uint64_t end;
+	uint64_t first_cluster;
+	uint64_t cues_position;
+	uint64_t timecode_scale;
+	uint64_t default_duration;
+	uint64_t cluster_time;
+	uint64_t seek_time;
+
+	uint64_t video_track;
+	unsigned nal_length_size;
+
+	mkv_cue *cues;
+	uint32_t cues_nb;
+	uint32_t cues_max;
+
+	unsigned has_video:1;
+	unsigned has_cues:1;
+	unsigned indexing:1;
+	unsigned seeking:1;
+	unsigned laced_warned:1;
+} mkv_segment;
+
+/*
+ * EBML variable size integer, its length is given by the leading zero bits
+ * of the first byte. IDs are kept with the length marker.
+ */
+static uint64_t read_vint(bitstream_reader *reader, int is_id,
+			  unsigned *length)
+{
+	uint64_t value = bitstream_read_u(reader, 8);
+	unsigned i, len = 1;
+
+	if (value == 0) {
+		SYNTAX_ERR("EBML number is malformed\n");
+	}
+
+	while (!(value & (0x80 >> (len - 1)))) {
+		len++;
+	}
+
+	if (is_id && len > 4) {
+		SYNTAX_ERR("EBML ID is malformed\n");
+	}
+
+	if (!is_id) {
+		value &= (0x80 >> (len - 1)) - 1;
+	}
+
+	for (i = 1; i < len; i++) {
+		value = (value << 8) | bitstream_read_u(reader, 8);
+	}
+
+	if (length != NULL) {
+		*length = len;
+	}
+
+	return value;
+}
+
+static void read_element_header(bitstream_reader *reader,
+				uint32_t *id, uint64_t *size)
+{
+	unsigned len;
+
+	*id = read_vint(reader, 1, NULL);
+	*size = read_vint(reader, 0, &len);
+
+	/* All size bits set is the reserved "unknown" value.  */
+	if (*size == (1ULL << (7 * len)) - 1) {
+		*size = EBML_SIZE_UNKNOWN;
+	}
+
+	SYNTAX_IPRINT("EBML: 0x%X size: 0x%" PRIX64 "\n", *id, *size);
+}
+
+static uint64_t element_end(bitstream_reader *reader, uint32_t id,
+			    uint64_t size)
+{
+	if (size == EBML_SIZE_UNKNOWN) {
+		SYNTAX_ERR("EBML element 0x%X of unknown size\n", id);
+	}
+
+	return reader->data_offset + size;
+}
+
+static uint64_t read_uint(bitstream_reader *reader, uint64_t size)
+{
+	uint64_t value = 0;
+
+	if (size > 8) {
+		SYNTAX_ERR("EBML unsigned integer is malformed\n");
+	}
+
+	while (size--) {
+		value = (value << 8) | bitstream_read_u(reader, 8);
+	}
+
+	return value;
+}
+
+/* Returns 0 if a stream ended before the element at offset.  */
+static int element_wait(bitstream_reader *reader, uint64_t offset)
+{
+	return bitstream_wait(reader, offset + 2) >= offset + 2;
+}
+
+static int is_MKV(bitstream_reader *reader)
+{
+	const uint8_t *data;
+
+	if (bitstream_wait(reader, 4) < 4) {
+		return 0;
+	}
+
+	data = bitstream_data(reader, 0, 4);
+
+	return ((data[0] << 24) | (data[1] << 16) | (data[2] << 8) |
+			data[3]) == EBML_ID_HEADER;
+}
+
+/* Whether the stream is Matroska, it isn't parsed.  */
+int probe_mkv(bitstream_reader *reader)
+{
+	return is_MKV(reader);
+}
+
+static void parse_EBML_header(bitstream_reader *reader, uint64_t end)
+{
+	const uint8_t *data;
+	uint64_t size, child_end;
+	uint32_t id;
+
+	while (reader->data_offset < end) {
+		read_element_header(reader, &id, &size);
+		child_end = element_end(reader, id, size);
+
+		if (id == EBML_ID_DOC_TYPE && size < 32) {
+			data = bitstream_data(reader, reader->data_offset, size);
+
+			SYNTAX_IPRINT("DocType: \"%.*s\"\n", (int) size, data);
+		}
+
+		reader->data_offset = child_end;
+	}
+}
+
+static void parse_info(bitstream_reader *reader, mkv_segment *seg,
+		       uint64_t end)
+{
+	uint64_t size, child_end;
+	uint32_t id;
+
+	while (reader->data_offset < end) {
+		read_element_header(reader, &id, &size);
+		child_end = element_end(reader, id, size);
+
+		if (id == MKV_ID_TIMECODE_SCALE) {
+			seg->timecode_scale = read_uint(reader, size);
+
+			SYNTAX_IPRINT("TimecodeScale = %" PRIu64 "\n",
+				      seg->timecode_scale);
+		}
+
+		reader->data_offset = child_end;
+	}
+
+	if (seg->timecode_scale == 0) {
+		SYNTAX_WARN("TimecodeScale is 0, assuming 1 ms\n");
+		seg->timecode_scale = 1000000;
+	}
+}
+
+static int is_codec_AVC(bitstream_reader *reader, uint64_t offset,
+			uint64_t size)
+{
+	unsigned len = strlen(MKV_CODEC_AVC);
+	const uint8_t *data;
+
+	if (size < len || size > 64) {
+		return 0;
+	}
+
+	data = bitstream_data(reader, offset, size);
+
+	/* String may be padded with zeros.  */
+	return !memcmp(data, MKV_CODEC_AVC, len) &&
+		(size == len || data[len] == 0x00);
+}
+
+/* The first AVC video track is decoded, its avcC is parsed right away.  */
+static void parse_track_entry(decoder_context *decoder, mkv_segment *seg,
+			      uint64_t end)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t number = 0, type = 0, duration = 0;
+	uint64_t private_offset = 0, private_size = 0;
+	uint64_t size, child_end;
+	uint32_t id;
+	int avc = 0;
+
+	while (reader->data_offset < end) {
+		read_element_header(reader, &id, &size);
+		child_end = element_end(reader, id, size);
+
+		switch (id) {
+		case MKV_ID_TRACK_NUMBER:
+			number = read_uint(reader, size);
+			break;
+		case MKV_ID_TRACK_TYPE:
+			type = read_uint(reader, size);
+			break;
+		case MKV_ID_CODEC_ID:
+			avc = is_codec_AVC(reader, reader->data_offset, size);
+			break;
+		case MKV_ID_CODEC_PRIVATE:
+			private_offset = reader->data_offset;
+			private_size = size;
+			break;
+		case MKV_ID_DEFAULT_DURATION:
+			duration = read_uint(reader, size);
+			break;
+		default:
+			break;
+		}
+
+		reader->data_offset = child_end;
+		reader->bit_shift = 0;
+	}
+
+	SYNTAX_IPRINT("Track %" PRIu64 " type %" PRIu64 "%s\n",
+		      number, type, avc ? " AVC" : "");
+
+	if (seg->has_video || type != MKV_TRACK_TYPE_VIDEO || !avc) {
+		return;
+	}
+
+	if (private_size == 0) {
+		SYNTAX_WARN("AVC track %" PRIu64 " has no CodecPrivate\n",
+			    number);
+		return;
+	}
+
+	reader->data_offset = private_offset;
+
+	seg->nal_length_size = parse_avc_config(decoder,
+						private_offset + private_size,
+						1);
+
+	reader->data_offset = end;
+	reader->bit_shift = 0;
+
+	if (seg->nal_length_size == 0) {
+		return;
+	}
+
+	seg->video_track = number;
+	seg->default_duration = duration;
+	seg->has_video = 1;
+}
+
+static void parse_tracks(decoder_context *decoder, mkv_segment *seg,
+			 uint64_t end)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t size, entry_end;
+	uint32_t id;
+
+	while (reader->data_offset < end) {
+		read_element_header(reader, &id, &size);
+		entry_end = element_end(reader, id, size);
+
+		if (id == MKV_ID_TRACK_ENTRY) {
+			parse_track_entry(decoder, seg, entry_end);
+		}
+
+		reader->data_offset = entry_end;
+		reader->bit_shift = 0;
+	}
+}
+
+/* SeekHead tells where Cues are if they are behind the clusters.  */
+static void parse_seek_head(bitstream_reader *reader, mkv_segment *seg,
+			    uint64_t end)
+{
+	uint64_t size, child_end, seek_end, seek_id, position;
+	uint32_t id;
+
+	while (reader->data_offset < end) {
+		read_element_header(reader, &id, &size);
+		seek_end = element_end(reader, id, size);
+
+		if (id != MKV_ID_SEEK) {
+			reader->data_offset = seek_end;
+			continue;
+		}
+
+		seek_id = 0;
+		position = 0;
+
+		while (reader->data_offset < seek_end) {
+			read_element_header(reader, &id, &size);
+			child_end = element_end(reader, id, size);
+
+			if (id == MKV_ID_SEEK_ID) {
+				seek_id = read_uint(reader, size);
+			} else if (id == MKV_ID_SEEK_POSITION) {
+				position = read_uint(reader, size);
+			}
+
+			reader->data_offset = child_end;
+		}
+
+		if (seek_id == MKV_ID_CUES) {
+			seg->cues_position = seg->data_start + position;
+		}
+	}
+}
+
+static void add_cue(mkv_segment *seg, uint64_t time, uint64_t track,
+		    uint64_t cluster)
+{
+	if (seg->cues_nb == seg->cues_max) {
+		seg->cues_max = seg->cues_max ? seg->cues_max * 2 : 256;
+		seg->cues = realloc(seg->cues,
+				    seg->cues_max * sizeof(*seg->cues));
+		if (seg->cues == NULL) {
+			perror("Failed to grow Matroska cues");
+			abort();
+		}
+	}
+
+	seg->cues[seg->cues_nb].time = time;
+	seg->cues[seg->cues_nb].track = track;
+	seg->cues[seg->cues_nb].cluster = cluster;
+	seg->cues_nb++;
+}
+
+static void parse_cue_point(bitstream_reader *reader, mkv_segment *seg,
+			    uint64_t end)
+{
+	uint64_t size, child_end, positions_end, time = 0, track, cluster;
+	uint32_t id;
+
+	while (reader->data_offset < end) {
+		read_element_header(reader, &id, &size);
+		positions_end = element_end(reader, id, size);
+
+		if (id == MKV_ID_CUE_TIME) {
+			time = read_uint(reader, size);
+		}
+
+		if (id != MKV_ID_CUE_TRACK_POSITIONS) {
+			reader->data_offset = positions_end;
+			continue;
+		}
+
+		track = 0;
+		cluster = 0;
+
+		while (reader->data_offset < positions_end) {
+			read_element_header(reader, &id, &size);
+			child_end = element_end(reader, id, size);
+
+			if (id == MKV_ID_CUE_TRACK) {
+				track = read_uint(reader, size);
+			} else if (id == MKV_ID_CUE_CLUSTER_POSITION) {
+				cluster = read_uint(reader, size);
+			}
+
+			reader->data_offset = child_end;
+		}
+
+		add_cue(seg, time, track, seg->data_start + cluster);
+	}
+}
+
+static void parse_cues(bitstream_reader *reader, mkv_segment *seg,
+		       uint64_t end)
+{
+	uint64_t size, point_end;
+	uint32_t id;
+
+	while (reader->data_offset < end) {
+		read_element_header(reader, &id, &size);
+		point_end = element_end(reader, id, size);
+
+		if (id == MKV_ID_CUE_POINT) {
+			parse_cue_point(reader, seg, point_end);
+		}
+
+		reader->data_offset = point_end;
+	}
+
+	seg->has_cues = 1;
+
+	SYNTAX_IPRINT("Cues: %u\n", seg->cues_nb);
+}
+
+/*
+ * Block of the video track is an access unit of NALs prefixed by their size,
+ * blocks of other tracks are skipped. Cue is added for a keyframe instead if
+ * the clusters are indexed.
+ */
+static void parse_block(decoder_context *decoder, mkv_segment *seg,
+			uint64_t cluster, uint64_t end, int simple,
+			int keyframe)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t track, offset;
+	int64_t time;
+	int16_t timecode;
+	unsigned flags;
+
+	track = read_vint(reader, 0, NULL);
+
+	if (track != seg->video_track) {
+		return;
+	}
+
+	timecode = bitstream_read_u(reader, 16);
+	flags = bitstream_read_u(reader, 8);
+
+	if (simple) {
+		keyframe = !!(flags & MKV_BLOCK_KEYFRAME);
+	}
+
+	time = (int64_t) seg->cluster_time + timecode;
+
+	if (time < 0) {
+		time = 0;
+	}
+
+	/* Video isn't laced in practice, frames of a lace aren't split.  */
+	if (flags & MKV_BLOCK_LACING) {
+		if (!seg->laced_warned) {
+			SYNTAX_WARN("Laced video blocks are unsupported, "
+				    "skipped\n");
+			seg->laced_warned = 1;
+		}
+		return;
+	}
+
+	if (seg->indexing) {
+		if (keyframe) {
+			add_cue(seg, time, track, cluster);
+		}
+		return;
+	}
+
+	if (seg->seeking) {
+		if (!keyframe || time < seg->seek_time) {
+			return;
+		}
+
+		/* Keyframe may be a non-IDR I picture, see decoder_seek_done().  */
+		SYNTAX_IPRINT("Seek to block of time %" PRId64 "\n", time);
+
+		seg->seeking = 0;
+		decoder_seek_done(decoder);
+	}
+
+	offset = reader->data_offset;
+
+	decoder->pts = (double) time * seg->timecode_scale * 90000 /
+			1000000000;
+	decoder->dts = TIMESTAMP_NONE;
+
+	parse_avc_sample(decoder, offset, end - offset, seg->nal_length_size);
+}
+
+/* Block of a BlockGroup is a keyframe if it references no other block.  */
+static void parse_block_group(decoder_context *decoder, mkv_segment *seg,
+			      uint64_t cluster, uint64_t end)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t size, child_end, block = 0, block_end = 0;
+	int keyframe = 1;
+	uint32_t id;
+
+	while (reader->data_offset < end) {
+		read_element_header(reader, &id, &size);
+		child_end = element_end(reader, id, size);
+
+		if (id == MKV_ID_BLOCK) {
+			block = reader->data_offset;
+			block_end = child_end;
+		} else if (id == MKV_ID_REFERENCE_BLOCK) {
+			keyframe = 0;
+		}
+
+		reader->data_offset = child_end;
+		reader->bit_shift = 0;
+	}
+
+	if (block != 0) {
+		reader->data_offset = block;
+
+		parse_block(decoder, seg, cluster, block_end, 0, keyframe);
+	}
+}
+
+/*
+ * Cluster of unknown size ends with the next top level element, those are
+ * the only ones with 4 bytes IDs.
+ */
+static void parse_cluster(decoder_context *decoder, mkv_segment *seg,
+			  uint64_t cluster, uint64_t size)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t end = reader->data_offset + size;
+	uint64_t child, child_end;
+	uint32_t id;
+
+	if (size == EBML_SIZE_UNKNOWN) {
+		end = seg->end;
+	}
+
+	seg->cluster_time = 0;
+
+	while (reader->data_offset < end) {
+		child = reader->data_offset;
+
+		bitstream_release(reader, child);
+
+		if (!element_wait(reader, child)) {
+			break;
+		}
+
+		read_element_header(reader, &id, &size);
+
+		if (id > 0xFFFFFF) {
+			reader->data_offset = child;
+			break;
+		}
+
+		child_end = element_end(reader, id, size);
+
+		switch (id) {
+		case MKV_ID_TIMECODE:
+			seg->cluster_time = read_uint(reader, size);
+			break;
+		case MKV_ID_SIMPLE_BLOCK:
+			parse_block(decoder, seg, cluster, child_end, 1, 0);
+			break;
+		case MKV_ID_BLOCK_GROUP:
+			parse_block_group(decoder, seg, cluster, child_end);
+			break;
+		default:
+			break;
+		}
+
+		reader->data_offset = child_end;
+		reader->bit_shift = 0;
+	}
+}
+
+/*
+ * Top level elements of a file's segment are looked up for the tracks and
+ * cues wherever they are, up to the first element of unknown size.
+ */
+static void parse_segment_of_file(decoder_context *decoder, mkv_segment *seg)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t offset = reader->data_offset;
+	uint64_t size, end;
+	uint32_t id;
+
+	while (reader->data_offset + 2 <= seg->end) {
+		read_element_header(reader, &id, &size);
+
+		if (size == EBML_SIZE_UNKNOWN) {
+			if (id == MKV_ID_CLUSTER && seg->first_cluster == 0) {
+				seg->first_cluster = reader->data_offset;
+			}
+			break;
+		}
+
+		end = reader->data_offset + size;
+
+		switch (id) {
+		case MKV_ID_INFO:
+			parse_info(reader, seg, end);
+			break;
+		case MKV_ID_TRACKS:
+			if (!seg->has_video) {
+				parse_tracks(decoder, seg, end);
+			}
+			break;
+		case MKV_ID_SEEK_HEAD:
+			parse_seek_head(reader, seg, end);
+			break;
+		case MKV_ID_CUES:
+			if (!seg->has_cues) {
+				parse_cues(reader, seg, end);
+			}
+			break;
+		case MKV_ID_CLUSTER:
+			if (seg->first_cluster == 0) {
+				seg->first_cluster = end - size;
+			}
+			break;
+		default:
+			break;
+		}
+
+		reader->data_offset = end;
+		reader->bit_shift = 0;
+	}
+
+	/* Cues behind a cluster of unknown size are found by SeekHead.  */
+	if (!seg->has_cues && seg->cues_position != 0 &&
+			seg->cues_position + 2 <= seg->end) {
+		reader->data_offset = seg->cues_position;
+		reader->bit_shift = 0;
+
+		read_element_header(reader, &id, &size);
+
+		if (id == MKV_ID_CUES && size != EBML_SIZE_UNKNOWN) {
+			parse_cues(reader, seg, reader->data_offset + size);
+		}
+	}
+
+	reader->data_offset = offset;
+	reader->bit_shift = 0;
+}
+
+/* Keyframes of the clusters are the cues of a file without Cues.  */
+static void index_clusters(decoder_context *decoder, mkv_segment *seg)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t offset = reader->data_offset;
+	uint64_t cluster, size;
+	uint32_t id;
+
+	seg->indexing = 1;
+
+	reader->data_offset = seg->first_cluster;
+	reader->bit_shift = 0;
+
+	while (reader->data_offset + 2 <= seg->end) {
+		cluster = reader->data_offset;
+
+		read_element_header(reader, &id, &size);
+
+		if (id == MKV_ID_CLUSTER) {
+			parse_cluster(decoder, seg, cluster, size);
+		} else {
+			reader->data_offset = element_end(reader, id, size);
+		}
+
+		reader->bit_shift = 0;
+	}
+
+	seg->indexing = 0;
+
+	reader->data_offset = offset;
+	reader->bit_shift = 0;
+
+	SYNTAX_IPRINT("Indexed keyframes: %u\n", seg->cues_nb);
+}
+
+/*
+ * Start from the cluster of the last video cue at or before the target, its
+ * blocks are skipped up to the keyframe of the cue.
+ */
+static void seek_segment(decoder_context *decoder, mkv_segment *seg)
+{
+	bitstream_reader *reader = &decoder->reader;
+	seek_target *seek = &decoder->seek;
+	mkv_cue *cue = NULL;
+	uint64_t time;
+	uint32_t i;
+
+	if (seek->unit == SEEK_TIME) {
+		time = seek->target / seg->timecode_scale;
+	} else if (seg->default_duration != 0) {
+		time = (double) seek->target * seg->default_duration /
+				seg->timecode_scale;
+	} else {
+		SYNTAX_WARN("Video track has no DefaultDuration, "
+			    "decoding from the start\n");
+		decoder_seek_done(decoder);
+		return;
+	}
+
+	if (!seg->has_cues) {
+		index_clusters(decoder, seg);
+	}
+
+	for (i = 0; i < seg->cues_nb; i++) {
+		if (seg->cues[i].track != seg->video_track ||
+				seg->cues[i].time > time) {
+			continue;
+		}
+
+		if (cue == NULL || seg->cues[i].time >= cue->time) {
+			cue = &seg->cues[i];
+		}
+	}
+
+	seg->seeking = 1;
+	seg->seek_time = 0;
+
+	if (cue != NULL) {
+		SYNTAX_IPRINT("Seek to cue of time %" PRIu64 " at 0x%" PRIX64
+			      "\n", cue->time, cue->cluster);
+
+		seg->seek_time = cue->time;
+
+		reader->data_offset = cue->cluster;
+		reader->bit_shift = 0;
+	}
+}
+
+static void parse_segment(decoder_context *decoder, uint64_t size)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t element, end;
+	mkv_segment seg;
+	uint32_t id;
+
+	bzero(&seg, sizeof(seg));
+
+	seg.data_start = reader->data_offset;
+	seg.end = reader->bitstream_end;
+	seg.timecode_scale = 1000000;
+
+	if (size != EBML_SIZE_UNKNOWN) {
+		seg.end = min(seg.end, seg.data_start + size);
+	}
+
+	if (reader->ring == NULL) {
+		parse_segment_of_file(decoder, &seg);
+
+		if (seg.has_video && decoder->seek.unit != SEEK_NONE) {
+			seek_segment(decoder, &seg);
+		}
+	}
+
+	if (decoder->seek.unit != SEEK_NONE && !seg.seeking) {
+		SYNTAX_WARN("Streamed Matroska can't be seeked, "
+			    "decoding from the start\n");
+		decoder_seek_done(decoder);
+	}
+
+	/* Streamed elements are parsed as they arrive.  */
+	while (reader->data_offset < seg.end && !reader->error) {
+		element = reader->data_offset;
+
+		bitstream_release(reader, element);
+
+		if (!element_wait(reader, element)) {
+			break;
+		}
+
+		read_element_header(reader, &id, &size);
+
+		if (id == MKV_ID_CLUSTER) {
+			parse_cluster(decoder, &seg, element, size);
+			continue;
+		}
+
+		/* Next segment of a chained stream.  */
+		if (id == MKV_ID_SEGMENT || id == EBML_ID_HEADER) {
+			reader->data_offset = element;
+			break;
+		}
+
+		end = element_end(reader, id, size);
+
+		switch (id) {
+		case MKV_ID_INFO:
+			parse_info(reader, &seg, end);
+			break;
+		case MKV_ID_TRACKS:
+			if (!seg.has_video) {
+				parse_tracks(decoder, &seg, end);
+			}
+			break;
+		default:
+			break;
+		}
+
+		reader->data_offset = end;
+		reader->bit_shift = 0;
+	}
+
+	free(seg.cues);
+}
+
+int parse_mkv(decoder_context *decoder)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t element, size;
+	uint32_t id;
+
+	if (!is_MKV(reader)) {
+		return 0;
+	}
+
+	SYNTAX_IPRINT("Matroska header identified\n");
+
+	reader->data_offset = 0;
+	reader->bit_shift = 0;
+
+	while (!reader->error) {
+		element = reader->data_offset;
+
+		bitstream_release(reader, element);
+
+		if (!element_wait(reader, element)) {
+			break;
+		}
+
+		read_element_header(reader, &id, &size);
+
+		switch (id) {
+		case EBML_ID_HEADER:
+			parse_EBML_header(reader,
+					  element_end(reader, id, size));
+			break;
+		case MKV_ID_SEGMENT:
+			parse_segment(decoder, size);
+			break;
+		default:
+			reader->data_offset = element_end(reader, id, size);
+			break;
+		}
+
+		reader->bit_shift = 0;
+
+		/* Segment that extends to the stream end.  */
+		if (reader->data_offset >= reader->bitstream_end) {
+			break;
+		}
+	}
+
+	decoder_flush(decoder);
+
+	return 1;
+}
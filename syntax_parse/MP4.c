@@ -18,6 +18,7 @@
 #include "syntax_parse.h"
 
 #include "common.h"
+#include "mp4.h"
 
 #define FOURCC(a, b, c, d)	(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
 
@@ -27,17 +28,37 @@
 	((v) >> 8) & 0xFF,	\
 	(v) & 0xFF		\
 
+/* VisualSampleEntry fields in front of its child atoms.  */
+#define VISUAL_SAMPLE_ENTRY_SIZE	78
+
 static void read_atom_header(bitstream_reader *reader,
 			     int64_t *size, uint32_t *type)
 {
+	uint64_t start = reader->data_offset;
+
 	*size = bitstream_read_u(reader, 32);
 	*type = bitstream_read_u(reader, 32);
 
-	SYNTAX_IPRINT("ATOM: \"%c%c%c%c\" size: 0x%X\n",
-		      U32C(*type), (uint32_t) *size);
+	/* 64-bit "largesize" follows the type, used by >4GB mdat's.  */
+	if (*size == 1) {
+		*size = (int64_t) bitstream_read_u(reader, 32) << 32;
+		*size |= bitstream_read_u(reader, 32);
+		*size -= 8;
+	}
+
+	/* Size 0 is of the last atom, it extends to the stream end.  */
+	if (*size == 0) {
+		*size = reader->bitstream_end - start;
+	}
+
+	SYNTAX_IPRINT("ATOM: \"%c%c%c%c\" size: 0x%" PRIX64 "\n",
+		      U32C(*type), *size);
 
 	*size -= 8;
-	assert(*size >= 0);
+
+	if (*size < 0) {
+		SYNTAX_ERR("Atom \"%c%c%c%c\" is malformed\n", U32C(*type));
+	}
 }
 
 static int is_MP4(bitstream_reader *reader)
@@ -73,58 +94,1426 @@ static int is_MP4(bitstream_reader *reader)
 	return 1;
 }
 
-int parse_mp4(decoder_context *decoder)
+static void * mp4_alloc(uint64_t nb, size_t size)
+{
+	void *ptr = calloc(nb ? nb : 1, size);
+
+	if (ptr == NULL) {
+		perror("Failed to allocate MP4 sample table");
+		abort();
+	}
+
+	return ptr;
+}
+
+static void mp4_track_free(mp4_track *track)
+{
+	free(track->sample_offset);
+	free(track->sample_size);
+	free(track->sample_dts);
+	free(track->sample_cts);
+	free(track->sync_samples);
+	free(track->chunk_offset);
+	free(track->stsc);
+	free(track->stts);
+	free(track->ctts);
+}
+
+void mp4_free(mp4_movie *movie)
+{
+	if (movie == NULL) {
+		return;
+	}
+
+	mp4_track_free(&movie->video);
+	mp4_track_free(&movie->fragment);
+	free(movie->trex);
+	free(movie);
+}
+
+/*
+ * Parse the NAL of the given size at offset, reader is returned to where it
+ * was. NAL is parsed in place, it doesn't have a start code. Malformed NAL is
+ * skipped.
+ */
+static void mp4_parse_NAL(decoder_context *decoder, uint64_t offset,
+			  uint32_t size)
 {
 	bitstream_reader *reader = &decoder->reader;
-	uint32_t type;
-	int64_t size;
+	uint64_t orig_offset = reader->data_offset;
+	uint64_t orig_end = reader->bitstream_end;
+	int ret;
 
-	if (!is_MP4(reader)) {
-		reader->bit_shift = reader->data_offset = 0;
+	if (size == 0) {
+		return;
+	}
+
+	reader->data_offset = offset;
+	reader->bit_shift = 0;
+	reader->bitstream_end = offset + size;
+	reader->NAL_end = reader->bitstream_end;
+
+	SYNTAX_IPRINT("+++++++++++++++\n");
+	SYNTAX_IPRINT("NAL size 0x%X\n", size);
+
+	ret = try_parse_NAL(decoder);
+
+	SYNTAX_IPRINT("---------------\n\n");
+
+	/*
+	 * Stream ends within the NAL, otherwise NAL that is shorter than its
+	 * size is malformed.
+	 */
+	if (ret == BITSTREAM_END_REACHED && offset + size > reader->file_size) {
+		bitstream_bail(reader, ret);
+	}
+
+	if (ret != 0) {
+		SYNTAX_WARN("Malformed NAL is skipped\n");
+	}
+
+	reader->data_offset = orig_offset;
+	reader->bitstream_end = orig_end;
+	reader->bit_shift = 0;
+}
+
+static uint32_t read_full_atom(bitstream_reader *reader)
+{
+	uint32_t version = bitstream_read_u(reader, 8);
+
+	bitstream_read_u(reader, 24);
+
+	return version;
+}
+
+static void parse_tkhd(bitstream_reader *reader, mp4_track *track)
+{
+	uint32_t version = read_full_atom(reader);
+
+	/* creation_time and modification_time.  */
+	bitstream_reader_inc_offset(reader, version == 1 ? 16 : 8);
+
+	track->track_id = bitstream_read_u(reader, 32);
+
+	SYNTAX_IPRINT("track_ID = %u\n", track->track_id);
+}
+
+static void parse_mdhd(bitstream_reader *reader, mp4_track *track)
+{
+	uint32_t version = read_full_atom(reader);
+
+	bitstream_reader_inc_offset(reader, version == 1 ? 16 : 8);
+
+	track->timescale = bitstream_read_u(reader, 32);
+
+	SYNTAX_IPRINT("timescale = %u\n", track->timescale);
+}
+
+static void parse_hdlr(bitstream_reader *reader, mp4_track *track)
+{
+	read_full_atom(reader);
+
+	/* pre_defined.  */
+	bitstream_read_u(reader, 32);
+
+	track->handler = bitstream_read_u(reader, 32);
+
+	SYNTAX_IPRINT("handler_type = \"%c%c%c%c\"\n", U32C(track->handler));
+}
+
+/*
+ * AVCDecoderConfigurationRecord that ends at end, Matroska's CodecPrivate of
+ * AVC is the same. Parameter sets are parsed right away if parse_sets is set.
+ * Returns size of the NALs length prefix, 0 if record is unsupported.
+ */
+unsigned parse_avc_config(decoder_context *decoder, uint64_t end,
+			  int parse_sets)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint32_t version, sets_nb, size;
+	unsigned nal_length_size;
+	uint64_t offset;
+	int pps;
+
+	version = bitstream_read_u(reader, 8);
+
+	/* AVCProfileIndication, profile_compatibility, AVCLevelIndication.  */
+	bitstream_read_u(reader, 24);
+
+	nal_length_size = (bitstream_read_u(reader, 8) & 3) + 1;
+
+	SYNTAX_IPRINT("configurationVersion = %u\n", version);
+	SYNTAX_IPRINT("lengthSizeMinusOne = %u\n", nal_length_size - 1);
+
+	if (version != 1) {
+		SYNTAX_WARN("avcC version %u is unsupported\n", version);
 		return 0;
 	}
 
-	while (!reader->error) {
+	for (pps = 0; pps < 2 && parse_sets; pps++) {
+		sets_nb = bitstream_read_u(reader, 8);
+
+		if (!pps) {
+			sets_nb &= 0x1F;
+		}
+
+		while (sets_nb--) {
+			size = bitstream_read_u(reader, 16);
+			offset = reader->data_offset;
+
+			if (offset + size > end) {
+				SYNTAX_WARN("avcC parameter set is truncated\n");
+				return nal_length_size;
+			}
+
+			mp4_parse_NAL(decoder, offset, size);
+
+			reader->data_offset = offset + size;
+		}
+	}
+
+	return nal_length_size;
+}
+
+/* Parameter sets are parsed if the track is going to be decoded.  */
+static void parse_avcC(decoder_context *decoder, mp4_movie *movie,
+		       mp4_track *track, uint64_t end)
+{
+	track->nal_length_size = parse_avc_config(decoder, end,
+						  !movie->has_video);
+	track->has_avcC = (track->nal_length_size != 0);
+}
+
+static void parse_stsd(decoder_context *decoder, mp4_movie *movie,
+		       mp4_track *track, uint64_t end)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t entry_end, atom_end;
+	uint32_t entries_nb, type;
+	int64_t size;
+
+	read_full_atom(reader);
+
+	entries_nb = bitstream_read_u(reader, 32);
+
+	while (entries_nb-- && reader->data_offset + 8 <= end) {
 		read_atom_header(reader, &size, &type);
+		entry_end = reader->data_offset + size;
 
-		switch (type) {
-		case FOURCC('m', 'd', 'a', 't'):
-		{
-			uint32_t orig_end = reader->bitstream_end;
+		if (type != FOURCC('a', 'v', 'c', '1') &&
+		    type != FOURCC('a', 'v', 'c', '3')) {
+			reader->data_offset = entry_end;
+			continue;
+		}
+
+		bitstream_reader_inc_offset(reader, VISUAL_SAMPLE_ENTRY_SIZE);
 
-			do {
-				uint32_t NAL_size = bitstream_read_u(reader, 32);
-				uint32_t prev_offt = reader->data_offset;
+		while (reader->data_offset + 8 <= entry_end) {
+			read_atom_header(reader, &size, &type);
+			atom_end = reader->data_offset + size;
 
-				reader->bitstream_end = prev_offt + NAL_size;
+			if (type == FOURCC('a', 'v', 'c', 'C') &&
+			    !track->has_avcC) {
+				parse_avcC(decoder, movie, track, atom_end);
+			}
 
-				SYNTAX_IPRINT("+++++++++++++++\n");
-				SYNTAX_IPRINT("NAL size 0x%X\n", NAL_size);
+			reader->data_offset = atom_end;
+			reader->bit_shift = 0;
+		}
 
-				parse_NAL(decoder);
+		reader->data_offset = entry_end;
+	}
+}
 
-				SYNTAX_IPRINT("---------------\n\n");
+static void parse_stsz(bitstream_reader *reader, mp4_track *track)
+{
+	uint32_t sample_size, i;
 
-				reader->data_offset = prev_offt + NAL_size;
-				reader->bitstream_end += 4;
-				reader->bit_shift = 0;
+	read_full_atom(reader);
 
-				size -= NAL_size + 4;
-			} while (size > 0);
+	sample_size = bitstream_read_u(reader, 32);
+	track->samples_nb = bitstream_read_u(reader, 32);
+	track->sample_size = mp4_alloc(track->samples_nb, sizeof(uint32_t));
 
-			reader->bitstream_end = orig_end;
-			break;
+	for (i = 0; i < track->samples_nb; i++) {
+		track->sample_size[i] = sample_size ? sample_size :
+					bitstream_read_u(reader, 32);
+	}
+
+	SYNTAX_IPRINT("sample_count = %u\n", track->samples_nb);
+}
+
+static void parse_stco(bitstream_reader *reader, mp4_track *track, int co64)
+{
+	uint32_t i;
+
+	read_full_atom(reader);
+
+	track->chunks_nb = bitstream_read_u(reader, 32);
+	track->chunk_offset = mp4_alloc(track->chunks_nb, sizeof(uint64_t));
+
+	for (i = 0; i < track->chunks_nb; i++) {
+		if (co64) {
+			track->chunk_offset[i] =
+				(uint64_t) bitstream_read_u(reader, 32) << 32;
+		}
+
+		track->chunk_offset[i] |= bitstream_read_u(reader, 32);
+	}
+}
+
+static void parse_stsc(bitstream_reader *reader, mp4_track *track)
+{
+	uint32_t i;
+
+	read_full_atom(reader);
+
+	track->stsc_nb = bitstream_read_u(reader, 32);
+	track->stsc = mp4_alloc(track->stsc_nb, 2 * sizeof(uint32_t));
+
+	for (i = 0; i < track->stsc_nb; i++) {
+		track->stsc[i * 2 + 0] = bitstream_read_u(reader, 32);
+		track->stsc[i * 2 + 1] = bitstream_read_u(reader, 32);
+
+		/* sample_description_index.  */
+		bitstream_read_u(reader, 32);
+	}
+}
+
+static void parse_stss(bitstream_reader *reader, mp4_track *track)
+{
+	uint32_t i;
+
+	read_full_atom(reader);
+
+	track->sync_nb = bitstream_read_u(reader, 32);
+	track->sync_samples = mp4_alloc(track->sync_nb, sizeof(uint32_t));
+	track->has_stss = 1;
+
+	for (i = 0; i < track->sync_nb; i++) {
+		track->sync_samples[i] = bitstream_read_u(reader, 32);
+	}
+}
+
+/*
+ * stts and ctts are run-length coded pairs of sample count and time, the runs
+ * are kept as they are until the count of samples is known from stsz. Only
+ * the first table of each kind is taken.
+ */
+static void parse_time_runs(bitstream_reader *reader, mp4_track *track,
+			    uint64_t end, int ctts)
+{
+	uint32_t runs_nb, max_nb, *runs, i;
+
+	if ((ctts ? track->ctts : track->stts) != NULL) {
+		SYNTAX_WARN("Track has more than one %s, ignored\n",
+			    ctts ? "ctts" : "stts");
+		return;
+	}
+
+	read_full_atom(reader);
+
+	runs_nb = bitstream_read_u(reader, 32);
+	max_nb = reader->data_offset < end ?
+			(end - reader->data_offset) / 8 : 0;
+
+	if (runs_nb > max_nb) {
+		SYNTAX_WARN("%s is truncated, %u runs don't fit the atom\n",
+			    ctts ? "ctts" : "stts", runs_nb);
+		runs_nb = max_nb;
+	}
+
+	runs = mp4_alloc(runs_nb, 2 * sizeof(uint32_t));
+
+	for (i = 0; i < runs_nb; i++) {
+		runs[i * 2 + 0] = bitstream_read_u(reader, 32);
+		runs[i * 2 + 1] = bitstream_read_u(reader, 32);
+	}
+
+	if (ctts) {
+		track->ctts = runs;
+		track->ctts_nb = runs_nb;
+	} else {
+		track->stts = runs;
+		track->stts_nb = runs_nb;
+	}
+}
+
+/*
+ * Count of samples the time runs cover, 0 if they cover more samples than
+ * the track has and so are malformed.
+ */
+static uint32_t time_runs_samples(mp4_track *track, const uint32_t *runs,
+				  uint32_t runs_nb, const char *name)
+{
+	uint64_t samples_nb = 0;
+	uint32_t i;
+
+	for (i = 0; i < runs_nb; i++) {
+		samples_nb += runs[i * 2 + 0];
+	}
+
+	if (samples_nb > track->samples_nb) {
+		SYNTAX_WARN("%s covers %" PRIu64 " samples of %u, ignored\n",
+			    name, samples_nb, track->samples_nb);
+		return 0;
+	}
+
+	return samples_nb;
+}
+
+/*
+ * Expand the time runs into the samples times. Samples that the time tables
+ * don't cover get the time of the last one and no composition offset.
+ */
+static void complete_sample_times(mp4_track *track)
+{
+	uint64_t *dts = mp4_alloc(track->samples_nb, sizeof(uint64_t));
+	int32_t *cts = mp4_alloc(track->samples_nb, sizeof(int32_t));
+	uint32_t dts_nb, cts_nb, count, i, s;
+	uint64_t time = 0;
+
+	dts_nb = time_runs_samples(track, track->stts, track->stts_nb, "stts");
+	cts_nb = time_runs_samples(track, track->ctts, track->ctts_nb, "ctts");
+
+	for (i = 0, s = 0; s < dts_nb; i++) {
+		for (count = track->stts[i * 2 + 0]; count; count--, s++) {
+			dts[s] = time;
+			time += track->stts[i * 2 + 1];
+		}
+	}
+
+	for (; s < track->samples_nb; s++) {
+		if (s > 0) {
+			dts[s] = dts[s - 1];
+		}
+	}
+
+	for (i = 0, s = 0; s < cts_nb; i++) {
+		for (count = track->ctts[i * 2 + 0]; count; count--, s++) {
+			cts[s] = track->ctts[i * 2 + 1];
+		}
+	}
+
+	free(track->stts);
+	free(track->ctts);
+
+	track->stts = NULL;
+	track->ctts = NULL;
+	track->sample_dts = dts;
+	track->sample_cts = cts;
+}
+
+/*
+ * Sample tables have to tell where every sample is, a track of a fragmented
+ * movie may have none as its samples are in the fragments. Sync samples,
+ * numbered from 1 by stss, are made 0-based. Returns 0 if the tables are
+ * malformed.
+ */
+static int check_sample_tables(mp4_track *track)
+{
+	uint32_t i;
+
+	for (i = 0; i < track->sync_nb; i++) {
+		if (track->sync_samples[i] == 0) {
+			SYNTAX_WARN("stss entry %u is malformed, sample is 0\n",
+				    i);
+			return 0;
+		}
+
+		track->sync_samples[i]--;
+	}
+
+	if (track->sample_size == NULL && track->chunk_offset == NULL &&
+			track->stsc_nb == 0) {
+		track->sample_size = mp4_alloc(0, sizeof(uint32_t));
+		return 1;
+	}
+
+	if (track->sample_size == NULL) {
+		SYNTAX_WARN("Video track has no stsz\n");
+		return 0;
+	}
+
+	if (track->chunk_offset == NULL) {
+		SYNTAX_WARN("Video track has no stco or co64\n");
+		return 0;
+	}
+
+	for (i = 0; i < track->stsc_nb; i++) {
+		if (track->stsc[i * 2 + 0] == 0) {
+			SYNTAX_WARN("stsc entry %u is malformed, first chunk "
+				    "is 0\n", i);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Expand the stsc runs of chunks into the samples offsets. Samples of a chunk
+ * follow each other.
+ */
+static void build_sample_offsets(mp4_track *track)
+{
+	uint32_t first, next, per_chunk, chunk;
+	uint32_t i, j, s = 0;
+	uint64_t offset;
+
+	track->sample_offset = mp4_alloc(track->samples_nb, sizeof(uint64_t));
+
+	for (i = 0; i < track->stsc_nb; i++) {
+		first = track->stsc[i * 2 + 0];
+		per_chunk = track->stsc[i * 2 + 1];
+		next = (i + 1 < track->stsc_nb) ? track->stsc[i * 2 + 2] :
+						  track->chunks_nb + 1;
+
+		for (chunk = first; chunk < next && chunk <= track->chunks_nb;
+				chunk++) {
+			offset = track->chunk_offset[chunk - 1];
+
+			for (j = 0; j < per_chunk && s < track->samples_nb;
+					j++, s++) {
+				track->sample_offset[s] = offset;
+				offset += track->sample_size[s];
+			}
+		}
+	}
+
+	if (s < track->samples_nb) {
+		SYNTAX_WARN("Chunks cover %u of %u samples\n",
+			    s, track->samples_nb);
+		track->samples_nb = s;
+	}
+
+	free(track->chunk_offset);
+	free(track->stsc);
+
+	track->chunk_offset = NULL;
+	track->stsc = NULL;
+}
+
+static void parse_trex(bitstream_reader *reader, mp4_movie *movie)
+{
+	mp4_trex *trex;
+
+	movie->trex = realloc(movie->trex,
+			      (movie->trex_nb + 1) * sizeof(*movie->trex));
+	if (movie->trex == NULL) {
+		perror("Failed to allocate MP4 track defaults");
+		abort();
+	}
+
+	trex = &movie->trex[movie->trex_nb++];
+
+	read_full_atom(reader);
+
+	trex->track_id = bitstream_read_u(reader, 32);
+
+	/* default_sample_description_index.  */
+	bitstream_read_u(reader, 32);
+
+	trex->default_duration = bitstream_read_u(reader, 32);
+	trex->default_size = bitstream_read_u(reader, 32);
+	trex->default_flags = bitstream_read_u(reader, 32);
+
+	SYNTAX_IPRINT("trex: track_ID %u, duration %u, size %u, flags 0x%X\n",
+		      trex->track_id, trex->default_duration,
+		      trex->default_size, trex->default_flags);
+}
+
+static void parse_atoms(decoder_context *decoder, mp4_movie *movie,
+			mp4_track *track, uint64_t end);
+
+static void parse_trak(decoder_context *decoder, mp4_movie *movie,
+		       uint64_t end)
+{
+	mp4_track track;
+
+	bzero(&track, sizeof(track));
+
+	parse_atoms(decoder, movie, &track, end);
+
+	if (movie->has_video || !track.has_avcC ||
+			track.handler != FOURCC('v', 'i', 'd', 'e')) {
+		mp4_track_free(&track);
+		return;
+	}
+
+	if (!check_sample_tables(&track)) {
+		mp4_track_free(&track);
+		return;
+	}
+
+	build_sample_offsets(&track);
+
+	complete_sample_times(&track);
+
+	movie->video = track;
+	movie->has_video = 1;
+
+	SYNTAX_IPRINT("Video track %u: %u samples, %u sync samples\n",
+		      track.track_id, track.samples_nb,
+		      track.has_stss ? track.sync_nb : track.samples_nb);
+}
+
+static void parse_atoms(decoder_context *decoder, mp4_movie *movie,
+			mp4_track *track, uint64_t end)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t atom_end;
+	uint32_t type;
+	int64_t size;
+
+	while (reader->data_offset + 8 <= end) {
+		read_atom_header(reader, &size, &type);
+		atom_end = reader->data_offset + size;
+
+		if (atom_end > end) {
+			SYNTAX_ERR("Atom \"%c%c%c%c\" exceeds its parent\n",
+				   U32C(type));
 		}
+
+		switch (type) {
+		case FOURCC('t', 'r', 'a', 'k'):
+			parse_trak(decoder, movie, atom_end);
+			break;
+		case FOURCC('m', 'd', 'i', 'a'):
+		case FOURCC('m', 'i', 'n', 'f'):
+		case FOURCC('s', 't', 'b', 'l'):
+		case FOURCC('m', 'v', 'e', 'x'):
+			parse_atoms(decoder, movie, track, atom_end);
+			break;
+		case FOURCC('t', 'r', 'e', 'x'):
+			parse_trex(reader, movie);
+			break;
 		default:
 			break;
 		}
 
-		assert(size >= 0);
+		if (track != NULL) {
+			switch (type) {
+			case FOURCC('t', 'k', 'h', 'd'):
+				parse_tkhd(reader, track);
+				break;
+			case FOURCC('m', 'd', 'h', 'd'):
+				parse_mdhd(reader, track);
+				break;
+			case FOURCC('h', 'd', 'l', 'r'):
+				parse_hdlr(reader, track);
+				break;
+			case FOURCC('s', 't', 's', 'd'):
+				parse_stsd(decoder, movie, track, atom_end);
+				break;
+			case FOURCC('s', 't', 's', 'z'):
+				parse_stsz(reader, track);
+				break;
+			case FOURCC('s', 't', 'c', 'o'):
+				parse_stco(reader, track, 0);
+				break;
+			case FOURCC('c', 'o', '6', '4'):
+				parse_stco(reader, track, 1);
+				break;
+			case FOURCC('s', 't', 's', 'c'):
+				parse_stsc(reader, track);
+				break;
+			case FOURCC('s', 't', 's', 's'):
+				parse_stss(reader, track);
+				break;
+			case FOURCC('s', 't', 't', 's'):
+				parse_time_runs(reader, track, atom_end, 0);
+				break;
+			case FOURCC('c', 't', 't', 's'):
+				parse_time_runs(reader, track, atom_end, 1);
+				break;
+			default:
+				break;
+			}
+		}
+
+		reader->data_offset = atom_end;
+		reader->bit_shift = 0;
+	}
+}
+
+/* Index of the last element <= value of the ascending array, -1 if none.  */
+static int64_t find_last_le_u64(const uint64_t *array, uint32_t nb,
+				uint64_t value)
+{
+	uint32_t lo = 0, hi = nb, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
 
-		if (size != 0) {
-			bitstream_reader_inc_offset(reader, size);
+		if (array[mid] <= value) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
 		}
 	}
 
+	return (int64_t) lo - 1;
+}
+
+static int64_t find_last_le_u32(const uint32_t *array, uint32_t nb,
+				uint32_t value)
+{
+	uint32_t lo = 0, hi = nb, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (array[mid] <= value) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return (int64_t) lo - 1;
+}
+
+/*
+ * Start the track from the sync sample at or before the seek target. Track
+ * begins with the picture number first_picture and ends at end_time, a
+ * target past it is left for the next fragment and 0 is returned.
+ */
+static int seek_track(decoder_context *decoder, mp4_track *track,
+		      uint64_t first_picture, uint64_t end_time)
+{
+	seek_target *seek = &decoder->seek;
+	uint64_t time;
+	int64_t sample, idx;
+
+	if (track->samples_nb == 0) {
+		return 0;
+	}
+
+	if (seek->unit == SEEK_TIME) {
+		time = (double) seek->target * track->timescale / 1000000000;
+
+		if (time >= end_time) {
+			return 0;
+		}
+
+		sample = find_last_le_u64(track->sample_dts, track->samples_nb,
+					  time);
+	} else {
+		if (seek->target >= first_picture + track->samples_nb &&
+				end_time != UINT64_MAX) {
+			return 0;
+		}
+
+		sample = (int64_t) seek->target - (int64_t) first_picture;
+
+		if (sample >= track->samples_nb) {
+			sample = track->samples_nb - 1;
+		}
+	}
+
+	if (sample < 0) {
+		sample = 0;
+	}
+
+	if (track->has_stss) {
+		/* Sync sample that follows if there is none before.  */
+		idx = find_last_le_u32(track->sync_samples, track->sync_nb,
+				       sample);
+		if (idx < 0) {
+			idx = 0;
+		}
+
+		if (idx >= track->sync_nb) {
+			track->next_sample = track->samples_nb;
+			return 0;
+		}
+
+		sample = track->sync_samples[idx];
+	}
+
+	SYNTAX_IPRINT("Seek to sample %" PRId64 " of %u\n",
+		      sample, track->samples_nb);
+
+	track->next_sample = sample;
+
+	decoder_seek_done(decoder);
+
+	return 1;
+}
+
+/* tfhd and trun flags.  */
+#define TFHD_BASE_DATA_OFFSET		0x000001
+#define TFHD_SAMPLE_DESCRIPTION		0x000002
+#define TFHD_DEFAULT_DURATION		0x000008
+#define TFHD_DEFAULT_SIZE		0x000010
+#define TFHD_DEFAULT_FLAGS		0x000020
+#define TFHD_DEFAULT_BASE_IS_MOOF	0x020000
+
+#define TRUN_DATA_OFFSET		0x000001
+#define TRUN_FIRST_SAMPLE_FLAGS		0x000004
+#define TRUN_SAMPLE_DURATION		0x000100
+#define TRUN_SAMPLE_SIZE		0x000200
+#define TRUN_SAMPLE_FLAGS		0x000400
+#define TRUN_SAMPLE_CTS_OFFSET		0x000800
+
+#define SAMPLE_IS_NON_SYNC		0x010000
+
+/* State of a traf while its atoms are parsed.  */
+typedef struct mp4_traf {
+	mp4_trex defaults;
+	uint64_t base_offset;
+	uint64_t data_offset;
+	uint64_t dts;
+	unsigned video:1;
+} mp4_traf;
+
+static void fragment_add_sample(mp4_track *fragment, uint64_t offset,
+				uint32_t size, uint64_t dts, int32_t cts,
+				int sync)
+{
+	size_t max = fragment->samples_max;
+
+	if (fragment->samples_nb == max) {
+		if (max > UINT32_MAX / 2 ||
+				max > SIZE_MAX / 2 / sizeof(uint64_t)) {
+			fprintf(stderr, "MP4 fragment has too many samples\n");
+			abort();
+		}
+
+		max = max ? max * 2 : 64;
+
+		fragment->sample_offset = realloc(fragment->sample_offset,
+						  max * sizeof(uint64_t));
+		fragment->sample_size = realloc(fragment->sample_size,
+						max * sizeof(uint32_t));
+		fragment->sample_dts = realloc(fragment->sample_dts,
+					       max * sizeof(uint64_t));
+		fragment->sample_cts = realloc(fragment->sample_cts,
+					       max * sizeof(int32_t));
+		fragment->sync_samples = realloc(fragment->sync_samples,
+						 max * sizeof(uint32_t));
+
+		if (fragment->sample_offset == NULL ||
+		    fragment->sample_size == NULL ||
+		    fragment->sample_dts == NULL ||
+		    fragment->sample_cts == NULL ||
+		    fragment->sync_samples == NULL) {
+			perror("Failed to grow MP4 fragment sample table");
+			abort();
+		}
+
+		fragment->samples_max = max;
+	}
+
+	if (sync) {
+		fragment->sync_samples[fragment->sync_nb++] =
+							fragment->samples_nb;
+	}
+
+	fragment->sample_offset[fragment->samples_nb] = offset;
+	fragment->sample_size[fragment->samples_nb] = size;
+	fragment->sample_dts[fragment->samples_nb] = dts;
+	fragment->sample_cts[fragment->samples_nb] = cts;
+	fragment->samples_nb++;
+}
+
+static void parse_tfhd(bitstream_reader *reader, mp4_movie *movie,
+		       mp4_traf *traf, uint64_t moof_offset)
+{
+	uint32_t flags, track_id;
+	uint32_t i;
+
+	/* version.  */
+	bitstream_read_u(reader, 8);
+
+	flags = bitstream_read_u(reader, 24);
+
+	track_id = bitstream_read_u(reader, 32);
+
+	for (i = 0; i < movie->trex_nb; i++) {
+		if (movie->trex[i].track_id == track_id) {
+			traf->defaults = movie->trex[i];
+		}
+	}
+
+	traf->video = (movie->has_video && track_id == movie->video.track_id);
+
+	/* Otherwise it is the end of the previous traf data.  */
+	if (flags & TFHD_DEFAULT_BASE_IS_MOOF) {
+		traf->base_offset = moof_offset;
+	}
+
+	if (flags & TFHD_BASE_DATA_OFFSET) {
+		traf->base_offset = (uint64_t) bitstream_read_u(reader, 32) << 32;
+		traf->base_offset |= bitstream_read_u(reader, 32);
+	}
+
+	if (flags & TFHD_SAMPLE_DESCRIPTION) {
+		bitstream_read_u(reader, 32);
+	}
+
+	if (flags & TFHD_DEFAULT_DURATION) {
+		traf->defaults.default_duration = bitstream_read_u(reader, 32);
+	}
+
+	if (flags & TFHD_DEFAULT_SIZE) {
+		traf->defaults.default_size = bitstream_read_u(reader, 32);
+	}
+
+	if (flags & TFHD_DEFAULT_FLAGS) {
+		traf->defaults.default_flags = bitstream_read_u(reader, 32);
+	}
+
+	traf->data_offset = traf->base_offset;
+
+	SYNTAX_IPRINT("tfhd: track_ID %u, base 0x%" PRIX64 "\n",
+		      track_id, traf->base_offset);
+}
+
+static void parse_tfdt(bitstream_reader *reader, mp4_traf *traf)
+{
+	uint32_t version = read_full_atom(reader);
+
+	if (version == 1) {
+		traf->dts = (uint64_t) bitstream_read_u(reader, 32) << 32;
+		traf->dts |= bitstream_read_u(reader, 32);
+	} else {
+		traf->dts = bitstream_read_u(reader, 32);
+	}
+
+	SYNTAX_IPRINT("baseMediaDecodeTime = %" PRIu64 "\n", traf->dts);
+}
+
+static void parse_trun(bitstream_reader *reader, mp4_movie *movie,
+		       mp4_traf *traf, uint64_t end)
+{
+	uint32_t samples_nb, first_flags = 0;
+	uint32_t duration, size, flags, i;
+	uint64_t max_nb;
+	unsigned sample_fields;
+	int32_t cts = 0;
+	uint32_t trun_flags;
+
+	/* version, signedness of the composition offsets is the same.  */
+	bitstream_read_u(reader, 8);
+
+	trun_flags = bitstream_read_u(reader, 24);
+
+	samples_nb = bitstream_read_u(reader, 32);
+
+	/* Otherwise data follows the previous trun.  */
+	if (trun_flags & TRUN_DATA_OFFSET) {
+		traf->data_offset = traf->base_offset +
+					(int32_t) bitstream_read_u(reader, 32);
+	}
+
+	if (trun_flags & TRUN_FIRST_SAMPLE_FLAGS) {
+		first_flags = bitstream_read_u(reader, 32);
+	}
+
+	sample_fields = !!(trun_flags & TRUN_SAMPLE_DURATION) +
+			!!(trun_flags & TRUN_SAMPLE_SIZE) +
+			!!(trun_flags & TRUN_SAMPLE_FLAGS) +
+			!!(trun_flags & TRUN_SAMPLE_CTS_OFFSET);
+
+	/*
+	 * Samples are bounded by their fields that have to fit the atom, or
+	 * else by their data that has to fit the stream.
+	 */
+	if (sample_fields != 0) {
+		max_nb = reader->data_offset < end ?
+				(end - reader->data_offset) /
+						(sample_fields * 4) : 0;
+	} else if (traf->defaults.default_size != 0 &&
+			traf->data_offset < reader->file_size) {
+		max_nb = (reader->file_size - traf->data_offset) /
+				traf->defaults.default_size;
+	} else {
+		max_nb = 0;
+	}
+
+	if (samples_nb > max_nb) {
+		SYNTAX_WARN("trun of %u samples is truncated to %" PRIu64 "\n",
+			    samples_nb, max_nb);
+		samples_nb = max_nb;
+	}
+
+	for (i = 0; i < samples_nb; i++) {
+		duration = traf->defaults.default_duration;
+		size = traf->defaults.default_size;
+		flags = traf->defaults.default_flags;
+
+		if (trun_flags & TRUN_SAMPLE_DURATION) {
+			duration = bitstream_read_u(reader, 32);
+		}
+
+		if (trun_flags & TRUN_SAMPLE_SIZE) {
+			size = bitstream_read_u(reader, 32);
+		}
+
+		if (trun_flags & TRUN_SAMPLE_FLAGS) {
+			flags = bitstream_read_u(reader, 32);
+		} else if (i == 0 && (trun_flags & TRUN_FIRST_SAMPLE_FLAGS)) {
+			flags = first_flags;
+		}
+
+		if (trun_flags & TRUN_SAMPLE_CTS_OFFSET) {
+			cts = bitstream_read_u(reader, 32);
+		}
+
+		if (traf->video) {
+			fragment_add_sample(&movie->fragment, traf->data_offset,
+					    size, traf->dts, cts,
+					    !(flags & SAMPLE_IS_NON_SYNC));
+		}
+
+		traf->data_offset += size;
+		traf->dts += duration;
+	}
+}
+
+static void parse_traf(decoder_context *decoder, mp4_movie *movie,
+		       uint64_t moof_offset, uint64_t *data_end,
+		       uint64_t end)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t atom_end;
+	mp4_traf traf;
+	uint32_t type;
+	int64_t size;
+
+	bzero(&traf, sizeof(traf));
+
+	traf.base_offset = *data_end;
+	traf.dts = movie->fragment_dts;
+
+	while (reader->data_offset + 8 <= end) {
+		read_atom_header(reader, &size, &type);
+		atom_end = reader->data_offset + size;
+
+		switch (type) {
+		case FOURCC('t', 'f', 'h', 'd'):
+			parse_tfhd(reader, movie, &traf, moof_offset);
+			break;
+		case FOURCC('t', 'f', 'd', 't'):
+			parse_tfdt(reader, &traf);
+			break;
+		case FOURCC('t', 'r', 'u', 'n'):
+			parse_trun(reader, movie, &traf, atom_end);
+			break;
+		default:
+			break;
+		}
+
+		reader->data_offset = atom_end;
+		reader->bit_shift = 0;
+	}
+
+	*data_end = traf.data_offset;
+
+	if (traf.video) {
+		movie->fragment_dts = traf.dts;
+	}
+}
+
+/*
+ * Fragment's moof replaces the samples of the previous fragment, they are
+ * parsed once the fragment's mdat arrives.
+ */
+static void parse_moof(decoder_context *decoder, mp4_movie *movie,
+		       uint64_t moof_offset, uint64_t end)
+{
+	bitstream_reader *reader = &decoder->reader;
+	mp4_track *fragment = &movie->fragment;
+	uint64_t data_end = moof_offset;
+	uint64_t atom_end;
+	uint32_t type;
+	int64_t size;
+
+	movie->fragment_picture += fragment->samples_nb;
+
+	fragment->samples_nb = 0;
+	fragment->sync_nb = 0;
+	fragment->next_sample = 0;
+	fragment->nal_length_size = movie->video.nal_length_size;
+	fragment->timescale = movie->video.timescale;
+	fragment->has_stss = 1;
+
+	while (reader->data_offset + 8 <= end) {
+		read_atom_header(reader, &size, &type);
+		atom_end = reader->data_offset + size;
+
+		if (type == FOURCC('t', 'r', 'a', 'f')) {
+			parse_traf(decoder, movie, moof_offset, &data_end,
+				   atom_end);
+		}
+
+		reader->data_offset = atom_end;
+		reader->bit_shift = 0;
+	}
+
+	movie->fragments_nb++;
+
+	SYNTAX_IPRINT("Fragment %u: %u samples\n",
+		      movie->fragments_nb, fragment->samples_nb);
+
+	/* Fragments before the seek target are skipped as a whole.  */
+	if (decoder->seek.unit != SEEK_NONE &&
+			!seek_track(decoder, fragment, movie->fragment_picture,
+				    movie->fragment_dts)) {
+		fragment->next_sample = fragment->samples_nb;
+	}
+}
+
+/*
+ * Sample is an access unit of NALs, each prefixed by its size. Picture is
+ * decoded once the sample ends. Matroska's blocks are the same.
+ */
+void parse_avc_sample(decoder_context *decoder, uint64_t offset,
+		      uint32_t size, unsigned nal_length_size)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t end = offset + size;
+	uint32_t NAL_size;
+
+	while (offset + nal_length_size <= end) {
+		bitstream_release(reader, offset);
+
+		reader->data_offset = offset;
+		reader->bit_shift = 0;
+
+		NAL_size = bitstream_read_u(reader, 8 * nal_length_size);
+		offset += nal_length_size;
+
+		if (NAL_size > end - offset) {
+			SYNTAX_WARN("NAL at 0x%" PRIX64 " exceeds its sample\n",
+				    offset);
+			break;
+		}
+
+		mp4_parse_NAL(decoder, offset, NAL_size);
+
+		offset += NAL_size;
+	}
+
+	reader->data_offset = end;
+
+	decoder_flush(decoder);
+}
+
+/* Timestamps of the sample in 90 kHz units, CTS is the PTS offset.  */
+static void sample_timestamps(decoder_context *decoder, mp4_track *track,
+			      uint32_t sample)
+{
+	int64_t dts = track->sample_dts[sample];
+	int64_t pts = dts + track->sample_cts[sample];
+
+	if (track->timescale == 0) {
+		decoder->pts = TIMESTAMP_NONE;
+		decoder->dts = TIMESTAMP_NONE;
+		return;
+	}
+
+	decoder->pts = pts * 90000 / track->timescale;
+	decoder->dts = dts * 90000 / track->timescale;
+}
+
+/*
+ * Parse the video samples that lie within start..end in the decoding order,
+ * until the first one that isn't there yet. Samples before start are gone
+ * from a stream, they are skipped.
+ */
+static void parse_samples(decoder_context *decoder, mp4_track *track,
+			  uint64_t start, uint64_t end)
+{
+	uint64_t offset;
+	uint32_t size;
+
+	while (track->next_sample < track->samples_nb) {
+		offset = track->sample_offset[track->next_sample];
+		size = track->sample_size[track->next_sample];
+
+		if (offset >= end || offset + size > end) {
+			break;
+		}
+
+		if (offset >= start) {
+			sample_timestamps(decoder, track, track->next_sample);
+			parse_avc_sample(decoder, offset, size,
+					 track->nal_length_size);
+		} else {
+			SYNTAX_WARN("Sample %u is out of order, skipped\n",
+				    track->next_sample);
+		}
+
+		track->next_sample++;
+	}
+}
+
+/* Parameter sets of the size prefixed NALs in [offset, end) are parsed.  */
+static void mdat_linear_parameter_sets(decoder_context *decoder,
+				       uint64_t offset, uint64_t end)
+{
+	bitstream_reader *reader = &decoder->reader;
+	const uint8_t *header;
+	uint32_t NAL_size;
+
+	while (offset + 4 <= end) {
+		reader->data_offset = offset;
+		reader->bit_shift = 0;
+
+		NAL_size = bitstream_read_u(reader, 32);
+		offset += 4;
+
+		if (NAL_size > end - offset) {
+			break;
+		}
+
+		if (NAL_size > 0) {
+			header = bitstream_data(reader, offset, 1);
+
+			if ((header[0] & 0x1F) == 7 || (header[0] & 0x1F) == 8) {
+				mp4_parse_NAL(decoder, offset, NAL_size);
+			}
+		}
+
+		offset += NAL_size;
+	}
+}
+
+/*
+ * There are no sample tables to seek with, NALs of the mdat are walked to
+ * the last IDR picture at or before the target like Annex B does. Returns
+ * offset of the IDR's size prefix, the mdat start if there is no such IDR.
+ */
+static uint64_t mdat_linear_seek(decoder_context *decoder, uint64_t offset,
+				 uint64_t end)
+{
+	bitstream_reader *reader = &decoder->reader;
+	seek_target *seek = &decoder->seek;
+	uint64_t picture = seek->target;
+	uint64_t pictures_nb = 0;
+	uint64_t IDR_offset = 0;
+	uint64_t start = offset;
+	const uint8_t *header;
+	uint32_t NAL_size;
+	int found = 0;
+
+	while (offset + 4 <= end) {
+		reader->data_offset = offset;
+		reader->bit_shift = 0;
+
+		NAL_size = bitstream_read_u(reader, 32);
+
+		if (NAL_size > end - offset - 4) {
+			break;
+		}
+
+		if (NAL_size >= 2) {
+			header = bitstream_data(reader, offset + 4, 2);
+
+			/* Parameter sets ahead of the pictures give the rate.  */
+			if ((header[0] & 0x1F) == 7) {
+				mp4_parse_NAL(decoder, offset + 4, NAL_size);
+			}
+
+			if (IS_PICTURE_START(header)) {
+				if (seek->unit == SEEK_TIME && pictures_nb == 0) {
+					picture = seek->target *
+						seek_fps(decoder) / 1000000000;
+				}
+
+				if (pictures_nb > picture) {
+					break;
+				}
+
+				if ((header[0] & 0x1F) == 5) {
+					IDR_offset = offset;
+					found = 1;
+				}
+
+				pictures_nb++;
+			}
+		}
+
+		offset += 4 + NAL_size;
+	}
+
+	decoder_seek_done(decoder);
+
+	if (!found) {
+		SYNTAX_WARN("Stream has no IDR pictures to seek to\n");
+		return start;
+	}
+
+	SYNTAX_IPRINT("Seek for picture %" PRIu64 ", IDR @0x%" PRIX64 "\n",
+		      picture, IDR_offset);
+
+	mdat_linear_parameter_sets(decoder, start, IDR_offset);
+
+	return IDR_offset;
+}
+
+/*
+ * mdat without the sample tables is assumed to be a sequence of NALs, each
+ * prefixed by its 4 bytes size.
+ */
+static void parse_mdat_linear(decoder_context *decoder, int64_t size)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t end = reader->data_offset + size;
+	uint64_t offset = reader->data_offset;
+	uint32_t NAL_size;
+
+	decoder->pts = TIMESTAMP_NONE;
+	decoder->dts = TIMESTAMP_NONE;
+
+	if (decoder->seek.unit != SEEK_NONE && reader->ring == NULL) {
+		offset = mdat_linear_seek(decoder, offset, end);
+	}
+
+	if (decoder->seek.unit != SEEK_NONE) {
+		SYNTAX_WARN("Streamed MP4 without moov can't be seeked, "
+			    "decoding from the start\n");
+		decoder_seek_done(decoder);
+	}
+
+	while (offset + 4 <= end) {
+		bitstream_release(reader, offset);
+
+		reader->data_offset = offset;
+		reader->bit_shift = 0;
+
+		NAL_size = bitstream_read_u(reader, 32);
+		offset += 4;
+
+		if (NAL_size > end - offset) {
+			SYNTAX_WARN("NAL at 0x%" PRIX64 " exceeds mdat\n",
+				    offset);
+			break;
+		}
+
+		mp4_parse_NAL(decoder, offset, NAL_size);
+
+		offset += NAL_size;
+	}
+
+	reader->data_offset = end;
+}
+
+/*
+ * Files are mapped, moov is looked up among the top level atoms wherever it
+ * is. Returns 1 if it has a video track.
+ */
+static int parse_moov_of_file(decoder_context *decoder, mp4_movie *movie)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t offset = reader->data_offset;
+	uint32_t type;
+	int64_t size;
+
+	while (reader->data_offset + 8 <= reader->bitstream_end) {
+		read_atom_header(reader, &size, &type);
+
+		if (type == FOURCC('m', 'o', 'o', 'v')) {
+			parse_atoms(decoder, movie, NULL,
+				    reader->data_offset + size);
+			break;
+		}
+
+		reader->data_offset += size;
+		reader->bit_shift = 0;
+	}
+
+	reader->data_offset = offset;
+	reader->bit_shift = 0;
+
+	return movie->has_video;
+}
+
+int parse_mp4(decoder_context *decoder)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t atom_start, atom_end;
+	mp4_movie *movie;
+	uint32_t type;
+	int64_t size;
+
+	if (!is_MP4(reader)) {
+		reader->bit_shift = reader->data_offset = 0;
+		return 0;
+	}
+
+	movie = mp4_alloc(1, sizeof(*movie));
+
+	mp4_free(decoder->mp4);
+	decoder->mp4 = movie;
+
+	if (reader->ring == NULL && parse_moov_of_file(decoder, movie)) {
+		if (decoder->seek.unit != SEEK_NONE) {
+			seek_track(decoder, &movie->video, 0, UINT64_MAX);
+		}
+
+		parse_samples(decoder, &movie->video, 0, reader->bitstream_end);
+	}
+
+	/*
+	 * Streamed atoms are parsed as they arrive, so are the fragments.
+	 * Fragment's samples are parsed when its mdat arrives.
+	 */
+	while (!reader->error) {
+		bitstream_release(reader, reader->data_offset);
+
+		/* Stream ends after the last atom.  */
+		if (bitstream_wait(reader, reader->data_offset + 8) <
+						reader->data_offset + 8) {
+			break;
+		}
+
+		atom_start = reader->data_offset;
+
+		read_atom_header(reader, &size, &type);
+		atom_end = reader->data_offset + size;
+
+		switch (type) {
+		case FOURCC('m', 'o', 'o', 'v'):
+			if (movie->has_video) {
+				break;
+			}
+
+			parse_atoms(decoder, movie, NULL, atom_end);
+
+			if (movie->has_video && decoder->seek.unit != SEEK_NONE) {
+				seek_track(decoder, &movie->video, 0,
+					   UINT64_MAX);
+			}
+			break;
+		case FOURCC('m', 'o', 'o', 'f'):
+			if (movie->has_video) {
+				parse_moof(decoder, movie, atom_start, atom_end);
+			}
+			break;
+		case FOURCC('m', 'd', 'a', 't'):
+			if (movie->fragments_nb) {
+				parse_samples(decoder, &movie->fragment,
+					      reader->data_offset, atom_end);
+			} else if (movie->has_video) {
+				parse_samples(decoder, &movie->video,
+					      reader->data_offset, atom_end);
+			} else {
+				parse_mdat_linear(decoder, size);
+			}
+			break;
+		default:
+			break;
+		}
+
+		reader->data_offset = atom_end;
+		reader->bit_shift = 0;
+	}
+
+	decoder_flush(decoder);
+
 	return 1;
 }
@@ -17,7 +17,8 @@
 
 #include "common.h"
 
-#define NAL_START_CODE	0x000001
+/* Set while try_parse_NAL() runs, syntax errors return there.  */
+static __thread jmp_buf *NAL_bail;
 
 static const char * NAL_TYPE(int type)
 {
@@ -51,46 +52,42 @@ static const char * NAL_TYPE(int type)
 	}
 }
 
-int is_NAL_start_code(bitstream_reader *reader)
-{
-	uint32_t data = bitstream_read_next_word(reader);
-
-	SYNTAX_DPRINT("NAL offset 0x%X data 0x%08X\n",
-		      reader->data_offset, be32toh(data));
-
-	if (be32toh(data) == NAL_START_CODE) {
-		return 4;
-	}
-
-	if (be32toh(data) >> 8 == NAL_START_CODE) {
-		return 3;
-	}
-
-	return 0;
-}
-
 int seek_to_NAL_start(bitstream_reader *reader)
 {
-	int NAL_found = 0;
+	uint64_t code_offset, end;
+	int NAL_found;
 
-	SYNTAX_IPRINT("Searching for the NAL ... @0x%X\n", reader->data_offset);
+	SYNTAX_IPRINT("Searching for the NAL ... @0x%" PRIX64 "\n",
+		      reader->data_offset);
 
 	reader->bit_shift = 0;
 
-	do {
-		NAL_found = is_NAL_start_code(reader);
+	bitstream_release(reader, reader->data_offset);
 
-		if (reader->error) {
+	NAL_found = bitstream_find_start_code(reader, reader->data_offset,
+					      &code_offset);
+	if (!NAL_found) {
+		if (reader->bitstream_end != BITSTREAM_SIZE_UNKNOWN) {
+			SYNTAX_IPRINT("Reached data stream end\n");
 			return 0;
 		}
 
-		bitstream_reader_inc_offset(reader, NAL_found ?: 1);
+		/* Skip scanned data, but the start code that may be cut.  */
+		end = bitstream_wait(reader, 0);
 
-		if (NAL_found) {
-			SYNTAX_IPRINT("found NAL_start_code at offset 0x%X\n",
-				      reader->data_offset);
+		if (end > reader->data_offset + 3) {
+			reader->data_offset = end - 3;
 		}
-	} while (!NAL_found);
+
+		return 0;
+	}
+
+	reader->data_offset = code_offset;
+
+	bitstream_reader_inc_offset(reader, NAL_found);
+
+	SYNTAX_IPRINT("found NAL_start_code at offset 0x%" PRIX64 "\n",
+		      reader->data_offset);
 
 	return NAL_found;
 }
@@ -98,11 +95,18 @@ int seek_to_NAL_start(bitstream_reader *reader)
 void parse_NAL(decoder_context *decoder)
 {
 	bitstream_reader *reader = &decoder->reader;
+	decoder_context_sps *sps;
+	decoder_context_pps *pps;
 	unsigned forbidden_zero_bit;
+	unsigned refs_missing;
 
 	reader->NAL_offset = reader->data_offset;
 	reader->rbsp_mode = 1;
 
+	bitstream_find_stop_bit(reader);
+
+	bitstream_rbsp_start(reader, &decoder->rbsp);
+
 	forbidden_zero_bit     = bitstream_read_u(reader, 1);
 	decoder->nal.ref_idc   = bitstream_read_u(reader, 2);
 	decoder->nal.unit_type = bitstream_read_u(reader, 5);
@@ -119,18 +123,106 @@ void parse_NAL(decoder_context *decoder)
 	switch (decoder->nal.unit_type) {
 	case 5:
 	case 1:
-		parse_slice_header(decoder);
-		tegra_VDE_decode_frame(decoder);
+		if (decoder->indexing != NULL) {
+			decoder_reset_SH(decoder);
+			parse_slice_header_prefix(decoder);
+			break;
+		}
+
+		if (AU_skip_slice(decoder)) {
+			decoder_flush(decoder);
+			break;
+		}
+
+		if (AU_first_slice(decoder)) {
+			decoder_flush(decoder);
+			parse_slice_header(decoder);
+
+			/* Skipped reference pictures aren't in the DPB.  */
+			decoder->sh.refs_missing = decoder->trick.refs_missing;
+			decoder->trick.refs_missing = 0;
+		} else if (AU_general_slice(decoder)) {
+			/* Picture is set up by its most general slice.  */
+			refs_missing = decoder->sh.refs_missing;
+			parse_slice_header(decoder);
+			decoder->sh.refs_missing = refs_missing;
+		}
+
+		decoder_queue_slice(decoder);
 		break;
 	case 7:
-		parse_SPS(decoder);
+		decoder_flush(decoder);
+		sps = parse_SPS(decoder);
+
+		if (decoder->lookahead != NULL) {
+			lookahead_queue_SPS(decoder, sps);
+		}
 		break;
 	case 8:
-		parse_PPS(decoder);
+		decoder_flush(decoder);
+		pps = parse_PPS(decoder);
+
+		if (decoder->lookahead != NULL) {
+			lookahead_queue_PPS(decoder, pps);
+		}
+		break;
+	case 6:
+	case 9 ... 11:
+	case 14 ... 18:
+		/* These come ahead of the first slice of a picture.  */
+		decoder_flush(decoder);
 		break;
 	default:
 		break;
 	}
 
+	if (decoder->indexing != NULL) {
+		nal_index_add(decoder->indexing, decoder);
+	}
+
+	bitstream_rbsp_stop(reader);
+
 	reader->rbsp_mode = 0;
 }
+
+void syntax_error(void)
+{
+	if (NAL_bail != NULL) {
+		longjmp(*NAL_bail, BITSTREAM_MALFORMED);
+	}
+
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * parse_NAL() that returns instead of exiting if NAL is truncated or
+ * malformed. Returns 0 on success, BITSTREAM_END_REACHED or
+ * BITSTREAM_MALFORMED otherwise. Bail points of the caller are restored.
+ */
+int try_parse_NAL(decoder_context *decoder)
+{
+	bitstream_reader *reader = &decoder->reader;
+	jmp_buf *reader_bail = reader->bail;
+	jmp_buf *prev_bail = NAL_bail;
+	jmp_buf bail;
+	int ret;
+
+	ret = setjmp(bail);
+
+	if (ret == 0) {
+		reader->bail = &bail;
+		NAL_bail = &bail;
+
+		parse_NAL(decoder);
+	} else {
+		bitstream_rbsp_stop(reader);
+
+		reader->rbsp_mode = 0;
+		reader->error = 0;
+	}
+
+	reader->bail = reader_bail;
+	NAL_bail = prev_bail;
+
+	return ret;
+}
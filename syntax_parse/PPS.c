@@ -17,7 +17,7 @@
 
 #include "common.h"
 
-void parse_PPS(decoder_context *decoder)
+decoder_context_pps * parse_PPS(decoder_context *decoder)
 {
 	bitstream_reader *reader = &decoder->reader;
 	decoder_context_sps *sps;
@@ -38,6 +38,8 @@ void parse_PPS(decoder_context *decoder)
 
 	decoder_reset_PPS(pps);
 
+	pps->pic_parameter_set_id = pps_id;
+
 	sps_id = bitstream_read_ue(reader);
 
 	SYNTAX_IPRINT("seq_parameter_set_id = %u\n", sps_id);
@@ -79,7 +81,8 @@ void parse_PPS(decoder_context *decoder)
 		case 0:
 			pps->run_length_minus1 =
 				realloc(pps->run_length_minus1,
-					pps->num_slice_groups_minus1 + 1);
+					sizeof(uint32_t) *
+					(pps->num_slice_groups_minus1 + 1));
 
 			assert(pps->run_length_minus1 != NULL);
 
@@ -94,13 +97,15 @@ void parse_PPS(decoder_context *decoder)
 		case 2:
 			pps->top_left =
 				realloc(pps->top_left,
-					pps->num_slice_groups_minus1 + 1);
+					sizeof(uint32_t) *
+					(pps->num_slice_groups_minus1 + 1));
 
 			assert(pps->top_left != NULL);
 
 			pps->bottom_right =
 				realloc(pps->bottom_right,
-					pps->num_slice_groups_minus1 + 1);
+					sizeof(uint32_t) *
+					(pps->num_slice_groups_minus1 + 1));
 
 			assert(pps->bottom_right != NULL);
 
@@ -134,7 +139,8 @@ void parse_PPS(decoder_context *decoder)
 
 			pps->slice_group_id =
 				realloc(pps->slice_group_id,
-					pps->pic_size_in_map_units_minus1 + 1);
+					sizeof(uint32_t) *
+					(pps->pic_size_in_map_units_minus1 + 1));
 
 			assert(pps->slice_group_id != NULL);
 
@@ -239,4 +245,6 @@ void parse_PPS(decoder_context *decoder)
 
 end:
 	pps->valid = 1;
+
+	return pps;
 }
@@ -0,0 +1,613 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "syntax_parse.h"
+
+#include "common.h"
+
+#define RTP_HEADER_SIZE		12
+#define RTP_VERSION		2
+#define RTP_DYNAMIC_PT		96
+
+/* RFC 6184 NAL unit types of the payload.  */
+#define RTP_NAL_STAP_A		24
+#define RTP_NAL_FU_A		28
+
+#define FU_START		0x80
+#define FU_END			0x40
+
+/* Largest UDP payload.  */
+#define RTP_PACKET_MAX		65536
+
+/* Streamed input is over once no packet arrives for that long.  */
+#define RTP_UDP_TIMEOUT_SEC	5
+
+#define PCAP_MAGIC		0xA1B2C3D4
+#define PCAP_MAGIC_NS		0xA1B23C4D
+#define PCAP_HEADER_SIZE	24
+#define PCAP_RECORD_SIZE	16
+
+#define PCAP_LINK_NULL		0
+#define PCAP_LINK_ETHERNET	1
+#define PCAP_LINK_RAW		101
+#define PCAP_LINK_LINUX_SLL	113
+
+#define ETHERTYPE_IPV4		0x0800
+#define ETHERTYPE_IPV6		0x86DD
+#define ETHERTYPE_VLAN		0x8100
+
+#define IP_PROTO_UDP		17
+
+/* Buffers are reused once the data they hold is parsed.  */
+typedef struct rtp_buffer {
+	struct rtp_buffer *next;
+	uint8_t *data;
+	uint32_t size;
+	uint32_t max;
+} rtp_buffer;
+
+/*
+ * Depacketizer of an RTP session, the first H.264 SSRC seen is taken. NALs
+ * of single NAL and STAP-A packets are parsed where the packet is, FU-A
+ * fragments are gathered in a buffer of the pool.
+ */
+typedef struct rtp_session {
+	rtp_buffer *pool;
+	rtp_buffer *fu;
+	uint32_t ssrc;
+	uint16_t seq;
+	uint32_t timestamp;
+	int64_t pts;
+	uint16_t port;
+	unsigned synced:1;
+	unsigned warned:1;
+} rtp_session;
+
+typedef struct pcap_file {
+	uint32_t linktype;
+	unsigned swapped:1;
+} pcap_file;
+
+static rtp_buffer * rtp_buffer_get(rtp_session *rtp, uint32_t size)
+{
+	rtp_buffer *buf = rtp->pool;
+
+	if (buf != NULL) {
+		rtp->pool = buf->next;
+	} else {
+		buf = calloc(1, sizeof(*buf));
+		if (buf == NULL) {
+			perror("Failed to allocate RTP buffer");
+			abort();
+		}
+	}
+
+	if (buf->max < size) {
+		buf->data = realloc(buf->data, size);
+		if (buf->data == NULL) {
+			perror("Failed to allocate RTP buffer");
+			abort();
+		}
+		buf->max = size;
+	}
+
+	buf->next = NULL;
+	buf->size = 0;
+
+	return buf;
+}
+
+static void rtp_buffer_put(rtp_session *rtp, rtp_buffer *buf)
+{
+	buf->next = rtp->pool;
+	rtp->pool = buf;
+}
+
+static void rtp_buffer_append(rtp_buffer *buf, const uint8_t *data,
+			      uint32_t size)
+{
+	if (buf->size + size > buf->max) {
+		buf->max = max(buf->max * 2, buf->size + size);
+		buf->data = realloc(buf->data, buf->max);
+		if (buf->data == NULL) {
+			perror("Failed to grow RTP buffer");
+			abort();
+		}
+	}
+
+	memcpy(buf->data + buf->size, data, size);
+	buf->size += size;
+}
+
+static void rtp_session_free(rtp_session *rtp)
+{
+	rtp_buffer *buf;
+
+	if (rtp->fu != NULL) {
+		rtp_buffer_put(rtp, rtp->fu);
+	}
+
+	while (rtp->pool != NULL) {
+		buf = rtp->pool;
+		rtp->pool = buf->next;
+		free(buf->data);
+		free(buf);
+	}
+}
+
+/* NAL of the packet, reader is pointed to it meanwhile.  */
+static void rtp_parse_NAL(decoder_context *decoder, const uint8_t *data,
+			  uint32_t size)
+{
+	bitstream_reader reader = decoder->reader;
+
+	if (size == 0) {
+		return;
+	}
+
+	bitstream_init(&decoder->reader, (void *) data, size);
+
+	SYNTAX_IPRINT("+++++++++++++++\n");
+
+	if (try_parse_NAL(decoder) == BITSTREAM_MALFORMED) {
+		SYNTAX_WARN("Malformed NAL is skipped\n");
+	}
+
+	SYNTAX_IPRINT("---------------\n\n");
+
+	decoder->reader = reader;
+}
+
+static void rtp_parse_STAP_A(decoder_context *decoder, const uint8_t *data,
+			     uint32_t size)
+{
+	uint32_t pos = 1, NAL_size;
+
+	while (pos + 2 <= size) {
+		NAL_size = (data[pos] << 8) | data[pos + 1];
+		pos += 2;
+
+		if (NAL_size > size - pos) {
+			SYNTAX_WARN("STAP-A NAL exceeds its packet\n");
+			break;
+		}
+
+		rtp_parse_NAL(decoder, data + pos, NAL_size);
+
+		pos += NAL_size;
+	}
+}
+
+/* NAL header of the fragmented NAL is made of FU indicator and FU header.  */
+static void rtp_parse_FU_A(decoder_context *decoder, rtp_session *rtp,
+			   const uint8_t *data, uint32_t size)
+{
+	uint8_t header;
+
+	if (size < 2) {
+		return;
+	}
+
+	if (data[1] & FU_START) {
+		if (rtp->fu != NULL) {
+			SYNTAX_WARN("FU-A end is lost\n");
+			rtp_buffer_put(rtp, rtp->fu);
+		}
+
+		header = (data[0] & 0xE0) | (data[1] & 0x1F);
+
+		rtp->fu = rtp_buffer_get(rtp, size);
+		rtp_buffer_append(rtp->fu, &header, 1);
+	}
+
+	/* Fragments of the NAL whose start is lost are dropped.  */
+	if (rtp->fu == NULL) {
+		return;
+	}
+
+	rtp_buffer_append(rtp->fu, data + 2, size - 2);
+
+	if (data[1] & FU_END) {
+		rtp_parse_NAL(decoder, rtp->fu->data, rtp->fu->size);
+		rtp_buffer_put(rtp, rtp->fu);
+		rtp->fu = NULL;
+	}
+}
+
+/*
+ * Size of the RTP header, 0 if it isn't a packet of H.264 that the session
+ * takes. RTP timestamp is of the 90 kHz clock, a change of it or the marker
+ * bit ends the access unit.
+ */
+static uint32_t rtp_header(rtp_session *rtp, const uint8_t *data,
+			   uint32_t *size, int *marker, uint32_t *timestamp)
+{
+	uint32_t ssrc, header_size, type;
+	uint16_t seq;
+
+	if (*size < RTP_HEADER_SIZE || (data[0] >> 6) != RTP_VERSION ||
+			(data[1] & 0x7F) < RTP_DYNAMIC_PT) {
+		return 0;
+	}
+
+	header_size = RTP_HEADER_SIZE + 4 * (data[0] & 0x0F);
+
+	/* Header extension.  */
+	if ((data[0] & 0x10) && header_size + 4 <= *size) {
+		header_size += 4 + 4 * ((data[header_size + 2] << 8) |
+					data[header_size + 3]);
+	}
+
+	/* Padding, its size is the last byte.  */
+	if (data[0] & 0x20) {
+		if (data[*size - 1] > *size) {
+			return 0;
+		}
+		*size -= data[*size - 1];
+	}
+
+	if (header_size >= *size) {
+		return 0;
+	}
+
+	seq = (data[2] << 8) | data[3];
+	*timestamp = (data[4] << 24) | (data[5] << 16) | (data[6] << 8) |
+			data[7];
+	ssrc = (data[8] << 24) | (data[9] << 16) | (data[10] << 8) | data[11];
+	*marker = data[1] >> 7;
+
+	if (!rtp->synced) {
+		type = data[header_size] & 0x1F;
+
+		if (type == 0 || type > RTP_NAL_FU_A) {
+			return 0;
+		}
+
+		SYNTAX_IPRINT("RTP: SSRC 0x%08X, payload type %u\n",
+			      ssrc, data[1] & 0x7F);
+
+		rtp->ssrc = ssrc;
+		rtp->seq = seq - 1;
+		rtp->timestamp = *timestamp;
+		rtp->synced = 1;
+	}
+
+	if (ssrc != rtp->ssrc) {
+		return 0;
+	}
+
+	if (seq != (uint16_t) (rtp->seq + 1)) {
+		SYNTAX_WARN("RTP packets %u-%u are lost\n",
+			    (uint16_t) (rtp->seq + 1), (uint16_t) (seq - 1));
+	}
+
+	rtp->seq = seq;
+
+	return header_size;
+}
+
+/* RTP packet of the size, it is parsed in place.  */
+static void rtp_packet(decoder_context *decoder, rtp_session *rtp,
+		       const uint8_t *data, uint32_t size)
+{
+	uint32_t header_size, timestamp;
+	uint16_t prev_seq = rtp->seq;
+	int marker;
+
+	header_size = rtp_header(rtp, data, &size, &marker, &timestamp);
+	if (header_size == 0) {
+		return;
+	}
+
+	/* Fragments of the NAL that lost a packet can't be put together.  */
+	if (rtp->seq != (uint16_t) (prev_seq + 1) && rtp->fu != NULL) {
+		rtp_buffer_put(rtp, rtp->fu);
+		rtp->fu = NULL;
+	}
+
+	if (timestamp != rtp->timestamp) {
+		decoder_flush(decoder);
+
+		rtp->pts += (int32_t) (timestamp - rtp->timestamp);
+		rtp->timestamp = timestamp;
+	}
+
+	decoder->pts = rtp->pts;
+	decoder->dts = TIMESTAMP_NONE;
+
+	data += header_size;
+	size -= header_size;
+
+	switch (data[0] & 0x1F) {
+	case 1 ... 23:
+		rtp_parse_NAL(decoder, data, size);
+		break;
+	case RTP_NAL_STAP_A:
+		rtp_parse_STAP_A(decoder, data, size);
+		break;
+	case RTP_NAL_FU_A:
+		rtp_parse_FU_A(decoder, rtp, data, size);
+		break;
+	default:
+		/* STAP-B, MTAP and FU-B are of the interleaved mode.  */
+		if (!rtp->warned) {
+			SYNTAX_WARN("RTP packet type %u is unsupported\n",
+				    data[0] & 0x1F);
+			rtp->warned = 1;
+		}
+		break;
+	}
+
+	if (marker) {
+		decoder_flush(decoder);
+	}
+}
+
+static void rtp_seek_unsupported(decoder_context *decoder)
+{
+	if (decoder->seek.unit != SEEK_NONE) {
+		SYNTAX_WARN("RTP can't be seeked, decoding from the start\n");
+		decoder_seek_done(decoder);
+	}
+}
+
+/*
+ * Datagrams of the bound UDP socket are received into a buffer of the pool,
+ * input ends once the stream stalls for RTP_UDP_TIMEOUT_SEC.
+ */
+void parse_rtp_udp(decoder_context *decoder, int fd)
+{
+	struct timeval timeout = { .tv_sec = RTP_UDP_TIMEOUT_SEC };
+	rtp_session rtp;
+	rtp_buffer *buf;
+	ssize_t ret;
+
+	bzero(&rtp, sizeof(rtp));
+
+	rtp_seek_unsupported(decoder);
+
+	for (;;) {
+		buf = rtp_buffer_get(&rtp, RTP_PACKET_MAX);
+
+		ret = recv(fd, buf->data, RTP_PACKET_MAX, 0);
+
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			SYNTAX_IPRINT("RTP stream stalled, ending\n");
+			rtp_buffer_put(&rtp, buf);
+			break;
+		}
+
+		if (ret < 0) {
+			perror("Failed to receive RTP packet");
+			abort();
+		}
+
+		/* Stream is waited for as long as it takes to start.  */
+		if (!rtp.synced) {
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+				   sizeof(timeout));
+		}
+
+		rtp_packet(decoder, &rtp, buf->data, ret);
+		rtp_buffer_put(&rtp, buf);
+	}
+
+	decoder_flush(decoder);
+	rtp_session_free(&rtp);
+}
+
+static uint32_t pcap_u32(pcap_file *pcap, const uint8_t *data)
+{
+	uint32_t val;
+
+	memcpy(&val, data, sizeof(val));
+
+	return pcap->swapped ? __builtin_bswap32(val) : val;
+}
+
+static int is_pcap(bitstream_reader *reader, pcap_file *pcap)
+{
+	const uint8_t *data;
+	uint32_t magic;
+
+	if (bitstream_wait(reader, PCAP_HEADER_SIZE) < PCAP_HEADER_SIZE) {
+		return 0;
+	}
+
+	data = bitstream_data(reader, 0, PCAP_HEADER_SIZE);
+
+	memcpy(&magic, data, sizeof(magic));
+
+	if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NS) {
+		pcap->swapped = 0;
+	} else if (__builtin_bswap32(magic) == PCAP_MAGIC ||
+			__builtin_bswap32(magic) == PCAP_MAGIC_NS) {
+		pcap->swapped = 1;
+	} else {
+		return 0;
+	}
+
+	pcap->linktype = pcap_u32(pcap, data + 20);
+
+	SYNTAX_IPRINT("pcap with link type %u identified\n", pcap->linktype);
+
+	return 1;
+}
+
+/* Whether the stream is a pcap capture, it isn't parsed.  */
+int probe_rtp_pcap(bitstream_reader *reader)
+{
+	pcap_file pcap;
+
+	return is_pcap(reader, &pcap);
+}
+
+/*
+ * UDP payload of the captured frame, NULL if it has none. Packets to other
+ * ports than that of the session are ignored.
+ */
+static const uint8_t * pcap_udp_payload(pcap_file *pcap, rtp_session *rtp,
+					const uint8_t *data, uint32_t *size)
+{
+	uint32_t pos = 0, ethertype = 0, ip_size, udp_size;
+	uint16_t port;
+
+	switch (pcap->linktype) {
+	case PCAP_LINK_NULL:
+		pos = 4;
+		break;
+	case PCAP_LINK_ETHERNET:
+		pos = 14;
+
+		if (*size < pos) {
+			return NULL;
+		}
+
+		ethertype = (data[12] << 8) | data[13];
+
+		if (ethertype == ETHERTYPE_VLAN && *size >= pos + 4) {
+			ethertype = (data[16] << 8) | data[17];
+			pos += 4;
+		}
+
+		if (ethertype != ETHERTYPE_IPV4 && ethertype != ETHERTYPE_IPV6) {
+			return NULL;
+		}
+		break;
+	case PCAP_LINK_RAW:
+		break;
+	case PCAP_LINK_LINUX_SLL:
+		pos = 16;
+		break;
+	default:
+		return NULL;
+	}
+
+	if (pos + 1 > *size) {
+		return NULL;
+	}
+
+	switch (data[pos] >> 4) {
+	case 4:
+		ip_size = (data[pos] & 0x0F) * 4;
+
+		/* Fragments aren't put together.  */
+		if (pos + 20 > *size || data[pos + 9] != IP_PROTO_UDP ||
+				((data[pos + 6] << 8 | data[pos + 7]) & 0x3FFF)) {
+			return NULL;
+		}
+		break;
+	case 6:
+		ip_size = 40;
+
+		if (pos + ip_size > *size || data[pos + 6] != IP_PROTO_UDP) {
+			return NULL;
+		}
+		break;
+	default:
+		return NULL;
+	}
+
+	pos += ip_size;
+
+	if (pos + 8 > *size) {
+		return NULL;
+	}
+
+	port = (data[pos + 2] << 8) | data[pos + 3];
+	udp_size = (data[pos + 4] << 8) | data[pos + 5];
+
+	if (rtp->synced && port != rtp->port) {
+		return NULL;
+	}
+
+	if (udp_size < 8 || pos + udp_size > *size) {
+		return NULL;
+	}
+
+	if (!rtp->synced) {
+		rtp->port = port;
+	}
+
+	*size = udp_size - 8;
+
+	return data + pos + 8;
+}
+
+/*
+ * Captured RTP session, the first UDP flow that carries H.264 is taken.
+ * Packets are parsed where they are in the input.
+ */
+int parse_rtp_pcap(decoder_context *decoder)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t offset = PCAP_HEADER_SIZE;
+	const uint8_t *data;
+	rtp_session rtp;
+	pcap_file pcap;
+	uint32_t size;
+
+	if (!is_pcap(reader, &pcap)) {
+		return 0;
+	}
+
+	bzero(&rtp, sizeof(rtp));
+
+	rtp_seek_unsupported(decoder);
+
+	for (;;) {
+		bitstream_release(reader, offset);
+
+		if (bitstream_wait(reader, offset + PCAP_RECORD_SIZE) <
+					offset + PCAP_RECORD_SIZE) {
+			break;
+		}
+
+		data = bitstream_data(reader, offset, PCAP_RECORD_SIZE);
+		size = pcap_u32(&pcap, data + 8);
+		offset += PCAP_RECORD_SIZE;
+
+		if (bitstream_wait(reader, offset + size) < offset + size) {
+			SYNTAX_WARN("pcap record is truncated\n");
+			break;
+		}
+
+		data = bitstream_data(reader, offset, size);
+		offset += size;
+
+		data = pcap_udp_payload(&pcap, &rtp, data, &size);
+		if (data == NULL) {
+			continue;
+		}
+
+		rtp_packet(decoder, &rtp, data, size);
+
+		/* Another UDP flow is looked for if this one isn't RTP.  */
+		if (!rtp.synced) {
+			rtp.port = 0;
+		}
+	}
+
+	decoder_flush(decoder);
+	rtp_session_free(&rtp);
+
+	return 1;
+}
@@ -17,48 +17,19 @@
 
 #include "common.h"
 
-static int is_end_of_NAL(bitstream_reader *reader, int NAL_start_delim)
-{
-	int no_more_data = (reader->data_offset >= reader->bitstream_end);
-
-	if (!NAL_start_delim) {
-		return no_more_data;
-	}
-
-	return no_more_data || is_NAL_start_code(reader);
-}
-
+/*
+ * Position compare with the rbsp_stop_one_bit that is located once per NAL,
+ * see bitstream_find_stop_bit().
+ */
 int more_rbsp_data(decoder_context *decoder)
 {
 	bitstream_reader *reader = &decoder->reader;
-	uint32_t data_offset = reader->data_offset;
-	uint8_t bit_shift = reader->bit_shift;
-
-	/* Check stop bit.  */
-	if (bitstream_read_u(reader, 1) == 0) {
-		goto more_data;
-	}
-
-	reader->rbsp_mode = 0;
 
-	if (bitstream_read_rbsp_align(reader) != 0) {
-		goto more_data;
-	}
-
-	while (!is_end_of_NAL(reader, decoder->NAL_start_delim)) {
-		if (bitstream_read_u(reader, 8) != 0) {
-			goto more_data;
-		}
+	if (reader->data_offset != reader->stop_bit_offset) {
+		return reader->data_offset < reader->stop_bit_offset;
 	}
 
-	return 0;
-
-more_data:
-	reader->rbsp_mode = 1;
-	reader->data_offset = data_offset;
-	reader->bit_shift = bit_shift;
-
-	return 1;
+	return reader->bit_shift < reader->stop_bit_shift;
 }
 
 void scaling_list(bitstream_reader *reader, int8_t *scalingList,
@@ -87,7 +58,7 @@ void scaling_list(bitstream_reader *reader, int8_t *scalingList,
 	}
 }
 
-void parse_SPS(decoder_context *decoder)
+decoder_context_sps * parse_SPS(decoder_context *decoder)
 {
 	bitstream_reader *reader = &decoder->reader;
 	decoder_context_sps *sps;
@@ -129,6 +100,8 @@ void parse_SPS(decoder_context *decoder)
 
 	decoder_reset_SPS(sps);
 
+	sps->seq_parameter_set_id = sps_id;
+
 	SYNTAX_IPRINT("profile_idc = %u\n", profile_idc);
 	SYNTAX_IPRINT("level_idc = %u\n", level_idc);
 	SYNTAX_IPRINT("constraint_set0_flag = %u\n", constraint_set0_flag);
@@ -189,7 +162,7 @@ void parse_SPS(decoder_context *decoder)
 
 		sps->seq_scaling_list_present_flag = 0;
 
-		for (i = 0; i < (sps->chroma_format_idc != 3) ? 8 : 12; i++) {
+		for (i = 0; i < ((sps->chroma_format_idc != 3) ? 8 : 12); i++) {
 			unsigned present_flag = bitstream_read_u(reader, 1);
 
 			sps->seq_scaling_list_present_flag |= present_flag << i;
@@ -343,7 +316,7 @@ void parse_SPS(decoder_context *decoder)
 		      sps->vui_parameters_present_flag);
 
 	if (sps->vui_parameters_present_flag) {
-		SPS_vui_parameters(decoder);
+		SPS_vui_parameters(decoder, sps);
 	}
 
 	if (more_rbsp_data(decoder)) {
@@ -351,4 +324,6 @@ void parse_SPS(decoder_context *decoder)
 	}
 
 	sps->valid = 1;
+
+	return sps;
 }
@@ -0,0 +1,514 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "syntax_parse.h"
+
+#include "common.h"
+
+#define TS_PACKET_SIZE		188
+#define TS_SYNC_BYTE		0x47
+#define TS_PID_PAT		0x0000
+#define TS_PID_NONE		0xFFFF
+#define TS_STREAM_TYPE_H264	0x1B
+
+/* Packets whose sync bytes are checked by is_TS().  */
+#define TS_PROBE_PACKETS	3
+
+/*
+ * H.264 PES payloads of a PID form an Annex B byte stream. NALs that end
+ * within the packet they start in are parsed in place, a NAL that spans
+ * packets is gathered in the buffer and parsed from there. Until the first
+ * start code is found the buffer holds the bytes that may begin it.
+ */
+typedef struct ts_demux {
+	unsigned packet_size;
+	uint32_t pmt_pid;
+	uint32_t video_pid;
+	unsigned cc;
+	unsigned cc_valid:1;
+	unsigned synced:1;
+
+	int64_t pes_pts;
+	int64_t pes_dts;
+	int64_t nal_pts;
+	int64_t nal_dts;
+
+	uint8_t *nal;
+	uint32_t nal_size;
+	uint32_t nal_max;
+} ts_demux;
+
+static int is_TS(bitstream_reader *reader, ts_demux *ts)
+{
+	static const unsigned sizes[] = { 188, 192 };
+	const uint8_t *data;
+	uint64_t end;
+	unsigned i, j;
+
+	end = bitstream_wait(reader, 192 * TS_PROBE_PACKETS);
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		if (end < sizes[i] * TS_PROBE_PACKETS) {
+			continue;
+		}
+
+		data = bitstream_data(reader, 0, sizes[i] * TS_PROBE_PACKETS);
+
+		/* 192 bytes packets carry a 4 bytes timecode in front.  */
+		for (j = 0; j < TS_PROBE_PACKETS; j++) {
+			if (data[sizes[i] * j + sizes[i] - TS_PACKET_SIZE] !=
+							TS_SYNC_BYTE) {
+				break;
+			}
+		}
+
+		if (j == TS_PROBE_PACKETS) {
+			ts->packet_size = sizes[i];
+
+			SYNTAX_IPRINT("MPEG-TS with %u bytes packets "
+				      "identified\n", sizes[i]);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int64_t read_timestamp(const uint8_t *data)
+{
+	return ((int64_t) (data[0] & 0x0E) << 29) |
+		(data[1] << 22) | ((data[2] & 0xFE) << 14) |
+		(data[3] << 7) | (data[4] >> 1);
+}
+
+/* PSI section of the packet, sections spanning packets aren't supported.  */
+static const uint8_t * ts_section(const uint8_t *data, unsigned size,
+				  unsigned *section_size)
+{
+	unsigned pointer_field;
+	unsigned length;
+
+	if (size < 1) {
+		return NULL;
+	}
+
+	pointer_field = data[0];
+
+	if (1 + pointer_field + 3 > size) {
+		return NULL;
+	}
+
+	data += 1 + pointer_field;
+	size -= 1 + pointer_field;
+
+	length = ((data[1] & 0x0F) << 8) | data[2];
+
+	/* Section header and CRC_32.  */
+	if (length < 9 || 3 + length > size) {
+		SYNTAX_WARN("PSI section doesn't fit the packet\n");
+		return NULL;
+	}
+
+	*section_size = 3 + length - 4;
+
+	return data;
+}
+
+static void ts_parse_PAT(ts_demux *ts, const uint8_t *data, unsigned size)
+{
+	unsigned section_size, program, pos;
+	const uint8_t *section;
+
+	section = ts_section(data, size, &section_size);
+	if (section == NULL || section[0] != 0x00) {
+		return;
+	}
+
+	/* The first program that isn't the network PID is taken.  */
+	for (pos = 8; pos + 4 <= section_size; pos += 4) {
+		program = (section[pos] << 8) | section[pos + 1];
+
+		if (program != 0) {
+			ts->pmt_pid = ((section[pos + 2] & 0x1F) << 8) |
+					section[pos + 3];
+
+			SYNTAX_IPRINT("PAT: program %u, PMT PID 0x%X\n",
+				      program, ts->pmt_pid);
+			return;
+		}
+	}
+}
+
+static void ts_parse_PMT(ts_demux *ts, const uint8_t *data, unsigned size)
+{
+	unsigned section_size, info_length, stream_type, pid, pos;
+	const uint8_t *section;
+
+	section = ts_section(data, size, &section_size);
+	if (section == NULL || section[0] != 0x02) {
+		return;
+	}
+
+	info_length = ((section[10] & 0x0F) << 8) | section[11];
+
+	for (pos = 12 + info_length; pos + 5 <= section_size; ) {
+		stream_type = section[pos];
+		pid = ((section[pos + 1] & 0x1F) << 8) | section[pos + 2];
+		info_length = ((section[pos + 3] & 0x0F) << 8) | section[pos + 4];
+
+		SYNTAX_IPRINT("PMT: stream_type 0x%02X, PID 0x%X\n",
+			      stream_type, pid);
+
+		if (stream_type == TS_STREAM_TYPE_H264) {
+			ts->video_pid = pid;
+			return;
+		}
+
+		pos += 5 + info_length;
+	}
+}
+
+static void ts_buffer_nal(ts_demux *ts, const uint8_t *data, uint32_t size)
+{
+	if (ts->nal_size + size > ts->nal_max) {
+		ts->nal_max = max(ts->nal_max * 2, ts->nal_size + size);
+		ts->nal = realloc(ts->nal, ts->nal_max);
+		if (ts->nal == NULL) {
+			perror("Failed to grow TS NAL buffer");
+			abort();
+		}
+	}
+
+	memcpy(ts->nal + ts->nal_size, data, size);
+	ts->nal_size += size;
+}
+
+static void ts_parse_result(int ret)
+{
+	if (ret == BITSTREAM_MALFORMED) {
+		SYNTAX_WARN("Malformed NAL is skipped\n");
+	}
+}
+
+/* NAL that is in the stream as is, without start code.  */
+static void ts_parse_NAL(decoder_context *decoder, uint64_t offset,
+			 uint32_t size, int64_t pts, int64_t dts)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t orig_end = reader->bitstream_end;
+
+	if (size == 0) {
+		return;
+	}
+
+	reader->data_offset = offset;
+	reader->bit_shift = 0;
+	reader->bitstream_end = offset + size;
+	reader->NAL_end = reader->bitstream_end;
+
+	decoder->pts = pts;
+	decoder->dts = dts;
+
+	SYNTAX_IPRINT("+++++++++++++++\n");
+
+	ts_parse_result(try_parse_NAL(decoder));
+
+	SYNTAX_IPRINT("---------------\n\n");
+
+	reader->bitstream_end = orig_end;
+	reader->bit_shift = 0;
+}
+
+/* NAL gathered from packets, reader is pointed to the buffer meanwhile.  */
+static void ts_parse_buffered(decoder_context *decoder, ts_demux *ts,
+			      uint32_t size)
+{
+	bitstream_reader reader = decoder->reader;
+
+	/* Zero byte of the 4 bytes start code that is split by packets.  */
+	while (size > 0 && ts->nal[size - 1] == 0x00) {
+		size--;
+	}
+
+	if (size != 0) {
+		bitstream_init(&decoder->reader, ts->nal, size);
+
+		decoder->pts = ts->nal_pts;
+		decoder->dts = ts->nal_dts;
+
+		SYNTAX_IPRINT("+++++++++++++++\n");
+
+		ts_parse_result(try_parse_NAL(decoder));
+
+		SYNTAX_IPRINT("---------------\n\n");
+
+		decoder->reader = reader;
+	}
+
+	ts->nal_size = 0;
+}
+
+/*
+ * Offset of the payload data that follows the start code ending the buffered
+ * NAL, start code may straddle the payloads. Returns -1 if there is none and
+ * stores the buffered NAL size to nal_size otherwise.
+ */
+static int64_t ts_buffered_end(ts_demux *ts, const uint8_t *data,
+			      uint32_t size, uint32_t *nal_size)
+{
+	uint8_t edge[6];
+	uint32_t tail = min(ts->nal_size, 3);
+	uint32_t code;
+	int code_size;
+	unsigned i, n;
+
+	n = tail + min(size, 3);
+
+	memcpy(edge, ts->nal + ts->nal_size - tail, tail);
+	memcpy(edge + tail, data, n - tail);
+
+	for (i = 0; i < tail && i + 3 <= n; i++) {
+		if (edge[i] == 0x00 && edge[i + 1] == 0x00 &&
+				edge[i + 2] == 0x01) {
+			*nal_size = ts->nal_size - tail + i;
+			return i + 3 - tail;
+		}
+	}
+
+	code_size = find_start_code(data, 0, size, &code);
+	if (code_size) {
+		ts_buffer_nal(ts, data, code);
+
+		*nal_size = ts->nal_size;
+		return code + code_size;
+	}
+
+	return -1;
+}
+
+static void ts_payload(decoder_context *decoder, ts_demux *ts,
+		       uint64_t offset, uint32_t size)
+{
+	bitstream_reader *reader = &decoder->reader;
+	const uint8_t *data = bitstream_data(reader, offset, size);
+	uint32_t pos = 0, code, nal_size;
+	int64_t next;
+	int code_size;
+
+	next = ts_buffered_end(ts, data, size, &nal_size);
+
+	if (next < 0) {
+		ts_buffer_nal(ts, data, size);
+
+		/* Only a start code that is split by packets matters for sync.  */
+		if (!ts->synced && ts->nal_size > 3) {
+			memmove(ts->nal, ts->nal + ts->nal_size - 3, 3);
+			ts->nal_size = 3;
+		}
+		return;
+	}
+
+	if (ts->synced) {
+		ts_parse_buffered(decoder, ts, nal_size);
+		data = bitstream_data(reader, offset, size);
+	} else {
+		ts->nal_size = 0;
+		ts->synced = 1;
+	}
+
+	pos = next;
+
+	for (;;) {
+		code_size = find_start_code(data, pos, size, &code);
+		if (!code_size) {
+			break;
+		}
+
+		ts_parse_NAL(decoder, offset + pos, code - pos,
+			     ts->pes_pts, ts->pes_dts);
+
+		data = bitstream_data(reader, offset, size);
+		pos = code + code_size;
+	}
+
+	ts->nal_pts = ts->pes_pts;
+	ts->nal_dts = ts->pes_dts;
+
+	ts_buffer_nal(ts, data + pos, size - pos);
+}
+
+/* PES header of the packet that starts a PES, returns its size.  */
+static int ts_PES_header(ts_demux *ts, const uint8_t *data, unsigned size)
+{
+	unsigned flags, header_size;
+
+	if (size < 9 || data[0] != 0x00 || data[1] != 0x00 || data[2] != 0x01) {
+		SYNTAX_WARN("PES header is malformed\n");
+		return -1;
+	}
+
+	flags = data[7] >> 6;
+	header_size = 9 + data[8];
+
+	if (header_size > size) {
+		SYNTAX_WARN("PES header doesn't fit the packet\n");
+		return -1;
+	}
+
+	ts->pes_pts = TIMESTAMP_NONE;
+	ts->pes_dts = TIMESTAMP_NONE;
+
+	if ((flags & 2) && header_size >= 14) {
+		ts->pes_pts = read_timestamp(data + 9);
+		ts->pes_dts = ts->pes_pts;
+	}
+
+	if (flags == 3 && header_size >= 19) {
+		ts->pes_dts = read_timestamp(data + 14);
+	}
+
+	SYNTAX_IPRINT("PES: stream_id 0x%02X, PTS %" PRId64 ", DTS %" PRId64
+		      "\n", data[3], ts->pes_pts, ts->pes_dts);
+
+	return header_size;
+}
+
+static void ts_packet(decoder_context *decoder, ts_demux *ts, uint64_t offset)
+{
+	bitstream_reader *reader = &decoder->reader;
+	const uint8_t *data = bitstream_data(reader, offset, TS_PACKET_SIZE);
+	unsigned pusi, pid, afc, cc;
+	unsigned pos = 4;
+	int header_size;
+
+	if (data[0] != TS_SYNC_BYTE) {
+		SYNTAX_WARN("TS packet at 0x%" PRIX64 " lost sync\n", offset);
+		return;
+	}
+
+	pusi = (data[1] >> 6) & 1;
+	pid = ((data[1] & 0x1F) << 8) | data[2];
+	afc = (data[3] >> 4) & 3;
+	cc = data[3] & 0x0F;
+
+	/*
+	 * Adaptation field is skipped, timestamps of the pictures are of
+	 * their PES packets and the PCR isn't needed for decoding.
+	 */
+	if (afc & 2) {
+		pos += 1 + data[4];
+	}
+
+	if (!(afc & 1) || pos >= TS_PACKET_SIZE) {
+		return;
+	}
+
+	if (pid == TS_PID_PAT) {
+		ts_parse_PAT(ts, data + pos, TS_PACKET_SIZE - pos);
+		return;
+	}
+
+	if (pid == ts->pmt_pid && ts->video_pid == TS_PID_NONE) {
+		ts_parse_PMT(ts, data + pos, TS_PACKET_SIZE - pos);
+		return;
+	}
+
+	if (pid != ts->video_pid) {
+		return;
+	}
+
+	/* Data of the lost packet is gone, so is the NAL that it was of.  */
+	if (ts->cc_valid && cc != ((ts->cc + 1) & 0x0F)) {
+		SYNTAX_WARN("TS packet of PID 0x%X is lost at 0x%" PRIX64 "\n",
+			    pid, offset);
+		ts->nal_size = 0;
+		ts->synced = 0;
+	}
+
+	ts->cc = cc;
+	ts->cc_valid = 1;
+
+	if (pusi) {
+		header_size = ts_PES_header(ts, data + pos,
+					    TS_PACKET_SIZE - pos);
+		if (header_size < 0) {
+			return;
+		}
+
+		pos += header_size;
+	}
+
+	if (pos < TS_PACKET_SIZE) {
+		ts_payload(decoder, ts, offset + pos, TS_PACKET_SIZE - pos);
+	}
+}
+
+/* Whether the stream is MPEG-TS, it isn't parsed.  */
+int probe_ts(bitstream_reader *reader)
+{
+	ts_demux ts;
+
+	bzero(&ts, sizeof(ts));
+
+	return is_TS(reader, &ts);
+}
+
+int parse_ts(decoder_context *decoder)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t offset, end;
+	ts_demux ts;
+
+	bzero(&ts, sizeof(ts));
+
+	if (!is_TS(reader, &ts)) {
+		return 0;
+	}
+
+	ts.pmt_pid = TS_PID_NONE;
+	ts.video_pid = TS_PID_NONE;
+	ts.pes_pts = TIMESTAMP_NONE;
+	ts.pes_dts = TIMESTAMP_NONE;
+
+	if (decoder->seek.unit != SEEK_NONE) {
+		SYNTAX_WARN("MPEG-TS can't be seeked, decoding from the start\n");
+		decoder_seek_done(decoder);
+	}
+
+	for (offset = 0; ; offset += ts.packet_size) {
+		bitstream_release(reader, offset);
+
+		end = offset + ts.packet_size;
+
+		if (bitstream_wait(reader, end) < end) {
+			break;
+		}
+
+		ts_packet(decoder, &ts, end - TS_PACKET_SIZE);
+	}
+
+	/* The last NAL ends with the stream.  */
+	if (ts.synced) {
+		ts_parse_buffered(decoder, &ts, ts.nal_size);
+	}
+
+	decoder_flush(decoder);
+
+	free(ts.nal);
+
+	return 1;
+}
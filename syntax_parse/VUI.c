@@ -50,7 +50,7 @@ static void hrd_parameters(decoder_context *decoder)
 		      bitstream_read_u(reader, 5));
 }
 
-void SPS_vui_parameters(decoder_context *decoder)
+void SPS_vui_parameters(decoder_context *decoder, decoder_context_sps *sps)
 {
 	bitstream_reader *reader = &decoder->reader;
 	unsigned aspect_ratio_info_present_flag;
@@ -136,10 +136,12 @@ void SPS_vui_parameters(decoder_context *decoder)
 		      timing_info_present_flag);
 
 	if (timing_info_present_flag) {
+		sps->num_units_in_tick = bitstream_read_u(reader, 32);
+		sps->time_scale = bitstream_read_u(reader, 32);
+
 		SYNTAX_VPRINT("num_units_in_tick = %u\n",
-			      bitstream_read_u(reader, 32));
-		SYNTAX_VPRINT("time_scale = %u\n",
-			      bitstream_read_u(reader, 32));
+			      sps->num_units_in_tick);
+		SYNTAX_VPRINT("time_scale = %u\n", sps->time_scale);
 		SYNTAX_VPRINT("fixed_frame_rate_flag = %u\n",
 			      bitstream_read_u(reader, 1));
 	}
@@ -175,6 +177,8 @@ void SPS_vui_parameters(decoder_context *decoder)
 	SYNTAX_VPRINT("bitstream_restriction_flag = %u\n",
 		      bitstream_restriction_flag);
 
+	sps->bitstream_restriction_flag = bitstream_restriction_flag;
+
 	if (bitstream_restriction_flag) {
 		SYNTAX_VPRINT("motion_vectors_over_pic_boundaries_flag = %u\n",
 			      bitstream_read_u(reader, 1));
@@ -186,8 +190,10 @@ void SPS_vui_parameters(decoder_context *decoder)
 			      bitstream_read_ue(reader));
 		SYNTAX_VPRINT("log2_max_mv_length_vertical = %u\n",
 			      bitstream_read_ue(reader));
+		sps->max_num_reorder_frames = bitstream_read_ue(reader);
+
 		SYNTAX_VPRINT("max_num_reorder_frames = %u\n",
-			      bitstream_read_ue(reader));
+			      sps->max_num_reorder_frames);
 		SYNTAX_VPRINT("max_dec_frame_buffering = %u\n",
 			      bitstream_read_ue(reader));
 	}
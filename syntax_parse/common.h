@@ -18,6 +18,7 @@
 #ifndef SYNTAX_COMMON_H
 #define SYNTAX_COMMON_H
 
+#include <inttypes.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -26,6 +27,7 @@
 
 #include "bitstream.h"
 #include "decoder.h"
+#include "nal_index.h"
 #include "syntax_parse.h"
 
 #define SYNTAX_WARN(f, ...)				\
@@ -38,7 +40,7 @@
 #define SYNTAX_ERR(f, ...)				\
 {							\
 	SYNTAX_WARN(f, ## __VA_ARGS__)			\
-	exit(EXIT_FAILURE);				\
+	syntax_error();					\
 }
 
 // #define SYNTAX_IPRINT(f, ...)	printf("@%d " f, reader->data_offset*8 + reader->bit_shift, ## __VA_ARGS__)
@@ -59,33 +61,43 @@
 #define clz	__builtin_clz
 #endif
 
+/* NAL header h starts a picture, its first slice has first_mb_in_slice 0.  */
+#define IS_PICTURE_START(h)	\
+	((((h)[0] & 0x1F) == 1 || ((h)[0] & 0x1F) == 5) && ((h)[1] & 0x80))
+
 #define I_NxN	0
 #define I_PCM	25
 
-int seek_to_NAL_start(bitstream_reader *reader);
+void syntax_error(void);
 
-int is_NAL_start_code(bitstream_reader *reader);
+int seek_to_NAL_start(bitstream_reader *reader);
 
 void parse_NAL(decoder_context *decoder);
 
+int try_parse_NAL(decoder_context *decoder);
+
+double seek_fps(decoder_context *decoder);
+
 void scaling_list(bitstream_reader *reader, int8_t *scalingList,
 		  unsigned sizeOfScalingList,
 		  unsigned *useDefaultScalingMatrixFlag);
 
-void parse_SPS(decoder_context *decoder);
+decoder_context_sps * parse_SPS(decoder_context *decoder);
 
-void parse_PPS(decoder_context *decoder);
+decoder_context_pps * parse_PPS(decoder_context *decoder);
 
-void parse_slice_header(decoder_context *decoder);
+int AU_first_slice(decoder_context *decoder);
 
-int more_rbsp_data(decoder_context *decoder);
+int AU_general_slice(decoder_context *decoder);
 
-void SPS_vui_parameters(decoder_context *decoder);
+int AU_skip_slice(decoder_context *decoder);
 
-void decoder_reset_SPS(decoder_context_sps *sps);
+int parse_slice_header_prefix(decoder_context *decoder);
 
-void decoder_reset_PPS(decoder_context_pps *pps);
+void parse_slice_header(decoder_context *decoder);
+
+int more_rbsp_data(decoder_context *decoder);
 
-void decoder_reset_SH(decoder_context *decoder);
+void SPS_vui_parameters(decoder_context *decoder, decoder_context_sps *sps);
 
 #endif // SYNTAX_COMMON_H
@@ -0,0 +1,551 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "common.h"
+
+#define NAL_INDEX_MIN_ENTRIES	4096
+
+/*
+ * NAL boundaries of a file are found up front by the parallel start codes
+ * scan, leaving only the NAL headers to be parsed in sequence. Malformed
+ * NAL bails out to nal_index_build().
+ */
+static void index_annex_b(decoder_context *decoder)
+{
+	bitstream_reader *reader = &decoder->reader;
+	bitstream_start_code *codes;
+	uint64_t codes_nb, i;
+	int ret;
+
+	if (reader->ring != NULL) {
+		do {
+			ret = parse_annex_b_NAL(decoder);
+
+			if (ret == PARSE_NAL_MALFORMED) {
+				bitstream_bail(reader, BITSTREAM_MALFORMED);
+			}
+		} while (ret < PARSE_NEED_DATA);
+
+		decoder_flush(decoder);
+		return;
+	}
+
+	codes_nb = bitstream_scan_start_codes(reader->fd, reader->file_size, 0,
+					      &codes);
+
+	for (i = 0; i < codes_nb; i++) {
+		reader->data_offset = codes[i].offset + codes[i].size;
+		reader->bit_shift = 0;
+
+		if (i + 1 < codes_nb) {
+			reader->NAL_end = codes[i + 1].offset;
+		} else {
+			reader->NAL_end = reader->bitstream_end;
+		}
+
+		SYNTAX_IPRINT("+++++++++++++++\n");
+
+		if (try_parse_NAL(decoder) == BITSTREAM_MALFORMED) {
+			free(codes);
+			bitstream_bail(reader, BITSTREAM_MALFORMED);
+		}
+
+		SYNTAX_IPRINT("---------------\n\n");
+	}
+
+	free(codes);
+}
+
+/*
+ * Walk the whole stream with the parser alone. Parameter sets are parsed
+ * fully, slices up to frame_num, nothing is decoded. Only MP4 and Annex B
+ * are indexed, NULL is returned for the other containers and for a stream
+ * that is malformed beyond its NALs.
+ */
+nal_index * nal_index_build(int fd, uint64_t size)
+{
+	decoder_context *decoder;
+	nal_index *index;
+	jmp_buf bail;
+	int unsupported = 0;
+	int ret;
+
+	index = calloc(1, sizeof(*index));
+	decoder = malloc(sizeof(*decoder));
+
+	if (index == NULL || decoder == NULL) {
+		perror("Failed to allocate NAL index");
+		abort();
+	}
+
+	decoder_init_parser(decoder, fd, size);
+	decoder->indexing = index;
+
+	/*
+	 * MP4 parsing ends by running out of the stream, malformed NALs are
+	 * skipped by it. Index that stops at other malformed data would be
+	 * incomplete, it is dropped.
+	 */
+	ret = setjmp(bail);
+
+	if (ret == 0) {
+		decoder->reader.bail = &bail;
+
+		if (probe_mkv(&decoder->reader) ||
+		    probe_ts(&decoder->reader) ||
+		    probe_rtp_pcap(&decoder->reader)) {
+			unsupported = 1;
+		} else if (!parse_mp4(decoder)) {
+			index_annex_b(decoder);
+		}
+	}
+
+	decoder_close_parser(decoder);
+	free(decoder);
+
+	if (ret == BITSTREAM_MALFORMED) {
+		fprintf(stderr, "Stream is malformed, it isn't indexed\n");
+		unsupported = 1;
+	}
+
+	if (unsupported) {
+		nal_index_free(index);
+		return NULL;
+	}
+
+	return index;
+}
+
+void nal_index_add(nal_index *index, decoder_context *decoder)
+{
+	bitstream_reader *reader = &decoder->reader;
+	nal_index_entry *entry;
+
+	if (index->entries_nb == index->entries_max) {
+		index->entries_max = max(index->entries_max * 2,
+					 NAL_INDEX_MIN_ENTRIES);
+		index->entries = realloc(index->entries,
+				index->entries_max * sizeof(*index->entries));
+		if (index->entries == NULL) {
+			perror("Failed to grow NAL index");
+			abort();
+		}
+	}
+
+	entry = &index->entries[index->entries_nb++];
+	bzero(entry, sizeof(*entry));
+
+	entry->offset = reader->NAL_offset;
+	entry->size = reader->NAL_end - reader->NAL_offset;
+	entry->unit_type = decoder->nal.unit_type;
+	entry->ref_idc = decoder->nal.ref_idc;
+	entry->pts = decoder->pts;
+	entry->dts = decoder->dts;
+
+	if (entry->unit_type != 1 && entry->unit_type != 5) {
+		return;
+	}
+
+	entry->first_mb_in_slice = decoder->sh.first_mb_in_slice;
+	entry->frame_num = decoder->sh.frame_num;
+	entry->slice_type = decoder->sh.slice_type;
+
+	if (IdrPicFlag) {
+		entry->flags |= NAL_INDEX_IDR;
+	}
+}
+
+/*
+ * Sidecar is written to a temporary file that replaces the old one, so that
+ * a concurrent loader never sees it half-written. Returns 0 on success.
+ */
+int nal_index_save(nal_index *index, const char *path, const struct stat *sb)
+{
+	nal_index_header header;
+	char *tmp_path;
+	FILE *fp;
+	int err;
+
+	tmp_path = malloc(strlen(path) + 5);
+	if (tmp_path == NULL) {
+		return -1;
+	}
+
+	sprintf(tmp_path, "%s.tmp", path);
+
+	fp = fopen(tmp_path, "w");
+	if (fp == NULL) {
+		free(tmp_path);
+		return -1;
+	}
+
+	bzero(&header, sizeof(header));
+	memcpy(header.magic, NAL_INDEX_MAGIC, sizeof(header.magic));
+	header.version = NAL_INDEX_VERSION;
+	header.entry_size = sizeof(nal_index_entry);
+	header.file_size = sb->st_size;
+	header.mtime_sec = sb->st_mtim.tv_sec;
+	header.mtime_nsec = sb->st_mtim.tv_nsec;
+	header.entries_nb = index->entries_nb;
+
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(index->entries, sizeof(nal_index_entry), index->entries_nb, fp);
+
+	err = ferror(fp);
+	err |= fclose(fp);
+
+	if (err == 0) {
+		err = rename(tmp_path, path);
+	}
+
+	if (err != 0) {
+		unlink(tmp_path);
+	}
+
+	free(tmp_path);
+
+	return err ? -1 : 0;
+}
+
+/*
+ * Map the sidecar of the stream described by sb. Returns NULL if there is
+ * none or it is stale, corrupted or of other version.
+ */
+nal_index * nal_index_load(const char *path, const struct stat *sb)
+{
+	const nal_index_header *header;
+	nal_index *index;
+	struct stat isb;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	if (fstat(fd, &isb) == -1 || isb.st_size < sizeof(*header)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, isb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	header = map;
+
+	if (memcmp(header->magic, NAL_INDEX_MAGIC, sizeof(header->magic)) ||
+	    header->version != NAL_INDEX_VERSION ||
+	    header->entry_size != sizeof(nal_index_entry) ||
+	    header->file_size != sb->st_size ||
+	    header->mtime_sec != sb->st_mtim.tv_sec ||
+	    header->mtime_nsec != sb->st_mtim.tv_nsec ||
+	    header->entries_nb != (isb.st_size - sizeof(*header)) /
+					sizeof(nal_index_entry) ||
+	    (isb.st_size - sizeof(*header)) % sizeof(nal_index_entry)) {
+		munmap(map, isb.st_size);
+		return NULL;
+	}
+
+	index = calloc(1, sizeof(*index));
+	if (index == NULL) {
+		perror("Failed to allocate NAL index");
+		abort();
+	}
+
+	index->entries = (nal_index_entry *) (header + 1);
+	index->entries_nb = header->entries_nb;
+	index->map = map;
+	index->map_size = isb.st_size;
+
+	return index;
+}
+
+/*
+ * Sidecar index of the stream at path, it is (re)built if missing or stale.
+ * Returns NULL if the stream can't be indexed.
+ */
+nal_index * nal_index_open(const char *path, int fd, const struct stat *sb)
+{
+	nal_index *index;
+	char *idx_path;
+
+	idx_path = malloc(strlen(path) + sizeof(NAL_INDEX_SUFFIX));
+	if (idx_path == NULL) {
+		perror("Failed to allocate NAL index path");
+		abort();
+	}
+
+	sprintf(idx_path, "%s" NAL_INDEX_SUFFIX, path);
+
+	index = nal_index_load(idx_path, sb);
+	if (index == NULL) {
+		index = nal_index_build(fd, sb->st_size);
+
+		if (index != NULL &&
+				nal_index_save(index, idx_path, sb) != 0) {
+			fprintf(stderr, "Failed to save NAL index %s\n",
+				idx_path);
+		}
+	}
+
+	free(idx_path);
+
+	return index;
+}
+
+void nal_index_free(nal_index *index)
+{
+	if (index->map != NULL) {
+		munmap(index->map, index->map_size);
+	} else {
+		free(index->entries);
+	}
+
+	free(index->sync_points);
+	free(index);
+}
+
+static void parse_entry(decoder_context *decoder, nal_index_entry *entry)
+{
+	bitstream_reader *reader = &decoder->reader;
+
+	reader->data_offset = entry->offset;
+	reader->bit_shift = 0;
+	reader->bitstream_end = entry->offset + entry->size;
+	reader->NAL_end = reader->bitstream_end;
+
+	decoder->pts = entry->pts;
+	decoder->dts = entry->dts;
+
+	bitstream_release(reader, entry->offset);
+
+	SYNTAX_IPRINT("+++++++++++++++\n");
+
+	parse_NAL(decoder);
+
+	SYNTAX_IPRINT("---------------\n\n");
+}
+
+/*
+ * IDR pictures of the stream and their picture numbers in decoding order.
+ * Table is made once per index, seeks look it up by bisection.
+ */
+static void build_sync_points(nal_index *index)
+{
+	nal_index_entry *entry;
+	uint64_t pictures_nb = 0;
+	uint64_t max = 0;
+	uint64_t i;
+
+	for (i = 0; i < index->entries_nb; i++) {
+		entry = &index->entries[i];
+
+		if ((entry->unit_type != 1 && entry->unit_type != 5) ||
+				entry->first_mb_in_slice != 0) {
+			continue;
+		}
+
+		pictures_nb++;
+
+		if (!(entry->flags & NAL_INDEX_IDR)) {
+			continue;
+		}
+
+		if (index->sync_nb == max) {
+			max = max ? max * 2 : 256;
+			index->sync_points = realloc(index->sync_points,
+					max * sizeof(*index->sync_points));
+			if (index->sync_points == NULL) {
+				perror("Failed to grow sync points table");
+				abort();
+			}
+		}
+
+		index->sync_points[index->sync_nb].entry = i;
+		index->sync_points[index->sync_nb].picture = pictures_nb - 1;
+		index->sync_nb++;
+	}
+}
+
+/* Frame rate of the VUI timing info of a parsed SPS, 25 if there is none.  */
+double seek_fps(decoder_context *decoder)
+{
+	decoder_context_sps *sps;
+	int id;
+
+	for (id = 0; id < ARRAY_SIZE(decoder->sps); id++) {
+		sps = &decoder->sps[id];
+
+		if (sps->valid && sps->time_scale && sps->num_units_in_tick) {
+			return sps->time_scale / (2.0 * sps->num_units_in_tick);
+		}
+	}
+
+	SYNTAX_WARN("Stream has no timing info, seeking at 25 fps\n");
+
+	return 25;
+}
+
+/* Frame rate of the first SPS of the index.  */
+static double index_fps(decoder_context *decoder, nal_index *index)
+{
+	uint64_t i;
+
+	for (i = 0; i < index->entries_nb; i++) {
+		if (index->entries[i].unit_type == 7) {
+			parse_entry(decoder, &index->entries[i]);
+			break;
+		}
+	}
+
+	return seek_fps(decoder);
+}
+
+/*
+ * Last sync point at or before the target, the first one if there is none.
+ * Target is a picture number, or a pts of the sync pictures if by_pts is set.
+ */
+static uint64_t find_sync_point(nal_index *index, int64_t target, int by_pts)
+{
+	nal_sync_point *sync;
+	uint64_t lo, hi, mid;
+	int64_t key;
+
+	/* First sync point past the target, the one before it is taken.  */
+	for (lo = 0, hi = index->sync_nb; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		sync = &index->sync_points[mid];
+		key = by_pts ? index->entries[sync->entry].pts : sync->picture;
+
+		if (key <= target) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo ? lo - 1 : 0;
+}
+
+/*
+ * Resync on the IDR picture at or before the seek target. Time target is
+ * looked up by the container pts of the IDRs, raw Annex B has none and the
+ * time is converted to a picture number by the frame rate. Parameter sets are
+ * parsed from the ones ahead of that IDR, back to the previous IDR or, if it
+ * has no SPS and PPS in between, further back till they are found. Returns
+ * the entry number of the IDR's first slice.
+ */
+static uint64_t nal_index_seek(decoder_context *decoder, nal_index *index)
+{
+	seek_target *seek = &decoder->seek;
+	nal_index_entry *entry;
+	uint64_t first, prev, lo, i;
+	int sps_found = 0;
+	int pps_found = 0;
+	int64_t pts;
+
+	if (index->sync_points == NULL) {
+		build_sync_points(index);
+	}
+
+	if (index->sync_nb == 0) {
+		SYNTAX_WARN("Stream has no IDR pictures to seek to\n");
+		decoder_seek_done(decoder);
+		return 0;
+	}
+
+	pts = index->entries[index->sync_points[0].entry].pts;
+
+	if (seek->unit == SEEK_TIME && pts != TIMESTAMP_NONE) {
+		lo = find_sync_point(index, seek->target * 9 / 100000, 1);
+	} else if (seek->unit == SEEK_TIME) {
+		lo = find_sync_point(index, seek->target *
+				     index_fps(decoder, index) / 1000000000, 0);
+	} else {
+		lo = find_sync_point(index, seek->target, 0);
+	}
+
+	first = index->sync_points[lo].entry;
+	prev = lo ? index->sync_points[lo - 1].entry : 0;
+
+	for (i = first; i > 0; i--) {
+		entry = &index->entries[i - 1];
+
+		sps_found |= (entry->unit_type == 7);
+		pps_found |= (entry->unit_type == 8);
+
+		if (i - 1 <= prev && sps_found && pps_found) {
+			break;
+		}
+	}
+
+	decoder_seek_done(decoder);
+
+	SYNTAX_IPRINT("Seek to picture %" PRIu64 ", NAL %" PRIu64 "\n",
+		      index->sync_points[lo].picture, first);
+
+	for (i = i ? i - 1 : 0; i < first; i++) {
+		entry = &index->entries[i];
+
+		if (entry->unit_type == 7 || entry->unit_type == 8) {
+			parse_entry(decoder, entry);
+		}
+	}
+
+	return first;
+}
+
+/*
+ * Parse count NALs starting from the entry number first. NAL boundaries are
+ * taken from the index, stream isn't scanned for start codes. Pending seek
+ * moves the start forward to the IDR picture of the seek target.
+ */
+void parse_indexed(decoder_context *decoder, nal_index *index,
+		   uint64_t first, uint64_t count)
+{
+	bitstream_reader *reader = &decoder->reader;
+	uint64_t orig_end = reader->bitstream_end;
+	uint64_t i;
+
+	if (decoder->seek.unit != SEEK_NONE) {
+		i = nal_index_seek(decoder, index);
+
+		if (i > first) {
+			count -= min(count, i - first);
+			first = i;
+		}
+	}
+
+	for (i = first; i - first < count && i < index->entries_nb; i++) {
+		parse_entry(decoder, &index->entries[i]);
+	}
+
+	decoder_flush(decoder);
+
+	reader->bitstream_end = orig_end;
+	reader->bit_shift = 0;
+}
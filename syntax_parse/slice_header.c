@@ -39,24 +39,18 @@ static const char * SLICE_TYPE(int type)
 	return "Bad value";
 }
 
-void parse_slice_header(decoder_context *decoder)
+/*
+ * Slice header up to frame_num, enough to tell pictures apart without
+ * touching the DPB. Activates the slice's PPS and SPS, returns slice_type
+ * as coded, sh.slice_type is reduced to the 0..4 range.
+ */
+int parse_slice_header_prefix(decoder_context *decoder)
 {
-	frame_data **DPB_frames = decoder->DPB_frames_array.frames;
-	frames_list *REF_frames_list;
 	bitstream_reader *reader = &decoder->reader;
 	decoder_context_sps *sps;
 	decoder_context_pps *pps;
-	unsigned wrapped_frame_num;
 	unsigned pps_id;
-	int max_frame_num;
-	int log2_max_pic_order_cnt_lsb = 0;
-	int pic_order_cnt_lsb = 0;
-	int PicOrderCntMsb = 0;
-	int MaxPicOrderCntLsb;
 	int slice_type;
-	int i;
-
-	decoder_reset_SH(decoder);
 
 	decoder->sh.first_mb_in_slice = bitstream_read_ue(reader);
 	decoder->sh.slice_type = bitstream_read_ue(reader);
@@ -81,8 +75,6 @@ void parse_slice_header(decoder_context *decoder)
 	decoder->active_sps = &decoder->sps[pps->seq_parameter_set_id];
 	sps = decoder->active_sps;
 
-	max_frame_num = 1 << (sps->log2_max_frame_num_minus4 + 4);
-
 	slice_type = decoder->sh.slice_type;
 	decoder->sh.slice_type %= 5;
 
@@ -97,6 +89,40 @@ void parse_slice_header(decoder_context *decoder)
 
 	SYNTAX_IPRINT("frame_num = %u\n", decoder->sh.frame_num);
 
+	return slice_type;
+}
+
+/*
+ * Syntax of the slice header, DPB isn't touched. List modifications and
+ * memory management operations are stored for apply_slice_header().
+ */
+void parse_slice_header(decoder_context *decoder)
+{
+	bitstream_reader *reader = &decoder->reader;
+	decoder_context_sps *sps;
+	decoder_context_pps *pps;
+	uint32_t modification_of_pic_nums_idc;
+	uint32_t memory_management_control_operation;
+	uint32_t difference_of_pic_nums_minus1;
+	uint32_t long_term_pic_num;
+	uint32_t long_term_frame_idx;
+	uint32_t max_long_term_frame_idx_plus1;
+	unsigned ref_pic_list_modification_flag;
+	unsigned adaptive_ref_pic_marking_mode_flag;
+	int32_t abs_diff_pic_num;
+	int slice_type;
+	int i, l;
+
+	decoder_reset_SH(decoder);
+
+	slice_type = parse_slice_header_prefix(decoder);
+
+	pps = decoder->active_pps;
+	sps = decoder->active_sps;
+
+	decoder->sh.pic_parameter_set_id = pps - decoder->pps;
+	decoder->sh.is_B_frame = (slice_type == B); // Not B_ONLY!
+
 	if (!sps->frame_mbs_only_flag) {
 		decoder->sh.field_pic_flag = bitstream_read_u(reader, 1);
 
@@ -114,15 +140,11 @@ void parse_slice_header(decoder_context *decoder)
 		decoder->sh.idr_pic_id = bitstream_read_ue(reader);
 
 		SYNTAX_IPRINT("idr_pic_id = %u\n", decoder->sh.idr_pic_id);
-
-		clear_DPB(decoder);
 	}
 
 	if (sps->pic_order_cnt_type == 0) {
-		log2_max_pic_order_cnt_lsb = sps->log2_max_pic_order_cnt_lsb_minus4 + 4;
-
-		decoder->sh.pic_order_cnt_lsb =
-			bitstream_read_u(reader, log2_max_pic_order_cnt_lsb);
+		decoder->sh.pic_order_cnt_lsb = bitstream_read_u(reader,
+				sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
 
 		SYNTAX_IPRINT("pic_order_cnt_lsb = %u\n",
 			      decoder->sh.pic_order_cnt_lsb);
@@ -135,30 +157,6 @@ void parse_slice_header(decoder_context *decoder)
 			SYNTAX_IPRINT("delta_pic_order_cnt_bottom = %d\n",
 				      decoder->sh.delta_pic_order_cnt_bottom);
 		}
-
-		if (IdrPicFlag) {
-			decoder->prevPicOrderCntLsb = 0;
-			decoder->prevPicOrderCntMsb = 0;
-		}
-
-		pic_order_cnt_lsb = decoder->sh.pic_order_cnt_lsb;
-
-		MaxPicOrderCntLsb = (1 << log2_max_pic_order_cnt_lsb);
-
-		if ((pic_order_cnt_lsb < decoder->prevPicOrderCntLsb) &&
-			((decoder->prevPicOrderCntLsb - pic_order_cnt_lsb) >= (MaxPicOrderCntLsb / 2)))
-		{
-			PicOrderCntMsb = decoder->prevPicOrderCntMsb + MaxPicOrderCntLsb;
-		} else if ((pic_order_cnt_lsb > decoder->prevPicOrderCntLsb) &&
-			((pic_order_cnt_lsb - decoder->prevPicOrderCntLsb) > (MaxPicOrderCntLsb / 2)))
-		{
-			PicOrderCntMsb = decoder->prevPicOrderCntMsb - MaxPicOrderCntLsb;
-		} else {
-			PicOrderCntMsb = decoder->prevPicOrderCntMsb;
-		}
-
-		decoder->prevPicOrderCntLsb = pic_order_cnt_lsb;
-		decoder->prevPicOrderCntMsb = PicOrderCntMsb;
 	}
 
 	if (sps->pic_order_cnt_type == 1 &&
@@ -233,166 +231,63 @@ void parse_slice_header(decoder_context *decoder)
 		break;
 	}
 
-	if (!sps->gaps_in_frame_num_value_allowed_flag && !IdrPicFlag) {
-		if (decoder->prev_frame_num != decoder->sh.frame_num) {
-			wrapped_frame_num = (decoder->prev_frame_num + 1) % max_frame_num;
-
-			if (abs(decoder->sh.frame_num - wrapped_frame_num) > 1) {
-				SYNTAX_IPRINT("prev_frame_num = %d frame_num = %d\n",
-					decoder->prev_frame_num,
-					decoder->sh.frame_num);
-				abort();
-			}
-		}
-	}
-
-	decoder->prev_frame_num = decoder->sh.frame_num;
-
-	if (decoder->sh.frame_num == 0) {
-		for (i = 1; i <= decoder->DPB_frames_array.size; i++) {
-			DPB_frames[i]->frame_num_wrap = 1;
-		}
-	}
-
-	DPB_frames[0]->frame_dec_num = decoder->frames_decoded;
-	DPB_frames[0]->frame_num = decoder->sh.frame_num;
-	DPB_frames[0]->pic_order_cnt = PicOrderCntMsb | pic_order_cnt_lsb;
-	DPB_frames[0]->is_B_frame = (slice_type == B); // Not B_ONLY!
-	DPB_frames[0]->sps = sps;
-	DPB_frames[0]->empty = 0;
-
-	DECODER_DPRINT("DPB:\n");
-	show_frames_list(DPB_frames,
-			 ARRAY_SIZE(decoder->DPB_frames_array.frames),
-			 decoder->active_sps->max_num_ref_frames + 1);
-
+	// ref_pic_list_modification( )
 	switch (decoder->sh.slice_type) {
 	case P:
-		form_P_frame_ref_list_l0(decoder);
-		break;
 	case B:
-		form_B_frame_ref_list_l0(decoder);
-		form_B_frame_ref_list_l1(decoder);
-		break;
-	default:
-		break;
-	}
+		for (l = 0; l < (decoder->sh.slice_type == B ? 2 : 1); l++) {
+			ref_pic_list_modification_flag = bitstream_read_u(reader, 1);
 
-	// ref_pic_list_modification( )
-	{
-		unsigned ref_pic_list_modification_flag_l0;
-		unsigned ref_pic_list_modification_flag_l1;
-		uint32_t modification_of_pic_nums_idc;
-		uint32_t long_term_pic_num;
-		int32_t abs_diff_pic_num;
-		int predicted_picture = decoder->sh.frame_num;
-		int remapped_picture;
-		int refIdxL = 0;
-		int l1 = 0;
-
-		switch (decoder->sh.slice_type) {
-		case P:
-		case B:
-		case SP:
-			ref_pic_list_modification_flag_l0 = bitstream_read_u(reader, 1);
-
-			SYNTAX_IPRINT("ref_pic_list_modification_flag_l0 = %u\n",
-				      ref_pic_list_modification_flag_l0);
-
-			if (!ref_pic_list_modification_flag_l0) {
-				goto flag_l1;
-			}
-pics_num:
-			modification_of_pic_nums_idc = bitstream_read_ue(reader);
-
-			SYNTAX_IPRINT("modification_of_pic_nums_idc = %u\n",
-				      modification_of_pic_nums_idc);
-
-			switch (decoder->sh.slice_type) {
-			case P:
-				REF_frames_list = &decoder->ref_frames_P_list0;
-				break;
-			case B:
-				if (!l1) {
-					REF_frames_list = &decoder->ref_frames_B_list0;
-				} else {
-					REF_frames_list = &decoder->ref_frames_B_list1;
-				}
-				break;
-			default:
-				break;
-			}
+			SYNTAX_IPRINT("ref_pic_list_modification_flag_l%d = %u\n",
+				      l, ref_pic_list_modification_flag);
 
-			switch (modification_of_pic_nums_idc) {
-			case 0 ... 1:
-				abs_diff_pic_num = bitstream_read_ue(reader) + 1;
-
-				if (modification_of_pic_nums_idc == 0) {
-					abs_diff_pic_num = -abs_diff_pic_num;
-				}
-
-				SYNTAX_IPRINT("abs_diff_pic_num = %d\n",
-					      abs_diff_pic_num);
+			if (!ref_pic_list_modification_flag) {
+				continue;
+			}
 
-				remapped_picture = predicted_picture + abs_diff_pic_num;
-				remapped_picture &= max_frame_num - 1;
+			do {
+				modification_of_pic_nums_idc = bitstream_read_ue(reader);
 
-				SYNTAX_IPRINT("refIdxL%d[%d] <- %d\n",
-					      l1, refIdxL, remapped_picture);
+				SYNTAX_IPRINT("modification_of_pic_nums_idc = %u\n",
+					      modification_of_pic_nums_idc);
 
-				predicted_picture = remapped_picture;
+				switch (modification_of_pic_nums_idc) {
+				case 0 ... 1:
+					abs_diff_pic_num = bitstream_read_ue(reader) + 1;
 
-				for (i = 0; i < REF_frames_list->size; i++) {
-					if (REF_frames_list->frames[i]->frame_num != predicted_picture) {
-						continue;
+					if (modification_of_pic_nums_idc == 0) {
+						abs_diff_pic_num = -abs_diff_pic_num;
 					}
 
-					assert(remapped_picture != -1);
-					remapped_picture = -1;
+					SYNTAX_IPRINT("abs_diff_pic_num = %d\n",
+						      abs_diff_pic_num);
 
-					move_frame(REF_frames_list->frames,
-						   i, refIdxL++);
-				}
-
-				assert(remapped_picture == -1);
-
-				DECODER_DPRINT("modified REF list %d:\n", l1);
-				show_frames_list(REF_frames_list->frames,
-						 REF_frames_list->size, -1);
-
-				goto pics_num;
-			case 2:
-				long_term_pic_num = bitstream_read_ue(reader);
+					i = decoder->sh.modifications_nb[l]++;
 
-				SYNTAX_ERR("list_modification unimplemented!\n");
+					if (i == ARRAY_SIZE(decoder->sh.abs_diff_pic_num[l])) {
+						SYNTAX_ERR("slice header is malformed, too many list modifications\n");
+					}
 
-				SYNTAX_IPRINT("long_term_pic_num = %u\n",
-					      long_term_pic_num);
-				goto pics_num;
-flag_l1:		case 3:
-				if (l1 || decoder->sh.slice_type == P) {
+					decoder->sh.abs_diff_pic_num[l][i] = abs_diff_pic_num;
 					break;
-				}
-
-				ref_pic_list_modification_flag_l1 =
-						bitstream_read_u(reader, 1);
+				case 2:
+					long_term_pic_num = bitstream_read_ue(reader);
 
-				SYNTAX_IPRINT("ref_pic_list_modification_flag_l1 = %u\n",
-						ref_pic_list_modification_flag_l1);
+					SYNTAX_ERR("list_modification unimplemented!\n");
 
-				if (ref_pic_list_modification_flag_l1) {
-					refIdxL = 0;
-					l1 = 1;
-					goto pics_num;
+					SYNTAX_IPRINT("long_term_pic_num = %u\n",
+						      long_term_pic_num);
+					break;
+				case 3:
+					break;
+				default:
+					SYNTAX_ERR("slice header is malformed\n");
 				}
-				break;
-			default:
-				SYNTAX_ERR("slice header is malformed\n");
-			}
-			break;
-		default:
-			break;
+			} while (modification_of_pic_nums_idc != 3);
 		}
+		break;
+	default:
+		break;
 	}
 
 	switch (decoder->sh.slice_type) {
@@ -409,7 +304,9 @@ flag_l1:		case 3:
 pred_weight_table:
 {
 		pred_weight **pw;
-		int sz, l = 0;
+		int sz;
+
+		l = 0;
 
 		SYNTAX_ERR("pred_weight_table unimplemented!\n");
 
@@ -472,15 +369,6 @@ table_fill:
 				SYNTAX_ERR("long_term_reference unimplemented!\n");
 			}
 		} else {
-			unsigned adaptive_ref_pic_marking_mode_flag;
-			uint32_t memory_management_control_operation;
-			uint32_t difference_of_pic_nums_minus1;
-			uint32_t long_term_pic_num;
-			uint32_t long_term_frame_idx;
-			uint32_t max_long_term_frame_idx_plus1;
-			int marked;
-			int picNumX;
-
 			adaptive_ref_pic_marking_mode_flag =
 						bitstream_read_u(reader, 1);
 
@@ -509,24 +397,14 @@ table_fill:
 							goto long_term_frame_idx__;
 						}
 
-						picNumX = decoder->sh.frame_num - (difference_of_pic_nums_minus1 + 1);
-						picNumX &= max_frame_num - 1;
-
-						SYNTAX_IPRINT("picNumX = %u\n", picNumX);
-
-						for (i = 1, marked = 0; i <= decoder->DPB_frames_array.size; i++) {
-							if (DPB_frames[i]->frame_num != picNumX) {
-								continue;
-							}
+						i = decoder->sh.mmco_nb++;
 
-							assert(!DPB_frames[i]->empty);
-							DPB_frames[i]->marked_for_removal = 1;
-							marked++;
-
-							DECODER_DPRINT("DPB:\tframe[%d]: marked for removal\n", i);
+						if (i == ARRAY_SIZE(decoder->sh.difference_of_pic_nums_minus1)) {
+							SYNTAX_ERR("slice header is malformed, too many memory management operations\n");
 						}
 
-						assert(marked == 1);
+						decoder->sh.difference_of_pic_nums_minus1[i] =
+								difference_of_pic_nums_minus1;
 						break;
 					case 2:
 						long_term_pic_num =
@@ -631,3 +509,243 @@ long_term_frame_idx__:			case 6:
 			decoder->sh.slice_group_change_cycle);
 	}
 }
+
+/*
+ * Reference list modification of list l, frames are moved to the front of
+ * the list in the order of the stored pic nums.
+ */
+static void apply_ref_pic_list_modification(decoder_context *decoder,
+					    frames_list *REF_frames_list,
+					    int l, int *predicted_picture)
+{
+	int max_frame_num = 1 << (decoder->active_sps->log2_max_frame_num_minus4 + 4);
+	int remapped_picture;
+	int refIdxL = 0;
+	int i, m;
+
+	for (m = 0; m < decoder->sh.modifications_nb[l]; m++) {
+		remapped_picture = *predicted_picture +
+					decoder->sh.abs_diff_pic_num[l][m];
+		remapped_picture &= max_frame_num - 1;
+
+		SYNTAX_IPRINT("refIdxL%d[%d] <- %d\n",
+			      l, refIdxL, remapped_picture);
+
+		*predicted_picture = remapped_picture;
+
+		for (i = 0; i < REF_frames_list->size; i++) {
+			if (REF_frames_list->frames[i]->frame_num != *predicted_picture) {
+				continue;
+			}
+
+			assert(remapped_picture != -1);
+			remapped_picture = -1;
+
+			move_frame(REF_frames_list->frames, i, refIdxL++);
+		}
+
+		assert(remapped_picture == -1);
+
+		DECODER_DPRINT("modified REF list %d:\n", l);
+		show_frames_list(REF_frames_list->frames,
+				 REF_frames_list->size, -1);
+	}
+}
+
+/*
+ * Timestamps given by the container are taken as is. Pictures of a raw stream
+ * get them from POC, which counts fields: VUI time_scale / num_units_in_tick
+ * is the field rate, 25 fps is assumed without the timing info. IDR period
+ * starts a frame after the latest PTS of the previous one. DTS advances by a
+ * frame per picture, starting behind by the reorder depth so that it doesn't
+ * pass the PTS; max_num_ref_frames is that depth if VUI doesn't tell it.
+ */
+static void picture_timestamps(decoder_context *decoder, frame_data *frame)
+{
+	decoder_context_sps *sps = decoder->active_sps;
+	timestamp_clock *clock = &decoder->clock;
+	int64_t units = 1, scale = 50;
+	int64_t frame_duration;
+	unsigned delay;
+
+	frame->pts = decoder->au.pts;
+	frame->dts = decoder->au.dts;
+
+	if (frame->pts != TIMESTAMP_NONE) {
+		return;
+	}
+
+	if (sps->time_scale != 0 && sps->num_units_in_tick != 0) {
+		units = sps->num_units_in_tick;
+		scale = sps->time_scale;
+	}
+
+	frame_duration = 2 * 90000 * units / scale;
+
+	if (!clock->started) {
+		delay = sps->bitstream_restriction_flag ?
+				sps->max_num_reorder_frames :
+				sps->max_num_ref_frames;
+
+		clock->base = 0;
+		clock->last_pts = 0;
+		clock->delay = delay * frame_duration;
+		clock->next_dts = -clock->delay;
+		clock->started = 1;
+	} else if (IdrPicFlag) {
+		clock->base = clock->last_pts + frame_duration;
+	}
+
+	frame->dts = clock->next_dts;
+	clock->next_dts += frame_duration;
+
+	/* Output order is the decoding order without POC type 0.  */
+	if (sps->pic_order_cnt_type == 0) {
+		frame->pts = clock->base +
+			(int64_t) frame->pic_order_cnt * 90000 * units / scale;
+	} else {
+		frame->pts = frame->dts + clock->delay;
+	}
+
+	clock->last_pts = max(clock->last_pts, frame->pts);
+}
+
+/*
+ * DPB side of the slice header parsed by parse_slice_header(): POC, frame_num
+ * checks, the current frame setup, reference lists and marking. Has to be
+ * called in decoding order, right before the picture is decoded.
+ */
+void apply_slice_header(decoder_context *decoder)
+{
+	frame_data **DPB_frames = decoder->DPB_frames_array.frames;
+	decoder_context_sps *sps = decoder->active_sps;
+	unsigned wrapped_frame_num;
+	int max_frame_num;
+	int pic_order_cnt_lsb = 0;
+	int PicOrderCntMsb = 0;
+	int MaxPicOrderCntLsb;
+	int predicted_picture;
+	int marked;
+	int picNumX;
+	int i, m;
+
+	max_frame_num = 1 << (sps->log2_max_frame_num_minus4 + 4);
+
+	if (IdrPicFlag) {
+		clear_DPB(decoder);
+		decoder->DPB_incomplete = 0;
+	} else if (decoder->sh.refs_missing) {
+		/* Trick play skipped references, picture is intra.  */
+		clear_DPB(decoder);
+		decoder->DPB_incomplete = 1;
+	}
+
+	if (sps->pic_order_cnt_type == 0) {
+		if (IdrPicFlag) {
+			decoder->prevPicOrderCntLsb = 0;
+			decoder->prevPicOrderCntMsb = 0;
+		}
+
+		pic_order_cnt_lsb = decoder->sh.pic_order_cnt_lsb;
+
+		MaxPicOrderCntLsb = 1 << (sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
+
+		if ((pic_order_cnt_lsb < decoder->prevPicOrderCntLsb) &&
+			((decoder->prevPicOrderCntLsb - pic_order_cnt_lsb) >= (MaxPicOrderCntLsb / 2)))
+		{
+			PicOrderCntMsb = decoder->prevPicOrderCntMsb + MaxPicOrderCntLsb;
+		} else if ((pic_order_cnt_lsb > decoder->prevPicOrderCntLsb) &&
+			((pic_order_cnt_lsb - decoder->prevPicOrderCntLsb) > (MaxPicOrderCntLsb / 2)))
+		{
+			PicOrderCntMsb = decoder->prevPicOrderCntMsb - MaxPicOrderCntLsb;
+		} else {
+			PicOrderCntMsb = decoder->prevPicOrderCntMsb;
+		}
+
+		decoder->prevPicOrderCntLsb = pic_order_cnt_lsb;
+		decoder->prevPicOrderCntMsb = PicOrderCntMsb;
+	}
+
+	if (!sps->gaps_in_frame_num_value_allowed_flag && !IdrPicFlag &&
+		!decoder->sh.refs_missing)
+	{
+		if (decoder->prev_frame_num != decoder->sh.frame_num) {
+			wrapped_frame_num = (decoder->prev_frame_num + 1) % max_frame_num;
+
+			if (abs(decoder->sh.frame_num - wrapped_frame_num) > 1) {
+				SYNTAX_IPRINT("prev_frame_num = %d frame_num = %d\n",
+					decoder->prev_frame_num,
+					decoder->sh.frame_num);
+				abort();
+			}
+		}
+	}
+
+	decoder->prev_frame_num = decoder->sh.frame_num;
+
+	if (decoder->sh.frame_num == 0) {
+		for (i = 1; i <= decoder->DPB_frames_array.size; i++) {
+			DPB_frames[i]->frame_num_wrap = 1;
+		}
+	}
+
+	DPB_frames[0]->frame_dec_num = decoder->frames_decoded;
+	DPB_frames[0]->frame_num = decoder->sh.frame_num;
+	DPB_frames[0]->pic_order_cnt = PicOrderCntMsb | pic_order_cnt_lsb;
+	DPB_frames[0]->is_B_frame = decoder->sh.is_B_frame;
+	DPB_frames[0]->sps = sps;
+	DPB_frames[0]->empty = 0;
+
+	picture_timestamps(decoder, DPB_frames[0]);
+
+	DECODER_DPRINT("DPB:\n");
+	show_frames_list(DPB_frames,
+			 ARRAY_SIZE(decoder->DPB_frames_array.frames),
+			 decoder->active_sps->max_num_ref_frames + 1);
+
+	/* Pic num prediction carries over from list 0 to list 1.  */
+	predicted_picture = decoder->sh.frame_num;
+
+	switch (decoder->sh.slice_type) {
+	case P:
+		form_P_frame_ref_list_l0(decoder);
+		apply_ref_pic_list_modification(decoder,
+						&decoder->ref_frames_P_list0,
+						0, &predicted_picture);
+		break;
+	case B:
+		form_B_frame_ref_list_l0(decoder);
+		form_B_frame_ref_list_l1(decoder);
+		apply_ref_pic_list_modification(decoder,
+						&decoder->ref_frames_B_list0,
+						0, &predicted_picture);
+		apply_ref_pic_list_modification(decoder,
+						&decoder->ref_frames_B_list1,
+						1, &predicted_picture);
+		break;
+	default:
+		break;
+	}
+
+	for (m = 0; m < decoder->sh.mmco_nb; m++) {
+		picNumX = decoder->sh.frame_num -
+				(decoder->sh.difference_of_pic_nums_minus1[m] + 1);
+		picNumX &= max_frame_num - 1;
+
+		SYNTAX_IPRINT("picNumX = %u\n", picNumX);
+
+		for (i = 1, marked = 0; i <= decoder->DPB_frames_array.size; i++) {
+			if (DPB_frames[i]->frame_num != picNumX) {
+				continue;
+			}
+
+			assert(!DPB_frames[i]->empty);
+			DPB_frames[i]->marked_for_removal = 1;
+			marked++;
+
+			DECODER_DPRINT("DPB:\tframe[%d]: marked for removal\n", i);
+		}
+
+		assert(marked == 1 || decoder->DPB_incomplete);
+	}
+}
@@ -0,0 +1,511 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cut a range of pictures out of an Annex B or MP4 stream into an Annex B
+ * file. Cut starts at the IDR picture at or before the first picture of the
+ * range, preceded by the latest SPS and PPS of every id. NAL boundaries come
+ * from the NAL index sidecar, so the stream isn't scanned, and the data is
+ * copied by the kernel without passing through user space.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "decoder.h"
+#include "nal_index.h"
+
+#define NAL_SPS		7
+#define NAL_PPS		8
+
+#define IS_SLICE(entry)	((entry)->unit_type == 1 || (entry)->unit_type == 5)
+
+#define IDR_START(entry)	(((entry)->flags & NAL_INDEX_IDR) && \
+				 (entry)->first_mb_in_slice == 0)
+
+/* First bytes of a NAL with the emulation prevention removed.  */
+typedef struct nal_bits {
+	uint8_t data[32];
+	unsigned size;
+	unsigned pos;
+} nal_bits;
+
+static void nal_bits_load(nal_bits *bits, int fd, const nal_index_entry *entry)
+{
+	uint8_t raw[48];
+	unsigned zeros = 0;
+	ssize_t i, ret;
+
+	ret = pread(fd, raw, min(sizeof(raw), entry->size), entry->offset);
+	if (ret < 0) {
+		perror("Failed to read NAL");
+		exit(EXIT_FAILURE);
+	}
+
+	bits->size = 0;
+	bits->pos = 8;
+
+	for (i = 0; i < ret && bits->size < sizeof(bits->data); i++) {
+		if (zeros >= 2 && raw[i] == 0x03) {
+			zeros = 0;
+			continue;
+		}
+
+		zeros = raw[i] ? 0 : zeros + 1;
+		bits->data[bits->size++] = raw[i];
+	}
+}
+
+static unsigned nal_bits_read_u(nal_bits *bits, unsigned count)
+{
+	unsigned val = 0;
+
+	while (count--) {
+		if (bits->pos >= bits->size * 8) {
+			fprintf(stderr, "Parameter set is truncated\n");
+			exit(EXIT_FAILURE);
+		}
+
+		val <<= 1;
+		val |= (bits->data[bits->pos / 8] >> (7 - bits->pos % 8)) & 1;
+		bits->pos++;
+	}
+
+	return val;
+}
+
+static unsigned nal_bits_read_ue(nal_bits *bits)
+{
+	unsigned leading_zeros = 0;
+
+	while (nal_bits_read_u(bits, 1) == 0) {
+		if (++leading_zeros > 31) {
+			fprintf(stderr, "Parameter set is malformed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return (1u << leading_zeros) - 1 + nal_bits_read_u(bits, leading_zeros);
+}
+
+/*
+ * seq_parameter_set_id follows profile, constraint flags and level. Ids are
+ * up to 31 for SPS and up to 255 for PPS.
+ */
+static unsigned parameter_set_id(int fd, const nal_index_entry *entry)
+{
+	nal_bits bits;
+	unsigned id;
+
+	nal_bits_load(&bits, fd, entry);
+
+	if (entry->unit_type == NAL_SPS) {
+		nal_bits_read_u(&bits, 24);
+	}
+
+	id = nal_bits_read_ue(&bits);
+
+	if (id > (entry->unit_type == NAL_SPS ? 31 : 255)) {
+		fprintf(stderr, "Parameter set at 0x%" PRIX64 " is malformed, "
+			"id %u is out of range\n", entry->offset, id);
+		exit(EXIT_FAILURE);
+	}
+
+	return id;
+}
+
+static void copy_range(int fd_in, int fd_out, uint64_t offset, uint64_t size)
+{
+	loff_t off_in = offset;
+	off_t off = offset;
+	ssize_t ret = -1;
+
+	while (size) {
+#ifdef HAVE_COPY_FILE_RANGE
+		ret = copy_file_range(fd_in, &off_in, fd_out, NULL, size, 0);
+		if (ret < 0 && (errno == ENOSYS || errno == EXDEV ||
+				errno == EINVAL || errno == EOPNOTSUPP)) {
+			off = off_in;
+			ret = sendfile(fd_out, fd_in, &off, size);
+			off_in = off;
+		}
+#else
+		ret = sendfile(fd_out, fd_in, &off, size);
+#endif
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (ret <= 0) {
+			perror("Failed to copy stream data");
+			exit(EXIT_FAILURE);
+		}
+
+		size -= ret;
+	}
+}
+
+static void write_start_code(int fd_out)
+{
+	static const uint8_t start_code[] = { 0x00, 0x00, 0x00, 0x01 };
+
+	if (write(fd_out, start_code, sizeof(start_code)) != sizeof(start_code)) {
+		perror("Failed to write output");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void copy_NAL(int fd_in, int fd_out, const nal_index_entry *entry)
+{
+	write_start_code(fd_out);
+	copy_range(fd_in, fd_out, entry->offset, entry->size);
+}
+
+/* Whether the NALs of the index are preceded by start codes.  */
+static int annex_b(int fd, nal_index *index)
+{
+	uint8_t code[3];
+
+	if (index->entries_nb == 0 || index->entries[0].offset < 3) {
+		return 0;
+	}
+
+	if (pread(fd, code, 3, index->entries[0].offset - 3) != 3) {
+		perror("Failed to read input");
+		exit(EXIT_FAILURE);
+	}
+
+	return code[0] == 0x00 && code[1] == 0x00 && code[2] == 0x01;
+}
+
+/* Frame rate of the VUI timing info of the first SPS, 0 if there is none.  */
+static double stream_fps(int fd, uint64_t size, nal_index *index)
+{
+	decoder_context *decoder;
+	decoder_context_sps *sps;
+	double fps = 0;
+	uint64_t i;
+	int id;
+
+	for (i = 0; i < index->entries_nb; i++) {
+		if (index->entries[i].unit_type == NAL_SPS) {
+			break;
+		}
+	}
+
+	if (i == index->entries_nb) {
+		return 0;
+	}
+
+	decoder = malloc(sizeof(*decoder));
+	if (decoder == NULL) {
+		perror("Failed to allocate parser");
+		abort();
+	}
+
+	decoder_init_parser(decoder, fd, size);
+	parse_indexed(decoder, index, i, 1);
+
+	for (id = 0; id < ARRAY_SIZE(decoder->sps); id++) {
+		sps = &decoder->sps[id];
+
+		if (sps->valid && sps->time_scale && sps->num_units_in_tick) {
+			fps = sps->time_scale / (2.0 * sps->num_units_in_tick);
+			break;
+		}
+	}
+
+	decoder_close_parser(decoder);
+	free(decoder);
+
+	return fps;
+}
+
+/*
+ * Entry number of the first slice of the picture number pic_nb in decoding
+ * order, entries_nb if the stream has less pictures. Picture begins with a
+ * slice starting at the first macroblock.
+ */
+static uint64_t picture_entry(nal_index *index, uint64_t pic_nb)
+{
+	nal_index_entry *entry;
+	uint64_t i;
+
+	for (i = 0; i < index->entries_nb; i++) {
+		entry = &index->entries[i];
+
+		if (!IS_SLICE(entry) || entry->first_mb_in_slice != 0) {
+			continue;
+		}
+
+		if (pic_nb-- == 0) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+/* Number of the pictures that begin before the entry number entry_nb.  */
+static uint64_t entry_picture(nal_index *index, uint64_t entry_nb)
+{
+	nal_index_entry *entry;
+	uint64_t pic_nb = 0;
+	uint64_t i;
+
+	for (i = 0; i < entry_nb && i < index->entries_nb; i++) {
+		entry = &index->entries[i];
+
+		if (IS_SLICE(entry) && entry->first_mb_in_slice == 0) {
+			pic_nb++;
+		}
+	}
+
+	return pic_nb;
+}
+
+/* Whether the slices have container timestamps, Annex B has none.  */
+static int has_pts(nal_index *index)
+{
+	uint64_t i;
+
+	for (i = 0; i < index->entries_nb; i++) {
+		if (IS_SLICE(&index->entries[i])) {
+			return index->entries[i].pts != TIMESTAMP_NONE;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Entry number of the first slice of the first picture in decoding order
+ * whose pts, in 90 kHz units, is at or past the given one, entries_nb if
+ * there is no such picture.
+ */
+static uint64_t pts_entry(nal_index *index, int64_t pts)
+{
+	nal_index_entry *entry;
+	uint64_t i;
+
+	for (i = 0; i < index->entries_nb; i++) {
+		entry = &index->entries[i];
+
+		if (IS_SLICE(entry) && entry->first_mb_in_slice == 0 &&
+				entry->pts >= pts) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "-i Annex B or MP4 input file path\n");
+	fprintf(stderr, "-o Annex B output file path\n");
+	fprintf(stderr, "-s start time in seconds (0)\n");
+	fprintf(stderr, "-e end time in seconds (stream end)\n");
+	fprintf(stderr, "-S first picture, instead of the start time\n");
+	fprintf(stderr, "-E picture to end before, instead of the end time\n");
+	fprintf(stderr, "-r frame rate, instead of the MP4 timestamps, VUI "
+			"timing info or 25\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	const char *in_file_path = NULL;
+	const char *out_file_path = NULL;
+	uint64_t ps_entry[32 + 256];
+	uint64_t first_pic = 0;
+	uint64_t end_pic = UINT64_MAX;
+	uint64_t first, end, idr, i;
+	double start_sec = -1;
+	double end_sec = -1;
+	double fps = 0;
+	int use_pts;
+	nal_index_entry *entry;
+	nal_index *index;
+	struct stat sb;
+	int fd_in, fd_out;
+	int c;
+
+	while ((c = getopt(argc, argv, "i:o:s:e:S:E:r:")) != -1) {
+		switch (c) {
+		case 'i':
+			in_file_path = optarg;
+			break;
+		case 'o':
+			out_file_path = optarg;
+			break;
+		case 's':
+			start_sec = atof(optarg);
+			break;
+		case 'e':
+			end_sec = atof(optarg);
+			break;
+		case 'S':
+			first_pic = strtoull(optarg, NULL, 0);
+			break;
+		case 'E':
+			end_pic = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			fps = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (in_file_path == NULL || out_file_path == NULL) {
+		usage();
+	}
+
+	fd_in = open(in_file_path, O_RDONLY);
+	if (fd_in == -1 || fstat(fd_in, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+		fprintf(stderr, "Failed to open input file %s\n", in_file_path);
+		exit(EXIT_FAILURE);
+	}
+
+	index = nal_index_open(in_file_path, fd_in, &sb);
+	if (index == NULL) {
+		fprintf(stderr, "Only well-formed MP4 and Annex B files can "
+				"be cut\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Times are looked up by the pts, unless the frame rate is given.  */
+	use_pts = (fps <= 0 && has_pts(index));
+
+	if (fps <= 0 && !use_pts && (start_sec >= 0 || end_sec >= 0)) {
+		fps = stream_fps(fd_in, sb.st_size, index);
+
+		if (fps <= 0) {
+			fps = 25;
+		}
+	}
+
+	if (start_sec >= 0 && use_pts) {
+		first = pts_entry(index, start_sec * 90000);
+	} else {
+		if (start_sec >= 0) {
+			first_pic = start_sec * fps;
+		}
+
+		first = picture_entry(index, first_pic);
+	}
+
+	if (end_sec >= 0 && use_pts) {
+		end = pts_entry(index, end_sec * 90000);
+	} else {
+		if (end_sec >= 0) {
+			end_pic = end_sec * fps;
+		}
+
+		end = (end_pic == UINT64_MAX) ? index->entries_nb :
+						picture_entry(index, end_pic);
+	}
+
+	if (first >= end) {
+		fprintf(stderr, "Range is empty\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Latest parameter sets of every id before the IDR are collected.  */
+	for (i = 0; i < ARRAY_SIZE(ps_entry); i++) {
+		ps_entry[i] = UINT64_MAX;
+	}
+
+	for (idr = first; idr > 0; idr--) {
+		if (IDR_START(&index->entries[idr])) {
+			break;
+		}
+	}
+
+	if (!IDR_START(&index->entries[idr])) {
+		fprintf(stderr, "No IDR picture before the range start\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < idr; i++) {
+		entry = &index->entries[i];
+
+		if (entry->unit_type == NAL_SPS) {
+			ps_entry[parameter_set_id(fd_in, entry)] = i;
+		}
+
+		if (entry->unit_type == NAL_PPS) {
+			ps_entry[32 + parameter_set_id(fd_in, entry)] = i;
+		}
+	}
+
+	/* Trailing non-slice NALs belong to the picture that follows.  */
+	while (end > idr + 1 && !IS_SLICE(&index->entries[end - 1])) {
+		end--;
+	}
+
+	fd_out = open(out_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd_out == -1) {
+		perror("Failed to open output file");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(ps_entry); i++) {
+		if (ps_entry[i] != UINT64_MAX) {
+			copy_NAL(fd_in, fd_out, &index->entries[ps_entry[i]]);
+		}
+	}
+
+	/*
+	 * NALs of Annex B are back to back with start codes in between, they
+	 * are copied in one go. MP4 NALs are length prefixed and each one gets
+	 * a start code instead.
+	 */
+	if (annex_b(fd_in, index)) {
+		entry = &index->entries[end - 1];
+
+		write_start_code(fd_out);
+		copy_range(fd_in, fd_out, index->entries[idr].offset,
+			   entry->offset + entry->size -
+				index->entries[idr].offset);
+	} else {
+		for (i = idr; i < end; i++) {
+			copy_NAL(fd_in, fd_out, &index->entries[i]);
+		}
+	}
+
+	fprintf(stderr, "Cut pictures %" PRIu64 "..%" PRIu64 ", from IDR "
+		"at 0x%" PRIX64 "\n", entry_picture(index, first),
+		entry_picture(index, end), index->entries[idr].offset);
+
+	close(fd_out);
+	nal_index_free(index);
+
+	return 0;
+}
@@ -0,0 +1,1860 @@
+/*
+ * Copyright (c) 2016 Dmitry Osipenko <digetx@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Synthetic H.264 stream generator: SPS, PPS and slice header NALs with
+ * everything parse_SPS(), parse_PPS() and parse_slice_header() accept.
+ * Slices carry no macroblock data, the output is meant for the parser
+ * benchmarks and soak tests, not for the hardware.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bitstream_writer.h"
+
+#define ARRAY_SIZE(x)		(sizeof(x) / sizeof(*(x)))
+
+#define FOURCC(a, b, c, d)	(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+#define U32C(v)			\
+	((v) >> 24) & 0xFF,	\
+	((v) >> 16) & 0xFF,	\
+	((v) >> 8) & 0xFF,	\
+	(v) & 0xFF
+
+#define MKV_ID_TRACKS		0x1654AE6B
+#define MKV_ID_TRACK_ENTRY	0xAE
+#define MKV_ID_CODEC_PRIVATE	0x63A2
+#define MKV_ID_CLUSTER		0x1F43B675
+#define MKV_ID_TIMECODE		0xE7
+#define MKV_ID_SIMPLE_BLOCK	0xA3
+#define MKV_BLOCK_KEYFRAME	0x80
+#define MKV_FRAME_DURATION_MS	40
+
+#define TS_PACKET_SIZE		188
+#define TS_PID_PAT		0x0000
+#define TS_PID_PMT		0x1000
+#define TS_PID_VIDEO		0x0100
+#define TS_STREAM_TYPE_H264	0x1B
+
+#define RTP_PAYLOAD_TYPE	96
+#define RTP_NAL_STAP_A		24
+#define RTP_NAL_FU_A		28
+#define RTP_PORT		5004
+#define RTP_SSRC		0x48323634
+
+#define PCAP_MAGIC		0xA1B2C3D4
+#define PCAP_LINK_RAW		101
+
+#define MP4_TRACK_ID		1
+#define MP4_SAMPLE_NON_SYNC	0x00010000
+#define MP4_TFHD_BASE_IS_MOOF	0x020000
+#define MP4_TRUN_FLAGS		0x000F01
+
+/* 90 kHz timestamps of TS, RTP and MP4 at 25 fps.  */
+#define FRAME_DURATION_90K	3600
+#define TIMESTAMP_BASE_90K	90000
+
+#define NAL_SLICE		1
+#define NAL_SLICE_IDR		5
+#define NAL_SPS			7
+#define NAL_PPS			8
+
+#define SLICE_P			0
+#define SLICE_B			1
+#define SLICE_I			2
+
+#define MAX_REF_FRAMES		16
+#define MAX_REF_IDX		32
+#define LOG2_MAX_FRAME_NUM	8
+#define LOG2_MAX_POC_LSB	8
+
+typedef struct mp4_sample {
+	uint64_t dts;
+	uint32_t size;
+	uint32_t cts;
+	int sync;
+} mp4_sample;
+
+typedef struct gen_context {
+	bitstream_writer writer;
+	FILE *fp;
+	int mp4;
+	int mkv;
+	unsigned ts_packet_size;
+	unsigned ts_cc[3];
+	unsigned rtp_mtu;
+	uint16_t rtp_seq;
+
+	unsigned frames_nb;
+	unsigned gop_size;
+	unsigned intra_period;
+	unsigned sp_pictures_nb;
+	unsigned pp_pictures_nb;
+	unsigned max_ref_frames;
+	unsigned num_ref_idx;
+	unsigned modifications;
+	unsigned b_frames;
+	unsigned slices_nb;
+	unsigned width_mbs;
+	unsigned height_mbs;
+	unsigned poc_type;
+	int slice_group_map_type;
+	unsigned num_slice_groups_minus1[256];
+	int scaling_lists;
+	int vui;
+
+	unsigned frame_num;
+	unsigned idr_pic_id;
+	unsigned idr_display;
+	unsigned ref_frame_nums[MAX_REF_FRAMES];
+	unsigned refs_nb;
+	unsigned pictures_nb;
+
+	uint32_t NAL_start;
+	uint64_t mdat_size;
+
+	/* Samples of the moov or of the fragment that is being written.  */
+	int mp4_moov;
+	int mp4_fragments;
+	mp4_sample *samples;
+	uint32_t samples_nb;
+	uint32_t samples_max;
+	uint32_t sequence_nb;
+	bitstream_writer avcC;
+	bitstream_writer fragment;
+} gen_context;
+
+static int random_range(int min, int max)
+{
+	return min + rand() % (max - min + 1);
+}
+
+static void put_be32(uint8_t *data, uint32_t value)
+{
+	data[0] = value >> 24;
+	data[1] = value >> 16;
+	data[2] = value >> 8;
+	data[3] = value;
+}
+
+static void put_le16(uint8_t *data, uint16_t value)
+{
+	data[0] = value;
+	data[1] = value >> 8;
+}
+
+static void put_le32(uint8_t *data, uint32_t value)
+{
+	put_le16(data, value);
+	put_le16(data + 2, value >> 16);
+}
+
+static void NAL_begin(gen_context *gen, unsigned ref_idc, unsigned type,
+		      int long_start_code)
+{
+	bitstream_writer *writer = &gen->writer;
+	static const uint8_t start_code[4] = { 0x00, 0x00, 0x00, 0x01 };
+
+	if (gen->mp4 || gen->mkv || gen->rtp_mtu) {
+		/* Length prefix is filled in by NAL_end().  */
+		bitstream_write_bytes(writer, start_code, 4);
+	} else if (long_start_code) {
+		bitstream_write_bytes(writer, start_code, 4);
+	} else {
+		bitstream_write_bytes(writer, start_code + 1, 3);
+	}
+
+	gen->NAL_start = writer->data_offset;
+
+	writer->rbsp_mode = 1;
+
+	bitstream_write_u(writer, 0, 1);
+	bitstream_write_u(writer, ref_idc, 2);
+	bitstream_write_u(writer, type, 5);
+}
+
+static void NAL_end(gen_context *gen)
+{
+	bitstream_writer *writer = &gen->writer;
+
+	bitstream_write_rbsp_trailing_bits(writer);
+
+	writer->rbsp_mode = 0;
+
+	if (gen->mp4 || gen->mkv || gen->rtp_mtu) {
+		put_be32(writer->data_ptr + gen->NAL_start - 4,
+			 writer->data_offset - gen->NAL_start);
+	}
+}
+
+static void flush_output(gen_context *gen)
+{
+	bitstream_writer *writer = &gen->writer;
+
+	if (fwrite(writer->data_ptr, 1, writer->data_offset, gen->fp) !=
+			writer->data_offset) {
+		perror("Error writing to output file");
+		abort();
+	}
+
+	gen->mdat_size += writer->data_offset;
+
+	bitstream_writer_reset(writer);
+}
+
+static void write_scaling_list(bitstream_writer *writer, unsigned size)
+{
+	int lastScale = 8;
+	int nextScale;
+	unsigned j;
+
+	for (j = 0; j < size; j++) {
+		/* Sometimes cut the list short, the rest repeats lastScale.  */
+		if (j > 0 && rand() % 32 == 0) {
+			bitstream_write_se(writer, -lastScale);
+			break;
+		}
+
+		nextScale = random_range(4, 127);
+		bitstream_write_se(writer, nextScale - lastScale);
+		lastScale = nextScale;
+	}
+}
+
+static void write_hrd_parameters(bitstream_writer *writer)
+{
+	unsigned cpb_cnt_minus1 = random_range(0, 31);
+	unsigned i;
+
+	bitstream_write_ue(writer, cpb_cnt_minus1);
+	bitstream_write_u(writer, random_range(0, 15), 4);
+	bitstream_write_u(writer, random_range(0, 15), 4);
+
+	for (i = 0; i <= cpb_cnt_minus1; i++) {
+		bitstream_write_ue(writer, random_range(0, 1 << 20));
+		bitstream_write_ue(writer, random_range(0, 1 << 20));
+		bitstream_write_u(writer, rand() & 1, 1);
+	}
+
+	bitstream_write_u(writer, 23, 5);
+	bitstream_write_u(writer, 23, 5);
+	bitstream_write_u(writer, 23, 5);
+	bitstream_write_u(writer, 24, 5);
+}
+
+static void write_vui_parameters(bitstream_writer *writer)
+{
+	/* aspect_ratio_info_present_flag, Extended_SAR */
+	bitstream_write_u(writer, 1, 1);
+	bitstream_write_u(writer, 255, 8);
+	bitstream_write_u(writer, 64, 16);
+	bitstream_write_u(writer, 45, 16);
+
+	/* overscan_info_present_flag, overscan_appropriate_flag */
+	bitstream_write_u(writer, 1, 1);
+	bitstream_write_u(writer, 0, 1);
+
+	/* video_signal_type_present_flag */
+	bitstream_write_u(writer, 1, 1);
+	bitstream_write_u(writer, 5, 3);
+	bitstream_write_u(writer, 0, 1);
+	bitstream_write_u(writer, 1, 1);
+	bitstream_write_u(writer, 1, 8);
+	bitstream_write_u(writer, 1, 8);
+	bitstream_write_u(writer, 1, 8);
+
+	/* chroma_loc_info_present_flag */
+	bitstream_write_u(writer, 1, 1);
+	bitstream_write_ue(writer, 0);
+	bitstream_write_ue(writer, 0);
+
+	/* timing_info_present_flag */
+	bitstream_write_u(writer, 1, 1);
+	bitstream_write_u(writer, 1001, 32);
+	bitstream_write_u(writer, 60000, 32);
+	bitstream_write_u(writer, 1, 1);
+
+	/* nal_hrd_parameters_present_flag, vcl_hrd_parameters_present_flag */
+	bitstream_write_u(writer, 1, 1);
+	write_hrd_parameters(writer);
+	bitstream_write_u(writer, 1, 1);
+	write_hrd_parameters(writer);
+
+	/* low_delay_hrd_flag, pic_struct_present_flag */
+	bitstream_write_u(writer, 0, 1);
+	bitstream_write_u(writer, 0, 1);
+
+	/* bitstream_restriction_flag */
+	bitstream_write_u(writer, 1, 1);
+	bitstream_write_u(writer, 1, 1);
+	bitstream_write_ue(writer, 2);
+	bitstream_write_ue(writer, 1);
+	bitstream_write_ue(writer, 16);
+	bitstream_write_ue(writer, 16);
+	bitstream_write_ue(writer, 2);
+	bitstream_write_ue(writer, 4);
+}
+
+static void write_SPS(gen_context *gen, unsigned sps_id)
+{
+	bitstream_writer *writer = &gen->writer;
+	unsigned i;
+
+	NAL_begin(gen, 3, NAL_SPS, 1);
+
+	/* profile_idc, High profile if scaling lists are requested */
+	bitstream_write_u(writer, gen->scaling_lists ? 100 : 77, 8);
+	bitstream_write_u(writer, 0, 6);
+	bitstream_write_u(writer, 0, 2);
+	bitstream_write_u(writer, 41, 8);
+	bitstream_write_ue(writer, sps_id);
+
+	if (gen->scaling_lists) {
+		/* chroma_format_idc, bit depths, qpprime_y_zero_..._flag */
+		bitstream_write_ue(writer, 1);
+		bitstream_write_ue(writer, 0);
+		bitstream_write_ue(writer, 0);
+		bitstream_write_u(writer, 0, 1);
+
+		/* seq_scaling_matrix_present_flag */
+		bitstream_write_u(writer, 1, 1);
+
+		for (i = 0; i < 8; i++) {
+			unsigned present_flag = rand() & 1;
+
+			bitstream_write_u(writer, present_flag, 1);
+
+			if (present_flag) {
+				write_scaling_list(writer, i < 6 ? 16 : 64);
+			}
+		}
+	}
+
+	bitstream_write_ue(writer, LOG2_MAX_FRAME_NUM - 4);
+	bitstream_write_ue(writer, gen->poc_type);
+
+	switch (gen->poc_type) {
+	case 0:
+		bitstream_write_ue(writer, LOG2_MAX_POC_LSB - 4);
+		break;
+	case 1:
+		/* delta_pic_order_always_zero_flag */
+		bitstream_write_u(writer, 0, 1);
+		bitstream_write_se(writer, -2);
+		bitstream_write_se(writer, 0);
+		bitstream_write_ue(writer, gen->max_ref_frames);
+
+		for (i = 0; i < gen->max_ref_frames; i++) {
+			bitstream_write_se(writer, 2);
+		}
+		break;
+	default:
+		break;
+	}
+
+	bitstream_write_ue(writer, gen->max_ref_frames);
+	/* gaps_in_frame_num_value_allowed_flag */
+	bitstream_write_u(writer, 0, 1);
+	bitstream_write_ue(writer, gen->width_mbs - 1);
+	bitstream_write_ue(writer, gen->height_mbs - 1);
+	/* frame_mbs_only_flag, direct_8x8_inference_flag */
+	bitstream_write_u(writer, 1, 1);
+	bitstream_write_u(writer, 1, 1);
+
+	/* frame_cropping_flag, crop 1088 lines down to 1080 */
+	bitstream_write_u(writer, gen->height_mbs == 68, 1);
+
+	if (gen->height_mbs == 68) {
+		bitstream_write_ue(writer, 0);
+		bitstream_write_ue(writer, 0);
+		bitstream_write_ue(writer, 0);
+		bitstream_write_ue(writer, 4);
+	}
+
+	bitstream_write_u(writer, gen->vui, 1);
+
+	if (gen->vui) {
+		write_vui_parameters(writer);
+	}
+
+	NAL_end(gen);
+}
+
+static void write_PPS(gen_context *gen, unsigned pps_id)
+{
+	bitstream_writer *writer = &gen->writer;
+	unsigned map_units = gen->width_mbs * gen->height_mbs;
+	unsigned num_slice_groups_minus1 = 0;
+	unsigned i;
+
+	NAL_begin(gen, 3, NAL_PPS, 1);
+
+	bitstream_write_ue(writer, pps_id);
+	bitstream_write_ue(writer, pps_id % gen->sp_pictures_nb);
+	/* entropy_coding_mode_flag, CAVLC only */
+	bitstream_write_u(writer, 0, 1);
+	/* bottom_field_pic_order_in_frame_present_flag */
+	bitstream_write_u(writer, pps_id & 1, 1);
+
+	if (gen->slice_group_map_type >= 0) {
+		num_slice_groups_minus1 = random_range(1, 7);
+	}
+
+	gen->num_slice_groups_minus1[pps_id] = num_slice_groups_minus1;
+
+	bitstream_write_ue(writer, num_slice_groups_minus1);
+
+	if (num_slice_groups_minus1 > 0) {
+		bitstream_write_ue(writer, gen->slice_group_map_type);
+
+		switch (gen->slice_group_map_type) {
+		case 0:
+			for (i = 0; i <= num_slice_groups_minus1; i++) {
+				bitstream_write_ue(writer,
+						   random_range(0, map_units - 1));
+			}
+			break;
+		case 2:
+			for (i = 0; i < num_slice_groups_minus1; i++) {
+				bitstream_write_ue(writer, 0);
+				bitstream_write_ue(writer, map_units - 1);
+			}
+			break;
+		case 3 ... 5:
+			bitstream_write_u(writer, rand() & 1, 1);
+			bitstream_write_ue(writer, random_range(0, map_units - 1));
+			break;
+		case 6:
+			bitstream_write_ue(writer, map_units - 1);
+
+			for (i = 0; i < map_units; i++) {
+				bitstream_write_u(writer, i % (num_slice_groups_minus1 + 1),
+						  32 - __builtin_clz(map_units));
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	bitstream_write_ue(writer, gen->num_ref_idx - 1);
+	bitstream_write_ue(writer, 0);
+	/* weighted_pred_flag, weighted_bipred_idc */
+	bitstream_write_u(writer, 0, 1);
+	bitstream_write_u(writer, 0, 2);
+	bitstream_write_se(writer, random_range(-26, 25));
+	bitstream_write_se(writer, 0);
+	bitstream_write_se(writer, random_range(-12, 12));
+	/* deblocking_filter_control_present_flag */
+	bitstream_write_u(writer, 1, 1);
+	/* constrained_intra_pred_flag, redundant_pic_cnt_present_flag */
+	bitstream_write_u(writer, 0, 1);
+	bitstream_write_u(writer, 0, 1);
+
+	if (gen->scaling_lists) {
+		/* transform_8x8_mode_flag, pic_scaling_matrix_present_flag */
+		bitstream_write_u(writer, 0, 1);
+		bitstream_write_u(writer, 1, 1);
+
+		for (i = 0; i < 6; i++) {
+			unsigned present_flag = rand() & 1;
+
+			bitstream_write_u(writer, present_flag, 1);
+
+			if (present_flag) {
+				write_scaling_list(writer, 16);
+			}
+		}
+
+		/* second_chroma_qp_index_offset */
+		bitstream_write_se(writer, 0);
+	}
+
+	NAL_end(gen);
+}
+
+/*
+ * Reorder the l0 list by a chain of frame_num deltas. Entries refer to
+ * distinct frames of the num_ref_idx most recent references, the parser
+ * moves frames in place and can't handle a frame that is picked twice.
+ */
+static void write_ref_pic_list_modification(gen_context *gen,
+					    unsigned num_ref_idx)
+{
+	bitstream_writer *writer = &gen->writer;
+	unsigned max_frame_num = 1 << LOG2_MAX_FRAME_NUM;
+	unsigned picks[MAX_REF_FRAMES];
+	unsigned predicted = gen->frame_num;
+	unsigned chain = gen->modifications;
+	unsigned i, j, pick;
+	int diff;
+
+	chain = (chain < num_ref_idx) ? chain : num_ref_idx;
+
+	bitstream_write_u(writer, chain != 0, 1);
+
+	if (chain == 0) {
+		return;
+	}
+
+	memcpy(picks, gen->ref_frame_nums, sizeof(unsigned) * num_ref_idx);
+
+	for (i = 0; i < chain; i++) {
+		j = i + rand() % (num_ref_idx - i);
+		pick = picks[j];
+		picks[j] = picks[i];
+		picks[i] = pick;
+
+		diff = (pick - predicted) & (max_frame_num - 1);
+
+		if (diff > max_frame_num / 2) {
+			diff -= max_frame_num;
+		}
+
+		if (diff < 0) {
+			bitstream_write_ue(writer, 0);
+			bitstream_write_ue(writer, -diff - 1);
+		} else {
+			bitstream_write_ue(writer, 1);
+			bitstream_write_ue(writer, diff - 1);
+		}
+
+		predicted = pick;
+	}
+
+	bitstream_write_ue(writer, 3);
+}
+
+static void write_slice(gen_context *gen, unsigned slice_type, int idr,
+			unsigned ref_idc, unsigned display, unsigned slice)
+{
+	bitstream_writer *writer = &gen->writer;
+	unsigned mbs_nb = gen->width_mbs * gen->height_mbs;
+	unsigned pps_id = gen->pictures_nb % gen->pp_pictures_nb;
+	unsigned num_ref_idx;
+	unsigned disable_deblocking_filter_idc;
+
+	NAL_begin(gen, ref_idc, idr ? NAL_SLICE_IDR : NAL_SLICE, slice == 0);
+
+	bitstream_write_ue(writer, mbs_nb / gen->slices_nb * slice);
+	bitstream_write_ue(writer, slice_type + (gen->pictures_nb & 1) * 5);
+	bitstream_write_ue(writer, pps_id);
+	bitstream_write_u(writer, gen->frame_num, LOG2_MAX_FRAME_NUM);
+
+	if (idr) {
+		bitstream_write_ue(writer, gen->idr_pic_id);
+	}
+
+	switch (gen->poc_type) {
+	case 0:
+		bitstream_write_u(writer, (display - gen->idr_display) * 2,
+				  LOG2_MAX_POC_LSB);
+
+		if (pps_id & 1) {
+			bitstream_write_se(writer, 0);
+		}
+		break;
+	case 1:
+		/* delta_pic_order_cnt[0], delta_pic_order_cnt[1] */
+		bitstream_write_se(writer, 0);
+
+		if (pps_id & 1) {
+			bitstream_write_se(writer, 0);
+		}
+		break;
+	default:
+		break;
+	}
+
+	switch (slice_type) {
+	case SLICE_B:
+		/* direct_spatial_mv_pred_flag */
+		bitstream_write_u(writer, 1, 1);
+		/* num_ref_idx_active_override_flag */
+		bitstream_write_u(writer, 1, 1);
+		bitstream_write_ue(writer, 0);
+		bitstream_write_ue(writer, 0);
+		/* ref_pic_list_modification_flag_l0 / l1 */
+		bitstream_write_u(writer, 0, 1);
+		bitstream_write_u(writer, 0, 1);
+		break;
+	case SLICE_P:
+		/* Active references can't outnumber the decoded ones.  */
+		num_ref_idx = (gen->num_ref_idx < gen->refs_nb) ?
+					gen->num_ref_idx : gen->refs_nb;
+		num_ref_idx = random_range(1, num_ref_idx);
+
+		bitstream_write_u(writer, num_ref_idx != gen->num_ref_idx, 1);
+
+		if (num_ref_idx != gen->num_ref_idx) {
+			bitstream_write_ue(writer, num_ref_idx - 1);
+		}
+
+		write_ref_pic_list_modification(gen, num_ref_idx);
+		break;
+	default:
+		break;
+	}
+
+	if (ref_idc != 0) {
+		if (idr) {
+			/* no_output_of_prior_pics_flag, long_term_reference_flag */
+			bitstream_write_u(writer, 0, 1);
+			bitstream_write_u(writer, 0, 1);
+		} else {
+			/* adaptive_ref_pic_marking_mode_flag, sliding window */
+			bitstream_write_u(writer, 0, 1);
+		}
+	}
+
+	bitstream_write_se(writer, random_range(-10, 10));
+
+	disable_deblocking_filter_idc = random_range(0, 2);
+	bitstream_write_ue(writer, disable_deblocking_filter_idc);
+
+	if (disable_deblocking_filter_idc != 1) {
+		bitstream_write_se(writer, random_range(-6, 6));
+		bitstream_write_se(writer, random_range(-6, 6));
+	}
+
+	if (gen->slice_group_map_type >= 3 && gen->slice_group_map_type <= 5) {
+		bitstream_write_u(writer, 0,
+			32 - __builtin_clz(gen->num_slice_groups_minus1[pps_id] + 1));
+	}
+
+	NAL_end(gen);
+}
+
+/* Matroska element size, coded on 8 bytes.  */
+static void put_mkv_size(uint8_t *data, uint64_t size)
+{
+	put_be32(data, (size >> 32) | 0x01000000);
+	put_be32(data + 4, size);
+}
+
+/*
+ * Picture is a SimpleBlock of its own cluster, the cluster's timecode is the
+ * picture's display time in ms. All I pictures are keyframes.
+ */
+static void write_mkv_cluster(gen_context *gen, unsigned slice_type,
+			      unsigned display)
+{
+	uint32_t block_size = 4 + gen->writer.data_offset;
+	uint8_t header[12 + 10 + 9 + 4];
+
+	put_be32(header, MKV_ID_CLUSTER);
+	put_mkv_size(header + 4, 10 + 9 + block_size);
+
+	/* Timecode with 8 bytes value.  */
+	header[12] = MKV_ID_TIMECODE;
+	header[13] = 0x88;
+	put_be32(header + 14, 0);
+	put_be32(header + 18, display * MKV_FRAME_DURATION_MS);
+
+	/* SimpleBlock of track 1 with 0 time offset to the cluster.  */
+	header[22] = MKV_ID_SIMPLE_BLOCK;
+	put_mkv_size(header + 23, block_size);
+	header[31] = 0x81;
+	header[32] = 0;
+	header[33] = 0;
+	header[34] = (slice_type == SLICE_I) ? MKV_BLOCK_KEYFRAME : 0;
+
+	if (fwrite(header, 1, sizeof(header), gen->fp) != sizeof(header)) {
+		perror("Error writing to output file");
+		abort();
+	}
+}
+
+/*
+ * avcC record with all parameter sets of the picture, the NALs of the picture
+ * are prefixed by their length.
+ */
+static void write_avcC(gen_context *gen, bitstream_writer *avcC)
+{
+	const uint8_t *data = gen->writer.data_ptr;
+	uint32_t end = gen->writer.data_offset;
+	uint32_t offset, size;
+	unsigned type, sets_nb;
+
+	for (type = NAL_SPS; type <= NAL_PPS; type++) {
+		sets_nb = 0;
+
+		for (offset = 0; offset + 4 < end; offset += 4 + size) {
+			size = (data[offset] << 24) | (data[offset + 1] << 16) |
+				(data[offset + 2] << 8) | data[offset + 3];
+			sets_nb += (data[offset + 4] & 0x1F) == type;
+		}
+
+		if (type == NAL_SPS) {
+			/* Count of SPS is 5 bits, the rest are in band.  */
+			if (sets_nb > 31) {
+				sets_nb = 31;
+			}
+
+			/* Profile and level of the first SPS.  */
+			bitstream_write_u(avcC, 1, 8);
+			bitstream_write_bytes(avcC, data + 5, 3);
+			bitstream_write_u(avcC, 0xFF, 8);
+			bitstream_write_u(avcC, 0xE0 | sets_nb, 8);
+		} else {
+			if (sets_nb > 255) {
+				sets_nb = 255;
+			}
+
+			bitstream_write_u(avcC, sets_nb, 8);
+		}
+
+		for (offset = 0; offset + 4 < end && sets_nb; offset += 4 + size) {
+			size = (data[offset] << 24) | (data[offset + 1] << 16) |
+				(data[offset + 2] << 8) | data[offset + 3];
+
+			if ((data[offset + 4] & 0x1F) == type) {
+				bitstream_write_u(avcC, size, 16);
+				bitstream_write_bytes(avcC, data + offset + 4,
+						      size);
+				sets_nb--;
+			}
+		}
+	}
+}
+
+/*
+ * EBML header, Segment of unknown size, Info and Tracks with the AVC track.
+ * It is written ahead of the first picture, which is an IDR that carries
+ * the parameter sets for CodecPrivate.
+ */
+static void write_mkv_header(gen_context *gen)
+{
+	static const uint8_t segment[] = {
+		/* EBML, DocType "matroska" */
+		0x1A, 0x45, 0xDF, 0xA3, 0x8B,
+		0x42, 0x82, 0x88, 'm', 'a', 't', 'r', 'o', 's', 'k', 'a',
+		/* Segment */
+		0x18, 0x53, 0x80, 0x67,
+		0x01, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+		/* Info, TimecodeScale of 1 ms */
+		0x15, 0x49, 0xA9, 0x66, 0x87,
+		0x2A, 0xD7, 0xB1, 0x83, 0x0F, 0x42, 0x40,
+	};
+	static const uint8_t track[] = {
+		/* TrackNumber 1, TrackType video */
+		0xD7, 0x81, 0x01,
+		0x83, 0x81, 0x01,
+		/* CodecID */
+		0x86, 0x8F, 'V', '_', 'M', 'P', 'E', 'G', '4', '/',
+		'I', 'S', 'O', '/', 'A', 'V', 'C',
+		/* DefaultDuration in ns */
+		0x23, 0xE3, 0x83, 0x84,
+		U32C(MKV_FRAME_DURATION_MS * 1000000),
+	};
+	bitstream_writer avcC, header;
+	uint32_t entry_size;
+	uint8_t size[8];
+
+	bitstream_writer_init(&avcC);
+	bitstream_writer_init(&header);
+
+	write_avcC(gen, &avcC);
+
+	entry_size = sizeof(track) + 2 + 8 + avcC.data_offset;
+
+	bitstream_write_bytes(&header, segment, sizeof(segment));
+
+	bitstream_write_u(&header, MKV_ID_TRACKS, 32);
+	put_mkv_size(size, 1 + 8 + entry_size);
+	bitstream_write_bytes(&header, size, 8);
+
+	bitstream_write_u(&header, MKV_ID_TRACK_ENTRY, 8);
+	put_mkv_size(size, entry_size);
+	bitstream_write_bytes(&header, size, 8);
+
+	bitstream_write_bytes(&header, track, sizeof(track));
+
+	bitstream_write_u(&header, MKV_ID_CODEC_PRIVATE, 16);
+	put_mkv_size(size, avcC.data_offset);
+	bitstream_write_bytes(&header, size, 8);
+	bitstream_write_bytes(&header, avcC.data_ptr, avcC.data_offset);
+
+	if (fwrite(header.data_ptr, 1, header.data_offset, gen->fp) !=
+			header.data_offset) {
+		perror("Error writing to output file");
+		abort();
+	}
+
+	bitstream_writer_free(&avcC);
+	bitstream_writer_free(&header);
+}
+
+/* CRC_32 of the PSI sections.  */
+static uint32_t ts_crc32(const uint8_t *data, unsigned size)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	unsigned i;
+
+	while (size--) {
+		crc ^= (uint32_t) *data++ << 24;
+
+		for (i = 0; i < 8; i++) {
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 :
+						   crc << 1;
+		}
+	}
+
+	return crc;
+}
+
+/*
+ * TS packet with up to 184 bytes of the payload, a shorter payload is
+ * preceded by the adaptation field stuffing. 192 bytes packets carry a zero
+ * timecode in front. Returns the number of payload bytes taken.
+ */
+static unsigned write_ts_packet(gen_context *gen, unsigned pid, unsigned *cc,
+				int pusi, const uint8_t *data, unsigned size)
+{
+	unsigned prefix = gen->ts_packet_size - TS_PACKET_SIZE;
+	unsigned stuffing = 0;
+	uint8_t packet[192];
+	uint8_t *ts = packet + prefix;
+
+	if (size > TS_PACKET_SIZE - 4) {
+		size = TS_PACKET_SIZE - 4;
+	} else {
+		stuffing = TS_PACKET_SIZE - 4 - size;
+	}
+
+	memset(packet, 0x00, prefix);
+	memset(ts, 0xFF, TS_PACKET_SIZE);
+
+	ts[0] = 0x47;
+	ts[1] = (pusi ? 0x40 : 0x00) | (pid >> 8);
+	ts[2] = pid & 0xFF;
+	ts[3] = (stuffing ? 0x30 : 0x10) | *cc;
+
+	*cc = (*cc + 1) & 0x0F;
+
+	if (stuffing) {
+		ts[4] = stuffing - 1;
+	}
+
+	if (stuffing > 1) {
+		ts[5] = 0x00;
+	}
+
+	memcpy(ts + 4 + stuffing, data, size);
+
+	if (fwrite(packet, 1, gen->ts_packet_size, gen->fp) !=
+			gen->ts_packet_size) {
+		perror("Error writing to output file");
+		abort();
+	}
+
+	return size;
+}
+
+/* PAT with the only program and its PMT with the H.264 stream.  */
+static void write_ts_tables(gen_context *gen)
+{
+	uint8_t pat[] = {
+		/* pointer_field, table_id, section_length */
+		0x00, 0x00, 0xB0, 13,
+		/* transport_stream_id, version, section numbers */
+		0x00, 0x01, 0xC1, 0x00, 0x00,
+		/* program 1 */
+		0x00, 0x01, 0xE0 | (TS_PID_PMT >> 8), TS_PID_PMT & 0xFF,
+		/* CRC_32 */
+		0, 0, 0, 0,
+	};
+	uint8_t pmt[] = {
+		0x00, 0x02, 0xB0, 18,
+		/* program_number, version, section numbers */
+		0x00, 0x01, 0xC1, 0x00, 0x00,
+		/* PCR_PID, program_info_length */
+		0xE0 | (TS_PID_VIDEO >> 8), TS_PID_VIDEO & 0xFF, 0xF0, 0x00,
+		/* elementary stream */
+		TS_STREAM_TYPE_H264,
+		0xE0 | (TS_PID_VIDEO >> 8), TS_PID_VIDEO & 0xFF, 0xF0, 0x00,
+		0, 0, 0, 0,
+	};
+
+	put_be32(pat + sizeof(pat) - 4, ts_crc32(pat + 1, sizeof(pat) - 5));
+	put_be32(pmt + sizeof(pmt) - 4, ts_crc32(pmt + 1, sizeof(pmt) - 5));
+
+	write_ts_packet(gen, TS_PID_PAT, &gen->ts_cc[0], 1, pat, sizeof(pat));
+	write_ts_packet(gen, TS_PID_PMT, &gen->ts_cc[1], 1, pmt, sizeof(pmt));
+}
+
+static void put_ts_timestamp(uint8_t *data, unsigned prefix, uint64_t ts)
+{
+	data[0] = (prefix << 4) | ((ts >> 29) & 0x0E) | 1;
+	data[1] = ts >> 22;
+	data[2] = ((ts >> 14) & 0xFE) | 1;
+	data[3] = ts >> 7;
+	data[4] = ((ts << 1) & 0xFE) | 1;
+}
+
+/*
+ * Picture is a PES packet of its own, split over as many TS packets as it
+ * takes. DTS is carried if there are B frames.
+ */
+static void write_ts_pes(gen_context *gen, unsigned display)
+{
+	uint64_t dts = TIMESTAMP_BASE_90K +
+		(uint64_t) (gen->pictures_nb - 1) * FRAME_DURATION_90K;
+	uint64_t pts = TIMESTAMP_BASE_90K +
+		(uint64_t) (display + gen->b_frames) * FRAME_DURATION_90K;
+	uint8_t header[19] = { 0x00, 0x00, 0x01, 0xE0, 0x00, 0x00, 0x80 };
+	bitstream_writer pes;
+	uint32_t offset;
+
+	if (gen->b_frames) {
+		header[7] = 0xC0;
+		header[8] = 10;
+		put_ts_timestamp(header + 9, 3, pts);
+		put_ts_timestamp(header + 14, 1, dts);
+	} else {
+		header[7] = 0x80;
+		header[8] = 5;
+		put_ts_timestamp(header + 9, 2, pts);
+	}
+
+	bitstream_writer_init(&pes);
+	bitstream_write_bytes(&pes, header, 9 + header[8]);
+	bitstream_write_bytes(&pes, gen->writer.data_ptr,
+			      gen->writer.data_offset);
+
+	for (offset = 0; offset < pes.data_offset; ) {
+		offset += write_ts_packet(gen, TS_PID_VIDEO, &gen->ts_cc[2],
+					  offset == 0, pes.data_ptr + offset,
+					  pes.data_offset - offset);
+	}
+
+	bitstream_writer_free(&pes);
+	bitstream_writer_reset(&gen->writer);
+}
+
+static void write_pcap_header(gen_context *gen)
+{
+	uint8_t header[24];
+
+	put_le32(header, PCAP_MAGIC);
+	put_le16(header + 4, 2);
+	put_le16(header + 6, 4);
+	put_le32(header + 8, 0);
+	put_le32(header + 12, 0);
+	put_le32(header + 16, 65535);
+	put_le32(header + 20, PCAP_LINK_RAW);
+
+	if (fwrite(header, 1, sizeof(header), gen->fp) != sizeof(header)) {
+		perror("Error writing to output file");
+		abort();
+	}
+}
+
+/*
+ * RTP packet of the payload is captured as an IPv4 UDP datagram on the
+ * loopback, capture time is the RTP timestamp.
+ */
+static void write_rtp_packet(gen_context *gen, bitstream_writer *payload,
+			     int marker, uint32_t timestamp)
+{
+	uint32_t size = 20 + 8 + 12 + payload->data_offset;
+	uint32_t time = timestamp - TIMESTAMP_BASE_90K;
+	uint8_t header[16 + 20 + 8 + 12];
+	uint8_t *ip = header + 16;
+	uint8_t *udp = ip + 20;
+	uint8_t *rtp = udp + 8;
+	uint32_t sum = 0;
+	unsigned i;
+
+	/* pcap record */
+	put_le32(header, time / 90000);
+	put_le32(header + 4, time % 90000 * 100 / 9);
+	put_le32(header + 8, size);
+	put_le32(header + 12, size);
+
+	/* IPv4 of 127.0.0.1, don't fragment */
+	put_be32(ip, 0x45000000 | size);
+	put_be32(ip + 4, 0x00004000);
+	put_be32(ip + 8, 0x40110000);
+	put_be32(ip + 12, 0x7F000001);
+	put_be32(ip + 16, 0x7F000001);
+
+	for (i = 0; i < 20; i += 2) {
+		sum += (ip[i] << 8) | ip[i + 1];
+	}
+
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	ip[10] = ~sum >> 8;
+	ip[11] = ~sum;
+
+	/* UDP without checksum */
+	put_be32(udp, (RTP_PORT << 16) | RTP_PORT);
+	put_be32(udp + 4, (size - 20) << 16);
+
+	rtp[0] = 0x80;
+	rtp[1] = (marker ? 0x80 : 0x00) | RTP_PAYLOAD_TYPE;
+	rtp[2] = gen->rtp_seq >> 8;
+	rtp[3] = gen->rtp_seq;
+	put_be32(rtp + 4, timestamp);
+	put_be32(rtp + 8, RTP_SSRC);
+
+	gen->rtp_seq++;
+
+	if (fwrite(header, 1, sizeof(header), gen->fp) != sizeof(header) ||
+			fwrite(payload->data_ptr, 1, payload->data_offset,
+			       gen->fp) != payload->data_offset) {
+		perror("Error writing to output file");
+		abort();
+	}
+
+	bitstream_writer_reset(payload);
+}
+
+static uint32_t NAL_size(const uint8_t *data)
+{
+	return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+/*
+ * Picture's NALs are packetized in the non-interleaved mode of RFC 6184. NAL
+ * that exceeds the MTU is fragmented to FU-A packets, NALs that fit it
+ * together are aggregated to a STAP-A, the rest go in single NAL packets.
+ * Marker bit is set on the last packet of the picture.
+ */
+static void write_rtp_picture(gen_context *gen, unsigned display)
+{
+	const uint8_t *data = gen->writer.data_ptr;
+	uint32_t end = gen->writer.data_offset;
+	uint32_t timestamp = TIMESTAMP_BASE_90K +
+			(display + gen->b_frames) * FRAME_DURATION_90K;
+	uint32_t offset, next, size, stap_size, pos, fragment;
+	unsigned nals_nb, fu_header;
+	bitstream_writer payload;
+	uint8_t nri;
+
+	bitstream_writer_init(&payload);
+
+	for (offset = 0; offset < end; offset = next) {
+		size = NAL_size(data + offset);
+		next = offset + 4 + size;
+
+		if (size > gen->rtp_mtu) {
+			fu_header = 0x80 | (data[offset + 4] & 0x1F);
+
+			for (pos = 1; pos < size; pos += fragment) {
+				fragment = gen->rtp_mtu - 2;
+
+				if (size - pos <= fragment) {
+					fragment = size - pos;
+					fu_header |= 0x40;
+				}
+
+				bitstream_write_u(&payload,
+						  (data[offset + 4] & 0xE0) |
+						  RTP_NAL_FU_A, 8);
+				bitstream_write_u(&payload, fu_header, 8);
+				bitstream_write_bytes(&payload,
+						      data + offset + 4 + pos,
+						      fragment);
+
+				write_rtp_packet(gen, &payload,
+						 next == end && (fu_header & 0x40),
+						 timestamp);
+				fu_header &= ~0x80;
+			}
+			continue;
+		}
+
+		/* NALs that follow are aggregated while the STAP-A fits.  */
+		stap_size = 1 + 2 + size;
+		nri = data[offset + 4] & 0x60;
+		nals_nb = 1;
+
+		while (next < end &&
+				stap_size + 2 + NAL_size(data + next) <=
+							gen->rtp_mtu) {
+			stap_size += 2 + NAL_size(data + next);
+
+			if ((data[next + 4] & 0x60) > nri) {
+				nri = data[next + 4] & 0x60;
+			}
+
+			next += 4 + NAL_size(data + next);
+			nals_nb++;
+		}
+
+		if (nals_nb == 1) {
+			bitstream_write_bytes(&payload, data + offset + 4, size);
+		} else {
+			bitstream_write_u(&payload, nri | RTP_NAL_STAP_A, 8);
+
+			for (pos = offset; pos < next; pos += 4 + size) {
+				size = NAL_size(data + pos);
+				bitstream_write_u(&payload, size, 16);
+				bitstream_write_bytes(&payload, data + pos + 4,
+						      size);
+			}
+		}
+
+		write_rtp_packet(gen, &payload, next == end, timestamp);
+	}
+
+	bitstream_writer_free(&payload);
+	bitstream_writer_reset(&gen->writer);
+}
+
+static uint32_t box_begin(bitstream_writer *box, uint32_t type)
+{
+	uint32_t start = box->data_offset;
+
+	/* Size is filled in by box_end().  */
+	bitstream_write_u(box, 0, 32);
+	bitstream_write_u(box, type, 32);
+
+	return start;
+}
+
+static uint32_t full_box_begin(bitstream_writer *box, uint32_t type,
+			       uint32_t version_flags)
+{
+	uint32_t start = box_begin(box, type);
+
+	bitstream_write_u(box, version_flags, 32);
+
+	return start;
+}
+
+static void box_end(bitstream_writer *box, uint32_t start)
+{
+	put_be32(box->data_ptr + start, box->data_offset - start);
+}
+
+static void write_zeros(bitstream_writer *box, unsigned count)
+{
+	while (count--) {
+		bitstream_write_u(box, 0, 8);
+	}
+}
+
+static void write_matrix(bitstream_writer *box)
+{
+	static const uint32_t unity[] = {
+		0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000,
+	};
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(unity); i++) {
+		bitstream_write_u(box, unity[i], 32);
+	}
+}
+
+static void mp4_add_sample(gen_context *gen, unsigned slice_type,
+			   unsigned display)
+{
+	mp4_sample *sample;
+
+	if (gen->samples_nb == gen->samples_max) {
+		gen->samples_max = gen->samples_max ? gen->samples_max * 2 : 256;
+		gen->samples = realloc(gen->samples,
+				gen->samples_max * sizeof(*gen->samples));
+		if (gen->samples == NULL) {
+			perror("Failed to grow MP4 samples");
+			abort();
+		}
+	}
+
+	/* Composition time is the display time, B frames delay it.  */
+	sample = &gen->samples[gen->samples_nb++];
+	sample->dts = (uint64_t) (gen->pictures_nb - 1) * FRAME_DURATION_90K;
+	sample->cts = (display + gen->b_frames + 1 - gen->pictures_nb) *
+			FRAME_DURATION_90K;
+	sample->size = gen->writer.data_offset;
+	sample->sync = (slice_type == SLICE_I);
+}
+
+/* Sample tables of the samples, empty ones for a fragmented movie.  */
+static void write_stbl(gen_context *gen, bitstream_writer *box)
+{
+	uint32_t stbl, stsd, entry, atom, runs_nb, count_pos;
+	uint32_t i, j;
+
+	stbl = box_begin(box, FOURCC('s', 't', 'b', 'l'));
+
+	stsd = full_box_begin(box, FOURCC('s', 't', 's', 'd'), 0);
+	bitstream_write_u(box, 1, 32);
+
+	entry = box_begin(box, FOURCC('a', 'v', 'c', '1'));
+	write_zeros(box, 6);
+	bitstream_write_u(box, 1, 16);
+	write_zeros(box, 16);
+	bitstream_write_u(box, gen->width_mbs * 16, 16);
+	bitstream_write_u(box, gen->height_mbs * 16, 16);
+	bitstream_write_u(box, 0x00480000, 32);
+	bitstream_write_u(box, 0x00480000, 32);
+	bitstream_write_u(box, 0, 32);
+	bitstream_write_u(box, 1, 16);
+	write_zeros(box, 32);
+	bitstream_write_u(box, 0x0018, 16);
+	bitstream_write_u(box, 0xFFFF, 16);
+
+	atom = box_begin(box, FOURCC('a', 'v', 'c', 'C'));
+	bitstream_write_bytes(box, gen->avcC.data_ptr, gen->avcC.data_offset);
+	box_end(box, atom);
+
+	box_end(box, entry);
+	box_end(box, stsd);
+
+	atom = full_box_begin(box, FOURCC('s', 't', 't', 's'), 0);
+	bitstream_write_u(box, gen->samples_nb ? 1 : 0, 32);
+
+	if (gen->samples_nb) {
+		bitstream_write_u(box, gen->samples_nb, 32);
+		bitstream_write_u(box, FRAME_DURATION_90K, 32);
+	}
+
+	box_end(box, atom);
+
+	/* Runs of the composition offsets, counted as they are written.  */
+	if (gen->b_frames) {
+		atom = full_box_begin(box, FOURCC('c', 't', 't', 's'), 0);
+		count_pos = box->data_offset;
+		bitstream_write_u(box, 0, 32);
+
+		for (i = 0, runs_nb = 0; i < gen->samples_nb; i = j, runs_nb++) {
+			j = i + 1;
+
+			while (j < gen->samples_nb &&
+					gen->samples[j].cts == gen->samples[i].cts) {
+				j++;
+			}
+
+			bitstream_write_u(box, j - i, 32);
+			bitstream_write_u(box, gen->samples[i].cts, 32);
+		}
+
+		put_be32(box->data_ptr + count_pos, runs_nb);
+		box_end(box, atom);
+	}
+
+	atom = full_box_begin(box, FOURCC('s', 't', 's', 's'), 0);
+	count_pos = box->data_offset;
+	bitstream_write_u(box, 0, 32);
+
+	for (i = 0, j = 0; i < gen->samples_nb; i++) {
+		if (gen->samples[i].sync) {
+			bitstream_write_u(box, i + 1, 32);
+			j++;
+		}
+	}
+
+	put_be32(box->data_ptr + count_pos, j);
+	box_end(box, atom);
+
+	atom = full_box_begin(box, FOURCC('s', 't', 's', 'z'), 0);
+	bitstream_write_u(box, 0, 32);
+	bitstream_write_u(box, gen->samples_nb, 32);
+
+	for (i = 0; i < gen->samples_nb; i++) {
+		bitstream_write_u(box, gen->samples[i].size, 32);
+	}
+
+	box_end(box, atom);
+
+	/* All samples are in one chunk, that is the data of the mdat.  */
+	atom = full_box_begin(box, FOURCC('s', 't', 's', 'c'), 0);
+	bitstream_write_u(box, gen->samples_nb ? 1 : 0, 32);
+
+	if (gen->samples_nb) {
+		bitstream_write_u(box, 1, 32);
+		bitstream_write_u(box, gen->samples_nb, 32);
+		bitstream_write_u(box, 1, 32);
+	}
+
+	box_end(box, atom);
+
+	atom = full_box_begin(box, FOURCC('s', 't', 'c', 'o'), 0);
+	bitstream_write_u(box, gen->samples_nb ? 1 : 0, 32);
+
+	if (gen->samples_nb) {
+		bitstream_write_u(box, 24 + 8, 32);
+	}
+
+	box_end(box, atom);
+
+	box_end(box, stbl);
+}
+
+/*
+ * moov of the video track, its samples are in the only mdat. Fragmented
+ * movie has no samples in moov and the track defaults in mvex.
+ */
+static void write_moov(gen_context *gen)
+{
+	uint32_t duration = gen->samples_nb * FRAME_DURATION_90K;
+	uint32_t moov, trak, mdia, minf, atom;
+	bitstream_writer box;
+
+	bitstream_writer_init(&box);
+
+	moov = box_begin(&box, FOURCC('m', 'o', 'o', 'v'));
+
+	atom = full_box_begin(&box, FOURCC('m', 'v', 'h', 'd'), 0);
+	write_zeros(&box, 8);
+	bitstream_write_u(&box, 90000, 32);
+	bitstream_write_u(&box, duration, 32);
+	bitstream_write_u(&box, 0x00010000, 32);
+	bitstream_write_u(&box, 0x0100, 16);
+	write_zeros(&box, 10);
+	write_matrix(&box);
+	write_zeros(&box, 24);
+	bitstream_write_u(&box, MP4_TRACK_ID + 1, 32);
+	box_end(&box, atom);
+
+	trak = box_begin(&box, FOURCC('t', 'r', 'a', 'k'));
+
+	/* Track is enabled and in the movie.  */
+	atom = full_box_begin(&box, FOURCC('t', 'k', 'h', 'd'), 3);
+	write_zeros(&box, 8);
+	bitstream_write_u(&box, MP4_TRACK_ID, 32);
+	bitstream_write_u(&box, 0, 32);
+	bitstream_write_u(&box, duration, 32);
+	write_zeros(&box, 16);
+	write_matrix(&box);
+	bitstream_write_u(&box, gen->width_mbs * 16 << 16, 32);
+	bitstream_write_u(&box, gen->height_mbs * 16 << 16, 32);
+	box_end(&box, atom);
+
+	mdia = box_begin(&box, FOURCC('m', 'd', 'i', 'a'));
+
+	atom = full_box_begin(&box, FOURCC('m', 'd', 'h', 'd'), 0);
+	write_zeros(&box, 8);
+	bitstream_write_u(&box, 90000, 32);
+	bitstream_write_u(&box, duration, 32);
+	/* Language "und".  */
+	bitstream_write_u(&box, 0x55C4, 16);
+	bitstream_write_u(&box, 0, 16);
+	box_end(&box, atom);
+
+	atom = full_box_begin(&box, FOURCC('h', 'd', 'l', 'r'), 0);
+	bitstream_write_u(&box, 0, 32);
+	bitstream_write_u(&box, FOURCC('v', 'i', 'd', 'e'), 32);
+	write_zeros(&box, 12 + 1);
+	box_end(&box, atom);
+
+	minf = box_begin(&box, FOURCC('m', 'i', 'n', 'f'));
+
+	atom = full_box_begin(&box, FOURCC('v', 'm', 'h', 'd'), 1);
+	write_zeros(&box, 8);
+	box_end(&box, atom);
+
+	/* Data is in the same file.  */
+	atom = box_begin(&box, FOURCC('d', 'i', 'n', 'f'));
+	bitstream_write_u(&box, 28, 32);
+	bitstream_write_u(&box, FOURCC('d', 'r', 'e', 'f'), 32);
+	bitstream_write_u(&box, 0, 32);
+	bitstream_write_u(&box, 1, 32);
+	bitstream_write_u(&box, 12, 32);
+	bitstream_write_u(&box, FOURCC('u', 'r', 'l', ' '), 32);
+	bitstream_write_u(&box, 1, 32);
+	box_end(&box, atom);
+
+	write_stbl(gen, &box);
+
+	box_end(&box, minf);
+	box_end(&box, mdia);
+	box_end(&box, trak);
+
+	if (gen->mp4_fragments) {
+		atom = box_begin(&box, FOURCC('m', 'v', 'e', 'x'));
+		bitstream_write_u(&box, 32, 32);
+		bitstream_write_u(&box, FOURCC('t', 'r', 'e', 'x'), 32);
+		bitstream_write_u(&box, 0, 32);
+		bitstream_write_u(&box, MP4_TRACK_ID, 32);
+		bitstream_write_u(&box, 1, 32);
+		bitstream_write_u(&box, FRAME_DURATION_90K, 32);
+		bitstream_write_u(&box, 0, 32);
+		bitstream_write_u(&box, MP4_SAMPLE_NON_SYNC, 32);
+		box_end(&box, atom);
+	}
+
+	box_end(&box, moov);
+
+	if (fwrite(box.data_ptr, 1, box.data_offset, gen->fp) !=
+			box.data_offset) {
+		perror("Error writing to output file");
+		abort();
+	}
+
+	bitstream_writer_free(&box);
+}
+
+/*
+ * Fragment is a moof with a trun of all its samples, followed by the mdat
+ * of their data. Data offset of the trun is relative to the moof.
+ */
+static void write_mp4_fragment(gen_context *gen)
+{
+	uint32_t moof, traf, atom, data_offset_pos;
+	bitstream_writer box;
+	mp4_sample *sample;
+	uint32_t i;
+
+	bitstream_writer_init(&box);
+
+	moof = box_begin(&box, FOURCC('m', 'o', 'o', 'f'));
+
+	atom = full_box_begin(&box, FOURCC('m', 'f', 'h', 'd'), 0);
+	bitstream_write_u(&box, ++gen->sequence_nb, 32);
+	box_end(&box, atom);
+
+	traf = box_begin(&box, FOURCC('t', 'r', 'a', 'f'));
+
+	atom = full_box_begin(&box, FOURCC('t', 'f', 'h', 'd'),
+			      MP4_TFHD_BASE_IS_MOOF);
+	bitstream_write_u(&box, MP4_TRACK_ID, 32);
+	box_end(&box, atom);
+
+	atom = full_box_begin(&box, FOURCC('t', 'f', 'd', 't'), 1 << 24);
+	bitstream_write_u(&box, gen->samples[0].dts >> 32, 32);
+	bitstream_write_u(&box, gen->samples[0].dts, 32);
+	box_end(&box, atom);
+
+	atom = full_box_begin(&box, FOURCC('t', 'r', 'u', 'n'),
+			      MP4_TRUN_FLAGS);
+	bitstream_write_u(&box, gen->samples_nb, 32);
+	data_offset_pos = box.data_offset;
+	bitstream_write_u(&box, 0, 32);
+
+	for (i = 0; i < gen->samples_nb; i++) {
+		sample = &gen->samples[i];
+
+		bitstream_write_u(&box, FRAME_DURATION_90K, 32);
+		bitstream_write_u(&box, sample->size, 32);
+		bitstream_write_u(&box, sample->sync ? 0 : MP4_SAMPLE_NON_SYNC,
+				  32);
+		bitstream_write_u(&box, sample->cts, 32);
+	}
+
+	box_end(&box, atom);
+	box_end(&box, traf);
+	box_end(&box, moof);
+
+	/* Data follows the mdat header.  */
+	put_be32(box.data_ptr + data_offset_pos, box.data_offset + 8);
+
+	bitstream_write_u(&box, 8 + gen->fragment.data_offset, 32);
+	bitstream_write_u(&box, FOURCC('m', 'd', 'a', 't'), 32);
+
+	if (fwrite(box.data_ptr, 1, box.data_offset, gen->fp) !=
+			box.data_offset ||
+	    fwrite(gen->fragment.data_ptr, 1, gen->fragment.data_offset,
+		   gen->fp) != gen->fragment.data_offset) {
+		perror("Error writing to output file");
+		abort();
+	}
+
+	bitstream_writer_free(&box);
+	bitstream_writer_reset(&gen->fragment);
+
+	gen->samples_nb = 0;
+}
+
+/*
+ * Picture is a sample. Samples of a fragmented movie are gathered till the
+ * next IDR, the moov goes ahead of the first fragment. moov of the other
+ * movie follows its mdat, avcC is taken from the first picture for it.
+ */
+static void write_mp4_sample(gen_context *gen, unsigned slice_type, int idr,
+			     unsigned display)
+{
+	if (gen->pictures_nb == 1) {
+		write_avcC(gen, &gen->avcC);
+
+		if (gen->mp4_fragments) {
+			write_moov(gen);
+		}
+	}
+
+	if (!gen->mp4_fragments) {
+		mp4_add_sample(gen, slice_type, display);
+		flush_output(gen);
+		return;
+	}
+
+	if (idr && gen->samples_nb) {
+		write_mp4_fragment(gen);
+	}
+
+	mp4_add_sample(gen, slice_type, display);
+
+	bitstream_write_bytes(&gen->fragment, gen->writer.data_ptr,
+			      gen->writer.data_offset);
+	bitstream_writer_reset(&gen->writer);
+}
+
+static void write_picture(gen_context *gen, unsigned slice_type, int idr,
+			  unsigned display)
+{
+	unsigned ref_idc = (slice_type == SLICE_B) ? 0 : (idr ? 3 : 2);
+	unsigned slice;
+	unsigned i;
+
+	if (idr) {
+		for (i = 0; i < gen->sp_pictures_nb; i++) {
+			write_SPS(gen, i);
+		}
+
+		for (i = 0; i < gen->pp_pictures_nb; i++) {
+			write_PPS(gen, i);
+		}
+
+		gen->frame_num = 0;
+		gen->refs_nb = 0;
+		gen->idr_display = display;
+	}
+
+	for (slice = 0; slice < gen->slices_nb; slice++) {
+		write_slice(gen, slice_type, idr, ref_idc, display, slice);
+	}
+
+	if (idr) {
+		gen->idr_pic_id = (gen->idr_pic_id + 1) & 0xFFFF;
+	}
+
+	/* Sliding window marking, most recent reference goes first.  */
+	if (ref_idc != 0) {
+		if (gen->refs_nb < gen->max_ref_frames) {
+			gen->refs_nb++;
+		}
+
+		memmove(gen->ref_frame_nums + 1, gen->ref_frame_nums,
+			sizeof(unsigned) * (gen->refs_nb - 1));
+
+		gen->ref_frame_nums[0] = gen->frame_num;
+		gen->frame_num = (gen->frame_num + 1) &
+					((1 << LOG2_MAX_FRAME_NUM) - 1);
+	}
+
+	gen->pictures_nb++;
+
+	if (gen->mkv) {
+		if (gen->pictures_nb == 1) {
+			write_mkv_header(gen);
+		}
+
+		write_mkv_cluster(gen, slice_type, display);
+	}
+
+	if (gen->ts_packet_size) {
+		if (idr) {
+			write_ts_tables(gen);
+		}
+
+		write_ts_pes(gen, display);
+		return;
+	}
+
+	if (gen->rtp_mtu) {
+		write_rtp_picture(gen, display);
+		return;
+	}
+
+	if (gen->mp4_moov || gen->mp4_fragments) {
+		write_mp4_sample(gen, slice_type, idr, display);
+		return;
+	}
+
+	flush_output(gen);
+}
+
+/* Fragmented movie has its mdat in each fragment.  */
+static void write_mp4_header(gen_context *gen)
+{
+	static const uint32_t ftyp[] = {
+		24, FOURCC('f', 't', 'y', 'p'),
+		FOURCC('i', 's', 'o', 'm'), 0x200,
+		FOURCC('i', 's', 'o', 'm'), FOURCC('a', 'v', 'c', '1'),
+		/* mdat size is filled in by write_mp4_trailer() */
+		0, FOURCC('m', 'd', 'a', 't'),
+	};
+	uint8_t header[sizeof(ftyp)];
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(ftyp); i++) {
+		put_be32(header + i * 4, ftyp[i]);
+	}
+
+	bitstream_write_bytes(&gen->writer, header,
+			      gen->mp4_fragments ? 24 : sizeof(header));
+	flush_output(gen);
+
+	gen->mdat_size = 8;
+}
+
+static void write_mp4_trailer(gen_context *gen)
+{
+	uint8_t size[4];
+
+	if (gen->mp4_fragments) {
+		if (gen->samples_nb) {
+			write_mp4_fragment(gen);
+		}
+		return;
+	}
+
+	if (gen->mdat_size > UINT32_MAX) {
+		fprintf(stderr, "mdat is too large for 32-bit atom size\n");
+		exit(EXIT_FAILURE);
+	}
+
+	put_be32(size, gen->mdat_size);
+
+	if (fseek(gen->fp, 24, SEEK_SET) != 0 ||
+			fwrite(size, 1, 4, gen->fp) != 4) {
+		perror("Error writing to output file");
+		abort();
+	}
+
+	if (gen->mp4_moov) {
+		if (fseek(gen->fp, 0, SEEK_END) != 0) {
+			perror("Error writing to output file");
+			abort();
+		}
+
+		write_moov(gen);
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "-o output file path\n");
+	fprintf(stderr, "-m MP4 output, Annex B by default\n");
+	fprintf(stderr, "-M MP4 output with moov after the mdat\n");
+	fprintf(stderr, "-F fragmented MP4 output, a fragment per IDR "
+			"period\n");
+	fprintf(stderr, "-k Matroska output, I pictures are keyframes\n");
+	fprintf(stderr, "-t MPEG-TS output of 188 or 192 bytes packets\n");
+	fprintf(stderr, "-u RTP output captured to pcap, of the given max "
+			"payload size\n");
+	fprintf(stderr, "-f number of frames (100)\n");
+	fprintf(stderr, "-g IDR period (30)\n");
+	fprintf(stderr, "-i non-IDR I picture period, in P pictures (0)\n");
+	fprintf(stderr, "-S number of SPS ids, up to 32 (1)\n");
+	fprintf(stderr, "-p number of PPS ids, up to 256 (1)\n");
+	fprintf(stderr, "-r max_num_ref_frames, up to %d (4)\n", MAX_REF_FRAMES);
+	fprintf(stderr, "-R num_ref_idx_l0_active, up to %d (4)\n", MAX_REF_IDX);
+	fprintf(stderr, "-l ref_pic_list_modification chain length (0)\n");
+	fprintf(stderr, "-b number of non-reference B frames between P (0)\n");
+	fprintf(stderr, "-c number of slices per frame (1)\n");
+	fprintf(stderr, "-w frame width in macroblocks (120)\n");
+	fprintf(stderr, "-h frame height in macroblocks (68)\n");
+	fprintf(stderr, "-P pic_order_cnt_type, 1 is parsed but not decoded (0)\n");
+	fprintf(stderr, "-G slice group map type, 0-6\n");
+	fprintf(stderr, "-q scaling lists\n");
+	fprintf(stderr, "-v VUI with HRD parameters\n");
+	fprintf(stderr, "-x random seed (1)\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	const char *out_file_path = NULL;
+	gen_context gen;
+	unsigned display = 0;
+	unsigned since_idr = 0;
+	unsigned p_pictures_nb = 0;
+	unsigned i;
+	int c;
+
+	memset(&gen, 0, sizeof(gen));
+
+	gen.frames_nb = 100;
+	gen.gop_size = 30;
+	gen.sp_pictures_nb = 1;
+	gen.pp_pictures_nb = 1;
+	gen.max_ref_frames = 4;
+	gen.num_ref_idx = 4;
+	gen.slices_nb = 1;
+	gen.width_mbs = 120;
+	gen.height_mbs = 68;
+	gen.slice_group_map_type = -1;
+
+	while ((c = getopt(argc, argv, "o:mMFkt:u:f:g:i:S:p:r:R:l:b:c:w:h:P:G:qvx:")) != -1) {
+		switch (c) {
+		case 'o':
+			out_file_path = optarg;
+			break;
+		case 'm':
+			gen.mp4 = 1;
+			break;
+		case 'M':
+			gen.mp4 = 1;
+			gen.mp4_moov = 1;
+			break;
+		case 'F':
+			gen.mp4 = 1;
+			gen.mp4_fragments = 1;
+			break;
+		case 'k':
+			gen.mkv = 1;
+			break;
+		case 't':
+			gen.ts_packet_size = atoi(optarg);
+			break;
+		case 'u':
+			gen.rtp_mtu = atoi(optarg);
+			break;
+		case 'f':
+			gen.frames_nb = atoi(optarg);
+			break;
+		case 'g':
+			gen.gop_size = atoi(optarg);
+			break;
+		case 'i':
+			gen.intra_period = atoi(optarg);
+			break;
+		case 'S':
+			gen.sp_pictures_nb = atoi(optarg);
+			break;
+		case 'p':
+			gen.pp_pictures_nb = atoi(optarg);
+			break;
+		case 'r':
+			gen.max_ref_frames = atoi(optarg);
+			break;
+		case 'R':
+			gen.num_ref_idx = atoi(optarg);
+			break;
+		case 'l':
+			gen.modifications = atoi(optarg);
+			break;
+		case 'b':
+			gen.b_frames = atoi(optarg);
+			break;
+		case 'c':
+			gen.slices_nb = atoi(optarg);
+			break;
+		case 'w':
+			gen.width_mbs = atoi(optarg);
+			break;
+		case 'h':
+			gen.height_mbs = atoi(optarg);
+			break;
+		case 'P':
+			gen.poc_type = atoi(optarg);
+			break;
+		case 'G':
+			gen.slice_group_map_type = atoi(optarg);
+			break;
+		case 'q':
+			gen.scaling_lists = 1;
+			break;
+		case 'v':
+			gen.vui = 1;
+			break;
+		case 'x':
+			srand(atoi(optarg));
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (out_file_path == NULL ||
+			gen.sp_pictures_nb < 1 || gen.sp_pictures_nb > 32 ||
+			gen.pp_pictures_nb < 1 || gen.pp_pictures_nb > 256 ||
+			gen.max_ref_frames < 1 ||
+			gen.max_ref_frames > MAX_REF_FRAMES ||
+			gen.num_ref_idx < 1 || gen.num_ref_idx > MAX_REF_IDX ||
+			gen.modifications > MAX_REF_IDX ||
+			gen.slices_nb < 1 || gen.gop_size < 1 ||
+			gen.width_mbs < 1 || gen.height_mbs < 1 ||
+			gen.slices_nb > gen.width_mbs * gen.height_mbs ||
+			gen.poc_type > 2 || gen.slice_group_map_type > 6 ||
+			gen.mp4 + gen.mkv + !!gen.ts_packet_size +
+				!!gen.rtp_mtu > 1 ||
+			(gen.mp4_moov && gen.mp4_fragments) ||
+			(gen.rtp_mtu && (gen.rtp_mtu < 16 ||
+					 gen.rtp_mtu > 65000)) ||
+			(gen.ts_packet_size && gen.ts_packet_size != 188 &&
+			 gen.ts_packet_size != 192)) {
+		usage();
+	}
+
+	/* POC type 2 has output order equal to the decoding order.  */
+	if (gen.b_frames && gen.poc_type != 0) {
+		fprintf(stderr, "B frames require pic_order_cnt_type 0\n");
+		exit(EXIT_FAILURE);
+	}
+
+	gen.fp = fopen(out_file_path, "w+");
+
+	if (gen.fp == NULL) {
+		perror("Failed to open output file");
+		exit(EXIT_FAILURE);
+	}
+
+	bitstream_writer_init(&gen.writer);
+
+	if (gen.mp4) {
+		write_mp4_header(&gen);
+	}
+
+	if (gen.rtp_mtu) {
+		write_pcap_header(&gen);
+	}
+
+	while (gen.pictures_nb < gen.frames_nb) {
+		if (since_idr == 0 || since_idr >= gen.gop_size) {
+			write_picture(&gen, SLICE_I, 1, display++);
+			since_idr = 1;
+			continue;
+		}
+
+		if (gen.intra_period && ++p_pictures_nb % gen.intra_period == 0) {
+			write_picture(&gen, SLICE_I, 0, display + gen.b_frames);
+		} else {
+			write_picture(&gen, SLICE_P, 0, display + gen.b_frames);
+		}
+
+		for (i = 0; i < gen.b_frames &&
+				gen.pictures_nb < gen.frames_nb; i++) {
+			write_picture(&gen, SLICE_B, 0, display + i);
+		}
+
+		display += gen.b_frames + 1;
+		since_idr += gen.b_frames + 1;
+	}
+
+	if (gen.mp4) {
+		write_mp4_trailer(&gen);
+	}
+
+	bitstream_writer_free(&gen.writer);
+	bitstream_writer_free(&gen.avcC);
+	bitstream_writer_free(&gen.fragment);
+	free(gen.samples);
+	fclose(gen.fp);
+
+	return 0;
+}